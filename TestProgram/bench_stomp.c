@@ -0,0 +1,400 @@
+/*
+ * libstomp - a free implementation of the stomp protocol than can be plugged
+ * to different connection implementations using an adapter interface.
+ *
+ * Copyright (C) 2017 Sergio Otero <sergio.otero@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+
+
+/*
+ * Microbenchmarks of the frame parser, marshaller, header lookup and subscription dispatch.
+ *
+ * One CSV line per benchmark: name,iterations,ns_per_op,bytes_per_sec,allocs_per_op.
+ * Every benchmark runs for at least -t milliseconds (100 by default), -f runs only the
+ * benchmarks whose name contains the given string.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libstomp.h"
+#include "stomp_internal.h"
+
+static unsigned long long allocations;
+
+#ifdef __GLIBC__
+// Every allocation of the process goes through these, counted
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void *ptr, size_t size);
+
+void* malloc(size_t size) {
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+	allocations++;
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void *ptr, size_t size) {
+	allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+#define BENCH_COUNTS_ALLOCATIONS 1
+#else
+#define BENCH_COUNTS_ALLOCATIONS 0
+#endif
+
+#define BENCH_FRAME_TYPES 4
+#define BENCH_MAX_HEADERS 32
+#define BENCH_MAX_FRAME_LENGTH (128 * 1024)
+#define BENCH_DISPATCH_MESSAGES 64
+
+// Realistic frames: heartbeat sized, a small event, a document and a bulk transfer
+static const struct {
+	const char *name;
+	int headers;
+	size_t body_length;
+} frame_types[BENCH_FRAME_TYPES] = {
+	{ "tiny", 3, 0 },
+	{ "small", 8, 256 },
+	{ "medium", 16, 4096 },
+	{ "large", 32, 65536 }
+};
+
+typedef struct {
+	StompFrame frame;
+	StompHeaders headers;
+	StompHeader header_array[BENCH_MAX_HEADERS];
+	char names[BENCH_MAX_HEADERS][32];
+	char values[BENCH_MAX_HEADERS][64];
+	char *body;
+
+	char *marshalled;
+	int marshalled_len;
+} BenchFrame;
+
+typedef struct {
+	const char *name;
+	size_t bytes_per_op; // 0 when throughput makes no sense
+	void (*run)(void *data, unsigned long long iterations);
+	void *data;
+} Benchmark;
+
+static int min_time_ms = 100;
+static const char *filter;
+static volatile size_t sink;
+
+static long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int bench_frame_init(BenchFrame *bench_frame, int headers, size_t body_length) {
+	bench_frame->headers.len = headers;
+	bench_frame->headers.header_array = bench_frame->header_array;
+
+	for (int i = 0; i < headers; i++) {
+		StompHeader *header = &bench_frame->header_array[i];
+
+		// the usual MESSAGE headers first, then application properties
+		switch (i) {
+		case 0: strcpy(bench_frame->names[i], "subscription"); strcpy(bench_frame->values[i], "sub-0"); break;
+		case 1: strcpy(bench_frame->names[i], "message-id"); strcpy(bench_frame->values[i], "ID:broker-37231-1507893125-1:4:1:1:42"); break;
+		case 2: strcpy(bench_frame->names[i], "destination"); strcpy(bench_frame->values[i], "/topic/market.prices.eu"); break;
+		default:
+			sprintf(bench_frame->names[i], "x-property-%d", i);
+			sprintf(bench_frame->values[i], "value of the application property %d", i);
+		}
+
+		header->name = bench_frame->names[i];
+		header->value = bench_frame->values[i];
+	}
+
+	bench_frame->body = body_length ? malloc(body_length + 1) : NULL;
+	if (bench_frame->body) {
+		for (size_t i = 0; i < body_length; i++) bench_frame->body[i] = 'a' + i % 26;
+		bench_frame->body[body_length] = '\0';
+	}
+
+	bench_frame->frame.command = "MESSAGE";
+	bench_frame->frame.system_headers = &bench_frame->headers;
+	bench_frame->frame.user_headers = NULL;
+	bench_frame->frame.body = bench_frame->body;
+	bench_frame->frame.body_length = body_length;
+	bench_frame->frame.pool_buffer = NULL;
+
+	bench_frame->marshalled = malloc(BENCH_MAX_FRAME_LENGTH);
+	bench_frame->marshalled_len = stomp_frame_marshall(&bench_frame->frame, bench_frame->marshalled, BENCH_MAX_FRAME_LENGTH);
+
+	return bench_frame->marshalled_len < 0 ? -1 : 0;
+}
+
+static void bench_frame_free(BenchFrame *bench_frame) {
+	free(bench_frame->body);
+	free(bench_frame->marshalled);
+}
+
+static void run_marshall(void *data, unsigned long long iterations) {
+	BenchFrame *bench_frame = data;
+	char *buffer = malloc(BENCH_MAX_FRAME_LENGTH);
+
+	for (unsigned long long i = 0; i < iterations; i++) {
+		sink += stomp_frame_marshall(&bench_frame->frame, buffer, BENCH_MAX_FRAME_LENGTH);
+	}
+
+	free(buffer);
+}
+
+// What the stomp adapter does with every received frame: copy to a pooled buffer and parse it
+static void run_unmarshall(void *data, unsigned long long iterations) {
+	BenchFrame *bench_frame = data;
+	StompFramePool *pool = stomp_frame_pool_create();
+
+	for (unsigned long long i = 0; i < iterations; i++) {
+		StompFrameBuffer *frame_buffer = stomp_frame_pool_acquire(pool, bench_frame->marshalled_len);
+		memcpy(frame_buffer->data, bench_frame->marshalled, bench_frame->marshalled_len);
+
+		if (stomp_frame_unmarshall(frame_buffer, bench_frame->marshalled_len) == 0) {
+			sink += frame_buffer->frame.body_length;
+		}
+
+		stomp_frame_release(&frame_buffer->frame);
+	}
+
+	stomp_frame_pool_destroy(pool);
+}
+
+typedef struct {
+	BenchFrame *bench_frame;
+	char *name;
+} FindHeader;
+
+static void run_find_header(void *data, unsigned long long iterations) {
+	FindHeader *find_header = data;
+
+	for (unsigned long long i = 0; i < iterations; i++) {
+		sink += stomp_find_header(&find_header->bench_frame->headers, find_header->name) != NULL;
+	}
+}
+
+typedef struct {
+	StompAdapter adapter;
+	StompInfo stomp_info;
+	int subscriptions;
+	char *messages[BENCH_DISPATCH_MESSAGES];
+	size_t message_lengths[BENCH_DISPATCH_MESSAGES];
+} Dispatch;
+
+static int dispatch_connected;
+static unsigned long long dispatch_delivered;
+
+static void dispatch_connect_callback(StompInfo *stomp_info, const StompFrame *frame) {
+	dispatch_connected = 1;
+}
+
+static void dispatch_message_callback(StompInfo *stomp_info, const StompFrame *frame) {
+	dispatch_delivered++;
+}
+
+// A loopback broker connection with the given subscriptions, MESSAGEs are then fed straight
+// to the stomp adapter as if the child adapter received them
+static int dispatch_init(Dispatch *dispatch, int subscriptions) {
+	dispatch->subscriptions = subscriptions;
+	dispatch->adapter = stomp_loopback_adapter(BENCH_MAX_FRAME_LENGTH);
+	dispatch->stomp_info = stomp_create(&dispatch->adapter);
+	stomp_init(&dispatch->stomp_info);
+
+	StompHeaders headers;
+	headers.len = 0;
+
+	dispatch_connected = 0;
+	if (stomp_connect(&dispatch->stomp_info, &headers, dispatch_connect_callback, NULL)) return -1;
+
+	stomp_service(&dispatch->stomp_info, 0);
+	if (!dispatch_connected) return -1;
+
+	char body[257];
+	memset(body, 'x', 256);
+	body[256] = '\0';
+
+	char **subscription_ids = malloc(subscriptions * sizeof(char*));
+	for (int i = 0; i < subscriptions; i++) {
+		char destination[64];
+		sprintf(destination, "/queue/bench.%d", i);
+
+		subscription_ids[i] = stomp_subscribe(&dispatch->stomp_info, destination, dispatch_message_callback, NULL);
+		if (subscription_ids[i] == NULL) return -1;
+	}
+
+	// messages for subscriptions spread over the whole list
+	int messages = subscriptions < BENCH_DISPATCH_MESSAGES ? subscriptions : BENCH_DISPATCH_MESSAGES;
+	for (int i = 0; i < messages; i++) {
+		int subscription = (long long) i * subscriptions / messages;
+
+		dispatch->messages[i] = malloc(512);
+		dispatch->message_lengths[i] = sprintf(dispatch->messages[i],
+				"MESSAGE\nsubscription:%s\nmessage-id:%d\ndestination:/queue/bench.%d\ncontent-length:256\n\n%s",
+				subscription_ids[subscription], i, subscription, body);
+	}
+	free(subscription_ids);
+
+	// every SUBSCRIBE reaches the broker before measuring
+	stomp_service(&dispatch->stomp_info, 0);
+
+	return 0;
+}
+
+static void dispatch_free(Dispatch *dispatch) {
+	stomp_destroy(&dispatch->stomp_info);
+
+	int messages = dispatch->subscriptions < BENCH_DISPATCH_MESSAGES ? dispatch->subscriptions : BENCH_DISPATCH_MESSAGES;
+	for (int i = 0; i < messages; i++) free(dispatch->messages[i]);
+}
+
+static void run_dispatch(void *data, unsigned long long iterations) {
+	Dispatch *dispatch = data;
+	StompAdapter *adapter = &dispatch->stomp_info.adapter;
+	int messages = dispatch->subscriptions < BENCH_DISPATCH_MESSAGES ? dispatch->subscriptions : BENCH_DISPATCH_MESSAGES;
+
+	for (unsigned long long i = 0; i < iterations; i++) {
+		int message = i % messages;
+		adapter->onmessage_callback(adapter, dispatch->messages[message], dispatch->message_lengths[message]);
+	}
+}
+
+// Doubles the iterations until a run lasts min_time_ms, the last run is reported
+static void run_benchmark(const Benchmark *benchmark) {
+	if (filter != NULL && strstr(benchmark->name, filter) == NULL) return;
+
+	// warm up caches and pools
+	benchmark->run(benchmark->data, 1);
+
+	unsigned long long iterations = 1;
+	long long elapsed;
+	unsigned long long allocated;
+
+	while (1) {
+		unsigned long long start_allocations = allocations;
+		long long start = now_ns();
+
+		benchmark->run(benchmark->data, iterations);
+
+		elapsed = now_ns() - start;
+		allocated = allocations - start_allocations;
+
+		if (elapsed >= min_time_ms * 1000000LL) break;
+
+		iterations *= 2;
+	}
+
+	double ns_per_op = (double) elapsed / iterations;
+	double bytes_per_sec = benchmark->bytes_per_op ? benchmark->bytes_per_op * 1e9 / ns_per_op : 0;
+
+	if (BENCH_COUNTS_ALLOCATIONS) {
+		printf("%s,%llu,%.1f,%.0f,%.2f\n", benchmark->name, iterations, ns_per_op, bytes_per_sec, (double) allocated / iterations);
+	} else {
+		printf("%s,%llu,%.1f,%.0f,\n", benchmark->name, iterations, ns_per_op, bytes_per_sec);
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "t:f:")) != -1) {
+		switch (opt) {
+		case 't': min_time_ms = atoi(optarg); break;
+		case 'f': filter = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-t min_time_ms] [-f filter]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	printf("benchmark,iterations,ns_per_op,bytes_per_sec,allocs_per_op\n");
+
+	BenchFrame bench_frames[BENCH_FRAME_TYPES];
+	for (int i = 0; i < BENCH_FRAME_TYPES; i++) {
+		if (bench_frame_init(&bench_frames[i], frame_types[i].headers, frame_types[i].body_length)) {
+			fprintf(stderr, "%s frame does not fit in %d bytes\n", frame_types[i].name, BENCH_MAX_FRAME_LENGTH);
+			return 1;
+		}
+	}
+
+	for (int i = 0; i < BENCH_FRAME_TYPES; i++) {
+		char name[64];
+		sprintf(name, "marshall/%s", frame_types[i].name);
+
+		Benchmark benchmark = { name, bench_frames[i].marshalled_len, run_marshall, &bench_frames[i] };
+		run_benchmark(&benchmark);
+	}
+
+	for (int i = 0; i < BENCH_FRAME_TYPES; i++) {
+		char name[64];
+		sprintf(name, "unmarshall/%s", frame_types[i].name);
+
+		Benchmark benchmark = { name, bench_frames[i].marshalled_len, run_unmarshall, &bench_frames[i] };
+		run_benchmark(&benchmark);
+	}
+
+	// first, last and a missing header of the 32 headers frame
+	BenchFrame *large = &bench_frames[BENCH_FRAME_TYPES - 1];
+	FindHeader find_headers[] = {
+		{ large, "subscription" },
+		{ large, large->names[BENCH_MAX_HEADERS - 1] },
+		{ large, "content-type" }
+	};
+	const char *find_names[] = { "find_header/first", "find_header/last", "find_header/missing" };
+
+	for (int i = 0; i < 3; i++) {
+		Benchmark benchmark = { find_names[i], 0, run_find_header, &find_headers[i] };
+		run_benchmark(&benchmark);
+	}
+
+	int subscriptions[] = { 1, 100, 10000 };
+	for (int i = 0; i < 3; i++) {
+		char name[64];
+		sprintf(name, "dispatch/%d", subscriptions[i]);
+		if (filter != NULL && strstr(name, filter) == NULL) continue;
+
+		Dispatch *dispatch = malloc(sizeof(Dispatch));
+		if (dispatch_init(dispatch, subscriptions[i])) {
+			fprintf(stderr, "%s: loopback connection failed\n", name);
+			return 1;
+		}
+
+		Benchmark benchmark = { name, dispatch->message_lengths[0], run_dispatch, dispatch };
+		run_benchmark(&benchmark);
+
+		dispatch_free(dispatch);
+		free(dispatch);
+	}
+
+	for (int i = 0; i < BENCH_FRAME_TYPES; i++) bench_frame_free(&bench_frames[i]);
+
+	return 0;
+}
@@ -0,0 +1,245 @@
+/*
+ * libstomp - a free implementation of the stomp protocol than can be plugged
+ * to different connection implementations using an adapter interface.
+ *
+ * Copyright (C) 2017 Sergio Otero <sergio.otero@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+
+#define _GNU_SOURCE // memmem
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "test_broker.h"
+
+struct TestBroker {
+	int listen_fd;
+	int fd;
+	pthread_t thread;
+	int stopping;
+	int sends;
+
+	char *rx;
+	size_t rx_len;
+	size_t rx_size;
+
+	char subscription[64];
+	int next_message_id;
+};
+
+// Writes everything, chunk bytes at a time with a pause between them if chunk > 0
+static int broker_write(TestBroker *broker, const char *data, size_t len, size_t chunk) {
+	while (len > 0) {
+		size_t n = chunk > 0 && chunk < len ? chunk : len;
+		ssize_t written = send(broker->fd, data, n, MSG_NOSIGNAL);
+		if (written <= 0) return -1;
+
+		data += written;
+		len -= written;
+		if (chunk > 0) usleep(2000);
+	}
+
+	return 0;
+}
+
+// Value of the header in the head of a frame, or NULL
+static char* broker_header(const char *head, size_t head_len, const char *name, char *value, size_t size) {
+	size_t name_len = strlen(name);
+
+	for (const char *line = head; line < &head[head_len]; ) {
+		const char *end = memchr(line, '\n', &head[head_len] - line);
+		if (end == NULL) break;
+
+		if (end - line > name_len && !strncmp(line, name, name_len) && line[name_len] == ':') {
+			snprintf(value, size, "%.*s", (int)(end - line - name_len - 1), &line[name_len + 1]);
+			return value;
+		}
+
+		line = end + 1;
+	}
+
+	return NULL;
+}
+
+static int broker_frame(TestBroker *broker, const char *head, size_t head_len, const char *body, size_t body_len, int has_length) {
+	char value[64];
+
+	if (!strncmp(head, "CONNECT\n", 8) || !strncmp(head, "STOMP\n", 6)) {
+		static const char connected[] = "CONNECTED\nversion:1.2\n\n";
+		if (broker_write(broker, connected, sizeof(connected), 0)) return -1;
+	} else if (!strncmp(head, "SUBSCRIBE\n", 10)) {
+		broker_header(head, head_len, "id", broker->subscription, sizeof(broker->subscription));
+	} else if (!strncmp(head, "SEND\n", 5)) {
+		__atomic_add_fetch(&broker->sends, 1, __ATOMIC_RELEASE);
+
+		char destination[64] = "";
+		broker_header(head, head_len, "destination", destination, sizeof(destination));
+
+		char message[256];
+		int message_len = snprintf(message, sizeof(message), "MESSAGE\nsubscription:%s\nmessage-id:%d\ndestination:%s\n",
+				broker->subscription, broker->next_message_id++, destination);
+		if (has_length) message_len += snprintf(&message[message_len], sizeof(message) - message_len, "content-length:%zu\n", body_len);
+		message[message_len++] = '\n';
+
+		size_t frame_len = message_len + body_len + 1;
+		char *frame = malloc(frame_len);
+		memcpy(frame, message, message_len);
+		memcpy(&frame[message_len], body, body_len);
+		frame[frame_len - 1] = '\0';
+
+		int heartbeats = broker_header(head, head_len, "heartbeats", value, sizeof(value)) ? atoi(value) : 0;
+		size_t chunk = broker_header(head, head_len, "chunk", value, sizeof(value)) ? atoi(value) : 0;
+
+		int ret = 0;
+		for (int i = 0; i < heartbeats && !ret; i++) {
+			ret = broker_write(broker, "\n", 1, chunk);
+		}
+		if (!ret) ret = broker_write(broker, frame, frame_len, chunk);
+		free(frame);
+		if (ret) return -1;
+	}
+
+	if (broker_header(head, head_len, "receipt", value, sizeof(value))) {
+		char receipt[128];
+		int receipt_len = snprintf(receipt, sizeof(receipt), "RECEIPT\nreceipt-id:%s\n\n", value);
+		if (broker_write(broker, receipt, receipt_len + 1, 0)) return -1;
+	}
+
+	return strncmp(head, "DISCONNECT\n", 11) ? 0 : -1;
+}
+
+// Handles the complete frames of the read buffer, returns -1 to close the connection
+static int broker_input(TestBroker *broker) {
+	size_t pos = 0;
+
+	while (pos < broker->rx_len) {
+		char *frame = &broker->rx[pos];
+		size_t available = broker->rx_len - pos;
+
+		// heartbeats
+		if (*frame == '\n' || *frame == '\r') {
+			pos++;
+			continue;
+		}
+
+		char *head_end = memmem(frame, available, "\n\n", 2);
+		if (head_end == NULL) break;
+
+		size_t head_len = head_end + 2 - frame;
+		char value[32];
+		int has_length = broker_header(frame, head_len, "content-length", value, sizeof(value)) != NULL;
+
+		size_t body_len;
+		if (has_length) {
+			body_len = strtoul(value, NULL, 10);
+			if (head_len + body_len + 1 > available) break;
+		} else {
+			char *null_char = memchr(&frame[head_len], '\0', available - head_len);
+			if (null_char == NULL) break;
+			body_len = null_char - &frame[head_len];
+		}
+
+		if (broker_frame(broker, frame, head_len, &frame[head_len], body_len, has_length)) return -1;
+
+		pos += head_len + body_len + 1;
+	}
+
+	broker->rx_len -= pos;
+	memmove(broker->rx, &broker->rx[pos], broker->rx_len);
+
+	return 0;
+}
+
+static void* broker_thread(void *arg) {
+	TestBroker *broker = (TestBroker *)arg;
+
+	struct pollfd pollfd = {.fd = broker->listen_fd, .events = POLLIN};
+	while (!__atomic_load_n(&broker->stopping, __ATOMIC_ACQUIRE)) {
+		if (poll(&pollfd, 1, 10) <= 0) continue;
+
+		if (broker->fd < 0) {
+			broker->fd = accept(broker->listen_fd, NULL, NULL);
+			pollfd.fd = broker->fd;
+			continue;
+		}
+
+		if (broker->rx_size - broker->rx_len < 4096) {
+			broker->rx_size *= 2;
+			broker->rx = realloc(broker->rx, broker->rx_size);
+		}
+
+		ssize_t n = recv(broker->fd, &broker->rx[broker->rx_len], broker->rx_size - broker->rx_len, 0);
+		if (n <= 0) break;
+		broker->rx_len += n;
+
+		if (broker_input(broker)) break;
+	}
+
+	if (broker->fd >= 0) close(broker->fd);
+	broker->fd = -1;
+
+	return NULL;
+}
+
+TestBroker* test_broker_start(char *url, size_t url_size) {
+	TestBroker *broker = calloc(1, sizeof(TestBroker));
+	broker->fd = -1;
+	broker->rx_size = 8192;
+	broker->rx = malloc(broker->rx_size);
+
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t address_len = sizeof(address);
+
+	// port 0, the kernel picks a free one
+	broker->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (broker->listen_fd < 0 || bind(broker->listen_fd, (struct sockaddr *)&address, sizeof(address))
+			|| listen(broker->listen_fd, 1) || getsockname(broker->listen_fd, (struct sockaddr *)&address, &address_len)
+			|| pthread_create(&broker->thread, NULL, broker_thread, broker)) {
+		if (broker->listen_fd >= 0) close(broker->listen_fd);
+		free(broker->rx);
+		free(broker);
+		return NULL;
+	}
+
+	snprintf(url, url_size, "tcp://127.0.0.1:%d", ntohs(address.sin_port));
+
+	return broker;
+}
+
+int test_broker_sends(TestBroker *broker) {
+	return __atomic_load_n(&broker->sends, __ATOMIC_ACQUIRE);
+}
+
+void test_broker_stop(TestBroker *broker) {
+	__atomic_store_n(&broker->stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(broker->thread, NULL);
+
+	close(broker->listen_fd);
+	free(broker->rx);
+	free(broker);
+}
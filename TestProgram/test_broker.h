@@ -0,0 +1,43 @@
+/*
+ * libstomp - a free implementation of the stomp protocol than can be plugged
+ * to different connection implementations using an adapter interface.
+ *
+ * Copyright (C) 2017 Sergio Otero <sergio.otero@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+#ifndef test_broker_H
+#define test_broker_H
+
+// A STOMP broker on 127.0.0.1 for the tcp adapter tests, serving one connection from a thread.
+// It lives apart from test_stomp.c, whose connect test clashes with <sys/socket.h>.
+//
+// CONNECT is answered with CONNECTED, a SEND is echoed as a MESSAGE of the last SUBSCRIBE, keeping
+// its content-length if it had one, and a receipt header gets a RECEIPT. Headers of the SEND shape
+// the echo: heartbeats:N writes N EOLs before it and chunk:N writes it N bytes at a time.
+typedef struct TestBroker TestBroker;
+
+// url gets tcp://127.0.0.1:port
+extern TestBroker* test_broker_start(char *url, size_t url_size);
+
+// SENDs received so far
+extern int test_broker_sends(TestBroker *broker);
+
+// Closes the connection and waits for the thread
+extern void test_broker_stop(TestBroker *broker);
+
+#endif
@@ -27,14 +27,21 @@
  *  MA  02110-1301  USA
  */
 
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 #include "libstomp.h"
 #include "minunit.h"
+#include "test_broker.h"
 
 static StompAdapter test_adapter;
 static StompInfo stomp_info;
@@ -43,6 +50,17 @@ static int expected_init;
 static int expected_connect;
 static int expected_send;
 static char expected_send_message[2048];
+static int expected_sendv;
+static char expected_sendv_message[2048];
+static size_t expected_sendv_len;
+static int expected_sendv_async;
+static const struct iovec *held_iov;
+static int held_iovcnt;
+static stomp_release_function held_release;
+static void *held_release_data;
+static int expected_send_frames;
+static int expected_pause;
+static int expected_paused;
 static int expected_destroy;
 static int expected_restart;
 static int expected_service;
@@ -111,6 +129,55 @@ static int send_function (StompAdapter *adapter, char *message) {
 	return 0;
 }
 
+static void check_adapter_iovec(const struct iovec *iov, int iovcnt) {
+	char message[2048];
+	size_t message_len = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(&message[message_len], iov[i].iov_base, iov[i].iov_len);
+		message_len += iov[i].iov_len;
+	}
+
+	if (message_len != expected_sendv_len || memcmp(expected_sendv_message, message, message_len)) {
+		expected_adapter_call_error = 1;
+		strcpy(expected_adapter_call_error_message, message);
+	}
+}
+
+static int sendv_function (StompAdapter *adapter, const struct iovec *iov, int iovcnt) {
+	check_adapter_function(&expected_sendv, 1, NULL, "sendv not expected");
+	check_adapter_iovec(iov, iovcnt);
+
+	return 0;
+}
+
+static int sendv_async_function (StompAdapter *adapter, const struct iovec *iov, int iovcnt,
+		stomp_release_function release, void *release_data) {
+	check_adapter_function(&expected_sendv_async, 1, NULL, "sendv async not expected");
+
+	// written later, by the test
+	held_iov = iov;
+	held_iovcnt = iovcnt;
+	held_release = release;
+	held_release_data = release_data;
+
+	return 0;
+}
+
+static int send_frames_function (StompAdapter *adapter, const struct iovec *frames, int count) {
+	check_adapter_function(&expected_send_frames, 1, NULL, "send frames not expected");
+	check_adapter_iovec(frames, count);
+	expected_send_frames = 0;
+
+	return 0;
+}
+
+static int pause_function (StompAdapter *adapter, int paused) {
+	check_adapter_function(&expected_pause, 1, NULL, "pause not expected");
+	check_adapter_function(&expected_paused, paused, NULL, "pause value not expected");
+	expected_pause = 0;
+
+	return 0;
+}
 
 static int destroy_function (StompAdapter *adapter) {
 	check_adapter_function(&expected_destroy, 1, NULL, "destroy not expected");
@@ -138,9 +205,14 @@ StompAdapter create_test_adapter() {
 	adapter.service_function = service_function;
 	adapter.connect_function = connect_function;
 	adapter.send_function = send_function;
+	adapter.sendv_function = sendv_function;
+	adapter.sendv_async_function = NULL;
+	adapter.send_frames_function = send_frames_function;
 	adapter.restart_function = restart_function;
+	adapter.pause_function = pause_function;
 	adapter.destroy_function = destroy_function;
 	adapter.max_frame_length = 1024 * 10;
+	adapter.max_message_length = 0;
 	return adapter;
 }
 
@@ -149,6 +221,12 @@ void test_setup(void) {
 	expected_connect = 0;
 	expected_send = 0;
 	strcpy(expected_send_message, "");
+	expected_sendv = 0;
+	expected_sendv_len = 0;
+	expected_sendv_async = 0;
+	held_release = NULL;
+	expected_send_frames = 0;
+	expected_pause = 0;
 	expected_destroy = 0;
 	expected_restart = 0;
 	expected_service = 0;
@@ -200,7 +278,7 @@ MU_TEST(test_init) {
 	mu_assert(test_adapter.parent_adapter == &stomp_info.adapter, "test_adapter parent");
 }
 
-void preconnect() {
+static void preconnect() {
 	stomp_adapter_assert();
 
 	StompHeader header_array[1];
@@ -222,7 +300,7 @@ void preconnect() {
 	stomp_adapter_assert();
 }
 
-void connect() {
+static void connect() {
 	MU_SUB_TEST(preconnect);
 
 	expected_send = 1;
@@ -236,7 +314,7 @@ void connect() {
 
 	strcpy(expected_frame_msg, "CONNECTED\n\n");
 
-	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, str_connected);
+	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, str_connected, strlen(str_connected));
 
 	stomp_adapter_assert();
 	mu_assert(stomp_info.adapter.status == connected, "status connected");
@@ -272,7 +350,7 @@ MU_TEST(test_connect_ko_unauthorized) {
 	strcpy(expected_frame_msg, "ERROR\nmessage:AccessDeniedException\n\n\0");
 
 	char str_connected[] = "ERROR\nmessage:AccessDeniedException\ncontent-length:0\n";
-	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, str_connected);
+	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, str_connected, strlen(str_connected));
 
 	stomp_adapter_assert();
 
@@ -290,7 +368,7 @@ MU_TEST(test_subcribe_ok) {
 
 	// Mensaje otro subscriptor no se recibe
 	char str_connected[] = "MESSAGE\nsubscription:sub-XX\nmessage-id:001\ncontent-type:json\n\nel mensaje\n\0";
-	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, str_connected);
+	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, str_connected, strlen(str_connected));
 	stomp_adapter_assert();
 
 	// Mensaje bueno si
@@ -298,7 +376,7 @@ MU_TEST(test_subcribe_ok) {
 	strcpy(expected_frame_msg, "MESSAGE\nsubscription:sub-0\nmessage-id:001\ncontent-type:json\ncontent-length:11\n\nel mensaje\n\0");
 
 	strcpy(str_connected, "MESSAGE\nsubscription:sub-0\nmessage-id:001\ncontent-type:json\n\nel mensaje\n\0");
-	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, str_connected);
+	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, str_connected, strlen(str_connected));
 
 	stomp_adapter_assert();
 
@@ -326,6 +404,1759 @@ MU_TEST(test_send_ok) {
 	mu_assert(stomp_info.adapter.status == connected, "status connected");
 }
 
+// Run length encoding: pairs of (count, char)
+static ssize_t rle_compress(StompCodec *codec, const char *src, size_t src_len, char *dst, size_t dst_capacity) {
+	size_t out = 0;
+	for (size_t i = 0; i < src_len;) {
+		size_t run = 1;
+		while (i + run < src_len && src[i + run] == src[i] && run < 255) run++;
+
+		if (out + 2 > dst_capacity) return -1;
+		dst[out++] = (char)run;
+		dst[out++] = src[i];
+		i += run;
+	}
+	return out;
+}
+
+static ssize_t rle_decompress(StompCodec *codec, const char *src, size_t src_len, char *dst, size_t dst_capacity) {
+	size_t out = 0;
+	for (size_t i = 0; i + 1 < src_len; i += 2) {
+		unsigned char run = src[i];
+		if (out + run > dst_capacity) return -1;
+		memset(&dst[out], src[i + 1], run);
+		out += run;
+	}
+	return out;
+}
+
+static size_t rle_bound(StompCodec *codec, size_t src_len) {
+	return src_len * 2;
+}
+
+static ssize_t rle_decompressed_size(StompCodec *codec, const char *src, size_t src_len) {
+	ssize_t size = 0;
+	for (size_t i = 0; i + 1 < src_len; i += 2) {
+		size += (unsigned char)src[i];
+	}
+	return size;
+}
+
+static StompCodec rle_codec = {
+	.name = "rle",
+	.min_size = 8,
+	.compress_function = rle_compress,
+	.decompress_function = rle_decompress,
+	.bound_function = rle_bound,
+	.decompressed_size_function = rle_decompressed_size
+};
+
+MU_TEST(test_send_compressed) {
+	MU_SUB_TEST(connect);
+
+	mu_assert_int_eq(0, stomp_add_codec(&stomp_info, &rle_codec));
+	mu_assert_int_eq(0, stomp_set_send_codec(&stomp_info, "rle"));
+
+	// below min_size
+	expected_send = 1;
+	strcpy(expected_send_message, "SEND\ndestination:/destination\ncontent-length:3\n\naaa");
+
+	stomp_send(&stomp_info, "/destination", NULL, "aaa");
+	stomp_adapter_assert();
+
+	expected_send = 0;
+	expected_sendv = 1;
+	char compressed[] = "SEND\ndestination:/destination\ncontent-encoding:rle\ncontent-length:4\n\n\012a\012b";
+	memcpy(expected_sendv_message, compressed, sizeof(compressed));
+	expected_sendv_len = sizeof(compressed);
+
+	stomp_send(&stomp_info, "/destination", NULL, "aaaaaaaaaabbbbbbbbbb");
+	stomp_adapter_assert();
+}
+
+MU_TEST(test_receive_compressed) {
+	MU_SUB_TEST(connect);
+
+	stomp_add_codec(&stomp_info, &rle_codec);
+
+	expected_send = 1;
+	strcpy(expected_send_message, "SUBSCRIBE\ndestination:/queue\nid:sub-0\n\n");
+
+	stomp_subscribe(&stomp_info, "/queue", test_stomp_message_callback, NULL);
+	stomp_adapter_assert();
+
+	expected_message_callback = 1;
+	strcpy(expected_frame_msg, "MESSAGE\nsubscription:sub-0\nmessage-id:001\ncontent-length:20\n\naaaaaaaaaabbbbbbbbbb");
+
+	char message[] = "MESSAGE\nsubscription:sub-0\nmessage-id:001\ncontent-encoding:rle\ncontent-length:4\n\n\012a\012b";
+	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, message, sizeof(message));
+	stomp_adapter_assert();
+}
+
+MU_TEST(test_receive_compressed_too_large) {
+	MU_SUB_TEST(connect);
+
+	stomp_add_codec(&stomp_info, &rle_codec);
+	stomp_set_max_decompressed_size(&stomp_info, 16);
+
+	expected_send = 1;
+	strcpy(expected_send_message, "SUBSCRIBE\ndestination:/queue\nid:sub-0\n\n");
+
+	stomp_subscribe(&stomp_info, "/queue", test_stomp_message_callback, NULL);
+	stomp_adapter_assert();
+
+	// 4 bytes claiming 20, over the limit
+	char message[] = "MESSAGE\nsubscription:sub-0\nmessage-id:001\ncontent-encoding:rle\ncontent-length:4\n\n\012a\012b";
+	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, message, sizeof(message));
+	stomp_adapter_assert();
+}
+
+static int receive_in_fragments(StompRxBuffer *rx_buffer, const char *message) {
+	size_t len = strlen(message);
+
+	// in 10 bytes reads
+	for (size_t pos = 0; pos < len; pos += 10) {
+		if (stomp_rx_buffer_append(rx_buffer, &message[pos], len - pos < 10 ? len - pos : 10)) return -1;
+	}
+
+	return stomp_rx_buffer_deliver(rx_buffer, test_adapter.parent_adapter);
+}
+
+MU_TEST(test_receive_spilled) {
+	MU_SUB_TEST(connect);
+
+	expected_send = 1;
+	strcpy(expected_send_message, "SUBSCRIBE\ndestination:/queue\nid:sub-0\n\n");
+
+	stomp_subscribe(&stomp_info, "/queue", test_stomp_message_callback, NULL);
+	stomp_adapter_assert();
+
+	char message[] = "MESSAGE\nsubscription:sub-0\nmessage-id:001\ncontent-length:40\n\n"
+			"0123456789012345678901234567890123456789";
+	strcpy(expected_frame_msg, message);
+
+	StompRxBuffer rx_buffer;
+
+	// reassembled in the heap
+	stomp_rx_buffer_init(&rx_buffer, 0);
+	expected_message_callback = 1;
+	mu_assert_int_eq(0, receive_in_fragments(&rx_buffer, message));
+	stomp_adapter_assert();
+	mu_assert(rx_buffer.data != NULL, "not spilled");
+
+	// moved to a temp file and delivered mapped
+	rx_buffer.spill_threshold = 32;
+	mu_assert_int_eq(0, receive_in_fragments(&rx_buffer, message));
+	stomp_adapter_assert();
+	mu_assert(rx_buffer.data == NULL && rx_buffer.fd < 0, "spilled");
+
+	stomp_rx_buffer_free(&rx_buffer);
+}
+
+static StompFrame *retained_frame;
+
+static void test_stomp_retain_callback(StompInfo *stomp_info, const StompFrame *frame) {
+	retained_frame = stomp_frame_retain(frame);
+}
+
+MU_TEST(test_retain_frame) {
+	MU_SUB_TEST(connect);
+
+	expected_send = 1;
+	strcpy(expected_send_message, "SUBSCRIBE\ndestination:/queue\nid:sub-0\n\n");
+
+	stomp_subscribe(&stomp_info, "/queue", test_stomp_retain_callback, NULL);
+	stomp_adapter_assert();
+
+	char message[] = "MESSAGE\nsubscription:sub-0\nmessage-id:001\n\nfirst\0";
+	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, message, sizeof(message));
+
+	StompFrame *first = retained_frame;
+	mu_assert(first != NULL, "retained");
+
+	// the adapter buffer is reused, the retained frame is not
+	strcpy(message, "MESSAGE\nsubscription:sub-0\nmessage-id:002\n\nsecond");
+	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, message, strlen(message));
+
+	mu_assert(retained_frame != first, "second frame in another buffer");
+	mu_assert_string_eq("first", first->body);
+	mu_assert_string_eq("001", stomp_find_header(first->system_headers, "message-id")->value);
+	mu_assert_string_eq("second", retained_frame->body);
+
+	StompFrame *second = retained_frame;
+	stomp_frame_release(first);
+	stomp_frame_release(second);
+
+	// a released buffer is reused
+	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, message, strlen(message));
+	mu_assert(retained_frame == first || retained_frame == second, "buffer from the free list");
+	stomp_frame_release(retained_frame);
+}
+
+MU_TEST(test_retain_frame_copy) {
+	StompHeader header_array[1];
+	header_array[0].name = "message";
+	header_array[0].value = "closed";
+
+	StompHeaders headers = {.len = 1, .header_array = header_array};
+	StompFrame frame = {.command = "ERROR", .system_headers = &headers, .body = "body"};
+
+	StompFrame *copy = stomp_frame_retain(&frame);
+	header_array[0].value = "changed";
+
+	char frameStr[256];
+	stomp_frame_marshall(copy, frameStr, sizeof(frameStr));
+	mu_assert_string_eq("ERROR\nmessage:closed\ncontent-length:4\n\nbody", frameStr);
+
+	stomp_frame_release(copy);
+}
+
+static int batch_calls;
+static int batch_frames;
+static char batch_last_body[64];
+
+static void test_stomp_batch_callback(StompInfo *stomp_info, StompFrame *const *frames, int count) {
+	batch_calls++;
+	batch_frames += count;
+	strcpy(batch_last_body, frames[count - 1]->body);
+}
+
+MU_TEST(test_subscribe_batch) {
+	MU_SUB_TEST(connect);
+
+	batch_calls = 0;
+	batch_frames = 0;
+
+	StompSubscriptionOptions options = stomp_subscription_default_options();
+	options.batch_callback = test_stomp_batch_callback;
+	options.max_batch_size = 2;
+
+	expected_send = 1;
+	strcpy(expected_send_message, "SUBSCRIBE\ndestination:/queue\nid:sub-0\n\n");
+
+	stomp_subscribe_with_options(&stomp_info, "/queue", NULL, NULL, &options);
+	stomp_adapter_assert();
+
+	char message[64];
+	for (int i = 0; i < 3; i++) {
+		sprintf(message, "MESSAGE\nsubscription:sub-0\nmessage-id:%d\n\nbody %d", i, i);
+		test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, message, strlen(message));
+	}
+
+	// a full batch is delivered straight away
+	mu_assert_int_eq(1, batch_calls);
+	mu_assert_int_eq(2, batch_frames);
+	mu_assert_string_eq("body 1", batch_last_body);
+
+	// the rest at the end of the service call
+	expected_service = 1;
+	stomp_service(&stomp_info, 0);
+	stomp_adapter_assert();
+
+	mu_assert_int_eq(2, batch_calls);
+	mu_assert_int_eq(3, batch_frames);
+	mu_assert_string_eq("body 2", batch_last_body);
+}
+
+static void test_stomp_ack_callback(StompInfo *stomp_info, const StompFrame *frame) {
+	stomp_ack(stomp_info, frame);
+}
+
+static void subscribe_client_ack(enum StompAckMode ack_mode, int ack_batch_size, char *expected_subscribe) {
+	StompSubscriptionOptions options = stomp_subscription_default_options();
+	options.ack_mode = ack_mode;
+	options.ack_batch_size = ack_batch_size;
+
+	expected_send = 1;
+	strcpy(expected_send_message, expected_subscribe);
+
+	stomp_subscribe_with_options(&stomp_info, "/queue", test_stomp_ack_callback, NULL, &options);
+}
+
+static void receive_messages(int from, int to) {
+	char message[64];
+	for (int i = from; i < to; i++) {
+		sprintf(message, "MESSAGE\nsubscription:sub-0\nmessage-id:%d\nack:a%d\n\nbody", i, i);
+		test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, message, strlen(message));
+	}
+}
+
+MU_TEST(test_ack_individual_batch) {
+	MU_SUB_TEST(connect);
+
+	subscribe_client_ack(STOMP_ACK_CLIENT_INDIVIDUAL, 2, "SUBSCRIBE\ndestination:/queue\nid:sub-0\nack:client-individual\n\n");
+	stomp_adapter_assert();
+
+	// both ACKs go in the same adapter call
+	char expected[] = "ACK\nsubscription:sub-0\nmessage-id:0\nid:a0\n\n\0ACK\nsubscription:sub-0\nmessage-id:1\nid:a1\n\n";
+	memcpy(expected_sendv_message, expected, sizeof(expected));
+	expected_sendv_len = sizeof(expected);
+	expected_send_frames = 1;
+
+	receive_messages(0, 2);
+	stomp_adapter_assert();
+	mu_assert_int_eq(0, expected_send_frames);
+}
+
+static int frame_writes[4];
+static int frame_writes_len;
+
+static int test_count_send_frames_function(StompAdapter *adapter, const struct iovec *frames, int count) {
+	if (frame_writes_len < 4) frame_writes[frame_writes_len] = count;
+	frame_writes_len++;
+
+	return 0;
+}
+
+MU_TEST(test_ack_batch_chunks) {
+	MU_SUB_TEST(connect);
+
+	frame_writes_len = 0;
+	test_adapter.send_frames_function = test_count_send_frames_function;
+
+	subscribe_client_ack(STOMP_ACK_CLIENT_INDIVIDUAL, 100, "SUBSCRIBE\ndestination:/queue\nid:sub-0\nack:client-individual\n\n");
+	stomp_adapter_assert();
+
+	// a large batch is written in chunks
+	receive_messages(0, 100);
+	stomp_adapter_assert();
+	mu_assert_int_eq(2, frame_writes_len);
+	mu_assert_int_eq(64, frame_writes[0]);
+	mu_assert_int_eq(36, frame_writes[1]);
+}
+
+MU_TEST(test_ack_cumulative) {
+	MU_SUB_TEST(connect);
+
+	subscribe_client_ack(STOMP_ACK_CLIENT, 3, "SUBSCRIBE\ndestination:/queue\nid:sub-0\nack:client\n\n");
+	stomp_adapter_assert();
+
+	// only the last message is acknowledged
+	char expected[] = "ACK\nsubscription:sub-0\nmessage-id:2\nid:a2\n\n";
+	memcpy(expected_sendv_message, expected, sizeof(expected));
+	expected_sendv_len = sizeof(expected);
+	expected_send_frames = 1;
+
+	receive_messages(0, 3);
+	stomp_adapter_assert();
+	mu_assert_int_eq(0, expected_send_frames);
+}
+
+MU_TEST(test_nack_flushes_acks) {
+	MU_SUB_TEST(connect);
+
+	subscribe_client_ack(STOMP_ACK_CLIENT_INDIVIDUAL, 10, "SUBSCRIBE\ndestination:/queue\nid:sub-0\nack:client-individual\n\n");
+	stomp_adapter_assert();
+
+	receive_messages(0, 1);
+	stomp_adapter_assert();
+
+	StompFrame frame;
+	StompHeaders headers;
+	StompHeader header_array[3] = {{"subscription", "sub-0"}, {"message-id", "1"}, {"ack", "a1"}};
+	headers.len = 3;
+	headers.header_array = header_array;
+	frame.command = "MESSAGE";
+	frame.system_headers = &headers;
+	frame.user_headers = NULL;
+	frame.body = "body";
+	frame.body_length = 0;
+	frame.pool_buffer = NULL;
+
+	char expected[] = "ACK\nsubscription:sub-0\nmessage-id:0\nid:a0\n\n";
+	memcpy(expected_sendv_message, expected, sizeof(expected));
+	expected_sendv_len = sizeof(expected);
+	expected_send_frames = 1;
+	expected_send = 1;
+	strcpy(expected_send_message, "NACK\nsubscription:sub-0\nmessage-id:1\nid:a1\n\n");
+
+	stomp_nack(&stomp_info, &frame);
+	stomp_adapter_assert();
+	mu_assert_int_eq(0, expected_send_frames);
+}
+
+MU_TEST(test_subscribe_queue) {
+	MU_SUB_TEST(connect);
+
+	StompSubscriptionOptions options = stomp_subscription_default_options();
+	options.ack_mode = STOMP_ACK_CLIENT_INDIVIDUAL;
+	options.prefetch = 10;
+	options.queue_size = 4;
+
+	expected_send = 1;
+	strcpy(expected_send_message, "SUBSCRIBE\ndestination:/queue\nid:sub-0\nack:client-individual\n"
+			"prefetch-count:10\nactivemq.prefetchSize:10\n\n");
+
+	stomp_subscribe_with_options(&stomp_info, "/queue", NULL, NULL, &options);
+	stomp_adapter_assert();
+
+	receive_messages(0, 3);
+	stomp_adapter_assert();
+
+	// the fourth message fills the queue
+	expected_pause = 1;
+	expected_paused = 1;
+	receive_messages(3, 4);
+	stomp_adapter_assert();
+	mu_assert_int_eq(0, expected_pause);
+
+	// read before the pause took effect
+	receive_messages(4, 5);
+	stomp_adapter_assert();
+
+	StompFrame *frames[5];
+	mu_assert_int_eq(2, stomp_poll(&stomp_info, "sub-0", frames, 2));
+	mu_assert_string_eq("0", stomp_find_header(frames[0]->system_headers, "message-id")->value);
+	mu_assert_string_eq("1", stomp_find_header(frames[1]->system_headers, "message-id")->value);
+	stomp_adapter_assert();
+
+	// resumed when half empty
+	expected_pause = 1;
+	expected_paused = 0;
+	mu_assert_int_eq(3, stomp_poll(&stomp_info, "sub-0", &frames[2], 5));
+	stomp_adapter_assert();
+	mu_assert_int_eq(0, expected_pause);
+	mu_assert_string_eq("4", stomp_find_header(frames[4]->system_headers, "message-id")->value);
+
+	for (int i = 0; i < 5; i++) {
+		stomp_frame_release(frames[i]);
+	}
+
+	mu_assert_int_eq(0, stomp_poll(&stomp_info, "sub-0", frames, 5));
+}
+
+MU_TEST(test_subscribe_queue_overflow) {
+	MU_SUB_TEST(connect);
+
+	StompSubscriptionOptions options = stomp_subscription_default_options();
+	options.ack_mode = STOMP_ACK_CLIENT_INDIVIDUAL;
+	options.queue_size = 2;
+
+	expected_send = 1;
+	strcpy(expected_send_message, "SUBSCRIBE\ndestination:/queue\nid:sub-0\nack:client-individual\n\n");
+
+	stomp_subscribe_with_options(&stomp_info, "/queue", NULL, NULL, &options);
+	stomp_adapter_assert();
+	expected_send = 0;
+
+	expected_pause = 1;
+	expected_paused = 1;
+	receive_messages(0, 2);
+	stomp_adapter_assert();
+
+	// another queue_size read before the pause took effect
+	receive_messages(2, 4);
+	stomp_adapter_assert();
+
+	// beyond that the broker gets it back
+	expected_send = 1;
+	strcpy(expected_send_message, "NACK\nsubscription:sub-0\nmessage-id:4\nid:a4\n\n");
+	receive_messages(4, 5);
+	stomp_adapter_assert();
+
+	StompFrame *frames[5];
+	mu_assert_int_eq(4, stomp_poll(&stomp_info, "sub-0", frames, 5));
+	for (int i = 0; i < 4; i++) {
+		stomp_frame_release(frames[i]);
+	}
+}
+
+MU_TEST(test_subscribe_queue_no_pause) {
+	MU_SUB_TEST(connect);
+
+	// nothing would stop the reads of a full queue
+	test_adapter.pause_function = NULL;
+
+	StompSubscriptionOptions options = stomp_subscription_default_options();
+	options.queue_size = 4;
+
+	mu_check(stomp_subscribe_with_options(&stomp_info, "/queue", NULL, NULL, &options) == NULL);
+	stomp_adapter_assert();
+}
+
+static void receive_quote(char *instrument, char *price, char *timestamp) {
+	char message[128];
+	sprintf(message, "MESSAGE\nsubscription:sub-0\nmessage-id:%s\ninstrument:%s\ntimestamp:%s\n\n%s", price, instrument, timestamp, price);
+	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, message, strlen(message));
+}
+
+MU_TEST(test_subscribe_conflation) {
+	MU_SUB_TEST(connect);
+
+	StompSubscriptionOptions options = stomp_subscription_default_options();
+	options.queue_size = 4;
+	options.conflation_header = "instrument";
+	options.max_age_ms = 60000;
+
+	expected_send = 1;
+	strcpy(expected_send_message, "SUBSCRIBE\ndestination:/topic\nid:sub-0\n\n");
+
+	stomp_subscribe_with_options(&stomp_info, "/topic", NULL, NULL, &options);
+	stomp_adapter_assert();
+
+	char now[32];
+	sprintf(now, "%lld", (long long)time(NULL) * 1000);
+
+	receive_quote("A", "10", now);
+	receive_quote("B", "20", now);
+	receive_quote("A", "11", now);
+	receive_quote("C", "30", "1000"); // expired
+	receive_quote("A", "12", now);
+	stomp_adapter_assert();
+
+	// the latest value of each key, in the order the keys arrived
+	StompFrame *frames[4];
+	mu_assert_int_eq(2, stomp_poll(&stomp_info, "sub-0", frames, 4));
+	mu_assert_string_eq("12", frames[0]->body);
+	mu_assert_string_eq("20", frames[1]->body);
+	stomp_frame_release(frames[0]);
+	stomp_frame_release(frames[1]);
+
+	// the key is free again
+	receive_quote("A", "13", now);
+	mu_assert_int_eq(1, stomp_poll(&stomp_info, "sub-0", frames, 4));
+	mu_assert_string_eq("13", frames[0]->body);
+	stomp_frame_release(frames[0]);
+}
+
+MU_TEST(test_conflation_acks_dropped) {
+	MU_SUB_TEST(connect);
+
+	StompSubscriptionOptions options = stomp_subscription_default_options();
+	options.ack_mode = STOMP_ACK_CLIENT_INDIVIDUAL;
+	options.ack_batch_size = 2;
+	options.queue_size = 4;
+	options.conflation_header = "instrument";
+	options.max_age_ms = 60000;
+
+	expected_send = 1;
+	strcpy(expected_send_message, "SUBSCRIBE\ndestination:/topic\nid:sub-0\nack:client-individual\n\n");
+
+	stomp_subscribe_with_options(&stomp_info, "/topic", NULL, NULL, &options);
+	stomp_adapter_assert();
+
+	char now[32];
+	sprintf(now, "%lld", (long long)time(NULL) * 1000);
+
+	// the replaced and the expired messages are acknowledged in one batch
+	char expected[] = "ACK\nsubscription:sub-0\nmessage-id:10\n\n\0ACK\nsubscription:sub-0\nmessage-id:30\n\n";
+	memcpy(expected_sendv_message, expected, sizeof(expected));
+	expected_sendv_len = sizeof(expected);
+	expected_send_frames = 1;
+
+	receive_quote("A", "10", now);
+	receive_quote("A", "11", now);
+	receive_quote("C", "30", "1000");
+	stomp_adapter_assert();
+	mu_assert_int_eq(0, expected_send_frames);
+
+	StompFrame *frames[4];
+	mu_assert_int_eq(1, stomp_poll(&stomp_info, "sub-0", frames, 4));
+	mu_assert_string_eq("11", frames[0]->body);
+	stomp_frame_release(frames[0]);
+}
+
+static int shared_calls;
+static char *shared_unsubscribe_id;
+
+static void test_stomp_shared_callback(StompInfo *stomp_info, const StompFrame *frame) {
+	shared_calls++;
+}
+
+static void test_stomp_shared_unsubscribe_callback(StompInfo *stomp_info, const StompFrame *frame) {
+	shared_calls++;
+	stomp_unsubscribe(stomp_info, shared_unsubscribe_id);
+}
+
+MU_TEST(test_subscribe_shared) {
+	MU_SUB_TEST(connect);
+
+	shared_calls = 0;
+
+	StompSubscriptionOptions options = stomp_subscription_default_options();
+	options.shared = 1;
+
+	expected_send = 1;
+	strcpy(expected_send_message, "SUBSCRIBE\ndestination:/topic\nid:sub-0\n\n");
+
+	char *first_id = stomp_subscribe_with_options(&stomp_info, "/topic", test_stomp_shared_callback, NULL, &options);
+	stomp_adapter_assert();
+	mu_assert_string_eq("sub-0", first_id);
+
+	// no SUBSCRIBE for the second one
+	expected_send = 0;
+	char *second_id = stomp_subscribe_with_options(&stomp_info, "/topic", test_stomp_shared_unsubscribe_callback, NULL, &options);
+	stomp_adapter_assert();
+	mu_assert_string_eq("sub-1", second_id);
+	shared_unsubscribe_id = second_id;
+
+	// one frame for both, the second unsubscribes itself without the broker knowing
+	char message[] = "MESSAGE\nsubscription:sub-0\nmessage-id:1\n\nbody";
+	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, message, strlen(message));
+	stomp_adapter_assert();
+	mu_assert_int_eq(2, shared_calls);
+
+	char message2[] = "MESSAGE\nsubscription:sub-0\nmessage-id:2\n\nbody";
+	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, message2, strlen(message2));
+	mu_assert_int_eq(3, shared_calls);
+
+	// the last one leaves the broker subscription
+	expected_send = 1;
+	strcpy(expected_send_message, "UNSUBSCRIBE\nid:sub-0\n\n");
+	mu_assert_int_eq(0, stomp_unsubscribe(&stomp_info, first_id));
+	stomp_adapter_assert();
+}
+
+MU_TEST(test_unsubscribe_shared_twice) {
+	MU_SUB_TEST(connect);
+
+	StompSubscriptionOptions options = stomp_subscription_default_options();
+	options.shared = 1;
+
+	expected_send = 1;
+	strcpy(expected_send_message, "SUBSCRIBE\ndestination:/topic\nid:sub-0\n\n");
+	stomp_subscribe_with_options(&stomp_info, "/topic", test_stomp_shared_callback, NULL, &options);
+	stomp_subscribe_with_options(&stomp_info, "/topic", test_stomp_shared_callback, NULL, &options);
+	stomp_adapter_assert();
+
+	// the first listener has the id of the broker subscription, used by the second one
+	expected_send = 0;
+	mu_assert_int_eq(0, stomp_unsubscribe(&stomp_info, "sub-0"));
+	mu_assert_int_eq(-1, stomp_unsubscribe(&stomp_info, "sub-0"));
+	stomp_adapter_assert();
+
+	expected_send = 1;
+	strcpy(expected_send_message, "UNSUBSCRIBE\nid:sub-0\n\n");
+	mu_assert_int_eq(0, stomp_unsubscribe(&stomp_info, "sub-1"));
+	stomp_adapter_assert();
+}
+
+static int route_eur_calls;
+static int route_all_calls;
+static int route_usd_spot_calls;
+
+static void test_route_eur(StompInfo *stomp_info, const StompFrame *frame) {
+	route_eur_calls++;
+}
+
+static void test_route_all(StompInfo *stomp_info, const StompFrame *frame) {
+	route_all_calls++;
+}
+
+static void test_route_usd_spot(StompInfo *stomp_info, const StompFrame *frame) {
+	route_usd_spot_calls++;
+	// removed while dispatching
+	stomp_remove_route(stomp_info, "sub-0", "/topic/prices.USD.spot", test_route_usd_spot);
+}
+
+static void receive_destination(char *destination) {
+	char message[128];
+	sprintf(message, "MESSAGE\nsubscription:sub-0\nmessage-id:1\ndestination:%s\n\nbody", destination);
+	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, message, strlen(message));
+}
+
+MU_TEST(test_subscribe_routes) {
+	MU_SUB_TEST(connect);
+
+	route_eur_calls = route_all_calls = route_usd_spot_calls = 0;
+
+	expected_send = 1;
+	strcpy(expected_send_message, "SUBSCRIBE\ndestination:/topic/prices.>\nid:sub-0\n\n");
+
+	stomp_subscribe(&stomp_info, "/topic/prices.>", test_stomp_shared_callback, NULL);
+	stomp_adapter_assert();
+
+	mu_assert_int_eq(0, stomp_add_route(&stomp_info, "sub-0", "/topic/prices.EUR.*", test_route_eur));
+	mu_assert_int_eq(0, stomp_add_route(&stomp_info, "sub-0", "/topic/prices.#", test_route_all));
+	mu_assert_int_eq(0, stomp_add_route(&stomp_info, "sub-0", "/topic/prices.USD.spot", test_route_usd_spot));
+	mu_assert_int_eq(-1, stomp_add_route(&stomp_info, "sub-0", "/topic/>.spot", test_route_eur));
+
+	shared_calls = 0;
+
+	receive_destination("/topic/prices.EUR.spot");
+	receive_destination("/topic/prices.EUR");
+	receive_destination("/topic/prices.USD.spot");
+	receive_destination("/topic/prices.USD.spot");
+	receive_destination("/topic/news");
+
+	mu_assert_int_eq(1, route_eur_calls);
+	mu_assert_int_eq(4, route_all_calls);
+	mu_assert_int_eq(1, route_usd_spot_calls);
+	// only the frame without routes
+	mu_assert_int_eq(1, shared_calls);
+
+	mu_assert_int_eq(-1, stomp_remove_route(&stomp_info, "sub-0", "/topic/prices.USD.spot", test_route_usd_spot));
+}
+
+static void receive_message_id(char *message_id) {
+	char message[128];
+	sprintf(message, "MESSAGE\nsubscription:sub-0\nmessage-id:%s\n\nbody", message_id);
+	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, message, strlen(message));
+}
+
+MU_TEST(test_dedup) {
+	MU_SUB_TEST(connect);
+
+	StompDedupOptions options = stomp_dedup_default_options();
+	options.capacity = 64;
+	options.exact_size = 2;
+	mu_assert_int_eq(0, stomp_enable_dedup(&stomp_info, &options));
+
+	expected_send = 1;
+	strcpy(expected_send_message, "SUBSCRIBE\ndestination:/queue\nid:sub-0\n\n");
+
+	stomp_subscribe(&stomp_info, "/queue", test_stomp_shared_callback, NULL);
+	stomp_adapter_assert();
+
+	shared_calls = 0;
+
+	receive_message_id("1");
+	receive_message_id("2");
+	receive_message_id("1");
+	mu_assert_int_eq(2, shared_calls);
+
+	// 1 is not recent anymore, the filter still knows it
+	receive_message_id("3");
+	receive_message_id("4");
+	receive_message_id("1");
+	mu_assert_int_eq(4, shared_calls);
+
+	StompDedupStats stats;
+	mu_assert_int_eq(0, stomp_dedup_stats(&stomp_info, &stats));
+	mu_assert_int_eq(1, (int)stats.exact_hits);
+	mu_assert_int_eq(1, (int)stats.filter_hits);
+	mu_assert_int_eq(4, (int)stats.misses);
+}
+
+MU_TEST(test_dedup_redelivered_after_nack) {
+	MU_SUB_TEST(connect);
+
+	mu_assert_int_eq(0, stomp_enable_dedup(&stomp_info, NULL));
+
+	StompSubscriptionOptions options = stomp_subscription_default_options();
+	options.ack_mode = STOMP_ACK_CLIENT_INDIVIDUAL;
+	options.queue_size = 2;
+
+	expected_send = 1;
+	strcpy(expected_send_message, "SUBSCRIBE\ndestination:/queue\nid:sub-0\nack:client-individual\n\n");
+	stomp_subscribe_with_options(&stomp_info, "/queue", NULL, NULL, &options);
+	stomp_adapter_assert();
+
+	// 4 does not fit the queue and is NACKed
+	expected_pause = 1;
+	expected_paused = 1;
+	strcpy(expected_send_message, "NACK\nsubscription:sub-0\nmessage-id:4\nid:a4\n\n");
+	receive_messages(0, 5);
+	stomp_adapter_assert();
+
+	expected_pause = 1;
+	expected_paused = 0;
+	StompFrame *frames[4];
+	mu_assert_int_eq(4, stomp_poll(&stomp_info, "sub-0", frames, 4));
+	stomp_adapter_assert();
+	for (int i = 0; i < 4; i++) {
+		stomp_frame_release(frames[i]);
+	}
+
+	// its redelivery is not a duplicate
+	expected_send = 0;
+	receive_messages(4, 5);
+	mu_assert_int_eq(1, stomp_poll(&stomp_info, "sub-0", frames, 4));
+	mu_assert_string_eq("4", stomp_find_header(frames[0]->system_headers, "message-id")->value);
+	stomp_frame_release(frames[0]);
+	stomp_adapter_assert();
+
+	// one of a polled message is, acknowledged again
+	char expected[] = "ACK\nsubscription:sub-0\nmessage-id:0\nid:a0\n\n";
+	memcpy(expected_sendv_message, expected, sizeof(expected));
+	expected_sendv_len = sizeof(expected);
+	expected_send_frames = 1;
+	receive_messages(0, 1);
+	stomp_adapter_assert();
+	mu_assert_int_eq(0, expected_send_frames);
+	mu_assert_int_eq(0, stomp_poll(&stomp_info, "sub-0", frames, 4));
+}
+
+MU_TEST(test_dedup_client_ack) {
+	MU_SUB_TEST(connect);
+
+	mu_assert_int_eq(0, stomp_enable_dedup(&stomp_info, NULL));
+
+	subscribe_client_ack(STOMP_ACK_CLIENT, 1, "SUBSCRIBE\ndestination:/queue\nid:sub-0\nack:client\n\n");
+	stomp_adapter_assert();
+
+	char expected[] = "ACK\nsubscription:sub-0\nmessage-id:0\nid:a0\n\n";
+	memcpy(expected_sendv_message, expected, sizeof(expected));
+	expected_sendv_len = sizeof(expected);
+	expected_send_frames = 1;
+	receive_messages(0, 1);
+	stomp_adapter_assert();
+	mu_assert_int_eq(0, expected_send_frames);
+
+	// a cumulative ACK of the duplicate would acknowledge what was received after it
+	receive_messages(0, 1);
+	stomp_adapter_assert();
+}
+
+static char spool_directory[] = "/tmp/test_stomp_spool_XXXXXX";
+
+static void enable_spool() {
+	StompSpoolOptions options = stomp_spool_default_options(spool_directory);
+	options.segment_size = 16 * 1024;
+	options.max_segments = 4;
+	mu_assert_int_eq(0, stomp_enable_spool(&stomp_info, &options));
+}
+
+static void expect_frames(char *expected, size_t len) {
+	memcpy(expected_sendv_message, expected, len);
+	expected_sendv_len = len;
+	expected_send_frames = 1;
+}
+
+MU_TEST(test_spool_replay) {
+	mu_check(mkdtemp(spool_directory) != NULL);
+
+	MU_SUB_TEST(connect);
+	enable_spool();
+
+	char expected1[] = "SEND\ndestination:/queue\nreceipt:spool-1\ncontent-length:1\n\n1";
+	expect_frames(expected1, sizeof(expected1));
+	mu_assert_int_eq(0, stomp_send(&stomp_info, "/queue", NULL, "1"));
+	stomp_adapter_assert();
+	mu_assert_int_eq(0, expected_send_frames);
+
+	// kept while disconnected
+	stomp_info.adapter.status = disconnected;
+	mu_assert_int_eq(0, stomp_send(&stomp_info, "/queue", NULL, "2"));
+	mu_assert_int_eq(0, stomp_send(&stomp_info, "/queue", NULL, "3"));
+	stomp_adapter_assert();
+
+	StompSpoolStats stats;
+	stomp_spool_stats(&stomp_info, &stats);
+	mu_assert_int_eq(3, (int)stats.pending);
+	mu_assert_int_eq(2, (int)stats.unsent);
+
+	// every unconfirmed frame again, together and before the connect callback
+	char expected[] = "SEND\ndestination:/queue\nreceipt:spool-1\ncontent-length:1\n\n1\0"
+			"SEND\ndestination:/queue\nreceipt:spool-2\ncontent-length:1\n\n2\0"
+			"SEND\ndestination:/queue\nreceipt:spool-3\ncontent-length:1\n\n3";
+	expect_frames(expected, sizeof(expected));
+	expected_connect_callback = 1;
+	strcpy(expected_frame_msg, "CONNECTED\n\n");
+
+	char connected[] = "CONNECTED\n";
+	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, connected, strlen(connected));
+	stomp_adapter_assert();
+	mu_assert_int_eq(0, expected_send_frames);
+
+	char receipt[] = "RECEIPT\nreceipt-id:spool-2\n\n";
+	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, receipt, strlen(receipt));
+
+	stomp_spool_stats(&stomp_info, &stats);
+	mu_assert_int_eq(1, (int)stats.pending);
+	mu_assert_int_eq(0, (int)stats.unsent);
+}
+
+MU_TEST(test_spool_recover) {
+	MU_SUB_TEST(connect);
+
+	// the frame not confirmed in test_spool_replay
+	char expected[] = "SEND\ndestination:/queue\nreceipt:spool-3\ncontent-length:1\n\n3";
+	expect_frames(expected, sizeof(expected));
+	enable_spool();
+	stomp_adapter_assert();
+	mu_assert_int_eq(0, expected_send_frames);
+
+	char receipt[] = "RECEIPT\nreceipt-id:spool-3\n\n";
+	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, receipt, strlen(receipt));
+
+	StompSpoolStats stats;
+	stomp_spool_stats(&stomp_info, &stats);
+	mu_assert_int_eq(0, (int)stats.pending);
+	mu_assert_int_eq(1, stats.segments);
+
+	// the emptied segment is written again
+	char expected4[] = "SEND\ndestination:/queue\nreceipt:spool-4\ncontent-length:1\n\n4";
+	expect_frames(expected4, sizeof(expected4));
+	mu_assert_int_eq(0, stomp_send(&stomp_info, "/queue", NULL, "4"));
+	stomp_adapter_assert();
+	mu_assert_int_eq(0, expected_send_frames);
+
+	stomp_info.adapter.status = disconnected;
+	mu_assert_int_eq(0, stomp_send(&stomp_info, "/queue", NULL, "5"));
+
+	char expected45[] = "SEND\ndestination:/queue\nreceipt:spool-4\ncontent-length:1\n\n4\0"
+			"SEND\ndestination:/queue\nreceipt:spool-5\ncontent-length:1\n\n5";
+	expect_frames(expected45, sizeof(expected45));
+	expected_connect_callback = 1;
+	strcpy(expected_frame_msg, "CONNECTED\n\n");
+
+	char connected[] = "CONNECTED\n";
+	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, connected, strlen(connected));
+	stomp_adapter_assert();
+	mu_assert_int_eq(0, expected_send_frames);
+
+	DIR *dir = opendir(spool_directory);
+	struct dirent *entry;
+	char path[512];
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.') continue;
+		sprintf(path, "%s/%s", spool_directory, entry->d_name);
+		unlink(path);
+	}
+	closedir(dir);
+	rmdir(spool_directory);
+}
+
+MU_TEST(test_send_prepared) {
+	MU_SUB_TEST(connect);
+
+	StompHeader static_header_array[1] = {{"kind", "order"}};
+	StompHeaders static_headers = {.len = 1, .header_array = static_header_array};
+
+	StompPreparedSend *prepared = stomp_prepare_send(&stomp_info, "/queue", &static_headers);
+	mu_check(prepared != NULL);
+
+	StompHeader header_array[1] = {{"seq", "1"}};
+	StompHeaders headers = {.len = 1, .header_array = header_array};
+
+	char expected[] = "SEND\ndestination:/queue\nkind:order\nseq:1\ncontent-length:5\n\nhello";
+	memcpy(expected_sendv_message, expected, sizeof(expected));
+	expected_sendv_len = sizeof(expected);
+	expected_sendv = 1;
+
+	mu_assert_int_eq(0, stomp_send_prepared(prepared, &headers, "hello"));
+	stomp_adapter_assert();
+
+	char expected2[] = "SEND\ndestination:/queue\nkind:order\ncontent-length:2\n\nhi";
+	memcpy(expected_sendv_message, expected2, sizeof(expected2));
+	expected_sendv_len = sizeof(expected2);
+
+	mu_assert_int_eq(0, stomp_send_prepared(prepared, NULL, "hi"));
+	stomp_adapter_assert();
+
+	stomp_prepared_send_free(prepared);
+}
+
+MU_TEST(test_sendv) {
+	MU_SUB_TEST(connect);
+
+	char payload[] = {'a', '\0', 'b'};
+	struct iovec body[2] = {{.iov_base = "envelope:", .iov_len = 9}, {.iov_base = payload, .iov_len = sizeof(payload)}};
+
+	char expected[] = "SEND\ndestination:/queue\ncontent-length:12\n\nenvelope:a\0b";
+	memcpy(expected_sendv_message, expected, sizeof(expected));
+	expected_sendv_len = sizeof(expected);
+	expected_sendv = 1;
+
+	mu_assert_int_eq(0, stomp_sendv(&stomp_info, "/queue", NULL, body, 2));
+	stomp_adapter_assert();
+}
+
+MU_TEST(test_send_large) {
+	MU_SUB_TEST(connect);
+
+	stomp_info.adapter.max_frame_length = 64;
+
+	char body[101];
+	memset(body, 'x', 100);
+	body[100] = '\0';
+
+	// the adapter does not fragment
+	mu_assert_int_eq(-1, stomp_send(&stomp_info, "/queue", NULL, body));
+	stomp_adapter_assert();
+
+	test_adapter.max_message_length = 1024;
+
+	sprintf(expected_sendv_message, "SEND\ndestination:/queue\ncontent-length:100\n\n%s", body);
+	expected_sendv_len = strlen(expected_sendv_message) + 1;
+	expected_sendv = 1;
+
+	mu_assert_int_eq(0, stomp_send(&stomp_info, "/queue", NULL, body));
+	stomp_adapter_assert();
+
+	struct iovec iov = {.iov_base = body, .iov_len = 100};
+	mu_assert_int_eq(0, stomp_sendv(&stomp_info, "/queue", NULL, &iov, 1));
+	stomp_adapter_assert();
+}
+
+MU_TEST(test_send_fd) {
+	MU_SUB_TEST(connect);
+
+	char path[] = "/tmp/test_stomp_fd_XXXXXX";
+	int fd = mkstemp(path);
+	unlink(path);
+	mu_assert_int_eq(14, write(fd, "skip:file body", 14));
+
+	char expected[] = "SEND\ndestination:/files\ncontent-length:9\n\nfile body";
+	memcpy(expected_sendv_message, expected, sizeof(expected));
+	expected_sendv_len = sizeof(expected);
+
+	// copied by sendv before returning
+	expected_sendv = 1;
+	mu_assert_int_eq(0, stomp_send_fd(&stomp_info, "/files", NULL, fd, 5, 9));
+	stomp_adapter_assert();
+	expected_sendv = 0;
+
+	// held by the adapter until it is written
+	test_adapter.sendv_async_function = sendv_async_function;
+	expected_sendv_async = 1;
+	mu_assert_int_eq(0, stomp_send_fd(&stomp_info, "/files", NULL, fd, 5, 9));
+	stomp_adapter_assert();
+	expected_sendv_async = 0;
+
+	// nothing is sent from past the end of the file
+	mu_assert_int_eq(-1, stomp_send_fd(&stomp_info, "/files", NULL, fd, 5, 10));
+	mu_assert_int_eq(-1, stomp_send_fd(&stomp_info, "/files", NULL, fd, 4096, 1));
+	close(fd);
+	stomp_adapter_assert();
+
+	mu_assert(held_release != NULL, "segments held");
+	check_adapter_iovec(held_iov, held_iovcnt);
+	stomp_adapter_assert();
+	held_release(held_release_data);
+}
+
+static int shm_connected;
+static int shm_messages;
+static char shm_last_body[64];
+
+static void test_shm_connect_callback(StompInfo *stomp_info, const StompFrame *frame) {
+	shm_connected = 1;
+}
+
+static void test_shm_message_callback(StompInfo *stomp_info, const StompFrame *frame) {
+	shm_messages++;
+	snprintf(shm_last_body, sizeof(shm_last_body), "%s", frame->body);
+}
+
+MU_TEST(test_shm_adapter) {
+	char name[64];
+	sprintf(name, "/test_stomp_shm_%d", (int)getpid());
+
+	StompShm *peer = stomp_shm_peer_create(name, 65536);
+	mu_assert(peer != NULL, "peer created");
+
+	StompAdapter adapter = stomp_shm_adapter(name, 4096);
+	StompInfo shm_info = stomp_create(&adapter);
+	mu_assert_int_eq(0, stomp_init(&shm_info));
+
+	StompHeaders headers;
+	headers.len = 0;
+	shm_connected = 0;
+	mu_assert_int_eq(0, stomp_connect(&shm_info, &headers, test_shm_connect_callback, test_stomp_error_callback));
+
+	// a second client can not take the segment
+	StompAdapter second = stomp_shm_adapter(name, 4096);
+	second.init_function(&second, &shm_info.adapter);
+	mu_assert_int_eq(-1, second.connect_function(&second));
+	second.destroy_function(&second);
+
+	// CONNECT is written once the adapter is serviced
+	mu_assert_int_eq(0, stomp_service(&shm_info, 0));
+	char frame[256];
+	ssize_t len = stomp_shm_peer_receive(peer, frame, sizeof(frame), 1000);
+	mu_assert(len > 8 && !strncmp(frame, "CONNECT\n", 8), "CONNECT received");
+	mu_assert_int_eq(0, frame[len - 1]);
+
+	char connected[] = "CONNECTED\nversion:1.2\n\n";
+	mu_assert_int_eq(0, stomp_shm_peer_send(peer, connected, sizeof(connected)));
+	mu_assert_int_eq(0, stomp_service(&shm_info, 1000));
+	mu_assert_int_eq(1, shm_connected);
+
+	stomp_subscribe(&shm_info, "/queue", test_shm_message_callback, NULL);
+	len = stomp_shm_peer_receive(peer, frame, sizeof(frame), 1000);
+	mu_assert_string_eq("SUBSCRIBE\ndestination:/queue\nid:sub-0\n\n", frame);
+
+	// several frames in the ring are delivered by one service call
+	shm_messages = 0;
+	for (int i = 0; i < 3; i++) {
+		char message[64];
+		len = sprintf(message, "MESSAGE\nsubscription:sub-0\nmessage-id:%d\n\nbody %d", i, i) + 1;
+		mu_assert_int_eq(0, stomp_shm_peer_send(peer, message, len));
+	}
+	mu_assert_int_eq(0, stomp_service(&shm_info, 1000));
+	mu_assert_int_eq(3, shm_messages);
+	mu_assert_string_eq("body 2", shm_last_body);
+
+	// an EOL with its NULL char is a heartbeat
+	mu_assert_int_eq(0, stomp_shm_peer_send(peer, "\n", 2));
+	mu_assert_int_eq(0, stomp_service(&shm_info, 1000));
+	mu_assert_int_eq(3, shm_messages);
+
+	// a frame that does not fit is dropped, not truncated
+	stomp_subscribe(&shm_info, "/other", test_shm_message_callback, NULL);
+	errno = 0;
+	mu_assert_int_eq(-1, stomp_shm_peer_receive(peer, frame, 8, 1000));
+	mu_assert_int_eq(EMSGSIZE, errno);
+
+	// the peer sees the client go
+	stomp_destroy(&shm_info);
+	while ((len = stomp_shm_peer_receive(peer, frame, sizeof(frame), 1000)) > 0);
+	mu_assert_int_eq(-1, len);
+
+	stomp_shm_peer_destroy(peer);
+}
+
+MU_TEST(test_shm_corrupt) {
+	char name[64];
+	sprintf(name, "/test_stomp_shm_corrupt_%d", (int)getpid());
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	// a segment shorter than its rings is refused
+	StompShm *peer = stomp_shm_peer_create(name, 65536);
+	mu_assert(peer != NULL, "peer created");
+	int fd = shm_open(name, O_RDWR, 0);
+	mu_assert_int_eq(0, ftruncate(fd, page + 65536));
+	close(fd);
+
+	StompAdapter adapter = stomp_shm_adapter(name, 4096);
+	StompInfo shm_info = stomp_create(&adapter);
+	mu_assert_int_eq(0, stomp_init(&shm_info));
+
+	StompHeaders headers;
+	headers.len = 0;
+	mu_assert_int_eq(-1, stomp_connect(&shm_info, &headers, test_shm_connect_callback, test_stomp_error_callback));
+	stomp_destroy(&shm_info);
+	stomp_shm_peer_destroy(peer);
+
+	peer = stomp_shm_peer_create(name, 65536);
+	mu_assert(peer != NULL, "peer created");
+
+	adapter = stomp_shm_adapter(name, 4096);
+	shm_info = stomp_create(&adapter);
+	mu_assert_int_eq(0, stomp_init(&shm_info));
+	mu_assert_int_eq(0, stomp_connect(&shm_info, &headers, test_shm_connect_callback, test_stomp_error_callback));
+	mu_assert_int_eq(0, stomp_service(&shm_info, 0));
+
+	// the length of the first record of the ring read by the client, at the start of its data
+	char connected[] = "CONNECTED\nversion:1.2\n\n";
+	mu_assert_int_eq(0, stomp_shm_peer_send(peer, connected, sizeof(connected)));
+	fd = shm_open(name, O_RDWR, 0);
+	uint32_t *record_len = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page);
+	close(fd);
+	mu_assert(record_len != MAP_FAILED, "ring mapped");
+	*record_len = 65536;
+	munmap(record_len, page);
+
+	// the connection is closed, the peer sees it too
+	shm_connected = 0;
+	mu_assert_int_eq(-1, stomp_service(&shm_info, 1000));
+	mu_assert_int_eq(0, shm_connected);
+	mu_assert(stomp_shm_peer_send(peer, connected, sizeof(connected)) < 0, "peer closed");
+
+	stomp_destroy(&shm_info);
+	stomp_shm_peer_destroy(peer);
+}
+
+static int loopback_connected;
+static int loopback_errors;
+static int loopback_messages;
+static char loopback_last_body[64];
+
+static void test_loopback_connect_callback(StompInfo *stomp_info, const StompFrame *frame) {
+	loopback_connected = 1;
+}
+
+static void test_loopback_error_callback(StompInfo *stomp_info, const StompFrame *frame) {
+	loopback_errors++;
+}
+
+static void test_loopback_message_callback(StompInfo *stomp_info, const StompFrame *frame) {
+	loopback_messages++;
+	snprintf(loopback_last_body, sizeof(loopback_last_body), "%s", frame->body);
+}
+
+static int loopback_receipts;
+
+static void test_loopback_receipt_callback(StompInfo *stomp_info, const StompFrame *frame) {
+	loopback_receipts++;
+}
+
+// Connects to a loopback broker and subscribes to /queue
+static int loopback_connect(StompAdapter *adapter, StompInfo *loopback_info) {
+	loopback_connected = 0;
+	loopback_errors = 0;
+	loopback_messages = 0;
+
+	*adapter = stomp_loopback_adapter(4096);
+	*loopback_info = stomp_create(adapter);
+	stomp_init(loopback_info);
+
+	StompHeaders headers;
+	headers.len = 0;
+	if (stomp_connect(loopback_info, &headers, test_loopback_connect_callback, test_loopback_error_callback)) return -1;
+
+	// CONNECT and CONNECTED in the same call
+	stomp_service(loopback_info, 0);
+	if (!loopback_connected) return -1;
+
+	return stomp_subscribe(loopback_info, "/queue", test_loopback_message_callback, NULL) == NULL ? -1 : 0;
+}
+
+MU_TEST(test_loopback_broker) {
+	StompAdapter adapter;
+	StompInfo loopback_info;
+	mu_assert_int_eq(0, loopback_connect(&adapter, &loopback_info));
+
+	stomp_send(&loopback_info, "/queue", NULL, "1");
+	stomp_send(&loopback_info, "/other", NULL, "2");
+	stomp_send(&loopback_info, "/queue", NULL, "3");
+
+	// delivered by the service call, only the subscribed destination
+	mu_assert_int_eq(0, loopback_messages);
+	stomp_service(&loopback_info, 0);
+	mu_assert_int_eq(2, loopback_messages);
+	mu_assert_string_eq("3", loopback_last_body);
+
+	// the SENDs of a transaction are routed on COMMIT, which has a receipt
+	loopback_receipts = 0;
+	StompTransaction *transaction = stomp_begin(&loopback_info);
+	stomp_transaction_send(transaction, "/queue", NULL, "4");
+	stomp_transaction_send(transaction, "/queue", NULL, "5");
+	mu_assert_int_eq(0, stomp_commit(transaction, test_loopback_receipt_callback));
+	stomp_service(&loopback_info, 0);
+	mu_assert_int_eq(4, loopback_messages);
+	mu_assert_string_eq("5", loopback_last_body);
+	mu_assert_int_eq(1, loopback_receipts);
+
+	transaction = stomp_begin(&loopback_info);
+	stomp_transaction_send(transaction, "/queue", NULL, "6");
+	mu_assert_int_eq(0, stomp_abort(transaction));
+	stomp_service(&loopback_info, 0);
+	mu_assert_int_eq(4, loopback_messages);
+
+	StompLoopbackStats stats;
+	mu_assert_int_eq(0, stomp_loopback_get_stats(&adapter, &stats));
+	mu_assert_int_eq(4, (int)stats.messages_routed);
+	mu_assert_int_eq(1, (int)stats.receipts);
+
+	stomp_destroy(&loopback_info);
+}
+
+MU_TEST(test_loopback_faults) {
+	StompAdapter adapter;
+	StompInfo loopback_info;
+	mu_assert_int_eq(0, loopback_connect(&adapter, &loopback_info));
+
+	StompLoopbackOptions options = stomp_loopback_default_options();
+	options.latency_us = 20000;
+	options.drop_rate = 0.5;
+	options.disconnect_after = 101;
+	stomp_loopback_set_options(&adapter, &options);
+
+	for (int i = 0; i < 100; i++) {
+		stomp_send(&loopback_info, "/queue", NULL, "message");
+	}
+
+	StompLoopbackStats stats;
+	stomp_loopback_get_stats(&adapter, &stats);
+	mu_assert_int_eq(100, (int)(stats.messages_routed + stats.messages_dropped));
+	mu_assert(stats.messages_dropped > 25 && stats.messages_dropped < 75, "about half dropped");
+
+	// nothing before the latency
+	stomp_service(&loopback_info, 0);
+	mu_assert_int_eq(0, loopback_messages);
+
+	for (int i = 0; i < 20 && loopback_messages < stats.messages_routed; i++) {
+		stomp_service(&loopback_info, 100);
+	}
+	mu_assert_int_eq((int)stats.messages_routed, loopback_messages);
+	mu_assert_int_eq(0, loopback_errors);
+
+	// the next frame closes the connection
+	stomp_send(&loopback_info, "/queue", NULL, "last");
+	stomp_service(&loopback_info, 100);
+	mu_assert_int_eq(1, loopback_errors);
+	mu_assert_int_eq(-1, stomp_send(&loopback_info, "/queue", NULL, "closed"));
+
+	stomp_destroy(&loopback_info);
+}
+
+// Subscribes from the CONNECTED, as the replay delivers the MESSAGEs right after it
+static void test_record_connect_callback(StompInfo *stomp_info, const StompFrame *frame) {
+	loopback_connected = 1;
+	stomp_subscribe(stomp_info, "/queue", test_loopback_message_callback, NULL);
+}
+
+static int record_connect(StompInfo *record_info, StompAdapter *adapter) {
+	loopback_connected = 0;
+	loopback_errors = 0;
+	loopback_messages = 0;
+
+	*record_info = stomp_create(adapter);
+	if (stomp_init(record_info)) return -1;
+
+	StompHeaders headers;
+	headers.len = 0;
+	if (stomp_connect(record_info, &headers, test_record_connect_callback, test_loopback_error_callback)) return -1;
+
+	stomp_service(record_info, 0);
+
+	return loopback_connected ? 0 : -1;
+}
+
+MU_TEST(test_recorder_replay) {
+	char path[] = "/tmp/test_stomp_record_XXXXXX";
+	close(mkstemp(path));
+
+	StompAdapter loopback = stomp_loopback_adapter(4096);
+	StompAdapter recorder = stomp_recorder_adapter(&loopback, path);
+	StompInfo record_info;
+	mu_assert_int_eq(0, record_connect(&record_info, &recorder));
+
+	stomp_send(&record_info, "/queue", NULL, "m0");
+	stomp_send(&record_info, "/queue", NULL, "m1");
+	stomp_send(&record_info, "/queue", NULL, "m2");
+	stomp_service(&record_info, 0);
+	mu_assert_int_eq(3, loopback_messages);
+
+	// the log is complete once the recorder is destroyed
+	stomp_destroy(&record_info);
+
+	StompAdapter replay = stomp_replay_adapter(path, 4096);
+	mu_assert_int_eq(0, stomp_replay_set_speed(&replay, 0));
+	StompInfo replay_info;
+	mu_assert_int_eq(0, record_connect(&replay_info, &replay));
+
+	// the same MESSAGEs for the same subscription, the SENDs are not replayed
+	mu_assert_int_eq(3, loopback_messages);
+	mu_assert_string_eq("m2", loopback_last_body);
+	mu_assert_int_eq(0, stomp_send(&replay_info, "/queue", NULL, "dropped"));
+
+	// the end of the log closes the connection
+	stomp_service(&replay_info, 0);
+	mu_assert_int_eq(3, loopback_messages);
+	mu_assert_int_eq(1, loopback_errors);
+
+	stomp_destroy(&replay_info);
+	unlink(path);
+
+	StompAdapter missing = stomp_replay_adapter(path, 4096);
+	replay_info = stomp_create(&missing);
+	mu_assert_int_eq(-1, stomp_init(&replay_info));
+	stomp_destroy(&replay_info);
+}
+
+// Services the connection for up to 2 seconds, until *counter reaches expected
+static void tcp_service_until(StompInfo *tcp_info, int *counter, int expected) {
+	for (int i = 0; i < 200 && __atomic_load_n(counter, __ATOMIC_ACQUIRE) < expected; i++) {
+		stomp_service(tcp_info, 10);
+	}
+}
+
+static void tcp_service_until_sends(StompInfo *tcp_info, TestBroker *broker, int expected) {
+	for (int i = 0; i < 200 && test_broker_sends(broker) < expected; i++) {
+		stomp_service(tcp_info, 10);
+	}
+}
+
+// Connects to a test broker and subscribes to /queue
+static int tcp_connect(StompInfo *tcp_info, StompAdapter *adapter) {
+	loopback_connected = 0;
+	loopback_errors = 0;
+	loopback_messages = 0;
+
+	*tcp_info = stomp_create(adapter);
+	if (stomp_init(tcp_info)) return -1;
+
+	StompHeaders headers;
+	headers.len = 0;
+	if (stomp_connect(tcp_info, &headers, test_loopback_connect_callback, test_loopback_error_callback)) return -1;
+
+	tcp_service_until(tcp_info, &loopback_connected, 1);
+	if (!loopback_connected) return -1;
+
+	return stomp_subscribe(tcp_info, "/queue", test_loopback_message_callback, NULL) == NULL ? -1 : 0;
+}
+
+MU_TEST(test_tcp_uring) {
+	char url[64];
+	TestBroker *broker = test_broker_start(url, sizeof(url));
+	mu_check(broker != NULL);
+
+	StompAdapter adapter = stomp_tcp_adapter(url, 4096);
+	if (stomp_tcp_set_engine(&adapter, STOMP_TCP_ENGINE_URING)) {
+		printf("io_uring not available, test_tcp_uring skipped\n");
+		adapter.destroy_function(&adapter);
+		test_broker_stop(broker);
+		return;
+	}
+
+	StompInfo tcp_info;
+	mu_assert_int_eq(0, tcp_connect(&tcp_info, &adapter));
+
+	mu_assert_int_eq(0, stomp_send(&tcp_info, "/queue", NULL, "1"));
+	tcp_service_until(&tcp_info, &loopback_messages, 1);
+	mu_assert_int_eq(1, loopback_messages);
+	mu_assert_string_eq("1", loopback_last_body);
+
+	// the MESSAGEs wait in the socket while paused
+	mu_assert_int_eq(0, adapter.pause_function(&adapter, 1));
+	stomp_send(&tcp_info, "/queue", NULL, "2");
+	stomp_send(&tcp_info, "/queue", NULL, "3");
+	tcp_service_until_sends(&tcp_info, broker, 3);
+	mu_assert_int_eq(3, test_broker_sends(broker));
+
+	for (int i = 0; i < 5; i++) {
+		stomp_service(&tcp_info, 10);
+	}
+	mu_assert_int_eq(1, loopback_messages);
+
+	mu_assert_int_eq(0, adapter.pause_function(&adapter, 0));
+	tcp_service_until(&tcp_info, &loopback_messages, 3);
+	mu_assert_int_eq(3, loopback_messages);
+	mu_assert_string_eq("3", loopback_last_body);
+
+	// over max_frame_length, gathered in a pooled frame
+	char large[6000];
+	memset(large, 'l', sizeof(large) - 1);
+	large[sizeof(large) - 1] = '\0';
+	stomp_send(&tcp_info, "/queue", NULL, large);
+	tcp_service_until(&tcp_info, &loopback_messages, 4);
+	mu_assert_int_eq(4, loopback_messages);
+	mu_check(!strncmp(large, loopback_last_body, sizeof(loopback_last_body) - 1));
+	mu_assert_int_eq(0, loopback_errors);
+
+	stomp_destroy(&tcp_info);
+	test_broker_stop(broker);
+}
+
+static int tcp_opens;
+static int tcp_frames;
+static int tcp_heartbeats;
+static int tcp_closes;
+static char tcp_last_frame[2048];
+static size_t tcp_last_frame_len;
+static char tcp_lent[2048];
+static int tcp_lent_frames;
+
+static int test_tcp_open_callback(StompAdapter *adapter) {
+	tcp_opens++;
+	return 0;
+}
+
+static int test_tcp_message_callback(StompAdapter *adapter, char *message, size_t len) {
+	tcp_frames++;
+	if (message == tcp_lent) tcp_lent_frames++;
+	tcp_last_frame_len = len;
+	memcpy(tcp_last_frame, message, len < sizeof(tcp_last_frame) ? len : sizeof(tcp_last_frame));
+	return 0;
+}
+
+static char* test_tcp_acquire_buffer_callback(StompAdapter *adapter, size_t len) {
+	return len < sizeof(tcp_lent) ? tcp_lent : NULL;
+}
+
+static int test_tcp_heartbeat_callback(StompAdapter *adapter) {
+	tcp_heartbeats++;
+	return 0;
+}
+
+static int test_tcp_close_callback(StompAdapter *adapter, char *message) {
+	tcp_closes++;
+	return 0;
+}
+
+// Services the adapter for up to 2 seconds, until *counter reaches expected
+static void tcp_adapter_service_until(StompAdapter *adapter, int *counter, int expected) {
+	for (int i = 0; i < 200 && *counter < expected; i++) {
+		adapter->service_function(adapter, 10);
+	}
+}
+
+// Sends a frame that may have NULL chars, len includes its NULL char
+static void tcp_adapter_send(StompAdapter *adapter, char *frame, size_t len) {
+	struct iovec iov;
+	iov.iov_base = frame;
+	iov.iov_len = len;
+	adapter->sendv_function(adapter, &iov, 1);
+}
+
+// The epoll engine against the test broker, with a parent adapter that sees every frame and heartbeat
+MU_TEST(test_tcp_epoll) {
+	char url[64];
+	TestBroker *broker = test_broker_start(url, sizeof(url));
+	mu_check(broker != NULL);
+
+	StompAdapter parent;
+	memset(&parent, 0, sizeof(parent));
+	parent.onopen_callback = test_tcp_open_callback;
+	parent.onmessage_callback = test_tcp_message_callback;
+	parent.acquire_buffer_callback = test_tcp_acquire_buffer_callback;
+	parent.onheartbeat_callback = test_tcp_heartbeat_callback;
+	parent.onerror_callback = test_tcp_close_callback;
+	parent.onclose_callback = test_tcp_close_callback;
+	tcp_opens = tcp_frames = tcp_heartbeats = tcp_closes = tcp_lent_frames = 0;
+
+	StompAdapter adapter = stomp_tcp_adapter(url, 256);
+	mu_assert_int_eq(0, adapter.init_function(&adapter, &parent));
+	mu_assert_int_eq(0, adapter.connect_function(&adapter));
+	tcp_adapter_service_until(&adapter, &tcp_opens, 1);
+	mu_assert_int_eq(1, tcp_opens);
+
+	adapter.send_function(&adapter, "CONNECT\naccept-version:1.2\n\n");
+	adapter.send_function(&adapter, "SUBSCRIBE\nid:sub-0\ndestination:/queue\n\n");
+	tcp_adapter_service_until(&adapter, &tcp_frames, 1);
+	mu_assert_int_eq(1, tcp_frames);
+
+	// NULL terminated, written 3 bytes at a time after two EOL heartbeats
+	adapter.send_function(&adapter, "SEND\ndestination:/queue\nchunk:3\nheartbeats:2\n\nsplit");
+	tcp_adapter_service_until(&adapter, &tcp_frames, 2);
+	char expected_split[] = "MESSAGE\nsubscription:sub-0\nmessage-id:0\ndestination:/queue\n\nsplit";
+	mu_assert_int_eq(2, tcp_frames);
+	mu_assert_int_eq(2, tcp_heartbeats);
+	mu_assert_int_eq(sizeof(expected_split) - 1, (int)tcp_last_frame_len);
+	mu_check(!memcmp(expected_split, tcp_last_frame, tcp_last_frame_len));
+
+	// a content-length body with NULL chars
+	char binary[] = "SEND\ndestination:/queue\nchunk:4\ncontent-length:5\n\na\0b\0c";
+	tcp_adapter_send(&adapter, binary, sizeof(binary));
+	tcp_adapter_service_until(&adapter, &tcp_frames, 3);
+	char expected_binary[] = "MESSAGE\nsubscription:sub-0\nmessage-id:1\ndestination:/queue\ncontent-length:5\n\na\0b\0c";
+	mu_assert_int_eq(3, tcp_frames);
+	mu_assert_int_eq(sizeof(expected_binary) - 1, (int)tcp_last_frame_len);
+	mu_check(!memcmp(expected_binary, tcp_last_frame, tcp_last_frame_len));
+
+	// over the 256 bytes read buffer, reassembled by read_large_frame with and without content-length
+	char large[1200];
+	char expected_large[1200];
+	for (int with_length = 1; with_length >= 0; with_length--) {
+		int head_len = sprintf(large, with_length ? "SEND\ndestination:/queue\ncontent-length:1000\n\n" : "SEND\ndestination:/queue\n\n");
+		int expected_len = sprintf(expected_large, with_length ? "MESSAGE\nsubscription:sub-0\nmessage-id:%d\ndestination:/queue\ncontent-length:1000\n\n"
+				: "MESSAGE\nsubscription:sub-0\nmessage-id:%d\ndestination:/queue\n\n", 3 - with_length);
+		for (int i = 0; i < 1000; i++) {
+			// NULL chars only where the content-length allows them
+			char c = with_length && i % 100 == 0 ? '\0' : 'a' + i % 26;
+			large[head_len + i] = expected_large[expected_len + i] = c;
+		}
+		large[head_len + 1000] = '\0';
+
+		tcp_adapter_send(&adapter, large, head_len + 1001);
+		tcp_adapter_service_until(&adapter, &tcp_frames, 5 - with_length);
+		mu_assert_int_eq(5 - with_length, tcp_frames);
+		mu_assert_int_eq(expected_len + 1000, (int)tcp_last_frame_len);
+		mu_check(!memcmp(expected_large, tcp_last_frame, tcp_last_frame_len));
+
+		// the length is known with content-length, the frame is gathered in the parent buffer
+		mu_assert_int_eq(1, tcp_lent_frames);
+	}
+
+	mu_assert_int_eq(0, tcp_closes);
+
+	adapter.destroy_function(&adapter);
+	test_broker_stop(broker);
+}
+
+// The shm adapter hands frames to the parent without their NULL char, like the other adapters
+MU_TEST(test_shm_frames) {
+	char name[64];
+	sprintf(name, "/test_stomp_shm_frames_%d", (int)getpid());
+
+	StompShm *peer = stomp_shm_peer_create(name, 65536);
+	mu_assert(peer != NULL, "peer created");
+
+	StompAdapter parent;
+	memset(&parent, 0, sizeof(parent));
+	parent.onopen_callback = test_tcp_open_callback;
+	parent.onmessage_callback = test_tcp_message_callback;
+	parent.onheartbeat_callback = test_tcp_heartbeat_callback;
+	parent.onclose_callback = test_tcp_close_callback;
+	tcp_opens = tcp_frames = tcp_heartbeats = tcp_closes = 0;
+
+	StompAdapter adapter = stomp_shm_adapter(name, 4096);
+	mu_assert_int_eq(0, adapter.init_function(&adapter, &parent));
+	mu_assert_int_eq(0, adapter.connect_function(&adapter));
+	mu_assert_int_eq(0, adapter.service_function(&adapter, 0));
+	mu_assert_int_eq(1, tcp_opens);
+
+	char connected[] = "CONNECTED\nversion:1.2\n\n";
+	mu_assert_int_eq(0, stomp_shm_peer_send(peer, connected, sizeof(connected)));
+	mu_assert_int_eq(0, stomp_shm_peer_send(peer, "\n", 2));
+	mu_assert_int_eq(0, adapter.service_function(&adapter, 1000));
+	mu_assert_int_eq(1, tcp_frames);
+	mu_assert_int_eq(1, tcp_heartbeats);
+	mu_assert_int_eq(sizeof(connected) - 1, (int)tcp_last_frame_len);
+	mu_check(!memcmp(connected, tcp_last_frame, tcp_last_frame_len));
+
+	// a record without its NULL char closes the connection
+	mu_assert_int_eq(0, stomp_shm_peer_send(peer, "ERROR\n\n", 7));
+	mu_assert_int_eq(-1, adapter.service_function(&adapter, 1000));
+	mu_assert_int_eq(1, tcp_frames);
+	mu_assert_int_eq(1, tcp_closes);
+
+	adapter.destroy_function(&adapter);
+	stomp_shm_peer_destroy(peer);
+}
+
+static int receipt_calls;
+
+static void test_stomp_receipt_callback(StompInfo *stomp_info, const StompFrame *frame) {
+	receipt_calls++;
+}
+
+MU_TEST(test_transaction_commit) {
+	MU_SUB_TEST(connect);
+
+	receipt_calls = 0;
+
+	StompTransaction *transaction = stomp_begin(&stomp_info);
+	mu_check(transaction != NULL);
+
+	stomp_transaction_send(transaction, "/queue", NULL, "1");
+	stomp_transaction_send(transaction, "/queue", NULL, "2");
+
+	// nothing is written until the commit, then all the frames together
+	char expected[] = "BEGIN\ntransaction:tx-0\n\n\0"
+			"SEND\ndestination:/queue\ntransaction:tx-0\ncontent-length:1\n\n1\0"
+			"SEND\ndestination:/queue\ntransaction:tx-0\ncontent-length:1\n\n2\0"
+			"COMMIT\ntransaction:tx-0\nreceipt:receipt-0\n\n";
+	memcpy(expected_sendv_message, expected, sizeof(expected));
+	expected_sendv_len = sizeof(expected);
+	expected_send_frames = 1;
+
+	mu_assert_int_eq(0, stomp_commit(transaction, test_stomp_receipt_callback));
+	stomp_adapter_assert();
+	mu_assert_int_eq(0, expected_send_frames);
+
+	char message[] = "RECEIPT\nreceipt-id:receipt-0\n\n";
+	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, message, strlen(message));
+	mu_assert_int_eq(1, receipt_calls);
+
+	// only once
+	test_adapter.parent_adapter->onmessage_callback(test_adapter.parent_adapter, message, strlen(message));
+	mu_assert_int_eq(1, receipt_calls);
+}
+
+MU_TEST(test_transaction_commit_chunks) {
+	MU_SUB_TEST(connect);
+
+	frame_writes_len = 0;
+	test_adapter.send_frames_function = test_count_send_frames_function;
+
+	StompTransaction *transaction = stomp_begin(&stomp_info);
+	for (int i = 0; i < 100; i++) {
+		stomp_transaction_send(transaction, "/queue", NULL, "1");
+	}
+
+	// BEGIN, the SENDs and COMMIT in writes of at most 64 frames
+	mu_assert_int_eq(0, stomp_commit(transaction, NULL));
+	stomp_adapter_assert();
+	mu_assert_int_eq(2, frame_writes_len);
+	mu_assert_int_eq(64, frame_writes[0]);
+	mu_assert_int_eq(38, frame_writes[1]);
+}
+
+MU_TEST(test_transaction_abort) {
+	MU_SUB_TEST(connect);
+
+	StompTransaction *transaction = stomp_begin(&stomp_info);
+	stomp_transaction_send(transaction, "/queue", NULL, "1");
+
+	// the broker never sees an aborted transaction
+	mu_assert_int_eq(0, stomp_abort(transaction));
+	stomp_adapter_assert();
+}
+
+static int log_lines;
+static char log_last_line[1024];
+
+static void test_log_sink(enum StompLogLevel level, const char *line, void *user_data) {
+	log_lines++;
+	strcpy(log_last_line, line);
+}
+
+static void log_setup() {
+	log_lines = 0;
+	strcpy(log_last_line, "");
+	stomp_log_set_sink(test_log_sink, NULL);
+	stomp_log_set_level(STOMP_LOG_DEBUG);
+}
+
+static void log_teardown() {
+	stomp_log_set_level(STOMP_LOG_WARN);
+	stomp_log_set_payload_limit(256, 100);
+	stomp_log_set_sink(NULL, NULL);
+}
+
+MU_TEST(test_log_payload_truncated) {
+	log_setup();
+	stomp_log_set_payload_limit(7, 0);
+
+	MU_SUB_TEST(connect);
+
+	expected_send = 1;
+	strcpy(expected_send_message, "SEND\ndestination:/destination\ncontent-length:5\n\n12345");
+
+	stomp_send(&stomp_info, "/destination", NULL, "12345");
+	stomp_adapter_assert();
+
+	log_teardown();
+
+	mu_assert_string_eq("stomp sending (53 bytes): 'SEND\nde'...", log_last_line);
+}
+
+MU_TEST(test_log_level_filtered) {
+	log_setup();
+
+	stomp_log_trace("not logged %d", 1);
+	stomp_log_debug("logged %d", 2);
+
+	log_teardown();
+
+	mu_assert_int_eq(1, log_lines);
+	mu_assert_string_eq("logged 2", log_last_line);
+}
+
+MU_TEST(test_log_async) {
+	log_setup();
+
+	mu_assert_int_eq(0, stomp_log_start_async(16));
+	for (int i = 0; i < 10; i++) {
+		stomp_log_info("line %d", i);
+	}
+	mu_assert_int_eq(0, stomp_log_stop_async());
+
+	log_teardown();
+
+	mu_assert_int_eq(10, log_lines);
+	mu_assert_string_eq("line 9", log_last_line);
+}
+
+static atomic_int log_async_lines;
+
+static void test_log_async_sink(enum StompLogLevel level, const char *line, void *user_data) {
+	// not the dropped lines report
+	if (level == STOMP_LOG_INFO) atomic_fetch_add(&log_async_lines, 1);
+}
+
+static void* test_log_writer(void *arg) {
+	for (int i = 0; i < 20000; i++) {
+		stomp_log_info("line %d", i);
+	}
+
+	return NULL;
+}
+
+MU_TEST(test_log_async_stop_writing) {
+	log_setup();
+	stomp_log_set_sink(test_log_async_sink, NULL);
+	atomic_store(&log_async_lines, 0);
+	unsigned long dropped = stomp_log_dropped();
+
+	// stopped while another thread writes, its lines go to the ring or straight to the sink
+	mu_assert_int_eq(0, stomp_log_start_async(64));
+	pthread_t writer;
+	mu_assert_int_eq(0, pthread_create(&writer, NULL, test_log_writer, NULL));
+	while (atomic_load(&log_async_lines) == 0 && stomp_log_dropped() == dropped);
+	mu_assert_int_eq(0, stomp_log_stop_async());
+	pthread_join(writer, NULL);
+
+	log_teardown();
+
+	mu_assert_int_eq(20000, atomic_load(&log_async_lines) + (int)(stomp_log_dropped() - dropped));
+}
+
 MU_TEST_SUITE(test_suite) {
 	MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
 
@@ -335,6 +2166,49 @@ MU_TEST_SUITE(test_suite) {
 	MU_RUN_TEST(test_connect_ko_unauthorized);
 	MU_RUN_TEST(test_subcribe_ok);
 	MU_RUN_TEST(test_send_ok);
+	MU_RUN_TEST(test_send_compressed);
+	MU_RUN_TEST(test_receive_compressed);
+	MU_RUN_TEST(test_receive_compressed_too_large);
+	MU_RUN_TEST(test_receive_spilled);
+	MU_RUN_TEST(test_retain_frame);
+	MU_RUN_TEST(test_retain_frame_copy);
+	MU_RUN_TEST(test_subscribe_batch);
+	MU_RUN_TEST(test_ack_individual_batch);
+	MU_RUN_TEST(test_ack_batch_chunks);
+	MU_RUN_TEST(test_ack_cumulative);
+	MU_RUN_TEST(test_nack_flushes_acks);
+	MU_RUN_TEST(test_subscribe_queue);
+	MU_RUN_TEST(test_subscribe_queue_overflow);
+	MU_RUN_TEST(test_subscribe_queue_no_pause);
+	MU_RUN_TEST(test_subscribe_conflation);
+	MU_RUN_TEST(test_conflation_acks_dropped);
+	MU_RUN_TEST(test_subscribe_shared);
+	MU_RUN_TEST(test_unsubscribe_shared_twice);
+	MU_RUN_TEST(test_subscribe_routes);
+	MU_RUN_TEST(test_dedup);
+	MU_RUN_TEST(test_dedup_redelivered_after_nack);
+	MU_RUN_TEST(test_dedup_client_ack);
+	MU_RUN_TEST(test_spool_replay);
+	MU_RUN_TEST(test_spool_recover);
+	MU_RUN_TEST(test_send_prepared);
+	MU_RUN_TEST(test_sendv);
+	MU_RUN_TEST(test_send_large);
+	MU_RUN_TEST(test_send_fd);
+	MU_RUN_TEST(test_shm_adapter);
+	MU_RUN_TEST(test_shm_corrupt);
+	MU_RUN_TEST(test_shm_frames);
+	MU_RUN_TEST(test_loopback_broker);
+	MU_RUN_TEST(test_loopback_faults);
+	MU_RUN_TEST(test_recorder_replay);
+	MU_RUN_TEST(test_tcp_uring);
+	MU_RUN_TEST(test_tcp_epoll);
+	MU_RUN_TEST(test_transaction_commit);
+	MU_RUN_TEST(test_transaction_commit_chunks);
+	MU_RUN_TEST(test_transaction_abort);
+	MU_RUN_TEST(test_log_payload_truncated);
+	MU_RUN_TEST(test_log_level_filtered);
+	MU_RUN_TEST(test_log_async);
+	MU_RUN_TEST(test_log_async_stop_writing);
 }
 
 int main(int argc, char *argv[]) {
@@ -0,0 +1,402 @@
+/*
+ * libstomp - a free implementation of the stomp protocol than can be plugged
+ * to different connection implementations using an adapter interface.
+ *
+ * Copyright (C) 2017 Sergio Otero <sergio.otero@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+
+
+/*
+ * stomp-perf: load generator measuring end to end latency through any adapter.
+ *
+ * Every connection subscribes to its own destination and sends to it at a fixed rate.
+ * MESSAGEs carry the time they were scheduled and the time they were sent. Latency is
+ * measured from the schedule, so a stalled sender or broker is charged to every message
+ * that should have gone out meanwhile (coordinated omission), and from the actual send,
+ * which is what a naive client would see. Both are recorded in HDR histograms.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "libstomp.h"
+
+#define PERF_MAX_CONNECT_HEADERS 8
+#define PERF_MAX_BURST 1024
+#define PERF_DRAIN_MS 2000
+#define PERF_CONNECT_TIMEOUT_MS 10000
+
+// 3 significant digits from 1ns to a minute
+#define HDR_SUB_BUCKET_HALF_COUNT_MAGNITUDE 10
+#define HDR_SUB_BUCKET_HALF_COUNT (1 << HDR_SUB_BUCKET_HALF_COUNT_MAGNITUDE)
+#define HDR_SUB_BUCKET_COUNT (2 * HDR_SUB_BUCKET_HALF_COUNT)
+#define HDR_HIGHEST_VALUE 60000000000LL
+
+typedef struct {
+	long long *counts;
+	int counts_len;
+	long long total;
+	long long max;
+} HdrHistogram;
+
+typedef struct {
+	StompAdapter adapter;
+	StompInfo stomp_info;
+	char destination[128];
+	int connected;
+
+	long long next_send; // scheduled time of the next MESSAGE
+	long long sent;
+	long long received;
+} PerfConnection;
+
+static volatile int perf_force_exit = 0;
+
+static HdrHistogram corrected;
+static HdrHistogram uncorrected;
+static long long last_received_ns;
+static int errors;
+
+static void perf_sighandler(int sig) {
+	perf_force_exit = 1;
+}
+
+static long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void hdr_init(HdrHistogram *histogram) {
+	// buckets double the range of the previous one, the first covers the whole sub bucket count
+	int bucket_count = 1;
+	for (long long smallest_untrackable = HDR_SUB_BUCKET_COUNT; smallest_untrackable <= HDR_HIGHEST_VALUE; smallest_untrackable <<= 1) {
+		bucket_count++;
+	}
+
+	histogram->counts_len = (bucket_count + 1) * HDR_SUB_BUCKET_HALF_COUNT;
+	histogram->counts = calloc(histogram->counts_len, sizeof(long long));
+	histogram->total = 0;
+	histogram->max = 0;
+}
+
+static int hdr_index(long long value) {
+	int pow2_ceiling = 64 - __builtin_clzll(value | (HDR_SUB_BUCKET_COUNT - 1));
+	int bucket_index = pow2_ceiling - (HDR_SUB_BUCKET_HALF_COUNT_MAGNITUDE + 1);
+	int sub_bucket_index = value >> bucket_index;
+
+	return ((bucket_index + 1) << HDR_SUB_BUCKET_HALF_COUNT_MAGNITUDE) + sub_bucket_index - HDR_SUB_BUCKET_HALF_COUNT;
+}
+
+// Highest value counted in index, values are reported as the top of their range
+static long long hdr_value(int index) {
+	int bucket_index = (index >> HDR_SUB_BUCKET_HALF_COUNT_MAGNITUDE) - 1;
+	long long sub_bucket_index = (index & (HDR_SUB_BUCKET_HALF_COUNT - 1)) + HDR_SUB_BUCKET_HALF_COUNT;
+
+	if (bucket_index < 0) {
+		sub_bucket_index -= HDR_SUB_BUCKET_HALF_COUNT;
+		bucket_index = 0;
+	}
+
+	return ((sub_bucket_index + 1) << bucket_index) - 1;
+}
+
+static void hdr_record(HdrHistogram *histogram, long long value) {
+	if (value < 0) value = 0;
+	if (value > HDR_HIGHEST_VALUE) value = HDR_HIGHEST_VALUE;
+
+	histogram->counts[hdr_index(value)]++;
+	histogram->total++;
+	if (value > histogram->max) histogram->max = value;
+}
+
+static long long hdr_percentile(const HdrHistogram *histogram, double percentile) {
+	long long target = (long long) (percentile / 100 * histogram->total + 0.5);
+	if (target < 1) target = 1;
+
+	long long count = 0;
+	for (int i = 0; i < histogram->counts_len; i++) {
+		count += histogram->counts[i];
+		if (count >= target) {
+			long long value = hdr_value(i);
+			return value < histogram->max ? value : histogram->max;
+		}
+	}
+
+	return histogram->max;
+}
+
+static void hdr_print(const char *name, const HdrHistogram *histogram) {
+	printf("  %-12s %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+			hdr_percentile(histogram, 50) / 1000.0, hdr_percentile(histogram, 90) / 1000.0,
+			hdr_percentile(histogram, 99) / 1000.0, hdr_percentile(histogram, 99.9) / 1000.0,
+			histogram->max / 1000.0);
+}
+
+static long long header_ns(const StompFrame *frame, char *name) {
+	StompHeader *header = stomp_find_header(frame->system_headers, name);
+
+	return header == NULL ? -1 : strtoll(header->value, NULL, 10);
+}
+
+static void perf_message_callback(StompInfo *stomp_info, const StompFrame *frame) {
+	PerfConnection *connection = stomp_info->custom_data;
+	long long now = now_ns();
+
+	long long scheduled = header_ns(frame, "perf-scheduled");
+	long long sent = header_ns(frame, "perf-sent");
+	if (scheduled < 0 || sent < 0) return;
+
+	hdr_record(&corrected, now - scheduled);
+	hdr_record(&uncorrected, now - sent);
+
+	connection->received++;
+	last_received_ns = now;
+}
+
+static void perf_connect_callback(StompInfo *stomp_info, const StompFrame *frame) {
+	PerfConnection *connection = stomp_info->custom_data;
+
+	if (stomp_subscribe(stomp_info, connection->destination, perf_message_callback, NULL) == NULL) {
+		fprintf(stderr, "subscribing %s failed\n", connection->destination);
+		errors++;
+		perf_force_exit = 1;
+		return;
+	}
+
+	connection->connected = 1;
+}
+
+static void perf_error_callback(StompInfo *stomp_info, const StompFrame *frame) {
+	StompHeader *header = stomp_find_header(frame->system_headers, "message");
+
+	fprintf(stderr, "error %s\n", header != NULL ? header->value : frame->command);
+	errors++;
+	perf_force_exit = 1;
+}
+
+static int perf_send(PerfConnection *connection, long long scheduled, char *body) {
+	char scheduled_value[24];
+	char sent_value[24];
+	sprintf(scheduled_value, "%lld", scheduled);
+	sprintf(sent_value, "%lld", now_ns());
+
+	StompHeader header_array[2];
+	header_array[0].name = "perf-scheduled";
+	header_array[0].value = scheduled_value;
+	header_array[1].name = "perf-sent";
+	header_array[1].value = sent_value;
+
+	StompHeaders headers;
+	headers.len = 2;
+	headers.header_array = header_array;
+
+	if (stomp_send(&connection->stomp_info, connection->destination, &headers, body)) {
+		errors++;
+		return -1;
+	}
+
+	connection->sent++;
+
+	return 0;
+}
+
+static int perf_adapter(StompAdapter *adapter, char *adapter_name, char *url, char *engine, int max_frame_length) {
+	if (!strcmp(adapter_name, "loopback")) {
+		*adapter = stomp_loopback_adapter(max_frame_length);
+	} else if (!strcmp(adapter_name, "tcp") && url != NULL) {
+		*adapter = stomp_tcp_adapter(url, max_frame_length);
+
+		if (engine != NULL && !strcmp(engine, "uring")) return stomp_tcp_set_engine(adapter, STOMP_TCP_ENGINE_URING);
+	} else if (!strcmp(adapter_name, "websockets") && url != NULL) {
+		*adapter = stomp_libwebsockets_adapter(url, max_frame_length);
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	char *adapter_name = "loopback";
+	char *url = NULL;
+	char *engine = NULL;
+	char *destination = "/queue/stomp-perf";
+	int connection_count = 1;
+	int rate = 1000;
+	int pipeline = 100;
+	int size = 128;
+	int duration = 10;
+
+	StompHeader connect_header_array[PERF_MAX_CONNECT_HEADERS];
+	StompHeaders connect_headers;
+	connect_headers.len = 0;
+	connect_headers.header_array = connect_header_array;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "a:u:e:c:r:p:s:d:t:H:")) != -1) {
+		switch (opt) {
+		case 'a': adapter_name = optarg; break;
+		case 'u': url = optarg; break;
+		case 'e': engine = optarg; break;
+		case 'c': connection_count = atoi(optarg); break;
+		case 'r': rate = atoi(optarg); break;
+		case 'p': pipeline = atoi(optarg); break;
+		case 's': size = atoi(optarg); break;
+		case 'd': duration = atoi(optarg); break;
+		case 't': destination = optarg; break;
+		case 'H': {
+			char *sep = strchr(optarg, ':');
+			if (sep == NULL || connect_headers.len == PERF_MAX_CONNECT_HEADERS) goto usage;
+
+			*sep = '\0';
+			connect_header_array[connect_headers.len].name = optarg;
+			connect_header_array[connect_headers.len].value = &sep[1];
+			connect_headers.len++;
+			break;
+		}
+		default:
+			goto usage;
+		}
+	}
+
+	if (connection_count < 1 || rate < 0 || pipeline < 1 || size < 0 || duration < 1) goto usage;
+
+	signal(SIGINT, perf_sighandler);
+
+	hdr_init(&corrected);
+	hdr_init(&uncorrected);
+
+	char *body = malloc(size + 1);
+	memset(body, 'x', size);
+	body[size] = '\0';
+
+	// room for the body plus the headers of the MESSAGE
+	int max_frame_length = size + 1024;
+
+	PerfConnection *connections = calloc(connection_count, sizeof(PerfConnection));
+	for (int i = 0; i < connection_count; i++) {
+		PerfConnection *connection = &connections[i];
+
+		if (perf_adapter(&connection->adapter, adapter_name, url, engine, max_frame_length)) goto usage;
+
+		snprintf(connection->destination, sizeof(connection->destination), "%s.%d.%d", destination, getpid(), i);
+
+		connection->stomp_info = stomp_create(&connection->adapter);
+		connection->stomp_info.custom_data = connection;
+		stomp_init(&connection->stomp_info);
+
+		if (stomp_connect(&connection->stomp_info, &connect_headers, perf_connect_callback, perf_error_callback)) {
+			fprintf(stderr, "error connecting %s\n", url != NULL ? url : adapter_name);
+			return 1;
+		}
+	}
+
+	long long interval = rate > 0 ? 1000000000LL / rate : 0;
+	long long start = 0;
+	long long end = 0;
+	long long connect_deadline = now_ns() + PERF_CONNECT_TIMEOUT_MS * 1000000LL;
+	int connected = 0;
+
+	while (!perf_force_exit) {
+		long long now = now_ns();
+
+		if (start == 0 && connected < connection_count && now >= connect_deadline) {
+			fprintf(stderr, "%d of %d connections established\n", connected, connection_count);
+			errors++;
+			break;
+		}
+
+		if (start == 0 && connected == connection_count) {
+			start = now;
+			end = start + duration * 1000000000LL;
+			for (int i = 0; i < connection_count; i++) connections[i].next_send = start;
+		}
+
+		long long sent = 0;
+		long long received = 0;
+		long long next_send = now + 10000000LL;
+
+		for (int i = 0; i < connection_count; i++) {
+			PerfConnection *connection = &connections[i];
+
+			// late MESSAGEs keep their schedule, the delay is part of their latency
+			for (int burst = 0; start != 0 && now < end && burst < PERF_MAX_BURST; burst++) {
+				if (interval > 0 && connection->next_send > now) break;
+				if (interval == 0 && connection->sent - connection->received >= pipeline) break;
+
+				if (perf_send(connection, interval > 0 ? connection->next_send : now, body)) break;
+
+				connection->next_send += interval;
+			}
+
+			if (interval > 0 && connection->next_send < next_send) next_send = connection->next_send;
+
+			sent += connection->sent;
+			received += connection->received;
+		}
+
+		if (start != 0 && now >= end && (received == sent || now >= end + PERF_DRAIN_MS * 1000000LL)) break;
+
+		// only wait when nothing is due, the last connection waits for every one
+		int timeout_ms = interval > 0 && start != 0 && next_send > now ? (next_send - now) / 1000000 : 0;
+		if (start == 0) timeout_ms = 10;
+
+		connected = 0;
+		for (int i = 0; i < connection_count; i++) {
+			stomp_service(&connections[i].stomp_info, i == connection_count - 1 ? timeout_ms : 0);
+			connected += connections[i].connected;
+		}
+	}
+
+	long long sent = 0;
+	long long received = 0;
+	for (int i = 0; i < connection_count; i++) {
+		sent += connections[i].sent;
+		received += connections[i].received;
+		stomp_destroy(&connections[i].stomp_info);
+	}
+
+	double elapsed = start != 0 && last_received_ns > start ? (last_received_ns - start) / 1e9 : 0;
+
+	printf("stomp-perf %s connections=%d rate=%d/s size=%d duration=%ds\n", adapter_name, connection_count, rate, size, duration);
+	printf("sent %lld received %lld lost %lld errors %d\n", sent, received, sent - received, errors);
+	printf("throughput %.1f msg/s %.2f MB/s\n", elapsed > 0 ? received / elapsed : 0, elapsed > 0 ? received * (double) size / elapsed / 1e6 : 0);
+	printf("latency (us)        p50        p90        p99      p99.9        max\n");
+	hdr_print("corrected", &corrected);
+	hdr_print("uncorrected", &uncorrected);
+
+	free(connections);
+	free(body);
+	free(corrected.counts);
+	free(uncorrected.counts);
+
+	return errors > 0 || received < sent ? 1 : 0;
+
+	usage:
+		fprintf(stderr, "Usage: stomp-perf [-a loopback|tcp|websockets] [-u url] [-e epoll|uring] [-c connections]\n"
+				"                  [-r messages/s per connection, 0 for -p in flight] [-p pipeline] [-s size]\n"
+				"                  [-d seconds] [-t destination] [-H name:value]...\n");
+		return 1;
+}
@@ -3,9 +3,14 @@
  * libstomp - a free implementation of the stomp protocol than can be plugged
  * to different connection implementations using an adapter interface.
  *
- * 1 adapters available:
+ * 6 adapters available:
  *
  *  * websockets: make connection to Websockets via libwebsockets.
+ *  * tcp: native STOMP over TCP or unix domain sockets, optionally with TLS (OpenSSL).
+ *  * shm: frames through shared memory rings with a peer on the same host.
+ *  * loopback: in process broker for tests and benchmarks.
+ *  * recorder: logs the traffic of another adapter to a binary file.
+ *  * replay: plays a recorder log back through the parse and dispatch path.
  *
  * https://stomp.github.io/
  * https://github.com/warmcat/libwebsockets
@@ -31,12 +36,46 @@
 #ifndef libstomp_H
 #define libstomp_H
 
+#include <stdatomic.h>
+#include <stddef.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+enum StompLogLevel {
+	STOMP_LOG_TRACE,
+	STOMP_LOG_DEBUG,
+	STOMP_LOG_INFO,
+	STOMP_LOG_WARN,
+	STOMP_LOG_ERROR,
+	STOMP_LOG_NONE
+};
+
+// Log calls below this level are removed at compile time, ie -DSTOMP_LOG_MIN_LEVEL=STOMP_LOG_WARN
+#ifndef STOMP_LOG_MIN_LEVEL
+#define STOMP_LOG_MIN_LEVEL STOMP_LOG_DEBUG
+#endif
+
+// Runtime threshold, defaults to STOMP_LOG_WARN. Set with stomp_log_set_level from any thread
+extern _Atomic enum StompLogLevel stomp_log_level;
 
-extern const int STOMP_DEBUG;
+#define stomp_log_enabled(level) ((level) >= STOMP_LOG_MIN_LEVEL && \
+		(level) >= atomic_load_explicit(&stomp_log_level, memory_order_relaxed))
 
-#define stomp_debug_print(fmt, ...) \
-		do { if (STOMP_DEBUG) fprintf(stderr, fmt, ##__VA_ARGS__); } while (0)
+#define stomp_log(level, fmt, ...) \
+		do { if (stomp_log_enabled(level)) stomp_log_write(level, fmt, ##__VA_ARGS__); } while (0)
+
+#define stomp_log_trace(fmt, ...) stomp_log(STOMP_LOG_TRACE, fmt, ##__VA_ARGS__)
+#define stomp_log_debug(fmt, ...) stomp_log(STOMP_LOG_DEBUG, fmt, ##__VA_ARGS__)
+#define stomp_log_info(fmt, ...) stomp_log(STOMP_LOG_INFO, fmt, ##__VA_ARGS__)
+#define stomp_log_warn(fmt, ...) stomp_log(STOMP_LOG_WARN, fmt, ##__VA_ARGS__)
+#define stomp_log_error(fmt, ...) stomp_log(STOMP_LOG_ERROR, fmt, ##__VA_ARGS__)
+
+// Frame dumps are truncated and rate limited, see stomp_log_set_payload_limit
+#define stomp_log_payload(level, prefix, payload, len) \
+		do { if (stomp_log_enabled(level)) stomp_log_write_payload(level, prefix, payload, len); } while (0)
+
+typedef void (*stomp_log_sink)(enum StompLogLevel level, const char *line, void *user_data);
 
 enum StompAdapterStatus {
 	created,
@@ -62,17 +101,110 @@ typedef struct {
   StompHeaders *system_headers;
   StompHeaders *user_headers;
   char *body;
+  size_t body_length; // 0 means strlen(body)
+  void *pool_buffer; // internal, set in frames owned by libstomp
 } StompFrame;
 
+typedef struct StompFramePool StompFramePool;
+typedef struct StompTransaction StompTransaction;
+typedef struct StompReceipt StompReceipt;
+
 typedef struct StompInfo StompInfo;
 typedef struct StompSubscription StompSubscription;
+typedef struct StompListener StompListener;
+typedef struct StompRouter StompRouter;
+typedef struct StompDedup StompDedup;
+typedef struct StompSpool StompSpool;
+typedef struct StompPreparedSend StompPreparedSend;
 
 
 typedef void (*stomp_callback)(StompInfo *stomp_info, const StompFrame *frame);
 
+// frames stay valid until the callback returns, use stomp_frame_retain to keep them
+typedef void (*stomp_batch_callback)(StompInfo *stomp_info, StompFrame *const *frames, int count);
+
+enum StompAckMode {
+	STOMP_ACK_AUTO,
+	STOMP_ACK_CLIENT, // cumulative, acknowledges every previous message
+	STOMP_ACK_CLIENT_INDIVIDUAL
+};
+
+typedef struct {
+	// Deliver the frames received in one stomp_service call together, instead of message_callback
+	stomp_batch_callback batch_callback;
+	int max_batch_size;
+
+	// stomp_ack calls are coalesced until ack_batch_size are pending or the oldest is ack_interval_ms old
+	enum StompAckMode ack_mode;
+	int ack_batch_size;
+	int ack_interval_ms; // 0 disables the timer
+
+	// prefetch-count / activemq.prefetchSize sent with SUBSCRIBE, 0 leaves the broker default.
+	// Brokers only hold back messages not acknowledged yet, so it needs a client ack_mode
+	int prefetch;
+	// Keep up to queue_size messages for stomp_poll instead of calling message_callback.
+	// Socket reads are paused while a queue is full and resumed when it is half empty, so the adapter
+	// needs a pause_function. Messages read before the pause take up to another queue_size, beyond
+	// that they are dropped (NACKed with a client ack_mode)
+	int queue_size;
+
+	// Conflation of queued messages: a message replaces the queued one with the same value of
+	// this header, keeping its place. Needs queue_size, the queue then holds one message per key
+	char *conflation_header;
+	// Messages whose timestamp_header (ms since the epoch) is older than max_age_ms are dropped
+	char *timestamp_header;
+	int max_age_ms; // 0 disables the expiry
+
+	// Reuse the broker subscription of an earlier shared subscribe to the same destination, the
+	// frames are parsed once and passed to every message_callback. Its options apply.
+	// Only for message_callback subscriptions without headers
+	int shared;
+} StompSubscriptionOptions;
+
+// Queue position of the message with a conflation key, key is NULL for empty slots
+typedef struct {
+	const char *key;
+	long long position;
+} StompConflationSlot;
+
+// Local subscriber of a shared subscription
+struct StompListener {
+  char listener_id[30]; // the first one has the id of the subscription
+  stomp_callback message_callback; // NULL once unsubscribed during a delivery
+  StompListener *next;
+};
+
 struct StompSubscription{
   char subscription_id[30]; //TODO length?
   stomp_callback message_callback;
+  StompSubscriptionOptions options;
+
+  StompFrame **batch; // retained frames waiting for options.batch_callback
+  int batch_len;
+  StompSubscription *next_pending; // list of subscriptions with a batch to deliver
+  int delivering;
+  int unsubscribed;
+
+  StompFrame **acks; // retained frames waiting to be acknowledged, only the last one for STOMP_ACK_CLIENT
+  int acks_len;
+  int acks_count; // stomp_ack calls since the last ACK was sent
+  long long acks_since_ms;
+
+  StompFrame **queue; // retained frames waiting for stomp_poll, a ring
+  int queue_head;
+  int queue_len;
+  int queue_capacity; // up to 2 * options.queue_size with frames read before the pause
+  int queue_full;
+  long long queue_popped; // messages taken from the queue, positions are absolute
+
+  char *destination; // options.shared
+  StompListener *listeners;
+
+  StompRouter *router; // stomp_add_route
+
+  StompConflationSlot *conflation_slots; // open addressing, twice the queue capacity
+  unsigned int conflation_mask;
+
   StompSubscription *previous;
   StompSubscription *next;
 };
@@ -83,11 +215,29 @@ typedef int (*stomp_adapter_init_function)(StompAdapter *adapter, StompAdapter *
 typedef int (*stomp_adapter_service_function)(StompAdapter *adapter, int timeout_ms);
 typedef int (*stomp_adapter_connect_function)(StompAdapter *adapter);
 typedef int (*stomp_adapter_send_function)(StompAdapter *adapter, char *message);
+// Sends the concatenated segments as one message, they already include the final NULL char
+typedef int (*stomp_adapter_sendv_function)(StompAdapter *adapter, const struct iovec *iov, int iovcnt);
+typedef void (*stomp_release_function)(void *release_data);
+// Like sendv_function, but the iovec array and the segments stay valid until the adapter calls
+// release(release_data). It is called once, also on error, so they can be written later without a copy
+typedef int (*stomp_adapter_sendv_async_function)(StompAdapter *adapter, const struct iovec *iov, int iovcnt,
+		stomp_release_function release, void *release_data);
+// Sends several complete frames, one per iovec, in as few writes as the transport allows
+typedef int (*stomp_adapter_send_frames_function)(StompAdapter *adapter, const struct iovec *frames, int count);
 typedef int (*stomp_adapter_restart_function)(StompAdapter *adapter);
+// Stop delivering messages while paused is 1, leaving them in the socket
+typedef int (*stomp_adapter_pause_function)(StompAdapter *adapter, int paused);
 typedef int (*stomp_adapter_destroy_function)(StompAdapter *adapter);
 
 typedef int (*stomp_adapter_onopen_callback)(StompAdapter *adapter);
-typedef int (*stomp_adapter_onmessage_callback)(StompAdapter *adapter, char *message);
+// message must be writable and NULL terminated at message[len]
+typedef int (*stomp_adapter_onmessage_callback)(StompAdapter *adapter, char *message, size_t len);
+// message is a read only mapping of len bytes plus the NULL char, owned by the callee that unmaps
+// len + 1 bytes when the frame is released
+typedef int (*stomp_adapter_onmessage_mapped_callback)(StompAdapter *adapter, char *message, size_t len);
+// A buffer of the parent for a message of len bytes plus the NULL char, or NULL. A message gathered in
+// it is passed to onmessage_callback, which takes the buffer instead of copying the message
+typedef char* (*stomp_adapter_acquire_buffer_callback)(StompAdapter *adapter, size_t len);
 typedef int (*stomp_adapter_onerror_callback)(StompAdapter *adapter, char *message);
 typedef int (*stomp_adapter_onheartbeat_callback)(StompAdapter *adapter);
 typedef int (*stomp_adapter_onclose_callback)(StompAdapter *adapter, char *message);
@@ -97,12 +247,18 @@ struct StompAdapter{
 	stomp_adapter_init_function init_function;
 	stomp_adapter_connect_function connect_function;
 	stomp_adapter_send_function send_function;
+	stomp_adapter_sendv_function sendv_function; // optional, needed for binary bodies
+	stomp_adapter_sendv_async_function sendv_async_function; // optional
+	stomp_adapter_send_frames_function send_frames_function; // optional
 	stomp_adapter_service_function service_function;
 	stomp_adapter_restart_function restart_function;
+	stomp_adapter_pause_function pause_function; // optional
 	stomp_adapter_destroy_function destroy_function;
 
 	stomp_adapter_onopen_callback onopen_callback;
 	stomp_adapter_onmessage_callback onmessage_callback;
+	stomp_adapter_onmessage_mapped_callback onmessage_mapped_callback; // optional
+	stomp_adapter_acquire_buffer_callback acquire_buffer_callback; // optional
 	stomp_adapter_onerror_callback onerror_callback;
 	stomp_adapter_onheartbeat_callback onheartbeat_callback;
 	stomp_adapter_onclose_callback onclose_callback;
@@ -111,10 +267,93 @@ struct StompAdapter{
 	StompAdapter *child_adapter;
 
 	int max_frame_length;
+	// largest message accepted by sendv_function, it is written in fragments of max_frame_length.
+	// 0 if messages can not exceed max_frame_length
+	size_t max_message_length;
+
+	void *custom_data;
+};
+
+// Reassembles a message received in several reads. Once it grows over spill_threshold it is moved to
+// a temp file (memfd when available) and passed to onmessage_mapped_callback, so huge bodies do not
+// need a heap buffer of their size
+typedef struct {
+	size_t spill_threshold; // 0 never spills
+	char *data;
+	size_t len;
+	size_t capacity;
+	int fd; // -1 while the message is in data
+	char *acquired; // buffer of the parent the message is gathered in instead of data, see stomp_rx_buffer_expect
+	size_t acquired_len;
+} StompRxBuffer;
+
+extern void stomp_rx_buffer_init(StompRxBuffer *rx_buffer, size_t spill_threshold);
+
+// The next message has len bytes. It is gathered straight into a buffer of the parent adapter if it lends
+// one with acquire_buffer_callback and the message would not spill
+extern void stomp_rx_buffer_expect(StompRxBuffer *rx_buffer, StompAdapter *parent_adapter, size_t len);
+
+extern int stomp_rx_buffer_append(StompRxBuffer *rx_buffer, const char *data, size_t len);
+
+// Hands the complete message to the parent adapter and empties the buffer
+extern int stomp_rx_buffer_deliver(StompRxBuffer *rx_buffer, StompAdapter *parent_adapter);
+
+// Drops a partial message, ie when the connection is closed
+extern void stomp_rx_buffer_reset(StompRxBuffer *rx_buffer);
+
+extern void stomp_rx_buffer_free(StompRxBuffer *rx_buffer);
+
+
+typedef struct StompCodec StompCodec;
+
+// Return the number of bytes written to dst or -1
+typedef ssize_t (*stomp_codec_compress_function)(StompCodec *codec, const char *src, size_t src_len, char *dst, size_t dst_capacity);
+typedef ssize_t (*stomp_codec_decompress_function)(StompCodec *codec, const char *src, size_t src_len, char *dst, size_t dst_capacity);
+// Worst case compressed size
+typedef size_t (*stomp_codec_bound_function)(StompCodec *codec, size_t src_len);
+// Size of the original body or -1 if it can not be known
+typedef ssize_t (*stomp_codec_decompressed_size_function)(StompCodec *codec, const char *src, size_t src_len);
+typedef void (*stomp_codec_destroy_function)(StompCodec *codec);
+
+struct StompCodec {
+	char *name; // value of the content-encoding header
+	size_t min_size; // smaller bodies are sent uncompressed
+
+	stomp_codec_compress_function compress_function;
+	stomp_codec_decompress_function decompress_function;
+	stomp_codec_bound_function bound_function;
+	stomp_codec_decompressed_size_function decompressed_size_function;
+	stomp_codec_destroy_function destroy_function;
 
 	void *custom_data;
 };
 
+#define STOMP_MAX_CODECS 4
+
+typedef struct {
+	char *header; // the key of a message, message-id by default
+	int capacity; // keys remembered approximately
+	int exact_size; // most recent keys compared exactly
+} StompDedupOptions;
+
+typedef struct {
+	char *directory; // for the spool-*.seg files, it must exist
+	size_t segment_size; // bytes per file, at least max_frame_length plus 64
+	int max_segments; // stomp_send fails when they are all full
+} StompSpoolOptions;
+
+typedef struct {
+	unsigned long long pending; // frames without a RECEIPT
+	unsigned long long unsent; // frames not sent on this connection yet
+	int segments;
+} StompSpoolStats;
+
+typedef struct {
+	unsigned long long exact_hits; // duplicates found in the recent keys
+	unsigned long long filter_hits; // probable duplicates of older keys
+	unsigned long long misses;
+	unsigned long long filter_resets;
+} StompDedupStats;
 
 struct StompInfo {
 	StompAdapter adapter;
@@ -125,13 +364,157 @@ struct StompInfo {
 
 	int next_subscription_id;
 	StompSubscription *subscriptions;
+	StompSubscription *pending_subscriptions;
+
+	int next_transaction_id;
+	int next_receipt_id;
+	StompReceipt *receipts; // waiting for a RECEIPT frame
+
+	int full_queues; // reads are paused while there is any
 
 	time_t last_server_action_time;
+
+	StompCodec *codecs[STOMP_MAX_CODECS];
+	int codecs_len;
+	StompCodec *send_codec;
+	char *codec_tx_buffer;
+	size_t codec_tx_size;
+	size_t max_decompressed_size; // 0 for the largest frame the adapter carries
+
+	StompFramePool *frame_pool;
+
+	StompDedup *dedup;
+	char *dedup_header;
+
+	StompSpool *spool;
+
 	void *custom_data;
 };
 
+typedef struct {
+	int enabled; // negotiate permessage-deflate
+	int client_no_context_takeover;
+	int server_no_context_takeover;
+	int client_max_window_bits; // 8..15
+	int server_max_window_bits; // 8..15
+	int compression_level; // 0..9, for the whole connection. 0 does not negotiate permessage-deflate
+	int mem_level; // 1..9
+} StompDeflateOptions;
+
+typedef struct {
+	unsigned long long tx_uncompressed;
+	unsigned long long tx_compressed;
+	unsigned long long rx_compressed;
+	unsigned long long rx_uncompressed;
+} StompCompressionStats;
+
+// Default adapter.max_message_length. Messages over max_frame_length are sent as continuation fragments
+#define STOMP_LWS_MAX_MESSAGE_LENGTH (16 * 1024 * 1024)
+
+// Default size over which a received message is spilled to a temp file, see StompRxBuffer
+#define STOMP_LWS_SPILL_THRESHOLD (1024 * 1024)
+
 extern StompAdapter stomp_libwebsockets_adapter(char *url, int max_frame_length);
 
+extern StompDeflateOptions stomp_libwebsockets_default_deflate_options(void);
+
+// Must be called before stomp_connect
+extern int stomp_libwebsockets_set_deflate_options(StompAdapter *adapter, const StompDeflateOptions *options);
+
+// Counters of the current connection
+extern int stomp_libwebsockets_compression_stats(StompAdapter *adapter, StompCompressionStats *stats);
+
+// Messages received in several fragments and larger than spill_threshold are passed as a mapped temp file.
+// 0 keeps them in the heap. Must be called before stomp_connect
+extern int stomp_libwebsockets_set_spill_threshold(StompAdapter *adapter, size_t spill_threshold);
+
+typedef struct {
+	int verify_peer; // certificate and host name, against the system CAs unless ca_file is set
+	const char *ca_file;
+	const char *cert_file; // optional client certificate
+	const char *key_file;
+} StompTlsOptions;
+
+// Default size over which a received frame is spilled to a temp file, see StompRxBuffer
+#define STOMP_TCP_SPILL_THRESHOLD (1024 * 1024)
+
+// url is tcp://host[:port], ssl://host[:port] (or tls://) or unix:///path. The default ports are 61613 and 61614.
+// max_frame_length is the read buffer, larger frames are reassembled or spilled. Sent frames have no limit
+extern StompAdapter stomp_tcp_adapter(char *url, int max_frame_length);
+
+extern StompTlsOptions stomp_tcp_default_tls_options(void);
+
+// Must be called before stomp_connect. Returns -1 if libstomp is built without OpenSSL
+extern int stomp_tcp_set_tls_options(StompAdapter *adapter, const StompTlsOptions *options);
+
+enum StompTcpEngine {
+	STOMP_TCP_ENGINE_EPOLL, // one epoll per connection, the default
+	STOMP_TCP_ENGINE_URING // one io_uring for every connection of the process
+};
+
+// Must be called before stomp_connect. With STOMP_TCP_ENGINE_URING a stomp_service on any connection
+// submits the sends of all of them and runs their callbacks, so they have to be serviced from the same
+// thread. TLS connections fall back to epoll. Returns -1 if libstomp is built without io_uring or the ring
+// can not be set up, ie on kernels older than 6.0
+extern int stomp_tcp_set_engine(StompAdapter *adapter, enum StompTcpEngine engine);
+
+typedef struct StompShm StompShm;
+
+// name is the POSIX shared memory object created by the peer with stomp_shm_peer_create, ie "/stomp-sidecar".
+// Its rings must hold a max_frame_length frame
+extern StompAdapter stomp_shm_adapter(char *name, int max_frame_length);
+
+// Reference peer of the shm adapter, for sidecars and tests. capacity is the size of each ring, a power of 2.
+// A segment takes one client, after it detaches the peer creates it again
+extern StompShm* stomp_shm_peer_create(const char *name, size_t capacity);
+
+// Unlinks the segment, the client sees the connection closed
+extern void stomp_shm_peer_destroy(StompShm *peer);
+
+// Writes a frame, NULL char included. Returns 1 if the ring is full or -1 once the client is gone
+extern int stomp_shm_peer_send(StompShm *peer, const char *frame, size_t len);
+
+// Copies the next frame to buffer and returns its length, 0 if none arrives in timeout_ms or -1 once the client is gone.
+// A frame larger than size is dropped and returns -1 with errno EMSGSIZE
+extern ssize_t stomp_shm_peer_receive(StompShm *peer, char *buffer, size_t size, int timeout_ms);
+
+typedef struct {
+	int latency_us; // before a frame of the broker reaches the client
+	double drop_rate; // fraction of the routed messages that are lost
+	int disconnect_after; // frames from the client before the broker closes the connection, 0 never
+	unsigned int seed; // of the drops, the same seed drops the same messages
+} StompLoopbackOptions;
+
+typedef struct {
+	unsigned long long frames_received;
+	unsigned long long messages_routed;
+	unsigned long long messages_dropped;
+	unsigned long long receipts;
+} StompLoopbackStats;
+
+// In process broker for tests and benchmarks: CONNECTED, SENDs routed as MESSAGE to the subscriptions with
+// the same destination, transactions and RECEIPTs. The frames are delivered by stomp_service
+extern StompAdapter stomp_loopback_adapter(int max_frame_length);
+
+extern StompLoopbackOptions stomp_loopback_default_options(void);
+
+// Applies from the next frame, the drops start again from the seed
+extern int stomp_loopback_set_options(StompAdapter *adapter, const StompLoopbackOptions *options);
+
+// Counters since the adapter was created, reconnections included
+extern int stomp_loopback_get_stats(StompAdapter *adapter, StompLoopbackStats *stats);
+
+// Wraps child_adapter and records the frames in both directions, heartbeats, opens and closes with
+// their monotonic times to the binary log at path, replaced if it exists. child_adapter is destroyed with it
+extern StompAdapter stomp_recorder_adapter(StompAdapter *child_adapter, const char *path);
+
+// Delivers the frames received in a log of stomp_recorder_adapter from stomp_service, at the recorded pace.
+// Frames sent by the client are dropped
+extern StompAdapter stomp_replay_adapter(const char *path, int max_frame_length);
+
+// 1 the recorded pace, 10 ten times faster, 0 as fast as possible
+extern int stomp_replay_set_speed(StompAdapter *adapter, double speed);
+
 extern StompInfo stomp_create(StompAdapter *adapter);
 
 extern int stomp_init(StompInfo *stomp_info);
@@ -144,14 +527,133 @@ extern StompHeader* stomp_find_header(StompHeaders *headers, char *name);
 
 extern char* stomp_subscribe(StompInfo *stomp_info, char *destination, stomp_callback message_callback, StompHeaders* headers);
 
+extern StompSubscriptionOptions stomp_subscription_default_options(void);
+
+extern char* stomp_subscribe_with_options(StompInfo *stomp_info, char *destination, stomp_callback message_callback,
+		StompHeaders* headers, const StompSubscriptionOptions *options);
+
+// A shared subscription is only unsubscribed from the broker with its last listener
 extern int stomp_unsubscribe(StompInfo *stomp_info, char *subscription_id);
 
+// Calls callback for the messages of the subscription whose destination matches pattern.
+// Destinations are split in segments by '/' and '.', '*' matches one segment and '>' or '#'
+// the remaining ones. Messages without a matching route get the usual delivery
+extern int stomp_add_route(StompInfo *stomp_info, char *subscription_id, char *pattern, stomp_callback callback);
+
+extern int stomp_remove_route(StompInfo *stomp_info, char *subscription_id, char *pattern, stomp_callback callback);
+
+// Takes up to max queued messages of a subscription with queue_size. The frames are retained,
+// release them with stomp_frame_release. Returns the number of frames or -1
+extern int stomp_poll(StompInfo *stomp_info, char *subscription_id, StompFrame **frames, int max);
+
+// Acknowledge a MESSAGE of a STOMP_ACK_CLIENT / STOMP_ACK_CLIENT_INDIVIDUAL subscription.
+// The ACK may be delayed and coalesced, see ack_batch_size
+extern int stomp_ack(StompInfo *stomp_info, const StompFrame *frame);
+
+// Sent straight away, after the pending ACKs of the subscription
+extern int stomp_nack(StompInfo *stomp_info, const StompFrame *frame);
+
 extern int stomp_send(StompInfo *stomp_info, char *destination, StompHeaders* headers, char *message);
 
+extern StompSpoolOptions stomp_spool_default_options(char *directory);
+
+// stomp_send writes the frames to the spool first, with a receipt header. They are sent when
+// connected and replayed after every CONNECTED until the broker confirms them. The frames left
+// by a previous run in the directory are recovered
+extern int stomp_enable_spool(StompInfo *stomp_info, const StompSpoolOptions *options);
+
+extern int stomp_spool_stats(StompInfo *stomp_info, StompSpoolStats *stats);
+
+extern StompDedupOptions stomp_dedup_default_options(void);
+
+// Drop the messages already delivered to the application (callbacks and stomp_poll), they survive
+// stomp_reconnect. Duplicates of client-individual subscriptions are acknowledged so the broker stops
+// redelivering them, with client the ACK of a later message covers them
+extern int stomp_enable_dedup(StompInfo *stomp_info, const StompDedupOptions *options);
+
+extern int stomp_dedup_stats(StompInfo *stomp_info, StompDedupStats *stats);
+
+// Marshalls SEND, destination and headers once for many stomp_send_prepared calls
+extern StompPreparedSend* stomp_prepare_send(StompInfo *stomp_info, char *destination, StompHeaders *headers);
+
+// headers are the per message ones, they may be NULL
+extern int stomp_send_prepared(StompPreparedSend *prepared, StompHeaders *headers, char *message);
+
+// The body is the concatenation of the segments, it may contain NULL chars. content-length
+// is computed and the segments reach the adapter sendv_function without being copied
+extern int stomp_sendv(StompInfo *stomp_info, char *destination, StompHeaders* headers, const struct iovec *body, int body_count);
+
+extern int stomp_send_preparedv(StompPreparedSend *prepared, StompHeaders *headers, const struct iovec *body, int body_count);
+
+// The body is length bytes of fd from offset, mapped and streamed by the adapter without a heap copy.
+// The file can be closed when it returns
+extern int stomp_send_fd(StompInfo *stomp_info, char *destination, StompHeaders* headers, int fd, off_t offset, size_t length);
+
+extern void stomp_prepared_send_free(StompPreparedSend *prepared);
+
+// Frames of a transaction are kept until stomp_commit, that writes BEGIN, the SENDs and COMMIT at once
+extern StompTransaction* stomp_begin(StompInfo *stomp_info);
+
+// Like stomp_send, tagged with the transaction header
+extern int stomp_transaction_send(StompTransaction *transaction, char *destination, StompHeaders* headers, char *message);
+
+// receipt_callback, if not NULL, is called with the RECEIPT of the COMMIT. The transaction is freed
+extern int stomp_commit(StompTransaction *transaction, stomp_callback receipt_callback);
+
+// Nothing has been written yet, the frames are discarded. The transaction is freed
+extern int stomp_abort(StompTransaction *transaction);
+
 extern int stomp_service(StompInfo *stomp_info, int timeout_ms);
 
 extern int stomp_destroy(StompInfo *stomp_info);
 
-extern void stomp_frame_marshall(const StompFrame *frame, char *buffer, int maxLength);
+// Returns the marshalled length or -1 if it does not fit in maxLength
+extern int stomp_frame_marshall(const StompFrame *frame, char *buffer, int maxLength);
+
+extern size_t stomp_frame_body_length(const StompFrame *frame);
+
+// Keeps a frame received in a callback alive after the callback returns, without copying it.
+// Frames not built by libstomp are copied. Every retain needs a stomp_frame_release
+extern StompFrame* stomp_frame_retain(const StompFrame *frame);
+
+// Can be called from any thread
+extern void stomp_frame_release(StompFrame *frame);
+
+// Bodies of received MESSAGEs with a content-encoding of a registered codec are decompressed
+// before the subscription callback. The codec is owned by the caller
+extern int stomp_add_codec(StompInfo *stomp_info, StompCodec *codec);
+
+// Compress the body of stomp_send with a registered codec, NULL to disable
+extern int stomp_set_send_codec(StompInfo *stomp_info, char *name);
+
+// Larger decompressed bodies are rejected. 0, the default, limits them to the largest frame the
+// adapter carries, max_frame_length or max_message_length of the child
+extern void stomp_set_max_decompressed_size(StompInfo *stomp_info, size_t max_decompressed_size);
+
+// Dictionary codecs, only available when libstomp is built with zstd / lz4. Return -1 otherwise
+extern int stomp_zstd_codec(StompCodec *codec, const void *dictionary, size_t dictionary_len, int level);
+
+extern int stomp_lz4_codec(StompCodec *codec, const void *dictionary, size_t dictionary_len);
+
+extern void stomp_log_set_level(enum StompLogLevel level);
+
+// NULL restores the default sink, that writes to stderr
+extern void stomp_log_set_sink(stomp_log_sink sink, void *user_data);
+
+// max_bytes of each frame dump (0 disables them) and max dumps per second (0 unlimited)
+extern void stomp_log_set_payload_limit(int max_bytes, int max_per_second);
+
+// Format into a lock free ring of ring_size lines, drained by a background thread
+extern int stomp_log_start_async(int ring_size);
+
+// Waits for the lines being written, drains them and stops the background thread
+extern int stomp_log_stop_async(void);
+
+// Lines lost because the ring was full
+extern unsigned long stomp_log_dropped(void);
+
+extern void stomp_log_write(enum StompLogLevel level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+extern void stomp_log_write_payload(enum StompLogLevel level, const char *prefix, const char *payload, size_t len);
 
 #endif
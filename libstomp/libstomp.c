@@ -2,9 +2,14 @@
  * libstomp - a free implementation of the stomp protocol than can be plugged
  * to different connection implementations using an adapter interface.
  *
- * 1 adapters available:
+ * 6 adapters available:
  *
  *  * websockets: make connection to Websockets via libwebsockets.
+ *  * tcp: native STOMP over TCP or unix domain sockets, optionally with TLS (OpenSSL).
+ *  * shm: frames through shared memory rings with a peer on the same host.
+ *  * loopback: in process broker for tests and benchmarks.
+ *  * recorder: logs the traffic of another adapter to a binary file.
+ *  * replay: plays a recorder log back through the parse and dispatch path.
  *
  * https://stomp.github.io/
  * https://github.com/warmcat/libwebsockets
@@ -30,17 +35,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 //
 //#include <syslog.h>
 //#include <time.h>
 //#include <unistd.h>
 
 #include "libstomp.h"
-
-const int STOMP_DEBUG = 0;
+#include "stomp_internal.h"
 
 typedef struct {
 	StompInfo *stomp_info;
+	StompFrameBuffer *acquired; // lent to the child adapter by acquire_buffer_callback
 } StompAdapterStompInfo;
 
 static StompAdapterStompInfo* get_adapter_custom_data(StompAdapter *adapter) {
@@ -67,48 +75,75 @@ StompSubscription* stomp_find_subscription(StompInfo *stomp_info, char *subscrip
 	return NULL;
 }
 
-int stomp_frame_header_marshall(StompHeaders *headers, char *buffer, int skipContentLength) {
+// Appends data at pos keeping room for the final NULL char. Returns the new position or -1
+static int stomp_marshall_append(char *buffer, int pos, int maxLength, const char *data, size_t len) {
+	if (pos < 0 || pos + len >= maxLength) return -1;
+
+	memcpy(&buffer[pos], data, len);
+
+	return pos + len;
+}
+
+int stomp_frame_header_marshall(StompHeaders *headers, char *buffer, int pos, int maxLength, int *skipContentLength) {
 	if (headers) {
 		for (int i = 0; i < headers->len; i++) {
 			StompHeader *header = &headers->header_array[i];
 
 			if (!strcmp(header->name, "content-length")) {
-				skipContentLength = !strcmp(header->value, "false");
+				*skipContentLength = !strcmp(header->value, "false");
 				continue;
 			}
-			strcat(buffer, header->name);
-			strcat(buffer, ":");
-			strcat(buffer, header->value);
-			strcat(buffer, "\n");
+			pos = stomp_marshall_append(buffer, pos, maxLength, header->name, strlen(header->name));
+			pos = stomp_marshall_append(buffer, pos, maxLength, ":", 1);
+			pos = stomp_marshall_append(buffer, pos, maxLength, header->value, strlen(header->value));
+			pos = stomp_marshall_append(buffer, pos, maxLength, "\n", 1);
 		}
 	}
 
-	return skipContentLength;
+	return pos;
 }
 
-void stomp_frame_marshall(const StompFrame *frame, char *buffer, int maxLength) {
-	//TODO respect maxlength
+size_t stomp_frame_body_length(const StompFrame *frame) {
+	if (frame->body == NULL) return 0;
+
+	return frame->body_length ? frame->body_length : strlen(frame->body);
+}
 
-	strcpy(buffer, frame->command);
-	strcat(buffer, "\n");
+// Marshalls the command and headers up to the empty line, content-length is taken from body_length
+static int stomp_frame_marshall_head(const StompFrame *frame, size_t body_length, char *buffer, int maxLength) {
+	int pos = stomp_marshall_append(buffer, 0, maxLength, frame->command, strlen(frame->command));
+	pos = stomp_marshall_append(buffer, pos, maxLength, "\n", 1);
 
-	int skipContentLength = stomp_frame_header_marshall(frame->system_headers, buffer, 0);
-		skipContentLength = stomp_frame_header_marshall(frame->user_headers, buffer, skipContentLength);
+	int skipContentLength = 0;
+	pos = stomp_frame_header_marshall(frame->system_headers, buffer, pos, maxLength, &skipContentLength);
+	pos = stomp_frame_header_marshall(frame->user_headers, buffer, pos, maxLength, &skipContentLength);
 
 	if (frame->body && !skipContentLength) {
-		char temp[25];
+		char temp[40];
 		//FIXME it should be utf-8 length, not byte length
-		sprintf(temp,"content-length:%lu\n", strlen(frame->body));
-		strcat(buffer, temp);
+		int temp_len = sprintf(temp, "content-length:%zu\n", body_length);
+		pos = stomp_marshall_append(buffer, pos, maxLength, temp, temp_len);
 	}
 
-	strcat(buffer, "\n");
+	pos = stomp_marshall_append(buffer, pos, maxLength, "\n", 1);
+
+	if (pos >= 0) buffer[pos] = '\0';
+
+	return pos;
+}
+
+int stomp_frame_marshall(const StompFrame *frame, char *buffer, int maxLength) {
+	size_t body_length = stomp_frame_body_length(frame);
+
+	int pos = stomp_frame_marshall_head(frame, body_length, buffer, maxLength);
 
 	if (frame->body) {
-		strcat(buffer, frame->body);
+		pos = stomp_marshall_append(buffer, pos, maxLength, frame->body, body_length);
 	}
 
-//	strcat(buffer, "\0");
+	if (pos >= 0) buffer[pos] = '\0';
+
+	return pos;
 }
 
 int stomp_transmit(StompInfo *stomp_info, StompFrame *frame) {
@@ -119,13 +154,121 @@ int stomp_transmit(StompInfo *stomp_info, StompFrame *frame) {
 	//TODO reuse buffer
     char message[max_frame_length];
 
-    stomp_frame_marshall(frame, message, max_frame_length);
+    int message_len = stomp_frame_marshall(frame, message, max_frame_length);
+	if (message_len < 0) {
+		stomp_log_error("frame %s exceeds max_frame_length %d", frame->command, max_frame_length);
+		return -1;
+	}
 
-	stomp_debug_print("stomp sending:\n%s\n", message);
+	stomp_log_payload(STOMP_LOG_DEBUG, "stomp sending", message, message_len);
 
 	return child_adapter->send_function(child_adapter, message);
 }
 
+// Largest frame the child adapter takes through sendv, it may stream frames over max_frame_length
+static size_t stomp_max_message_length(StompInfo *stomp_info) {
+	StompAdapter *child_adapter = stomp_info->adapter.child_adapter;
+	size_t max_frame_length = stomp_info->adapter.max_frame_length;
+
+	if (child_adapter->sendv_function == NULL || child_adapter->max_message_length < max_frame_length) return max_frame_length;
+
+	return child_adapter->max_message_length;
+}
+
+// Sends a frame whose body may contain NULL chars. The body is gathered by the adapter, not copied
+static int stomp_transmit_binary(StompInfo *stomp_info, StompFrame *frame) {
+	StompAdapter *child_adapter = stomp_info->adapter.child_adapter;
+
+	if (child_adapter->sendv_function == NULL) {
+		stomp_log_error("adapter can not send binary frames");
+		return -1;
+	}
+
+	int max_frame_length = stomp_info->adapter.max_frame_length;
+	char head[max_frame_length];
+
+	size_t body_length = stomp_frame_body_length(frame);
+	int head_len = stomp_frame_marshall_head(frame, body_length, head, max_frame_length);
+	if (head_len < 0 || head_len + body_length >= stomp_max_message_length(stomp_info)) {
+		stomp_log_error("frame %s exceeds max_frame_length %d", frame->command, max_frame_length);
+		return -1;
+	}
+
+	stomp_log_payload(STOMP_LOG_DEBUG, "stomp sending", head, head_len);
+
+	struct iovec iov[3];
+	iov[0].iov_base = head;
+	iov[0].iov_len = head_len;
+	iov[1].iov_base = frame->body;
+	iov[1].iov_len = body_length;
+	iov[2].iov_base = "\0";
+	iov[2].iov_len = 1;
+
+	return child_adapter->sendv_function(child_adapter, iov, 3);
+}
+
+static int stomp_send_packed_frames(StompAdapter *child_adapter, struct iovec *iov, int count) {
+	if (count == 0) return 0;
+
+	if (child_adapter->send_frames_function != NULL) {
+		return child_adapter->send_frames_function(child_adapter, iov, count);
+	}
+
+	// one by one. Without sendv the marshalled frames are NULL terminated strings
+	for (int i = 0; i < count; i++) {
+		int ret = child_adapter->sendv_function != NULL
+				? child_adapter->sendv_function(child_adapter, &iov[i], 1)
+				: child_adapter->send_function(child_adapter, iov[i].iov_base);
+		if (ret) return -1;
+	}
+
+	return 0;
+}
+
+// Marshalls several frames in a pooled buffer of max_frame_length and hands them to the adapter
+// together, up to STOMP_FRAMES_CHUNK at a time
+int stomp_transmit_frames(StompInfo *stomp_info, StompFrame *frames, int count) {
+	StompAdapter *child_adapter = stomp_info->adapter.child_adapter;
+
+	int max_frame_length = stomp_info->adapter.max_frame_length;
+	StompFrameBuffer *frame_buffer = stomp_frame_pool_acquire(stomp_info->frame_pool, max_frame_length);
+	if (frame_buffer == NULL) return -1;
+
+	char *buffer = frame_buffer->data;
+	struct iovec iov[STOMP_FRAMES_CHUNK];
+
+	int ret = 0, pos = 0, packed = 0;
+	for (int i = 0; i < count; i++) {
+		int len = packed < STOMP_FRAMES_CHUNK ? stomp_frame_marshall(&frames[i], &buffer[pos], max_frame_length - pos) : -1;
+
+		if (len < 0 && packed > 0) {
+			// buffer full, send what is packed and start again
+			if ((ret = stomp_send_packed_frames(child_adapter, iov, packed))) break;
+			pos = packed = 0;
+			len = stomp_frame_marshall(&frames[i], buffer, max_frame_length);
+		}
+
+		if (len < 0) {
+			stomp_log_error("frame %s exceeds max_frame_length %d", frames[i].command, max_frame_length);
+			ret = -1;
+			break;
+		}
+
+		stomp_log_payload(STOMP_LOG_DEBUG, "stomp sending", &buffer[pos], len);
+
+		iov[packed].iov_base = &buffer[pos];
+		iov[packed].iov_len = len + 1; // with the NULL char
+		packed++;
+		pos += len + 1;
+	}
+
+	if (ret == 0) ret = stomp_send_packed_frames(child_adapter, iov, packed);
+
+	stomp_frame_release(&frame_buffer->frame);
+
+	return ret;
+}
+
 int stomp_send_connect(StompInfo *stomp_info) {
 	//TODO headers
 	StompHeader system_headers_array[2];
@@ -155,17 +298,22 @@ void stomp_empty_frame(StompFrame *frame) {
 	frame->body = NULL;
 	frame->system_headers = NULL;
 	frame->user_headers = NULL;
+	frame->body_length = 0;
+	frame->pool_buffer = NULL;
 }
 
-int stomp_frame_unmarshall(char *message, StompFrame *frame) {
+// Parses the len bytes of buffer->data in place
+int stomp_frame_unmarshall(StompFrameBuffer *buffer, size_t len) {
+	StompFrame *frame = &buffer->frame;
+	char *message = buffer->data;
+	message[len] = '\0';
+
 	// read command
 	char *cur_line = message;
 	char *next_line = stomp_read_line(cur_line);
 	frame->command = cur_line;
 
-	StompHeaders *headers = malloc(sizeof(StompHeaders));
-	headers->header_array = malloc(10*sizeof(StompHeader)); //TODO dynamic
-	headers->len = 0;
+	StompHeaders *headers = frame->system_headers;
 
 	// read headers until newline
 	while (next_line != NULL) {
@@ -180,30 +328,27 @@ int stomp_frame_unmarshall(char *message, StompFrame *frame) {
 		// Separate string in 2 with NULL char
 		*sep = 0;
 
-		StompHeader *header = &headers->header_array[headers->len];
+		StompHeader *header = stomp_frame_buffer_add_header(buffer);
+		if (header == NULL) return -1;
+
 		header->name = cur_line;
 		header->value = &sep[1];
-
-		headers->len++;
 	}
 
-	frame->system_headers = headers;
-
 	// read body
 	frame->body = next_line;
 
-	return 0;
-}
-
-int stomp_unmarshall_frame_free(StompFrame *frame) {
-	if (frame->system_headers != NULL) {
-		free(frame->system_headers->header_array);
-		free(frame->system_headers);
-	}
+	if (next_line != NULL) {
+		size_t available = &message[len] - next_line;
+		StompHeader *header_length = stomp_find_header(headers, "content-length");
 
-	if (frame->user_headers != NULL) {
-		free(frame->user_headers->header_array);
-		free(frame->user_headers);
+		if (header_length != NULL && strtoul(header_length->value, NULL, 10) <= available) {
+			// the body may hold NULL chars, content-length says where it ends
+			frame->body_length = strtoul(header_length->value, NULL, 10);
+			next_line[frame->body_length] = '\0';
+		} else {
+			frame->body_length = strlen(next_line);
+		}
 	}
 
 	return 0;
@@ -249,227 +394,1843 @@ int stomp_connect(StompInfo *stomp_info, StompHeaders *headers, stomp_callback c
 	return child_adapter->connect_function(child_adapter);
 }
 
-int stomp_unsubscribe(StompInfo *stomp_info, char *subscription_id) {
-	if (stomp_info->adapter.status != connected) return -1;
+static void stomp_release_acks(StompSubscription *subscription) {
+	for (int i = 0; i < subscription->acks_len; i++) {
+		stomp_frame_release(subscription->acks[i]);
+	}
+	subscription->acks_len = 0;
+	subscription->acks_count = 0;
+}
 
-	StompSubscription *subscription = stomp_find_subscription(stomp_info, subscription_id);
+static void stomp_subscription_free(StompSubscription *subscription) {
+	for (int i = 0; i < subscription->batch_len; i++) {
+		stomp_frame_release(subscription->batch[i]);
+	}
+	stomp_release_acks(subscription);
+	for (int i = 0; i < subscription->queue_len; i++) {
+		stomp_frame_release(subscription->queue[(subscription->queue_head + i) % subscription->queue_capacity]);
+	}
 
-	if (subscription == NULL) return -1;
+	free(subscription->batch);
+	free(subscription->acks);
+	free(subscription->queue);
+	free(subscription->conflation_slots);
 
-	if (subscription->previous == NULL) {
-		stomp_info->subscriptions = subscription->next;
-	}
-	if (subscription->next != NULL) {
-		subscription->next->previous = subscription->previous;
+	while (subscription->listeners != NULL) {
+		StompListener *listener = subscription->listeners;
+		subscription->listeners = listener->next;
+		free(listener);
 	}
+	free(subscription->destination);
+
+	if (subscription->router != NULL) stomp_router_destroy(subscription->router);
 
 	free(subscription);
+}
 
-	StompHeader system_headers_array[1];
-	system_headers_array[0].name = "id";
-	system_headers_array[0].value = subscription_id;
+static void stomp_pause(StompInfo *stomp_info, int paused) {
+	StompAdapter *child_adapter = stomp_info->adapter.child_adapter;
 
-	StompHeaders system_headers = {.len = 1 , .header_array = system_headers_array};
-	StompFrame frame;
-	stomp_empty_frame(&frame);
-	frame.command = "UNSUBSCRIBE";
-	frame.system_headers = &system_headers;
+	stomp_log_debug("stomp %s reading", paused ? "pause" : "resume");
 
-	return stomp_transmit(stomp_info, &frame);
+	if (child_adapter->pause_function != NULL) {
+		child_adapter->pause_function(child_adapter, paused);
+	}
 }
 
-char* stomp_subscribe(StompInfo *stomp_info, char *destination, stomp_callback message_callback, StompHeaders* headers) {
-	if (stomp_info->adapter.status != connected) return NULL;
+// Pauses the reads when the queue gets full and resumes them when every queue is half empty
+static void stomp_queue_update_pause(StompInfo *stomp_info, StompSubscription *subscription) {
+	int queue_size = subscription->options.queue_size;
+	int full = subscription->queue_full ? subscription->queue_len > queue_size / 2 : subscription->queue_len >= queue_size;
 
-	StompSubscription *subscription = malloc(sizeof(StompSubscription));
-	subscription->message_callback = message_callback;
+	if (full == subscription->queue_full) return;
 
-	StompHeader *header_id = stomp_find_header(headers, "id");
-	int num_headers = header_id ? 1 : 2;
+	subscription->queue_full = full;
+	stomp_info->full_queues += full ? 1 : -1;
 
-	StompHeader system_headers_array[num_headers];
-	system_headers_array[0].name = "destination";
-	system_headers_array[0].value = destination;
-	if (header_id) {
-		// The client has specicified a suscription id
-		strcpy(subscription->subscription_id, header_id->value);
-	} else {
-		// Autogenerate a suscription id
-		sprintf(subscription->subscription_id, "sub-%d", stomp_info->next_subscription_id++);
+	if (stomp_info->full_queues == (full ? 1 : 0)) {
+		stomp_pause(stomp_info, full);
+	}
+}
 
-		system_headers_array[1].name = "id";
-		system_headers_array[1].value = subscription->subscription_id;
+// FNV-1a
+static unsigned int stomp_conflation_hash(const char *key) {
+	unsigned int hash = 2166136261u;
+	for (; *key; key++) {
+		hash = (hash ^ (unsigned char)*key) * 16777619u;
 	}
 
-	StompHeaders system_headers = {.len = num_headers , .header_array = system_headers_array};
-	StompFrame frame = {.command = "SUBSCRIBE", .system_headers = &system_headers, .user_headers = headers, .body = NULL};
+	return hash;
+}
 
-	if (stomp_transmit(stomp_info, &frame)) {
-		free(subscription);
-		return NULL;
-	}
+static const char* stomp_conflation_key(StompSubscription *subscription, const StompFrame *frame) {
+	StompHeader *header = stomp_find_header(frame->system_headers, subscription->options.conflation_header);
 
-	subscription->next = stomp_info->subscriptions;
-	subscription->previous = NULL;
-	stomp_info->subscriptions = subscription;
-	if (subscription->next != NULL) subscription->next->previous = subscription;
+	return header != NULL ? header->value : NULL;
+}
 
-	return subscription->subscription_id;
+// The slot of key, or the empty slot where it would go
+static StompConflationSlot* stomp_conflation_find(StompSubscription *subscription, const char *key) {
+	unsigned int mask = subscription->conflation_mask;
+	unsigned int i = stomp_conflation_hash(key) & mask;
+
+	while (subscription->conflation_slots[i].key != NULL && strcmp(subscription->conflation_slots[i].key, key)) {
+		i = (i + 1) & mask;
+	}
+
+	return &subscription->conflation_slots[i];
 }
 
-int stomp_send(StompInfo *stomp_info, char *destination, StompHeaders* headers, char *message) {
-	if (stomp_info->adapter.status != connected) return -1;
+// Backward shift deletion, the following slots of the cluster move closer to their hash
+static void stomp_conflation_remove(StompSubscription *subscription, StompConflationSlot *slot) {
+	StompConflationSlot *slots = subscription->conflation_slots;
+	unsigned int mask = subscription->conflation_mask;
+	unsigned int i = slot - slots;
 
-	StompHeader system_headers_array[1];
-	system_headers_array[0].name = "destination";
-	system_headers_array[0].value = destination;
+	for (unsigned int j = (i + 1) & mask; slots[j].key != NULL; j = (j + 1) & mask) {
+		unsigned int home = stomp_conflation_hash(slots[j].key) & mask;
 
-	StompHeaders system_headers = {.len = 1 , .header_array = system_headers_array};
-	StompFrame frame = {.command = "SEND", .system_headers = &system_headers, .user_headers = headers, .body = message};
+		// slot j can move to i unless its home is between them
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			slots[i] = slots[j];
+			i = j;
+		}
+	}
 
-	return stomp_transmit(stomp_info, &frame);
+	slots[i].key = NULL;
 }
 
-int stomp_service(StompInfo *stomp_info, int timeout_ms) {
-	if (stomp_info->adapter.status != preconnected && stomp_info->adapter.status != connected) return -1;
+// Sized for the queue capacity, with the keys of the queued messages
+static int stomp_conflation_rebuild(StompSubscription *subscription) {
+	unsigned int size = 2;
+	while (size < 2 * subscription->queue_capacity) size *= 2;
 
-	StompAdapter *child_adapter = stomp_info->adapter.child_adapter;
+	StompConflationSlot *slots = calloc(size, sizeof(StompConflationSlot));
+	if (slots == NULL) return -1;
+
+	free(subscription->conflation_slots);
+	subscription->conflation_slots = slots;
+	subscription->conflation_mask = size - 1;
+
+	for (int i = 0; i < subscription->queue_len; i++) {
+		const char *key = stomp_conflation_key(subscription, subscription->queue[(subscription->queue_head + i) % subscription->queue_capacity]);
+		if (key == NULL) continue;
+
+		StompConflationSlot *slot = stomp_conflation_find(subscription, key);
+		slot->key = key;
+		slot->position = subscription->queue_popped + i;
+	}
 
-	return child_adapter->service_function(child_adapter, timeout_ms);
+	return 0;
 }
 
-int stomp_destroy_internal(StompInfo *stomp_info, int reconnect) {
-	if (stomp_info->adapter.status == destroyed) return -1;
+static long long stomp_now_ms(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	StompAdapter *adapter = &stomp_info->adapter;
-	StompAdapter *child_adapter = adapter->child_adapter;
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-	StompSubscription *subscription = stomp_info->subscriptions;
-	while (subscription != NULL) {
-		StompSubscription *next_subscription = subscription->next;
-		free(subscription);
-		subscription = next_subscription;
+// ACK or NACK for a received MESSAGE. 1.2 brokers identify it by the ack header, 1.0/1.1 by message-id
+static void stomp_ack_frame(StompFrame *ack_frame, StompHeaders *headers, StompHeader *header_array, char *command,
+		StompSubscription *subscription, const StompFrame *message) {
+	StompHeader *header_message_id = stomp_find_header(message->system_headers, "message-id");
+	StompHeader *header_ack = stomp_find_header(message->system_headers, "ack");
+
+	headers->len = 0;
+	headers->header_array = header_array;
+
+	header_array[headers->len].name = "subscription";
+	header_array[headers->len++].value = subscription->subscription_id;
+	if (header_message_id != NULL) {
+		header_array[headers->len].name = "message-id";
+		header_array[headers->len++].value = header_message_id->value;
+	}
+	if (header_ack != NULL) {
+		header_array[headers->len].name = "id";
+		header_array[headers->len++].value = header_ack->value;
 	}
 
-	stomp_info->subscriptions = NULL;
+	ack_frame->command = command;
+	ack_frame->system_headers = headers;
+	ack_frame->user_headers = NULL;
+	ack_frame->body = NULL;
+	ack_frame->body_length = 0;
+	ack_frame->pool_buffer = NULL;
+}
 
-	if (reconnect) {
-		child_adapter->restart_function(child_adapter);
+// Sends the pending ACKs of a subscription, STOMP_FRAMES_CHUNK per write
+static int stomp_flush_acks(StompInfo *stomp_info, StompSubscription *subscription) {
+	int count = subscription->acks_len;
+	if (count == 0) return 0;
 
-		stomp_info->adapter.status = initialized;
-	} else {
-		child_adapter->destroy_function(child_adapter);
-		free(adapter->custom_data);
+	StompFrame frames[STOMP_FRAMES_CHUNK];
+	StompHeaders headers[STOMP_FRAMES_CHUNK];
+	StompHeader header_array[STOMP_FRAMES_CHUNK][3];
 
-		if (stomp_info->connect_headers.len > 0) {
-			free(stomp_info->connect_headers.header_array);
+	int ret = 0;
+	for (int sent = 0; sent < count && ret == 0; sent += STOMP_FRAMES_CHUNK) {
+		int chunk = count - sent < STOMP_FRAMES_CHUNK ? count - sent : STOMP_FRAMES_CHUNK;
+
+		for (int i = 0; i < chunk; i++) {
+			stomp_ack_frame(&frames[i], &headers[i], header_array[i], "ACK", subscription, subscription->acks[sent + i]);
 		}
 
-		stomp_info->adapter.status = destroyed;
+		ret = stomp_transmit_frames(stomp_info, frames, chunk);
 	}
 
+	// the frames point to the retained messages
+	stomp_release_acks(subscription);
 
-	return 0;
+	return ret;
 }
 
-int stomp_destroy(StompInfo *stomp_info) {
-	return stomp_destroy_internal(stomp_info, 0);
+static void stomp_flush_expired_acks(StompInfo *stomp_info) {
+	long long now = -1;
+
+	for (StompSubscription *subscription = stomp_info->subscriptions; subscription != NULL; subscription = subscription->next) {
+		if (subscription->acks_len == 0 || subscription->options.ack_interval_ms <= 0) continue;
+
+		if (now < 0) now = stomp_now_ms();
+		if (now - subscription->acks_since_ms >= subscription->options.ack_interval_ms) {
+			stomp_flush_acks(stomp_info, subscription);
+		}
+	}
 }
 
-int stomp_reconnect(StompInfo *stomp_info) {
-	if (stomp_info->adapter.status == destroyed) return -1;
+static StompSubscription* stomp_find_frame_subscription(StompInfo *stomp_info, const StompFrame *frame) {
+	StompHeader *header_subscription = stomp_find_header(frame->system_headers, "subscription");
+	if (header_subscription == NULL) return NULL;
 
-	if (stomp_destroy_internal(stomp_info, 1) != 0) return -1;
+	StompSubscription *subscription = stomp_find_subscription(stomp_info, header_subscription->value);
+	if (subscription == NULL || subscription->options.ack_mode == STOMP_ACK_AUTO) return NULL;
 
-	return stomp_connect(stomp_info, &stomp_info->connect_headers, stomp_info->connect_callback, stomp_info->error_callback);
+	return subscription;
 }
 
-static int onopen_callback(StompAdapter *adapter) {
-	StompAdapterStompInfo *custom_info = get_adapter_custom_data(adapter);
-	StompInfo *stomp_info = custom_info->stomp_info;
+int stomp_ack(StompInfo *stomp_info, const StompFrame *frame) {
+	if (stomp_info->adapter.status != connected) return -1;
 
-	return stomp_send_connect(stomp_info);
-}
+	StompSubscription *subscription = stomp_find_frame_subscription(stomp_info, frame);
+	if (subscription == NULL) return -1;
 
-static int onerror_callback_internal(StompAdapter *adapter, StompFrame *frame) {
-	StompAdapterStompInfo *custom_info = get_adapter_custom_data(adapter);
-	StompInfo *stomp_info = custom_info->stomp_info;
+	StompFrame *retained = stomp_frame_retain(frame);
+	if (retained == NULL) return -1;
 
-	adapter->status = disconnected;
+	if (subscription->acks_len == 0) {
+		subscription->acks_since_ms = stomp_now_ms();
+	}
 
-	stomp_info->error_callback(stomp_info, frame);
+	if (subscription->options.ack_mode == STOMP_ACK_CLIENT) {
+		// cumulative, the last message acknowledges the previous ones
+		if (subscription->acks_len > 0) stomp_frame_release(subscription->acks[0]);
+		subscription->acks[0] = retained;
+		subscription->acks_len = 1;
+		subscription->acks_count++;
+	} else {
+		subscription->acks[subscription->acks_len++] = retained;
+		subscription->acks_count = subscription->acks_len;
+	}
+
+	if (subscription->acks_count >= subscription->options.ack_batch_size) {
+		return stomp_flush_acks(stomp_info, subscription);
+	}
 
 	return 0;
 }
 
-static int onerror_callback(StompAdapter *adapter, char *message) {
-	StompHeader header_array[1];
-	header_array[0].name = "message";
-	header_array[0].value = message;
+int stomp_nack(StompInfo *stomp_info, const StompFrame *frame) {
+	if (stomp_info->adapter.status != connected) return -1;
+
+	StompSubscription *subscription = stomp_find_frame_subscription(stomp_info, frame);
+	if (subscription == NULL) return -1;
 
+	if (stomp_flush_acks(stomp_info, subscription)) return -1;
+
+	StompFrame nack_frame;
 	StompHeaders headers;
-	headers.len = 1;
-	headers.header_array = header_array;
+	StompHeader header_array[3];
+	stomp_ack_frame(&nack_frame, &headers, header_array, "NACK", subscription, frame);
 
-	StompFrame frame;
-	stomp_empty_frame(&frame);
-	frame.command = "ERROR";
-	frame.system_headers = &headers;
+	return stomp_transmit(stomp_info, &nack_frame);
+}
 
-	return onerror_callback_internal(adapter, &frame);
+static long long stomp_epoch_ms(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
 }
 
-static int onclose_callback(StompAdapter *adapter, char *message) {
-	return onerror_callback(adapter, message);
+static int stomp_frame_expired(StompSubscription *subscription, const StompFrame *frame, long long now) {
+	if (subscription->options.max_age_ms <= 0) return 0;
+
+	StompHeader *header = stomp_find_header(frame->system_headers, subscription->options.timestamp_header);
+	if (header == NULL) return 0;
+
+	return now - atoll(header->value) > subscription->options.max_age_ms;
 }
 
+// A MESSAGE dropped before the application saw it is still in flight for the broker. With STOMP_ACK_CLIENT
+// the ACK of a later message covers it, one of its own would also acknowledge the queued ones
+static void stomp_ack_dropped(StompInfo *stomp_info, StompSubscription *subscription, StompFrame *frame) {
+	if (subscription->options.ack_mode == STOMP_ACK_CLIENT_INDIVIDUAL) stomp_ack(stomp_info, frame);
+}
 
-static int onmessage_callback(StompAdapter *adapter, char *message) {
-	StompAdapterStompInfo *custom_info = get_adapter_custom_data(adapter);
-	StompInfo *stomp_info = custom_info->stomp_info;
+// Once the application has the message a redelivery is a duplicate. Queued, dropped or NACKed ones are not recorded
+static void stomp_dedup_delivered(StompInfo *stomp_info, const StompFrame *frame) {
+	if (stomp_info->dedup == NULL) return;
 
-	stomp_debug_print("stomp receive '%s'\n", message);
+	StompHeader *header_key = stomp_find_header(frame->system_headers, stomp_info->dedup_header);
+	if (header_key != NULL) stomp_dedup_insert(stomp_info->dedup, header_key->value);
+}
 
-	StompFrame frame;
-	stomp_empty_frame(&frame);
+static int stomp_queue_push(StompInfo *stomp_info, StompSubscription *subscription, StompFrame *frame) {
+	if (stomp_frame_expired(subscription, frame, stomp_epoch_ms())) {
+		stomp_ack_dropped(stomp_info, subscription, frame);
+		return 0;
+	}
 
-	if (stomp_frame_unmarshall(message, &frame)) return -1;
+	const char *key = subscription->conflation_slots != NULL ? stomp_conflation_key(subscription, frame) : NULL;
 
-	char *command = frame.command;
-	int ret;
+	if (key != NULL) {
+		StompConflationSlot *slot = stomp_conflation_find(subscription, key);
 
-	if (!strcmp(command, "CONNECTED")) {
-		stomp_info->adapter.status = connected;
+		if (slot->key != NULL) {
+			// newer value, in place of the queued one
+			StompFrame *retained = stomp_frame_retain(frame);
+			if (retained == NULL) return -1;
 
-		stomp_info->connect_callback(stomp_info, &frame);
+			int index = (subscription->queue_head + (int)(slot->position - subscription->queue_popped)) % subscription->queue_capacity;
+			stomp_ack_dropped(stomp_info, subscription, subscription->queue[index]);
+			stomp_frame_release(subscription->queue[index]);
+			subscription->queue[index] = retained;
+			slot->key = key;
 
-		ret = 0;
-	} else if (!strcmp(command, "MESSAGE")) {
-		StompHeader *header_subscription = stomp_find_header(frame.system_headers, "subscription");
+			return 0;
+		}
+	}
 
-		StompSubscription *subscription = stomp_find_subscription(stomp_info, header_subscription->value);
-		if (subscription != NULL) {
-			subscription->message_callback(stomp_info, &frame);
-			ret = 0;
-		} else {
-			ret = -1;
+	if (subscription->queue_len == subscription->queue_capacity && subscription->queue_capacity >= 2 * subscription->options.queue_size) {
+		// the adapter kept delivering after its pause, the broker redelivers a NACKed one
+		stomp_log_warn("stomp subscription %s queue above %d, message dropped", subscription->subscription_id, subscription->queue_capacity);
+		if (subscription->options.ack_mode != STOMP_ACK_AUTO) return stomp_nack(stomp_info, frame);
+		return 0;
+	}
+
+	if (subscription->queue_len == subscription->queue_capacity) {
+		// frames the adapter had already read when it was paused, up to another queue_size
+		int queue_capacity = subscription->queue_capacity * 2;
+		StompFrame **queue = malloc(queue_capacity * sizeof(StompFrame *));
+		if (queue == NULL) return -1;
+
+		for (int i = 0; i < subscription->queue_len; i++) {
+			queue[i] = subscription->queue[(subscription->queue_head + i) % subscription->queue_capacity];
 		}
-	} else if (!strcmp(command, "RECEIPT")) {
-		ret = -1;
-	} else if (!strcmp(command, "ERROR")) {
-		onerror_callback_internal(adapter, &frame);
-		ret = 0;
-	} else {
-		fprintf(stderr, "Invalid command %s\n", command);
-		onerror_callback(adapter, "invalid stomp command");
-		ret = -1;
+
+		free(subscription->queue);
+		subscription->queue = queue;
+		subscription->queue_head = 0;
+		subscription->queue_capacity = queue_capacity;
+
+		stomp_log_warn("stomp subscription %s queue above %d", subscription->subscription_id, subscription->options.queue_size);
+
+		if (subscription->conflation_slots != NULL && stomp_conflation_rebuild(subscription)) return -1;
 	}
 
-	stomp_unmarshall_frame_free(&frame);
+	StompFrame *retained = stomp_frame_retain(frame);
+	if (retained == NULL) return -1;
 
-	return ret;
+	if (key != NULL) {
+		StompConflationSlot *slot = stomp_conflation_find(subscription, key);
+		slot->key = key;
+		slot->position = subscription->queue_popped + subscription->queue_len;
+	}
+
+	subscription->queue[(subscription->queue_head + subscription->queue_len++) % subscription->queue_capacity] = retained;
+
+	stomp_queue_update_pause(stomp_info, subscription);
+
+	return 0;
 }
 
+int stomp_poll(StompInfo *stomp_info, char *subscription_id, StompFrame **frames, int max) {
+	StompSubscription *subscription = stomp_find_subscription(stomp_info, subscription_id);
+	if (subscription == NULL || subscription->queue == NULL) return -1;
+
+	long long now = subscription->options.max_age_ms > 0 ? stomp_epoch_ms() : 0;
+
+	int count = 0;
+	while (count < max && subscription->queue_len > 0) {
+		StompFrame *frame = subscription->queue[subscription->queue_head];
+		subscription->queue_head = (subscription->queue_head + 1) % subscription->queue_capacity;
+		subscription->queue_len--;
+
+		const char *key = subscription->conflation_slots != NULL ? stomp_conflation_key(subscription, frame) : NULL;
+		if (key != NULL) {
+			stomp_conflation_remove(subscription, stomp_conflation_find(subscription, key));
+		}
+		subscription->queue_popped++;
+
+		// it may have waited in the queue too long
+		if (stomp_frame_expired(subscription, frame, now)) {
+			stomp_ack_dropped(stomp_info, subscription, frame);
+			stomp_frame_release(frame);
+		} else {
+			stomp_dedup_delivered(stomp_info, frame);
+			frames[count++] = frame;
+		}
+	}
+
+	stomp_queue_update_pause(stomp_info, subscription);
+
+	return count;
+}
+
+static void stomp_subscription_remove_pending(StompInfo *stomp_info, StompSubscription *subscription) {
+	StompSubscription **current = &stomp_info->pending_subscriptions;
+	while (*current != NULL) {
+		if (*current == subscription) {
+			*current = subscription->next_pending;
+			return;
+		}
+		current = &(*current)->next_pending;
+	}
+}
+
+static StompListener* stomp_add_listener(StompSubscription *subscription, char *listener_id, stomp_callback message_callback) {
+	StompListener *listener = malloc(sizeof(StompListener));
+	strcpy(listener->listener_id, listener_id);
+	listener->message_callback = message_callback;
+
+	// delivered in subscription order
+	StompListener **last = &subscription->listeners;
+	while (*last != NULL) last = &(*last)->next;
+	listener->next = NULL;
+	*last = listener;
+
+	return listener;
+}
+
+static void stomp_sweep_listeners(StompSubscription *subscription) {
+	StompListener **current = &subscription->listeners;
+	while (*current != NULL) {
+		StompListener *listener = *current;
+		if (listener->message_callback == NULL) {
+			*current = listener->next;
+			free(listener);
+		} else {
+			current = &listener->next;
+		}
+	}
+}
+
+static int stomp_has_listeners(StompSubscription *subscription) {
+	for (StompListener *listener = subscription->listeners; listener != NULL; listener = listener->next) {
+		if (listener->message_callback != NULL) return 1;
+	}
+
+	return 0;
+}
+
+// Removes a listener, returns 1 if it was the last one of its subscription, 0 if not and -1 if not found
+static int stomp_remove_listener(StompInfo *stomp_info, char *listener_id, StompSubscription **listener_subscription) {
+	for (StompSubscription *subscription = stomp_info->subscriptions; subscription != NULL; subscription = subscription->next) {
+		int found = 0, remaining = 0;
+
+		for (StompListener *listener = subscription->listeners; listener != NULL; listener = listener->next) {
+			if (listener->message_callback == NULL) continue;
+
+			if (!found && !strcmp(listener->listener_id, listener_id)) {
+				// freed by stomp_sweep_listeners, it may be in the middle of a delivery
+				listener->message_callback = NULL;
+				found = 1;
+			} else {
+				remaining++;
+			}
+		}
+
+		if (found) {
+			if (!subscription->delivering) stomp_sweep_listeners(subscription);
+
+			*listener_subscription = subscription;
+			return remaining == 0;
+		}
+	}
+
+	return -1;
+}
+
+int stomp_unsubscribe(StompInfo *stomp_info, char *subscription_id) {
+	if (stomp_info->adapter.status != connected) return -1;
+
+	StompSubscription *subscription = NULL;
+
+	int last_listener = stomp_remove_listener(stomp_info, subscription_id, &subscription);
+	if (last_listener == 0) return 0;
+	if (last_listener < 0) {
+		subscription = stomp_find_subscription(stomp_info, subscription_id);
+		// the id of a listener already removed, the other listeners still use the subscription
+		if (subscription != NULL && stomp_has_listeners(subscription)) return -1;
+	}
+
+	if (subscription == NULL) return -1;
+
+	// otherwise the broker would redeliver them
+	stomp_flush_acks(stomp_info, subscription);
+
+	if (subscription->previous == NULL) {
+		stomp_info->subscriptions = subscription->next;
+	} else {
+		subscription->previous->next = subscription->next;
+	}
+	if (subscription->next != NULL) {
+		subscription->next->previous = subscription->previous;
+	}
+
+	// subscription_id may point to the subscription memory
+	char id[sizeof(subscription->subscription_id)];
+	strcpy(id, subscription->subscription_id);
+
+	stomp_subscription_remove_pending(stomp_info, subscription);
+
+	if (subscription->queue_full && --stomp_info->full_queues == 0) {
+		stomp_pause(stomp_info, 0);
+	}
+
+	if (subscription->delivering) {
+		// unsubscribed from its own callback, freed once it returns
+		subscription->unsubscribed = 1;
+	} else {
+		stomp_subscription_free(subscription);
+	}
+
+	StompHeader system_headers_array[1];
+	system_headers_array[0].name = "id";
+	system_headers_array[0].value = id;
+
+	StompHeaders system_headers = {.len = 1 , .header_array = system_headers_array};
+	StompFrame frame;
+	stomp_empty_frame(&frame);
+	frame.command = "UNSUBSCRIBE";
+	frame.system_headers = &system_headers;
+
+	return stomp_transmit(stomp_info, &frame);
+}
+
+StompSubscriptionOptions stomp_subscription_default_options(void) {
+	StompSubscriptionOptions options;
+
+	options.batch_callback = NULL;
+	options.max_batch_size = 64;
+
+	options.ack_mode = STOMP_ACK_AUTO;
+	options.ack_batch_size = 1;
+	options.ack_interval_ms = 0;
+
+	options.prefetch = 0;
+	options.queue_size = 0;
+
+	options.conflation_header = NULL;
+	options.timestamp_header = "timestamp";
+	options.max_age_ms = 0;
+
+	options.shared = 0;
+
+	return options;
+}
+
+char* stomp_subscribe(StompInfo *stomp_info, char *destination, stomp_callback message_callback, StompHeaders* headers) {
+	return stomp_subscribe_with_options(stomp_info, destination, message_callback, headers, NULL);
+}
+
+char* stomp_subscribe_with_options(StompInfo *stomp_info, char *destination, stomp_callback message_callback,
+		StompHeaders* headers, const StompSubscriptionOptions *options) {
+	if (stomp_info->adapter.status != connected) return NULL;
+
+	int shared = options != NULL && options->shared;
+	if (shared && ((headers != NULL && headers->len > 0) || options->batch_callback != NULL || options->queue_size > 0)) return NULL;
+
+	if (shared) {
+		for (StompSubscription *subscription = stomp_info->subscriptions; subscription != NULL; subscription = subscription->next) {
+			if (subscription->destination == NULL || strcmp(subscription->destination, destination)) continue;
+
+			// no SUBSCRIBE, the broker already sends the messages
+			char listener_id[30];
+			sprintf(listener_id, "sub-%d", stomp_info->next_subscription_id++);
+
+			return stomp_add_listener(subscription, listener_id, message_callback)->listener_id;
+		}
+	}
+
+	StompSubscription *subscription = malloc(sizeof(StompSubscription));
+	subscription->message_callback = message_callback;
+	subscription->options = options ? *options : stomp_subscription_default_options();
+	subscription->batch = NULL;
+	subscription->batch_len = 0;
+	subscription->next_pending = NULL;
+	subscription->delivering = 0;
+	subscription->unsubscribed = 0;
+	subscription->acks = NULL;
+	subscription->acks_len = 0;
+	subscription->acks_count = 0;
+	subscription->queue = NULL;
+	subscription->queue_head = 0;
+	subscription->queue_len = 0;
+	subscription->queue_capacity = 0;
+	subscription->queue_full = 0;
+	subscription->queue_popped = 0;
+	subscription->conflation_slots = NULL;
+	subscription->conflation_mask = 0;
+	subscription->destination = NULL;
+	subscription->listeners = NULL;
+	subscription->router = NULL;
+
+	StompSubscriptionOptions *subscription_options = &subscription->options;
+
+	if ((subscription_options->batch_callback != NULL && subscription_options->max_batch_size <= 0)
+			|| subscription_options->ack_batch_size <= 0 || subscription_options->queue_size < 0 || subscription_options->prefetch < 0
+			|| (subscription_options->conflation_header != NULL && subscription_options->queue_size == 0)
+			|| (subscription_options->queue_size > 0 && stomp_info->adapter.child_adapter->pause_function == NULL)) {
+		free(subscription);
+		return NULL;
+	}
+
+	if (subscription_options->batch_callback != NULL) {
+		subscription->batch = malloc(subscription_options->max_batch_size * sizeof(StompFrame *));
+	}
+
+	if (subscription_options->ack_mode != STOMP_ACK_AUTO) {
+		int acks_size = subscription_options->ack_mode == STOMP_ACK_CLIENT ? 1 : subscription_options->ack_batch_size;
+		subscription->acks = malloc(acks_size * sizeof(StompFrame *));
+	}
+
+	if (subscription_options->queue_size > 0) {
+		subscription->queue_capacity = subscription_options->queue_size;
+		subscription->queue = malloc(subscription->queue_capacity * sizeof(StompFrame *));
+
+		if (subscription_options->conflation_header != NULL) stomp_conflation_rebuild(subscription);
+	}
+
+	StompHeader *header_id = stomp_find_header(headers, "id");
+	int num_headers = 1;
+
+	StompHeader system_headers_array[5];
+	system_headers_array[0].name = "destination";
+	system_headers_array[0].value = destination;
+	if (header_id) {
+		// The client has specicified a suscription id
+		strcpy(subscription->subscription_id, header_id->value);
+	} else {
+		// Autogenerate a suscription id
+		sprintf(subscription->subscription_id, "sub-%d", stomp_info->next_subscription_id++);
+
+		system_headers_array[num_headers].name = "id";
+		system_headers_array[num_headers++].value = subscription->subscription_id;
+	}
+
+	if (subscription_options->ack_mode != STOMP_ACK_AUTO && stomp_find_header(headers, "ack") == NULL) {
+		system_headers_array[num_headers].name = "ack";
+		system_headers_array[num_headers++].value = subscription_options->ack_mode == STOMP_ACK_CLIENT ? "client" : "client-individual";
+	}
+
+	// RabbitMQ and ActiveMQ names
+	char prefetch[16];
+	if (subscription_options->prefetch > 0) {
+		sprintf(prefetch, "%d", subscription_options->prefetch);
+
+		if (stomp_find_header(headers, "prefetch-count") == NULL) {
+			system_headers_array[num_headers].name = "prefetch-count";
+			system_headers_array[num_headers++].value = prefetch;
+		}
+		if (stomp_find_header(headers, "activemq.prefetchSize") == NULL) {
+			system_headers_array[num_headers].name = "activemq.prefetchSize";
+			system_headers_array[num_headers++].value = prefetch;
+		}
+	}
+
+	StompHeaders system_headers = {.len = num_headers , .header_array = system_headers_array};
+	StompFrame frame = {.command = "SUBSCRIBE", .system_headers = &system_headers, .user_headers = headers, .body = NULL};
+
+	if (stomp_transmit(stomp_info, &frame)) {
+		stomp_subscription_free(subscription);
+		return NULL;
+	}
+
+	subscription->next = stomp_info->subscriptions;
+	subscription->previous = NULL;
+	stomp_info->subscriptions = subscription;
+	if (subscription->next != NULL) subscription->next->previous = subscription;
+
+	if (shared) {
+		subscription->destination = strdup(destination);
+		return stomp_add_listener(subscription, subscription->subscription_id, message_callback)->listener_id;
+	}
+
+	return subscription->subscription_id;
+}
+
+static void stomp_flush_subscription(StompInfo *stomp_info, StompSubscription *subscription) {
+	subscription->delivering = 1;
+	subscription->options.batch_callback(stomp_info, subscription->batch, subscription->batch_len);
+	subscription->delivering = 0;
+
+	for (int i = 0; i < subscription->batch_len; i++) {
+		stomp_dedup_delivered(stomp_info, subscription->batch[i]);
+	}
+
+	if (subscription->unsubscribed) {
+		stomp_subscription_free(subscription);
+		return;
+	}
+
+	for (int i = 0; i < subscription->batch_len; i++) {
+		stomp_frame_release(subscription->batch[i]);
+	}
+	subscription->batch_len = 0;
+}
+
+// Delivers the batches collected during a stomp_service call
+static void stomp_flush_batches(StompInfo *stomp_info) {
+	while (stomp_info->pending_subscriptions != NULL) {
+		StompSubscription *subscription = stomp_info->pending_subscriptions;
+		stomp_info->pending_subscriptions = subscription->next_pending;
+		subscription->next_pending = NULL;
+
+		stomp_flush_subscription(stomp_info, subscription);
+	}
+}
+
+// Every listener gets the same parsed frame
+static void stomp_deliver_listeners(StompInfo *stomp_info, StompSubscription *subscription, StompFrame *frame) {
+	subscription->delivering = 1;
+	for (StompListener *listener = subscription->listeners; listener != NULL; listener = listener->next) {
+		if (listener->message_callback != NULL) listener->message_callback(stomp_info, frame);
+	}
+	subscription->delivering = 0;
+
+	if (subscription->unsubscribed) {
+		stomp_subscription_free(subscription);
+		return;
+	}
+
+	stomp_sweep_listeners(subscription);
+}
+
+// Returns 1 if a route took the frame
+static int stomp_deliver_routes(StompInfo *stomp_info, StompSubscription *subscription, StompFrame *frame) {
+	StompHeader *header_destination = stomp_find_header(frame->system_headers, "destination");
+	if (header_destination == NULL) return 0;
+
+	subscription->delivering = 1;
+	int matched = stomp_router_dispatch(subscription->router, stomp_info, header_destination->value, frame);
+	subscription->delivering = 0;
+
+	if (subscription->unsubscribed) {
+		stomp_subscription_free(subscription);
+		return 1;
+	}
+
+	return matched > 0;
+}
+
+static void stomp_deliver(StompInfo *stomp_info, StompSubscription *subscription, StompFrame *frame) {
+	if (subscription->router != NULL && stomp_deliver_routes(stomp_info, subscription, frame)) {
+		stomp_dedup_delivered(stomp_info, frame);
+		return;
+	}
+
+	if (subscription->listeners != NULL) {
+		stomp_deliver_listeners(stomp_info, subscription, frame);
+		stomp_dedup_delivered(stomp_info, frame);
+		return;
+	}
+
+	if (subscription->queue != NULL) {
+		stomp_queue_push(stomp_info, subscription, frame);
+		return;
+	}
+
+	if (subscription->options.batch_callback == NULL) {
+		// subscriptions with routes only
+		if (subscription->message_callback != NULL) {
+			subscription->message_callback(stomp_info, frame);
+			stomp_dedup_delivered(stomp_info, frame);
+		}
+		return;
+	}
+
+	if (subscription->batch_len == 0) {
+		subscription->next_pending = stomp_info->pending_subscriptions;
+		stomp_info->pending_subscriptions = subscription;
+	}
+
+	subscription->batch[subscription->batch_len++] = stomp_frame_retain(frame);
+
+	if (subscription->batch_len == subscription->options.max_batch_size) {
+		stomp_subscription_remove_pending(stomp_info, subscription);
+		stomp_flush_subscription(stomp_info, subscription);
+	}
+}
+
+int stomp_add_route(StompInfo *stomp_info, char *subscription_id, char *pattern, stomp_callback callback) {
+	StompSubscription *subscription = stomp_find_subscription(stomp_info, subscription_id);
+	if (subscription == NULL || callback == NULL) return -1;
+
+	if (subscription->router == NULL) subscription->router = stomp_router_create();
+
+	return stomp_router_add(subscription->router, pattern, callback);
+}
+
+int stomp_remove_route(StompInfo *stomp_info, char *subscription_id, char *pattern, stomp_callback callback) {
+	StompSubscription *subscription = stomp_find_subscription(stomp_info, subscription_id);
+	if (subscription == NULL || subscription->router == NULL) return -1;
+
+	return stomp_router_remove(subscription->router, pattern, callback);
+}
+
+static StompCodec* stomp_find_codec(StompInfo *stomp_info, char *name) {
+	for (int i = 0; i < stomp_info->codecs_len; i++) {
+		if (!strcmp(stomp_info->codecs[i]->name, name)) return stomp_info->codecs[i];
+	}
+
+	return NULL;
+}
+
+int stomp_add_codec(StompInfo *stomp_info, StompCodec *codec) {
+	if (stomp_info->codecs_len == STOMP_MAX_CODECS) return -1;
+	if (stomp_find_codec(stomp_info, codec->name) != NULL) return -1;
+
+	stomp_info->codecs[stomp_info->codecs_len++] = codec;
+
+	return 0;
+}
+
+int stomp_set_send_codec(StompInfo *stomp_info, char *name) {
+	if (name == NULL) {
+		stomp_info->send_codec = NULL;
+		return 0;
+	}
+
+	StompCodec *codec = stomp_find_codec(stomp_info, name);
+	if (codec == NULL) return -1;
+
+	stomp_info->send_codec = codec;
+
+	return 0;
+}
+
+void stomp_set_max_decompressed_size(StompInfo *stomp_info, size_t max_decompressed_size) {
+	stomp_info->max_decompressed_size = max_decompressed_size;
+}
+
+static size_t stomp_max_decompressed_size(StompInfo *stomp_info) {
+	if (stomp_info->max_decompressed_size != 0) return stomp_info->max_decompressed_size;
+
+	// adapters without a message limit do not bound the body either
+	size_t max_message_length = stomp_max_message_length(stomp_info);
+	return max_message_length == SIZE_MAX ? stomp_info->adapter.max_frame_length : max_message_length;
+}
+
+// Grows a codec buffer, the content is not preserved
+static char* stomp_codec_buffer(char **buffer, size_t *size, size_t required) {
+	if (*size < required) {
+		free(*buffer);
+		*buffer = malloc(required);
+		*size = *buffer ? required : 0;
+	}
+
+	return *buffer;
+}
+
+// Returns the compressed length, or -1 when the body is sent as is
+static ssize_t stomp_compress_body(StompInfo *stomp_info, char *body, size_t body_length) {
+	StompCodec *codec = stomp_info->send_codec;
+	if (codec == NULL || body_length < codec->min_size) return -1;
+
+	size_t bound = codec->bound_function(codec, body_length);
+	char *buffer = stomp_codec_buffer(&stomp_info->codec_tx_buffer, &stomp_info->codec_tx_size, bound);
+	if (buffer == NULL) return -1;
+
+	ssize_t compressed_len = codec->compress_function(codec, body, body_length, buffer, bound);
+
+	// not worth it
+	if (compressed_len < 0 || (size_t)compressed_len >= body_length) return -1;
+
+	return compressed_len;
+}
+
+// Replaces the body of the frame with the decompressed one and removes the content-encoding header
+static int stomp_decompress_body(StompInfo *stomp_info, StompFrameBuffer *frame_buffer) {
+	StompFrame *frame = &frame_buffer->frame;
+	StompHeader *header_encoding = stomp_find_header(frame->system_headers, "content-encoding");
+	if (header_encoding == NULL || frame->body == NULL) return 0;
+
+	StompCodec *codec = stomp_find_codec(stomp_info, header_encoding->value);
+	if (codec == NULL) {
+		stomp_log_warn("unknown content-encoding %s", header_encoding->value);
+		return 0;
+	}
+
+	size_t body_length = stomp_frame_body_length(frame);
+	ssize_t length = codec->decompressed_size_function(codec, frame->body, body_length);
+	if (length < 0) return -1;
+
+	// the size comes from the peer, do not let a small frame allocate an arbitrary amount of memory
+	size_t max_decompressed_size = stomp_max_decompressed_size(stomp_info);
+	if ((size_t)length > max_decompressed_size) {
+		stomp_log_error("%s body of %zd bytes exceeds max decompressed size %zu", codec->name, length, max_decompressed_size);
+		return -1;
+	}
+
+	char *buffer = stomp_frame_buffer_body(frame_buffer, length + 1);
+	if (buffer == NULL) return -1;
+
+	if (codec->decompress_function(codec, frame->body, body_length, buffer, length) != length) {
+		stomp_log_error("error decompressing %s body", codec->name);
+		return -1;
+	}
+	buffer[length] = '\0';
+
+	frame->body = buffer;
+	frame->body_length = length;
+
+	StompHeaders *headers = frame->system_headers;
+	StompHeader *header_length = stomp_find_header(headers, "content-length");
+	if (header_length != NULL) {
+		sprintf(frame_buffer->body_length_value, "%zd", length);
+		header_length->value = frame_buffer->body_length_value;
+	}
+
+	size_t index = header_encoding - headers->header_array;
+	memmove(header_encoding, &header_encoding[1], (headers->len - index - 1) * sizeof(StompHeader));
+	headers->len--;
+
+	return 0;
+}
+
+// Fills a SEND frame, with the body compressed by the send codec if there is one.
+// system_headers must have room for 3 headers. Returns 1 if the body is binary
+static int stomp_send_frame(StompInfo *stomp_info, StompFrame *frame, StompHeaders *system_headers,
+		char *destination, StompHeaders* headers, char *message, char *transaction_id) {
+	StompHeader *system_headers_array = system_headers->header_array;
+	system_headers_array[0].name = "destination";
+	system_headers_array[0].value = destination;
+	system_headers->len = 1;
+
+	if (transaction_id != NULL) {
+		system_headers_array[system_headers->len].name = "transaction";
+		system_headers_array[system_headers->len++].value = transaction_id;
+	}
+
+	stomp_empty_frame(frame);
+	frame->command = "SEND";
+	frame->system_headers = system_headers;
+	frame->user_headers = headers;
+	frame->body = message;
+
+	if (stomp_info->send_codec != NULL && message != NULL && stomp_info->adapter.child_adapter->sendv_function != NULL) {
+		ssize_t compressed_len = stomp_compress_body(stomp_info, message, strlen(message));
+
+		if (compressed_len >= 0) {
+			system_headers_array[system_headers->len].name = "content-encoding";
+			system_headers_array[system_headers->len++].value = stomp_info->send_codec->name;
+
+			frame->body = stomp_info->codec_tx_buffer;
+			frame->body_length = compressed_len;
+
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int stomp_spool_send(void *user_data, struct iovec *frames, int count) {
+	StompInfo *stomp_info = (StompInfo *)user_data;
+
+	return stomp_send_packed_frames(stomp_info->adapter.child_adapter, frames, count);
+}
+
+// Writes the frame to the spool with a receipt and sends it when connected
+static int stomp_spool_frame(StompInfo *stomp_info, StompFrame *frame) {
+	int max_frame_length = stomp_info->adapter.max_frame_length;
+
+	unsigned long long sequence;
+	char *buffer = stomp_spool_reserve(stomp_info->spool, max_frame_length, &sequence);
+	if (buffer == NULL) return -1;
+
+	char receipt_id[32];
+	sprintf(receipt_id, "spool-%llu", sequence);
+
+	StompHeaders *system_headers = frame->system_headers;
+	system_headers->header_array[system_headers->len].name = "receipt";
+	system_headers->header_array[system_headers->len++].value = receipt_id;
+
+	int len = stomp_frame_marshall(frame, buffer, max_frame_length);
+	if (len < 0) {
+		stomp_log_error("frame %s exceeds max_frame_length %d", frame->command, max_frame_length);
+		return -1;
+	}
+
+	struct iovec spooled;
+	stomp_spool_commit(stomp_info->spool, len + 1, &spooled);
+
+	if (stomp_info->adapter.status != connected) return 0;
+
+	// the frame is safe in the spool even if this fails
+	stomp_spool_send_last(stomp_info->spool, &spooled, stomp_spool_send, stomp_info);
+
+	return 0;
+}
+
+int stomp_send(StompInfo *stomp_info, char *destination, StompHeaders* headers, char *message) {
+	if (stomp_info->adapter.status != connected && (stomp_info->spool == NULL || stomp_info->adapter.status == destroyed)) return -1;
+
+	StompHeader system_headers_array[4];
+	StompHeaders system_headers = {.len = 0 , .header_array = system_headers_array};
+	StompFrame frame;
+
+	int binary = stomp_send_frame(stomp_info, &frame, &system_headers, destination, headers, message, NULL);
+
+	if (stomp_info->spool != NULL) return stomp_spool_frame(stomp_info, &frame);
+
+	// large bodies are gathered instead of copied, and may exceed max_frame_length if the adapter fragments them
+	int max_frame_length = stomp_info->adapter.max_frame_length;
+	if (binary || (stomp_max_message_length(stomp_info) > max_frame_length && stomp_frame_body_length(&frame) > max_frame_length / 2)) {
+		return stomp_transmit_binary(stomp_info, &frame);
+	}
+
+	return stomp_transmit(stomp_info, &frame);
+}
+
+// Writes the segments of a frame to the spool, sends it if connected
+static int stomp_spool_segments(StompInfo *stomp_info, const struct iovec *iov, int iovcnt, size_t len) {
+	unsigned long long sequence;
+	char *buffer = stomp_spool_reserve(stomp_info->spool, len, &sequence);
+	if (buffer == NULL) return -1;
+
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(buffer, iov[i].iov_base, iov[i].iov_len);
+		buffer += iov[i].iov_len;
+	}
+
+	struct iovec spooled;
+	stomp_spool_commit(stomp_info->spool, len, &spooled);
+
+	if (stomp_info->adapter.status != connected) return 0;
+
+	stomp_spool_send_last(stomp_info->spool, &spooled, stomp_spool_send, stomp_info);
+
+	return 0;
+}
+
+// Segments of a frame held by a sendv_async_function adapter: the iovecs, then prefix and head copied after them
+typedef struct {
+	stomp_release_function release; // of the body
+	void *release_data;
+	struct iovec iov[];
+} StompAsyncSend;
+
+static void stomp_async_send_release(void *release_data) {
+	StompAsyncSend *async_send = (StompAsyncSend *)release_data;
+
+	async_send->release(async_send->release_data);
+	free(async_send);
+}
+
+// Hands the frame to the adapter keeping the body segments in place. Only the prefix and head, the
+// first 2 segments, are copied
+static int stomp_send_async(StompAdapter *child_adapter, const struct iovec *iov, int iovcnt,
+		stomp_release_function release, void *release_data) {
+	size_t head_len = iov[0].iov_len + iov[1].iov_len;
+	StompAsyncSend *async_send = malloc(sizeof(StompAsyncSend) + iovcnt * sizeof(struct iovec) + head_len);
+	if (async_send == NULL) {
+		release(release_data);
+		return -1;
+	}
+
+	async_send->release = release;
+	async_send->release_data = release_data;
+	memcpy(async_send->iov, iov, iovcnt * sizeof(struct iovec));
+
+	char *head = (char *)&async_send->iov[iovcnt];
+	async_send->iov[0].iov_base = memcpy(head, iov[0].iov_base, iov[0].iov_len);
+	async_send->iov[1].iov_base = memcpy(&head[iov[0].iov_len], iov[1].iov_base, iov[1].iov_len);
+
+	return child_adapter->sendv_async_function(child_adapter, async_send->iov, iovcnt, stomp_async_send_release, async_send);
+}
+
+// Sends a frame whose command and constant headers are already marshalled in prefix. The per message
+// headers, content-length and the body segments are added without copying the body when the adapter has sendv.
+// release, if not NULL, is called once the body is not needed anymore, which may be after returning
+static int stomp_send_segments(StompInfo *stomp_info, const char *prefix, size_t prefix_len, StompHeaders *headers,
+		const struct iovec *body, int body_count, stomp_release_function release, void *release_data) {
+	StompAdapter *child_adapter = stomp_info->adapter.child_adapter;
+	int max_frame_length = stomp_info->adapter.max_frame_length;
+
+	size_t body_length = 0;
+	for (int i = 0; i < body_count; i++) {
+		body_length += body[i].iov_len;
+	}
+
+	char head[max_frame_length];
+	int skipContentLength = 0;
+	int pos = stomp_frame_header_marshall(headers, head, 0, max_frame_length, &skipContentLength);
+
+	struct iovec compressed;
+	char *gathered = NULL;
+	if (stomp_info->send_codec != NULL && child_adapter->sendv_function != NULL && body_length > 0) {
+		char *source = body[0].iov_base;
+		if (body_count > 1) {
+			gathered = source = malloc(body_length);
+			if (gathered == NULL) {
+				stomp_log_warn("no memory to compress a body of %zu bytes, sent uncompressed", body_length);
+			} else {
+				for (size_t i = 0, offset = 0; i < body_count; offset += body[i].iov_len, i++) {
+					memcpy(&gathered[offset], body[i].iov_base, body[i].iov_len);
+				}
+			}
+		}
+
+		ssize_t compressed_len = source != NULL ? stomp_compress_body(stomp_info, source, body_length) : -1;
+		free(gathered);
+
+		if (compressed_len >= 0) {
+			pos = stomp_marshall_append(head, pos, max_frame_length, "content-encoding:", 17);
+			pos = stomp_marshall_append(head, pos, max_frame_length, stomp_info->send_codec->name, strlen(stomp_info->send_codec->name));
+			pos = stomp_marshall_append(head, pos, max_frame_length, "\n", 1);
+
+			compressed.iov_base = stomp_info->codec_tx_buffer;
+			compressed.iov_len = compressed_len;
+			body = &compressed;
+			body_count = 1;
+			body_length = compressed_len;
+		}
+	}
+
+	char temp[64];
+	int temp_len;
+	if (stomp_info->spool != NULL) {
+		temp_len = sprintf(temp, "receipt:spool-%llu\n", stomp_spool_next_sequence(stomp_info->spool));
+		pos = stomp_marshall_append(head, pos, max_frame_length, temp, temp_len);
+	}
+	if (!skipContentLength) {
+		temp_len = sprintf(temp, "content-length:%zu\n", body_length);
+		pos = stomp_marshall_append(head, pos, max_frame_length, temp, temp_len);
+	}
+	pos = stomp_marshall_append(head, pos, max_frame_length, "\n", 1);
+
+	// the spool keeps whole frames of up to max_frame_length
+	size_t frame_length = prefix_len + pos + body_length + 1;
+	size_t max_length = stomp_info->spool != NULL ? max_frame_length : stomp_max_message_length(stomp_info);
+	if (pos < 0 || frame_length > max_length) {
+		stomp_log_error("frame SEND exceeds max_frame_length %d", max_frame_length);
+		if (release != NULL) release(release_data);
+		return -1;
+	}
+
+	int iovcnt = 0;
+	struct iovec iov[body_count + 3];
+	iov[iovcnt].iov_base = (char *)prefix;
+	iov[iovcnt++].iov_len = prefix_len;
+	iov[iovcnt].iov_base = head;
+	iov[iovcnt++].iov_len = pos;
+	for (int i = 0; i < body_count; i++) {
+		iov[iovcnt++] = body[i];
+	}
+	iov[iovcnt].iov_base = "\0";
+	iov[iovcnt++].iov_len = 1;
+
+	stomp_log_payload(STOMP_LOG_DEBUG, "stomp sending", prefix, prefix_len);
+
+	// a compressed body is in codec_tx_buffer, that is reused by the next send
+	if (release != NULL && stomp_info->spool == NULL && child_adapter->sendv_async_function != NULL && body != &compressed) {
+		return stomp_send_async(child_adapter, iov, iovcnt, release, release_data);
+	}
+
+	int ret;
+	if (stomp_info->spool != NULL) {
+		ret = stomp_spool_segments(stomp_info, iov, iovcnt, frame_length);
+	} else if (child_adapter->sendv_function != NULL) {
+		ret = child_adapter->sendv_function(child_adapter, iov, iovcnt);
+	} else {
+		// text only adapters get one string
+		char message[frame_length];
+		for (int i = 0, offset = 0; i < iovcnt; offset += iov[i].iov_len, i++) {
+			memcpy(&message[offset], iov[i].iov_base, iov[i].iov_len);
+		}
+
+		ret = child_adapter->send_function(child_adapter, message);
+	}
+
+	if (release != NULL) release(release_data);
+
+	return ret;
+}
+
+StompPreparedSend* stomp_prepare_send(StompInfo *stomp_info, char *destination, StompHeaders *headers) {
+	int max_frame_length = stomp_info->adapter.max_frame_length;
+
+	StompPreparedSend *prepared = malloc(sizeof(StompPreparedSend));
+	if (prepared == NULL) return NULL;
+
+	char *buffer = malloc(max_frame_length);
+	if (buffer == NULL) {
+		free(prepared);
+		return NULL;
+	}
+
+	StompHeader system_headers_array[1];
+	system_headers_array[0].name = "destination";
+	system_headers_array[0].value = destination;
+	StompHeaders system_headers = {.len = 1 , .header_array = system_headers_array};
+
+	int skipContentLength = 0;
+	int pos = stomp_marshall_append(buffer, 0, max_frame_length, "SEND\n", 5);
+	pos = stomp_frame_header_marshall(&system_headers, buffer, pos, max_frame_length, &skipContentLength);
+	pos = stomp_frame_header_marshall(headers, buffer, pos, max_frame_length, &skipContentLength);
+	if (pos < 0 || skipContentLength) {
+		free(buffer);
+		free(prepared);
+		return NULL;
+	}
+
+	// the marshalled prefix is kept, usually much smaller than a frame
+	char *prefix = realloc(buffer, pos);
+
+	prepared->stomp_info = stomp_info;
+	prepared->prefix = prefix != NULL ? prefix : buffer;
+	prepared->prefix_len = pos;
+
+	return prepared;
+}
+
+int stomp_send_prepared(StompPreparedSend *prepared, StompHeaders *headers, char *message) {
+	StompInfo *stomp_info = prepared->stomp_info;
+	if (stomp_info->adapter.status != connected && (stomp_info->spool == NULL || stomp_info->adapter.status == destroyed)) return -1;
+
+	struct iovec body = {.iov_base = message, .iov_len = message ? strlen(message) : 0};
+
+	return stomp_send_segments(stomp_info, prepared->prefix, prepared->prefix_len, headers, &body, message ? 1 : 0, NULL, NULL);
+}
+
+int stomp_send_preparedv(StompPreparedSend *prepared, StompHeaders *headers, const struct iovec *body, int body_count) {
+	StompInfo *stomp_info = prepared->stomp_info;
+	if (stomp_info->adapter.status != connected && (stomp_info->spool == NULL || stomp_info->adapter.status == destroyed)) return -1;
+
+	return stomp_send_segments(stomp_info, prepared->prefix, prepared->prefix_len, headers, body, body_count, NULL, NULL);
+}
+
+int stomp_sendv(StompInfo *stomp_info, char *destination, StompHeaders* headers, const struct iovec *body, int body_count) {
+	if (stomp_info->adapter.status != connected && (stomp_info->spool == NULL || stomp_info->adapter.status == destroyed)) return -1;
+
+	size_t destination_len = strlen(destination);
+	char prefix[destination_len + 20];
+	int prefix_len = sprintf(prefix, "SEND\ndestination:%s\n", destination);
+
+	return stomp_send_segments(stomp_info, prefix, prefix_len, headers, body, body_count, NULL, NULL);
+}
+
+// Region of a file mapped by stomp_send_fd
+typedef struct {
+	void *address;
+	size_t length;
+} StompFileMapping;
+
+static void stomp_file_mapping_release(void *release_data) {
+	StompFileMapping *mapping = (StompFileMapping *)release_data;
+
+	munmap(mapping->address, mapping->length);
+	free(mapping);
+}
+
+int stomp_send_fd(StompInfo *stomp_info, char *destination, StompHeaders* headers, int fd, off_t offset, size_t length) {
+	if (stomp_info->adapter.status != connected && (stomp_info->spool == NULL || stomp_info->adapter.status == destroyed)) return -1;
+
+	if (length == 0) return stomp_sendv(stomp_info, destination, headers, NULL, 0);
+
+	// the pages past the end of the file map, but reading them raises SIGBUS
+	struct stat st;
+	if (fstat(fd, &st) || offset < 0 || (size_t)offset > (size_t)st.st_size || length > (size_t)st.st_size - offset) {
+		stomp_log_error("%zu bytes at %lld are past the end of fd %d", length, (long long)offset, fd);
+		return -1;
+	}
+
+	// mmap offsets are page aligned
+	off_t start = offset - offset % sysconf(_SC_PAGESIZE);
+
+	StompFileMapping *mapping = malloc(sizeof(StompFileMapping));
+	if (mapping == NULL) return -1;
+
+	mapping->length = length + (offset - start);
+	mapping->address = mmap(NULL, mapping->length, PROT_READ, MAP_SHARED, fd, start);
+	if (mapping->address == MAP_FAILED) {
+		stomp_log_error("error mapping %zu bytes of fd %d", length, fd);
+		free(mapping);
+		return -1;
+	}
+	madvise(mapping->address, mapping->length, MADV_SEQUENTIAL);
+
+	struct iovec body;
+	body.iov_base = (char *)mapping->address + (offset - start);
+	body.iov_len = length;
+
+	size_t destination_len = strlen(destination);
+	char prefix[destination_len + 20];
+	int prefix_len = sprintf(prefix, "SEND\ndestination:%s\n", destination);
+
+	return stomp_send_segments(stomp_info, prefix, prefix_len, headers, &body, 1, stomp_file_mapping_release, mapping);
+}
+
+void stomp_prepared_send_free(StompPreparedSend *prepared) {
+	free(prepared->prefix);
+	free(prepared);
+}
+
+// Marshalls a frame at the end of the transaction buffer
+static int stomp_transaction_append(StompTransaction *transaction, StompFrame *frame) {
+	int max_frame_length = transaction->stomp_info->adapter.max_frame_length;
+
+	if (transaction->buffer_size - transaction->buffer_len < max_frame_length) {
+		size_t buffer_size = transaction->buffer_size * 2;
+		if (buffer_size < transaction->buffer_len + max_frame_length) buffer_size = transaction->buffer_len + max_frame_length;
+
+		char *buffer = realloc(transaction->buffer, buffer_size);
+		if (buffer == NULL) return -1;
+
+		transaction->buffer = buffer;
+		transaction->buffer_size = buffer_size;
+	}
+
+	if (transaction->frames_len == transaction->frames_size) {
+		int frames_size = transaction->frames_size ? transaction->frames_size * 2 : 8;
+
+		size_t *frame_offsets = realloc(transaction->frame_offsets, frames_size * sizeof(size_t));
+		if (frame_offsets == NULL) return -1;
+
+		transaction->frame_offsets = frame_offsets;
+		transaction->frames_size = frames_size;
+	}
+
+	char *buffer = &transaction->buffer[transaction->buffer_len];
+	int len = stomp_frame_marshall(frame, buffer, max_frame_length);
+	if (len < 0) {
+		stomp_log_error("frame %s exceeds max_frame_length %d", frame->command, max_frame_length);
+		return -1;
+	}
+
+	transaction->frame_offsets[transaction->frames_len++] = transaction->buffer_len;
+	transaction->buffer_len += len + 1; // with the NULL char
+
+	return 0;
+}
+
+// BEGIN or COMMIT
+static int stomp_transaction_append_command(StompTransaction *transaction, char *command, char *receipt_id) {
+	StompHeader header_array[2];
+	StompHeaders headers = {.len = 1, .header_array = header_array};
+	header_array[0].name = "transaction";
+	header_array[0].value = transaction->transaction_id;
+
+	if (receipt_id != NULL) {
+		header_array[headers.len].name = "receipt";
+		header_array[headers.len++].value = receipt_id;
+	}
+
+	StompFrame frame;
+	stomp_empty_frame(&frame);
+	frame.command = command;
+	frame.system_headers = &headers;
+
+	return stomp_transaction_append(transaction, &frame);
+}
+
+static void stomp_transaction_free(StompTransaction *transaction) {
+	free(transaction->buffer);
+	free(transaction->frame_offsets);
+	free(transaction);
+}
+
+StompTransaction* stomp_begin(StompInfo *stomp_info) {
+	if (stomp_info->adapter.status != connected) return NULL;
+
+	StompTransaction *transaction = malloc(sizeof(StompTransaction));
+	transaction->stomp_info = stomp_info;
+	sprintf(transaction->transaction_id, "tx-%d", stomp_info->next_transaction_id++);
+	transaction->buffer = NULL;
+	transaction->buffer_len = 0;
+	transaction->buffer_size = 0;
+	transaction->frame_offsets = NULL;
+	transaction->frames_len = 0;
+	transaction->frames_size = 0;
+
+	if (stomp_transaction_append_command(transaction, "BEGIN", NULL)) {
+		stomp_transaction_free(transaction);
+		return NULL;
+	}
+
+	return transaction;
+}
+
+int stomp_transaction_send(StompTransaction *transaction, char *destination, StompHeaders* headers, char *message) {
+	StompInfo *stomp_info = transaction->stomp_info;
+
+	StompHeader system_headers_array[3];
+	StompHeaders system_headers = {.len = 0 , .header_array = system_headers_array};
+	StompFrame frame;
+
+	// the buffer keeps the body length, compressed bodies can be appended too
+	stomp_send_frame(stomp_info, &frame, &system_headers, destination, headers, message, transaction->transaction_id);
+
+	return stomp_transaction_append(transaction, &frame);
+}
+
+static StompReceipt* stomp_add_receipt(StompInfo *stomp_info, stomp_callback callback) {
+	StompReceipt *receipt = malloc(sizeof(StompReceipt));
+	sprintf(receipt->receipt_id, "receipt-%d", stomp_info->next_receipt_id++);
+	receipt->callback = callback;
+	receipt->next = stomp_info->receipts;
+	stomp_info->receipts = receipt;
+
+	return receipt;
+}
+
+static void stomp_remove_receipt(StompInfo *stomp_info, StompReceipt *receipt) {
+	StompReceipt **current = &stomp_info->receipts;
+	while (*current != NULL) {
+		if (*current == receipt) {
+			*current = receipt->next;
+			free(receipt);
+			return;
+		}
+		current = &(*current)->next;
+	}
+}
+
+static void stomp_free_receipts(StompInfo *stomp_info) {
+	while (stomp_info->receipts != NULL) {
+		stomp_remove_receipt(stomp_info, stomp_info->receipts);
+	}
+}
+
+int stomp_commit(StompTransaction *transaction, stomp_callback receipt_callback) {
+	StompInfo *stomp_info = transaction->stomp_info;
+
+	if (stomp_info->adapter.status != connected) {
+		stomp_transaction_free(transaction);
+		return -1;
+	}
+
+	StompReceipt *receipt = receipt_callback != NULL ? stomp_add_receipt(stomp_info, receipt_callback) : NULL;
+
+	if (stomp_transaction_append_command(transaction, "COMMIT", receipt ? receipt->receipt_id : NULL)) {
+		if (receipt != NULL) stomp_remove_receipt(stomp_info, receipt);
+		stomp_transaction_free(transaction);
+		return -1;
+	}
+
+	int count = transaction->frames_len;
+	stomp_log_debug("stomp commit %s, %d frames %zu bytes", transaction->transaction_id, count, transaction->buffer_len);
+
+	// a transaction has no frame limit, it is written STOMP_FRAMES_CHUNK frames at a time
+	int ret = 0;
+	struct iovec iov[STOMP_FRAMES_CHUNK];
+	for (int sent = 0; sent < count && ret == 0; sent += STOMP_FRAMES_CHUNK) {
+		int chunk = count - sent < STOMP_FRAMES_CHUNK ? count - sent : STOMP_FRAMES_CHUNK;
+
+		for (int i = 0; i < chunk; i++) {
+			int frame = sent + i;
+			size_t end = frame + 1 < count ? transaction->frame_offsets[frame + 1] : transaction->buffer_len;
+
+			iov[i].iov_base = &transaction->buffer[transaction->frame_offsets[frame]];
+			iov[i].iov_len = end - transaction->frame_offsets[frame];
+		}
+
+		ret = stomp_send_packed_frames(stomp_info->adapter.child_adapter, iov, chunk);
+	}
+	if (ret && receipt != NULL) stomp_remove_receipt(stomp_info, receipt);
+
+	stomp_transaction_free(transaction);
+
+	return ret;
+}
+
+int stomp_abort(StompTransaction *transaction) {
+	stomp_transaction_free(transaction);
+
+	return 0;
+}
+
+StompSpoolOptions stomp_spool_default_options(char *directory) {
+	StompSpoolOptions options;
+
+	options.directory = directory;
+	options.segment_size = 4 * 1024 * 1024;
+	options.max_segments = 16;
+
+	return options;
+}
+
+int stomp_enable_spool(StompInfo *stomp_info, const StompSpoolOptions *options) {
+	if (stomp_info->spool != NULL) return -1;
+
+	stomp_info->spool = stomp_spool_open(options, stomp_info->adapter.max_frame_length);
+	if (stomp_info->spool == NULL) return -1;
+
+	// frames recovered from a previous run
+	if (stomp_info->adapter.status == connected) {
+		stomp_spool_replay(stomp_info->spool, stomp_spool_send, stomp_info);
+	}
+
+	return 0;
+}
+
+int stomp_spool_stats(StompInfo *stomp_info, StompSpoolStats *stats) {
+	if (stomp_info->spool == NULL) return -1;
+
+	stomp_spool_get_stats(stomp_info->spool, stats);
+
+	return 0;
+}
+
+StompDedupOptions stomp_dedup_default_options(void) {
+	StompDedupOptions options;
+
+	options.header = "message-id";
+	options.capacity = 65536;
+	options.exact_size = 1024;
+
+	return options;
+}
+
+int stomp_enable_dedup(StompInfo *stomp_info, const StompDedupOptions *options) {
+	StompDedupOptions dedup_options = options ? *options : stomp_dedup_default_options();
+	if (dedup_options.header == NULL) return -1;
+
+	StompDedup *dedup = stomp_dedup_create(dedup_options.capacity, dedup_options.exact_size);
+	if (dedup == NULL) return -1;
+
+	if (stomp_info->dedup != NULL) {
+		stomp_dedup_destroy(stomp_info->dedup);
+		free(stomp_info->dedup_header);
+	}
+
+	stomp_info->dedup = dedup;
+	stomp_info->dedup_header = strdup(dedup_options.header);
+
+	return 0;
+}
+
+int stomp_dedup_stats(StompInfo *stomp_info, StompDedupStats *stats) {
+	if (stomp_info->dedup == NULL) return -1;
+
+	stomp_dedup_get_stats(stomp_info->dedup, stats);
+
+	return 0;
+}
+
+// A redelivered message is acknowledged again instead of delivered. With STOMP_ACK_CLIENT the ACK would
+// also cover the messages not delivered yet, the one of a later message covers it instead
+static int stomp_duplicate(StompInfo *stomp_info, StompSubscription *subscription, const StompFrame *frame) {
+	if (stomp_info->dedup == NULL) return 0;
+
+	StompHeader *header_key = stomp_find_header(frame->system_headers, stomp_info->dedup_header);
+	if (header_key == NULL || !stomp_dedup_contains(stomp_info->dedup, header_key->value)) return 0;
+
+	stomp_log_debug("stomp duplicate %s %s dropped", stomp_info->dedup_header, header_key->value);
+
+	if (subscription->options.ack_mode == STOMP_ACK_CLIENT_INDIVIDUAL) stomp_ack(stomp_info, frame);
+
+	return 1;
+}
+
+int stomp_service(StompInfo *stomp_info, int timeout_ms) {
+	if (stomp_info->adapter.status != preconnected && stomp_info->adapter.status != connected) return -1;
+
+	StompAdapter *child_adapter = stomp_info->adapter.child_adapter;
+
+	int ret = child_adapter->service_function(child_adapter, timeout_ms);
+
+	stomp_flush_batches(stomp_info);
+	stomp_flush_expired_acks(stomp_info);
+
+	return ret;
+}
+
+int stomp_destroy_internal(StompInfo *stomp_info, int reconnect) {
+	if (stomp_info->adapter.status == destroyed) return -1;
+
+	StompAdapter *adapter = &stomp_info->adapter;
+	StompAdapter *child_adapter = adapter->child_adapter;
+
+	StompSubscription *subscription = stomp_info->subscriptions;
+	while (subscription != NULL) {
+		StompSubscription *next_subscription = subscription->next;
+		stomp_subscription_free(subscription);
+		subscription = next_subscription;
+	}
+
+	stomp_info->subscriptions = NULL;
+	stomp_info->pending_subscriptions = NULL;
+	stomp_info->full_queues = 0;
+
+	// they will not arrive on a new connection
+	stomp_free_receipts(stomp_info);
+
+	// a message the child adapter did not finish
+	StompAdapterStompInfo *custom_info = get_adapter_custom_data(adapter);
+	if (custom_info->acquired != NULL) {
+		stomp_frame_release(&custom_info->acquired->frame);
+		custom_info->acquired = NULL;
+	}
+
+	if (reconnect) {
+		child_adapter->restart_function(child_adapter);
+
+		stomp_info->adapter.status = initialized;
+	} else {
+		child_adapter->destroy_function(child_adapter);
+		free(adapter->custom_data);
+
+		free(stomp_info->codec_tx_buffer);
+
+		stomp_frame_pool_destroy(stomp_info->frame_pool);
+
+		if (stomp_info->dedup != NULL) {
+			stomp_dedup_destroy(stomp_info->dedup);
+			free(stomp_info->dedup_header);
+		}
+
+		// the files stay for the next run
+		if (stomp_info->spool != NULL) stomp_spool_close(stomp_info->spool);
+
+		if (stomp_info->connect_headers.len > 0) {
+			free(stomp_info->connect_headers.header_array);
+		}
+
+		stomp_info->adapter.status = destroyed;
+	}
+
+
+	return 0;
+}
+
+int stomp_destroy(StompInfo *stomp_info) {
+	return stomp_destroy_internal(stomp_info, 0);
+}
+
+int stomp_reconnect(StompInfo *stomp_info) {
+	if (stomp_info->adapter.status == destroyed) return -1;
+
+	if (stomp_destroy_internal(stomp_info, 1) != 0) return -1;
+
+	return stomp_connect(stomp_info, &stomp_info->connect_headers, stomp_info->connect_callback, stomp_info->error_callback);
+}
+
+static int onopen_callback(StompAdapter *adapter) {
+	StompAdapterStompInfo *custom_info = get_adapter_custom_data(adapter);
+	StompInfo *stomp_info = custom_info->stomp_info;
+
+	return stomp_send_connect(stomp_info);
+}
+
+static int onerror_callback_internal(StompAdapter *adapter, StompFrame *frame) {
+	StompAdapterStompInfo *custom_info = get_adapter_custom_data(adapter);
+	StompInfo *stomp_info = custom_info->stomp_info;
+
+	adapter->status = disconnected;
+
+	stomp_info->error_callback(stomp_info, frame);
+
+	return 0;
+}
+
+static int onerror_callback(StompAdapter *adapter, char *message) {
+	StompHeader header_array[1];
+	header_array[0].name = "message";
+	header_array[0].value = message;
+
+	StompHeaders headers;
+	headers.len = 1;
+	headers.header_array = header_array;
+
+	StompFrame frame;
+	stomp_empty_frame(&frame);
+	frame.command = "ERROR";
+	frame.system_headers = &headers;
+
+	return onerror_callback_internal(adapter, &frame);
+}
+
+static int onclose_callback(StompAdapter *adapter, char *message) {
+	return onerror_callback(adapter, message);
+}
+
+
+// Runs the callbacks of a parsed frame and releases it
+static int stomp_dispatch_frame(StompAdapter *adapter, StompFrameBuffer *frame_buffer) {
+	StompAdapterStompInfo *custom_info = get_adapter_custom_data(adapter);
+	StompInfo *stomp_info = custom_info->stomp_info;
+
+	StompFrame *frame = &frame_buffer->frame;
+	char *command = frame->command;
+	int ret;
+
+	if (!strcmp(command, "CONNECTED")) {
+		stomp_info->adapter.status = connected;
+
+		// before anything the application sends now
+		if (stomp_info->spool != NULL) {
+			stomp_spool_reset_sent(stomp_info->spool);
+			stomp_spool_replay(stomp_info->spool, stomp_spool_send, stomp_info);
+		}
+
+		stomp_info->connect_callback(stomp_info, frame);
+
+		ret = 0;
+	} else if (!strcmp(command, "MESSAGE")) {
+		StompHeader *header_subscription = stomp_find_header(frame->system_headers, "subscription");
+
+		StompSubscription *subscription = header_subscription == NULL ? NULL : stomp_find_subscription(stomp_info, header_subscription->value);
+		if (subscription != NULL && stomp_duplicate(stomp_info, subscription, frame)) {
+			ret = 0;
+		} else if (subscription != NULL && stomp_decompress_body(stomp_info, frame_buffer)) {
+			ret = -1;
+		} else if (subscription != NULL) {
+			stomp_deliver(stomp_info, subscription, frame);
+			ret = 0;
+		} else {
+			ret = -1;
+		}
+	} else if (!strcmp(command, "RECEIPT")) {
+		StompHeader *header_receipt_id = stomp_find_header(frame->system_headers, "receipt-id");
+
+		StompReceipt *receipt = stomp_info->receipts;
+		while (receipt != NULL && (header_receipt_id == NULL || strcmp(receipt->receipt_id, header_receipt_id->value))) {
+			receipt = receipt->next;
+		}
+
+		unsigned long long sequence;
+		if (stomp_info->spool != NULL && header_receipt_id != NULL && sscanf(header_receipt_id->value, "spool-%llu", &sequence) == 1) {
+			stomp_spool_confirm(stomp_info->spool, sequence);
+			ret = 0;
+		} else if (receipt != NULL) {
+			receipt->callback(stomp_info, frame);
+			stomp_remove_receipt(stomp_info, receipt);
+			ret = 0;
+		} else {
+			ret = -1;
+		}
+	} else if (!strcmp(command, "ERROR")) {
+		onerror_callback_internal(adapter, frame);
+		ret = 0;
+	} else {
+		stomp_log_error("Invalid command %s", command);
+		onerror_callback(adapter, "invalid stomp command");
+		ret = -1;
+	}
+
+	stomp_frame_release(frame);
+
+	return ret;
+}
+
+static int onmessage_callback(StompAdapter *adapter, char *message, size_t len) {
+	StompAdapterStompInfo *custom_info = get_adapter_custom_data(adapter);
+	StompInfo *stomp_info = custom_info->stomp_info;
+
+	stomp_log_payload(STOMP_LOG_DEBUG, "stomp receive", message, len);
+
+	StompFrameBuffer *frame_buffer = custom_info->acquired;
+	if (frame_buffer != NULL && message == frame_buffer->data) {
+		// gathered by the adapter in the buffer lent by acquire_buffer_callback
+		custom_info->acquired = NULL;
+	} else {
+		// the adapter buffer is reused after this call, keep a pooled copy that callbacks can retain
+		frame_buffer = stomp_frame_pool_acquire(stomp_info->frame_pool, len);
+		if (frame_buffer == NULL) return -1;
+
+		memcpy(frame_buffer->data, message, len);
+	}
+
+	if (stomp_frame_unmarshall(frame_buffer, len)) {
+		stomp_frame_release(&frame_buffer->frame);
+		return -1;
+	}
+
+	return stomp_dispatch_frame(adapter, frame_buffer);
+}
+
+static char* acquire_buffer_callback(StompAdapter *adapter, size_t len) {
+	StompAdapterStompInfo *custom_info = get_adapter_custom_data(adapter);
+
+	// the previous message was not finished
+	if (custom_info->acquired != NULL) stomp_frame_release(&custom_info->acquired->frame);
+
+	custom_info->acquired = stomp_frame_pool_acquire(custom_info->stomp_info->frame_pool, len);
+
+	return custom_info->acquired != NULL ? custom_info->acquired->data : NULL;
+}
+
+// Offset of the body, after the empty line that ends the headers, or 0 if it is not in the first max_length bytes
+static size_t stomp_frame_head_length(const char *message, size_t len, size_t max_length) {
+	if (len > max_length) len = max_length;
+
+	const char *line = message;
+	while (line < &message[len]) {
+		const char *end = memchr(line, '\n', &message[len] - line);
+		if (end == NULL) return 0;
+
+		if (end == line || (end == line + 1 && *line == '\r')) return end + 1 - message;
+
+		line = end + 1;
+	}
+
+	return 0;
+}
+
+// A message spilled by the adapter: the head is copied to a pooled buffer and parsed, the body is
+// left in the read only mapping that is unmapped with the frame
+static int onmessage_mapped_callback(StompAdapter *adapter, char *message, size_t len) {
+	StompAdapterStompInfo *custom_info = get_adapter_custom_data(adapter);
+	StompInfo *stomp_info = custom_info->stomp_info;
+
+	stomp_log_payload(STOMP_LOG_DEBUG, "stomp receive", message, len);
+
+	size_t head_len = stomp_frame_head_length(message, len, stomp_info->adapter.max_frame_length);
+	StompFrameBuffer *frame_buffer = head_len == 0 ? NULL : stomp_frame_pool_acquire(stomp_info->frame_pool, head_len);
+	if (frame_buffer == NULL) {
+		stomp_log_error("headers of a %zu bytes frame exceed max_frame_length", len);
+		munmap(message, len + 1);
+		return -1;
+	}
+
+	memcpy(frame_buffer->data, message, head_len);
+	frame_buffer->mapping = message;
+	frame_buffer->mapping_len = len + 1;
+
+	StompFrame *frame = &frame_buffer->frame;
+
+	if (stomp_frame_unmarshall(frame_buffer, head_len)) {
+		stomp_frame_release(frame);
+		return -1;
+	}
+
+	frame->body = &message[head_len];
+
+	size_t available = len - head_len;
+	StompHeader *header_length = stomp_find_header(frame->system_headers, "content-length");
+	if (header_length != NULL && strtoul(header_length->value, NULL, 10) <= available) {
+		frame->body_length = strtoul(header_length->value, NULL, 10);
+	} else {
+		frame->body_length = strnlen(frame->body, available);
+	}
+
+	return stomp_dispatch_frame(adapter, frame_buffer);
+}
+
+
 
 static int onheartbeat_callback(StompAdapter *adapter) {
 	return 0;
@@ -484,19 +2245,39 @@ StompInfo stomp_create(StompAdapter *child_adapter) {
 
 	stomp_info.adapter.onopen_callback = onopen_callback;
 	stomp_info.adapter.onmessage_callback = onmessage_callback;
+	stomp_info.adapter.onmessage_mapped_callback = onmessage_mapped_callback;
+	stomp_info.adapter.acquire_buffer_callback = acquire_buffer_callback;
 	stomp_info.adapter.onerror_callback = onerror_callback;
 	stomp_info.adapter.onheartbeat_callback = onheartbeat_callback;
 	stomp_info.adapter.onclose_callback = onclose_callback;
 
 	stomp_info.adapter.max_frame_length = child_adapter->max_frame_length;
+	stomp_info.adapter.max_message_length = 0;
 
 	StompAdapterStompInfo *custom_data = malloc(sizeof(StompAdapterStompInfo));
+	custom_data->acquired = NULL;
 	stomp_info.adapter.custom_data = custom_data;
 
 	stomp_info.connect_headers.len = 0;
 	stomp_info.subscriptions = NULL;
+	stomp_info.pending_subscriptions = NULL;
 	stomp_info.last_server_action_time = time(NULL);
 	stomp_info.next_subscription_id = 0;
+	stomp_info.next_transaction_id = 0;
+	stomp_info.next_receipt_id = 0;
+	stomp_info.receipts = NULL;
+	stomp_info.full_queues = 0;
+	stomp_info.dedup = NULL;
+	stomp_info.dedup_header = NULL;
+	stomp_info.spool = NULL;
+
+	stomp_info.codecs_len = 0;
+	stomp_info.send_codec = NULL;
+	stomp_info.codec_tx_buffer = NULL;
+	stomp_info.codec_tx_size = 0;
+	stomp_info.max_decompressed_size = 0;
+
+	stomp_info.frame_pool = stomp_frame_pool_create();
 
 	return stomp_info;
 }
@@ -41,6 +41,20 @@ typedef struct {
 	struct lws_context *context;
 	struct lws_protocols *protocols;
 	char *url;
+
+	StompDeflateOptions deflate;
+	struct lws_extension extensions[3];
+	char deflate_offer[160];
+	StompCompressionStats compression_stats;
+
+	// messages over max_frame_length and the ones sent after them
+	struct StompLwsMessage *tx_head;
+	struct StompLwsMessage *tx_tail;
+	char *fragment_buffer; // LWS_PRE + max_frame_length, for messages that are not copied
+
+	// messages received in several fragments
+	StompRxBuffer rx_buffer;
+	size_t spill_threshold;
 } StompAdapterLibWebSocketsData;
 
 static StompAdapterLibWebSocketsData* get_adapter_custom_data(StompAdapter *adapter) {
@@ -59,19 +73,77 @@ enum stomp_lws_protocol_enum {
 		PROTOCOL_STOMP12
 	};
 
-static const struct lws_extension stomp_lws_exts[] = {
-	{
-		"permessage-deflate",
-		lws_extension_callback_pm_deflate,
-		"permessage-deflate; client_no_context_takeover"
-	},
-	{
-		"deflate-frame",
-		lws_extension_callback_pm_deflate,
-		"deflate_frame"
-	},
-	{ NULL, NULL, NULL /* terminator */ }
-};
+static int stomp_lws_deflate_callback(struct lws_context *context, const struct lws_extension *ext, struct lws *wsi,
+			enum lws_extension_callback_reasons reason, void *user, void *in, size_t len);
+
+static void prepare_deflate_extensions(StompAdapterLibWebSocketsData *custom_data) {
+	StompDeflateOptions *options = &custom_data->deflate;
+	char *offer = custom_data->deflate_offer;
+
+	strcpy(offer, "permessage-deflate");
+	if (options->client_no_context_takeover) strcat(offer, "; client_no_context_takeover");
+	if (options->server_no_context_takeover) strcat(offer, "; server_no_context_takeover");
+	if (options->client_max_window_bits < 15) {
+		sprintf(&offer[strlen(offer)], "; client_max_window_bits=%d", options->client_max_window_bits);
+	}
+	if (options->server_max_window_bits < 15) {
+		sprintf(&offer[strlen(offer)], "; server_max_window_bits=%d", options->server_max_window_bits);
+	}
+
+	custom_data->extensions[0].name = "permessage-deflate";
+	custom_data->extensions[0].callback = stomp_lws_deflate_callback;
+	custom_data->extensions[0].client_offer = offer;
+
+	custom_data->extensions[1].name = "deflate-frame";
+	custom_data->extensions[1].callback = lws_extension_callback_pm_deflate;
+	custom_data->extensions[1].client_offer = "deflate_frame";
+
+	// terminator
+	memset(&custom_data->extensions[2], 0, sizeof(struct lws_extension));
+}
+
+StompDeflateOptions stomp_libwebsockets_default_deflate_options(void) {
+	StompDeflateOptions options;
+
+	options.enabled = 1;
+	options.client_no_context_takeover = 1;
+	options.server_no_context_takeover = 0;
+	options.client_max_window_bits = 15;
+	options.server_max_window_bits = 15;
+	options.compression_level = 1;
+	options.mem_level = 8;
+
+	return options;
+}
+
+int stomp_libwebsockets_set_deflate_options(StompAdapter *adapter, const StompDeflateOptions *options) {
+	if (adapter->status != created && adapter->status != initialized) return -1;
+
+	if (options->client_max_window_bits < 8 || options->client_max_window_bits > 15) return -1;
+	if (options->server_max_window_bits < 8 || options->server_max_window_bits > 15) return -1;
+	if (options->compression_level < 0 || options->compression_level > 9) return -1;
+	if (options->mem_level < 1 || options->mem_level > 9) return -1;
+
+	get_adapter_custom_data(adapter)->deflate = *options;
+
+	return 0;
+}
+
+int stomp_libwebsockets_compression_stats(StompAdapter *adapter, StompCompressionStats *stats) {
+	if (adapter->status == destroyed) return -1;
+
+	*stats = get_adapter_custom_data(adapter)->compression_stats;
+
+	return 0;
+}
+
+int stomp_libwebsockets_set_spill_threshold(StompAdapter *adapter, size_t spill_threshold) {
+	if (adapter->status != created && adapter->status != initialized) return -1;
+
+	get_adapter_custom_data(adapter)->spill_threshold = spill_threshold;
+
+	return 0;
+}
 
 static int init_function(StompAdapter *adapter, StompAdapter *parent_adapter) {
 	if (adapter->status != created) return -1;
@@ -107,7 +179,7 @@ static int connect_function (StompAdapter *adapter) {
 	// Copiamos url a fullURL pq la funcion toca el string
 	strncpy(fullURL, url, sizeof(fullURL) - 1);
 	if (lws_parse_uri(fullURL, &prot, &i.address, &i.port, &p)) {
-		fprintf(stderr, "Error parsing URL %s\n", url);
+		stomp_log_error("Error parsing URL %s", url);
 		return -1;
 	}
 
@@ -165,7 +237,11 @@ static int connect_function (StompAdapter *adapter) {
 	info.gid = -1;
 	info.uid = -1;
 	info.ws_ping_pong_interval = pp_secs;
-	info.extensions = stomp_lws_exts;
+	// level 0 would still frame every message as deflated, without compressing it
+	if (custom_data->deflate.enabled && custom_data->deflate.compression_level > 0) {
+		prepare_deflate_extensions(custom_data);
+		info.extensions = custom_data->extensions;
+	}
 	info.max_http_header_data = 2048;
 
 #if defined(LWS_OPENSSL_SUPPORT)
@@ -175,7 +251,7 @@ static int connect_function (StompAdapter *adapter) {
 	custom_data->context = lws_create_context(&info);
 	if (custom_data->context == NULL) {
 		free(custom_data->protocols);
-		fprintf(stderr, "Creating libwebsocket context failed\n");
+		stomp_log_error("Creating libwebsocket context failed");
 		return -1;
 	}
 
@@ -185,7 +261,7 @@ static int connect_function (StompAdapter *adapter) {
 	i.origin = i.address;
 	i.ietf_version_or_minus_one = ietf_version;
 
-	stomp_debug_print("using %s mode (ws)\n", prot);
+	stomp_log_debug("using %s mode (ws)", prot);
 
 	/*
 	 * nothing happens until the client websocket connection is
@@ -194,17 +270,22 @@ static int connect_function (StompAdapter *adapter) {
 	 * asynchronously.
 	 */
 
-	stomp_debug_print("Opening socket \n");
+	stomp_log_debug("Opening socket");
 	i.protocol = info.protocols[PROTOCOL_STOMP12].name;
 	i.pwsi = &custom_data->wsi;
 
 	i.userdata = adapter;
 
+	memset(&custom_data->compression_stats, 0, sizeof(StompCompressionStats));
+
+	// without the mapped callback a big message stays in the heap
+	custom_data->rx_buffer.spill_threshold = adapter->parent_adapter->onmessage_mapped_callback != NULL ? custom_data->spill_threshold : 0;
+
 	struct lws *result = lws_client_connect_via_info(&i);
 
 	if (!result) {
 		free(custom_data->protocols);
-		fprintf(stderr, "Error opening socket!\n");
+		stomp_log_error("Error opening socket!");
 		return -1;
 	}
 
@@ -213,27 +294,180 @@ static int connect_function (StompAdapter *adapter) {
 	return 0;
 }
 
-static int send_function (StompAdapter *adapter, char *message) {
-	if (adapter->status != connected) return -1;
+// Large message waiting in the tx queue, written one fragment per WRITEABLE callback
+typedef struct StompLwsMessage {
+	struct StompLwsMessage *next;
+	size_t len;
+	size_t offset; // bytes already written
+	enum lws_write_protocol protocol;
+
+	// segments held for sendv_async_function, gathered fragment by fragment. NULL if copied to data
+	const struct iovec *iov;
+	int iov_index;
+	size_t iov_offset;
+	stomp_release_function release;
+	void *release_data;
+
+	char data[]; // LWS_PRE + len when copied
+} StompLwsMessage;
+
+static StompLwsMessage* create_message(size_t data_len, size_t message_len, enum lws_write_protocol protocol) {
+	StompLwsMessage *message = malloc(sizeof(StompLwsMessage) + data_len);
+	if (message == NULL) return NULL;
+
+	message->next = NULL;
+	message->len = message_len;
+	message->offset = 0;
+	message->protocol = protocol;
+	message->iov = NULL;
+	message->iov_index = 0;
+	message->iov_offset = 0;
+	message->release = NULL;
+
+	return message;
+}
+
+static void free_message(StompLwsMessage *message) {
+	if (message->release != NULL) message->release(message->release_data);
+	free(message);
+}
+
+static void enqueue_message(StompAdapterLibWebSocketsData *custom_data, StompLwsMessage *message) {
+	if (custom_data->tx_tail != NULL) {
+		custom_data->tx_tail->next = message;
+	} else {
+		custom_data->tx_head = message;
+	}
+	custom_data->tx_tail = message;
+
+	lws_callback_on_writable(custom_data->wsi);
+}
+
+static int queue_message(StompAdapterLibWebSocketsData *custom_data, const struct iovec *iov, int iovcnt,
+		size_t message_len, enum lws_write_protocol protocol) {
+	StompLwsMessage *message = create_message(LWS_PRE + message_len, message_len, protocol);
+	if (message == NULL) return -1;
+
+	char *pos = &message->data[LWS_PRE];
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+
+	enqueue_message(custom_data, message);
 
+	return 0;
+}
+
+static void free_tx_queue(StompAdapterLibWebSocketsData *custom_data) {
+	StompLwsMessage *message = custom_data->tx_head;
+	while (message != NULL) {
+		StompLwsMessage *next = message->next;
+		free_message(message);
+		message = next;
+	}
+
+	custom_data->tx_head = NULL;
+	custom_data->tx_tail = NULL;
+}
+
+// Copies the next len bytes of the held segments
+static void gather_fragment(StompLwsMessage *message, char *buffer, size_t len) {
+	while (len > 0) {
+		const struct iovec *segment = &message->iov[message->iov_index];
+		size_t available = segment->iov_len - message->iov_offset;
+		size_t n = available < len ? available : len;
+
+		memcpy(buffer, (char *)segment->iov_base + message->iov_offset, n);
+		buffer += n;
+		len -= n;
+
+		message->iov_offset += n;
+		if (message->iov_offset == segment->iov_len) {
+			message->iov_index++;
+			message->iov_offset = 0;
+		}
+	}
+}
+
+// Writes the next fragment of the first queued message: the first one carries the opcode, the
+// rest are continuations and all but the last have NO_FIN
+static int write_fragment(StompAdapter *adapter) {
+	StompAdapterLibWebSocketsData *custom_data = get_adapter_custom_data(adapter);
+	StompLwsMessage *message = custom_data->tx_head;
+	if (message == NULL) return 0;
+
+	size_t fragment_len = message->len - message->offset;
+	if (fragment_len > adapter->max_frame_length) fragment_len = adapter->max_frame_length;
+
+	int protocol = message->offset == 0 ? message->protocol : LWS_WRITE_CONTINUATION;
+	if (message->offset + fragment_len < message->len) protocol |= LWS_WRITE_NO_FIN;
+
+	// lws writes its header in the LWS_PRE bytes before the fragment, already sent or reserved for the first one
+	unsigned char *fragment = (unsigned char *)&message->data[LWS_PRE + message->offset];
+	if (message->iov != NULL) {
+		fragment = (unsigned char *)&custom_data->fragment_buffer[LWS_PRE];
+		gather_fragment(message, (char *)fragment, fragment_len);
+	}
+
+	if (lws_write(custom_data->wsi, fragment, fragment_len, (enum lws_write_protocol)protocol) < 0)
+		return -1;
+
+	message->offset += fragment_len;
+	if (message->offset == message->len) {
+		custom_data->tx_head = message->next;
+		if (custom_data->tx_head == NULL) custom_data->tx_tail = NULL;
+		free_message(message);
+	}
+
+	if (custom_data->tx_head != NULL) lws_callback_on_writable(custom_data->wsi);
+
+	return 0;
+}
+
+// Writes a message at once when it fits in max_frame_length. Larger ones, and everything behind them
+// so the fragments are not interleaved, go to the tx queue
+static int write_message(StompAdapter *adapter, const struct iovec *iov, int iovcnt, size_t message_len,
+		enum lws_write_protocol protocol) {
 	StompAdapterLibWebSocketsData *custom_data = get_adapter_custom_data(adapter);
 
 	int max_frame_length = adapter->max_frame_length;
 
+	if (message_len > adapter->max_message_length && message_len > max_frame_length) {
+		stomp_log_error("message exceed max_message_length %zu > %zu", message_len, adapter->max_message_length);
+		return -1;
+	}
+
+	if (custom_data->tx_head != NULL || message_len > max_frame_length) {
+		return queue_message(custom_data, iov, iovcnt, message_len, protocol);
+	}
+
 	//TODO reuse buffer
 	char buffer[LWS_PRE + max_frame_length];
 
-	int message_len = strlen(message) + 1; // send the null char
+	// gather the segments after the lws header room
+	char *pos = &buffer[LWS_PRE];
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
 
-	if (strlen(message) > max_frame_length) {
-		fprintf(stderr, "message exceed STOMP_MAX_FRAME_BUFFER %d > %d", message_len, max_frame_length);
+	if (lws_write(custom_data->wsi, (unsigned char *)&buffer[LWS_PRE], message_len, protocol) < 0)
 		return -1;
-	}
 
-	strcpy(&buffer[LWS_PRE], message);
+	return 0;
+}
+
+static int send_function (StompAdapter *adapter, char *message) {
+	if (adapter->status != connected) return -1;
+
+	StompAdapterLibWebSocketsData *custom_data = get_adapter_custom_data(adapter);
+
+	struct iovec iov;
+	iov.iov_base = message;
+	iov.iov_len = strlen(message) + 1; // send the null char
 
-	int n = lws_write(custom_data->wsi, (unsigned char *)&buffer[LWS_PRE], message_len, LWS_WRITE_TEXT);
-	if (n < 0)
+	if (write_message(adapter, &iov, 1, iov.iov_len, LWS_WRITE_TEXT) < 0)
 		return -1;
 
 	/* we only had one thing to send, so inform lws we are done
@@ -246,6 +480,91 @@ static int send_function (StompAdapter *adapter, char *message) {
 
 }
 
+static int sendv_function (StompAdapter *adapter, const struct iovec *iov, int iovcnt) {
+	if (adapter->status != connected) return -1;
+
+	StompAdapterLibWebSocketsData *custom_data = get_adapter_custom_data(adapter);
+
+	size_t message_len = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		message_len += iov[i].iov_len;
+	}
+
+	// the body may not be valid UTF-8
+	if (write_message(adapter, iov, iovcnt, message_len, LWS_WRITE_BINARY) < 0)
+		return -1;
+
+	lws_client_http_body_pending(custom_data->wsi, 0);
+
+	return 0;
+}
+
+// STOMP over websockets carries one frame per message, so each one is written on its own
+static int send_frames_function (StompAdapter *adapter, const struct iovec *frames, int count) {
+	if (adapter->status != connected) return -1;
+
+	StompAdapterLibWebSocketsData *custom_data = get_adapter_custom_data(adapter);
+
+	for (int i = 0; i < count; i++) {
+		size_t message_len = frames[i].iov_len;
+
+		// a NULL char before the terminator means a binary body
+		enum lws_write_protocol protocol = memchr(frames[i].iov_base, '\0', message_len - 1) ? LWS_WRITE_BINARY : LWS_WRITE_TEXT;
+
+		if (write_message(adapter, &frames[i], 1, message_len, protocol) < 0)
+			return -1;
+	}
+
+	lws_client_http_body_pending(custom_data->wsi, 0);
+
+	return 0;
+}
+
+// Large messages are queued without copying the segments, fragments are gathered in fragment_buffer
+static int sendv_async_function (StompAdapter *adapter, const struct iovec *iov, int iovcnt,
+		stomp_release_function release, void *release_data) {
+	StompAdapterLibWebSocketsData *custom_data = get_adapter_custom_data(adapter);
+
+	size_t message_len = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		message_len += iov[i].iov_len;
+	}
+
+	if (adapter->status != connected || message_len > adapter->max_message_length ||
+			(custom_data->tx_head == NULL && message_len <= adapter->max_frame_length)) {
+		int ret = sendv_function(adapter, iov, iovcnt);
+		release(release_data);
+		return ret;
+	}
+
+	if (custom_data->fragment_buffer == NULL) {
+		custom_data->fragment_buffer = malloc(LWS_PRE + adapter->max_frame_length);
+	}
+
+	StompLwsMessage *message = custom_data->fragment_buffer == NULL ? NULL : create_message(0, message_len, LWS_WRITE_BINARY);
+	if (message == NULL) {
+		release(release_data);
+		return -1;
+	}
+
+	message->iov = iov;
+	message->release = release;
+	message->release_data = release_data;
+
+	enqueue_message(custom_data, message);
+
+	return 0;
+}
+
+static int pause_function (StompAdapter *adapter, int paused) {
+	if (adapter->status != connected) return -1;
+
+	StompAdapterLibWebSocketsData *custom_data = get_adapter_custom_data(adapter);
+
+	// the broker is throttled by the TCP window once the socket buffer fills
+	return lws_rx_flow_control(custom_data->wsi, !paused);
+}
+
 static int service_function (StompAdapter *adapter, int timeout_ms) {
 	if (adapter->status != preconnected && adapter->status != connected) return -1;
 
@@ -253,7 +572,7 @@ static int service_function (StompAdapter *adapter, int timeout_ms) {
 
 	int status = lws_service(custom_data->context, timeout_ms);
 	if (status != 0) {
-		fprintf(stderr, "Status is %d!!!!!!\n", status);
+		stomp_log_warn("lws_service status is %d", status);
 	}
 	return status;
 }
@@ -269,6 +588,10 @@ static int destroy_function_internal (StompAdapter *adapter, int reconnect) {
 	if (custom_data->protocols) {
 		free(custom_data->protocols);
 	}
+	free_tx_queue(custom_data);
+	free(custom_data->fragment_buffer);
+	custom_data->fragment_buffer = NULL;
+	stomp_rx_buffer_free(&custom_data->rx_buffer);
 
 	if (reconnect) {
 		adapter->status = initialized;
@@ -302,15 +625,27 @@ StompAdapter stomp_libwebsockets_adapter(char *url, int max_frame_length) {
 	adapter.service_function = service_function;
 	adapter.connect_function = connect_function;
 	adapter.send_function = send_function;
+	adapter.sendv_function = sendv_function;
+	adapter.sendv_async_function = sendv_async_function;
+	adapter.send_frames_function = send_frames_function;
 	adapter.restart_function = restart_function;
+	adapter.pause_function = pause_function;
 	adapter.destroy_function = destroy_function;
 	adapter.max_frame_length = max_frame_length;
+	adapter.max_message_length = STOMP_LWS_MAX_MESSAGE_LENGTH;
 
 	StompAdapterLibWebSocketsData *custom_data = malloc(sizeof(StompAdapterLibWebSocketsData));
 	custom_data->url = url;
 	custom_data->context = NULL;
 	custom_data->wsi = NULL;
 	custom_data->protocols = NULL;
+	custom_data->tx_head = NULL;
+	custom_data->tx_tail = NULL;
+	custom_data->fragment_buffer = NULL;
+	stomp_rx_buffer_init(&custom_data->rx_buffer, 0);
+	custom_data->spill_threshold = STOMP_LWS_SPILL_THRESHOLD;
+	custom_data->deflate = stomp_libwebsockets_default_deflate_options();
+	memset(&custom_data->compression_stats, 0, sizeof(StompCompressionStats));
 	adapter.custom_data = custom_data;
 
 	return adapter;
@@ -336,7 +671,7 @@ int stomp_libwebsockets_callback_lws_http(struct lws *wsi, enum lws_callback_rea
 int stomp_libwebsockets_callback_lws_websocket(struct lws *wsi, enum lws_callback_reasons reason,
 			void *user, void *in, size_t len)
 {
-	stomp_debug_print("stomp_callback http %i !!\n", reason);
+	stomp_log_trace("stomp_callback websocket %i", reason);
 
 	StompAdapter *adapter = (StompAdapter *)lws_wsi_user(wsi);
 	StompAdapter *parent_adapter = NULL;
@@ -349,12 +684,14 @@ int stomp_libwebsockets_callback_lws_websocket(struct lws *wsi, enum lws_callbac
 		case LWS_CALLBACK_WS_EXT_DEFAULTS:
 			// Change the deflate buffer to fit messages in 1 callback
 			if (!strcmp(user, "permessage-deflate")) {
+				StompDeflateOptions *options = &get_adapter_custom_data(adapter)->deflate;
 				int max_frame_size = adapter->max_frame_length;
 
 				// 2^rx_buf_size = max_frame_size  => rx_buf_size = log2(max_frame_size)
 				int rx_buf_size = ceil(log(max_frame_size) / log(2));
 
-				sprintf(in, "rx_buf_size=%i", rx_buf_size); // 2^n=2048)
+				snprintf(in, len, "rx_buf_size=%i; compression_level=%i; mem_level=%i",
+						rx_buf_size, options->compression_level, options->mem_level);
 			}
 			break;
 		case LWS_CALLBACK_CLIENT_ESTABLISHED:
@@ -365,16 +702,35 @@ int stomp_libwebsockets_callback_lws_websocket(struct lws *wsi, enum lws_callbac
 			parent_adapter->onopen_callback(parent_adapter);
 
 			break;
-		case LWS_CALLBACK_CLIENT_RECEIVE:
+		case LWS_CALLBACK_CLIENT_WRITEABLE:
+			if (adapter->status != connected) return 0;
+
+			// closes the connection on error, the rest of the message can not be sent
+			return write_fragment(adapter);
+		case LWS_CALLBACK_CLIENT_RECEIVE: {
 			if (adapter->status != connected && adapter->status != preconnected) return 0;
 
-			if (len == 0) return 0;
+			StompRxBuffer *rx_buffer = &get_adapter_custom_data(adapter)->rx_buffer;
+			int complete = lws_is_final_fragment(wsi) && lws_remaining_packet_payload(wsi) == 0;
+
+			// messages up to max_frame_length come in one callback and are parsed from the lws buffer
+			if (complete && rx_buffer->len == 0) {
+				if (len == 0) return 0;
+
+				message[len] = '\0';
+
+				parent_adapter->onmessage_callback(parent_adapter, message, len);
 
-			message[len] = '\0';
+				break;
+			}
+
+			// the rest of the message can not be parsed without this part
+			if (stomp_rx_buffer_append(rx_buffer, message, len)) return -1;
 
-			parent_adapter->onmessage_callback(parent_adapter, message);
+			if (complete) stomp_rx_buffer_deliver(rx_buffer, parent_adapter);
 
 			break;
+		}
 		case LWS_CALLBACK_CLOSED:
 			if (adapter->status != connected && adapter->status != preconnected) return 0;
 
@@ -389,3 +745,30 @@ int stomp_libwebsockets_callback_lws_websocket(struct lws *wsi, enum lws_callbac
 
 	return 0;
 }
+
+// Wraps the lws permessage-deflate extension to count the bytes before and after compression
+static int stomp_lws_deflate_callback(struct lws_context *context, const struct lws_extension *ext, struct lws *wsi,
+			enum lws_extension_callback_reasons reason, void *user, void *in, size_t len) {
+	if (wsi == NULL || (reason != LWS_EXT_CB_PAYLOAD_TX && reason != LWS_EXT_CB_PAYLOAD_RX)) {
+		return lws_extension_callback_pm_deflate(context, ext, wsi, reason, user, in, len);
+	}
+
+	StompAdapter *adapter = (StompAdapter *)lws_wsi_user(wsi);
+	struct lws_tokens *eff_buf = (struct lws_tokens *)in;
+	int len_in = eff_buf->token_len;
+
+	int ret = lws_extension_callback_pm_deflate(context, ext, wsi, reason, user, in, len);
+
+	if (adapter == NULL || ret < 0) return ret;
+
+	StompCompressionStats *stats = &get_adapter_custom_data(adapter)->compression_stats;
+	if (reason == LWS_EXT_CB_PAYLOAD_TX) {
+		stats->tx_uncompressed += len_in;
+		stats->tx_compressed += eff_buf->token_len;
+	} else {
+		stats->rx_compressed += len_in;
+		stats->rx_uncompressed += eff_buf->token_len;
+	}
+
+	return ret;
+}
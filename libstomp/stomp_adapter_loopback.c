@@ -0,0 +1,637 @@
+/*
+ * libstomp - a free implementation of the stomp protocol than can be plugged
+ * to different connection implementations using an adapter interface.
+ *
+ * Copyright (C) 2017 Sergio Otero <sergio.otero@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+
+
+
+
+/*
+ * In process broker for tests and benchmarks, no network involved.
+ *
+ * Frames written by the client are parsed here: CONNECT is answered with CONNECTED,
+ * SEND is routed as MESSAGE to the subscriptions with the same destination, SENDs of a
+ * transaction wait for its COMMIT and a receipt header gets its RECEIPT. The answers are
+ * queued and delivered by service_function, never from inside a send, after an optional
+ * latency. Messages can be dropped at random and the connection closed after a number of
+ * frames, see StompLoopbackOptions.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libstomp.h"
+
+// Frame for the client
+typedef struct StompLoopbackFrame {
+	struct StompLoopbackFrame *next;
+	long long due_ns;
+	size_t len;
+	char data[]; // NULL terminated
+} StompLoopbackFrame;
+
+typedef struct StompLoopbackSubscription {
+	struct StompLoopbackSubscription *next;
+	char *id;
+	char *destination;
+} StompLoopbackSubscription;
+
+// SENDs waiting for the COMMIT, kept as the client wrote them
+typedef struct StompLoopbackTransaction {
+	struct StompLoopbackTransaction *next;
+	char *id;
+	StompLoopbackFrame *head;
+	StompLoopbackFrame *tail;
+} StompLoopbackTransaction;
+
+typedef struct {
+	StompLoopbackOptions options;
+	StompLoopbackStats stats;
+	int paused;
+	int closing; // connection closed by the next service call
+	unsigned long long frames; // received on this connection
+	unsigned long long next_message_id;
+	uint64_t random;
+
+	StompLoopbackSubscription *subscriptions;
+	StompLoopbackTransaction *transactions;
+
+	StompLoopbackFrame *out_head;
+	StompLoopbackFrame *out_tail;
+
+	char *scratch; // a client frame gathered from its segments
+	size_t scratch_size;
+} StompAdapterLoopbackData;
+
+static StompAdapterLoopbackData* get_adapter_custom_data(StompAdapter *adapter) {
+	return (StompAdapterLoopbackData*)adapter->custom_data;
+}
+
+StompLoopbackOptions stomp_loopback_default_options(void) {
+	StompLoopbackOptions options;
+
+	options.latency_us = 0;
+	options.drop_rate = 0;
+	options.disconnect_after = 0;
+	options.seed = 1;
+
+	return options;
+}
+
+int stomp_loopback_set_options(StompAdapter *adapter, const StompLoopbackOptions *options) {
+	if (adapter->status == destroyed) return -1;
+
+	StompAdapterLoopbackData *custom_data = get_adapter_custom_data(adapter);
+	custom_data->options = *options;
+	custom_data->random = options->seed ? options->seed : 1;
+
+	return 0;
+}
+
+int stomp_loopback_get_stats(StompAdapter *adapter, StompLoopbackStats *stats) {
+	if (adapter->status == destroyed) return -1;
+
+	*stats = get_adapter_custom_data(adapter)->stats;
+
+	return 0;
+}
+
+static long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// xorshift64, a sequence that repeats with the seed
+static double next_random(StompAdapterLoopbackData *custom_data) {
+	uint64_t x = custom_data->random;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	custom_data->random = x;
+
+	return (x >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void free_frames(StompLoopbackFrame *frame) {
+	while (frame != NULL) {
+		StompLoopbackFrame *next = frame->next;
+		free(frame);
+		frame = next;
+	}
+}
+
+static void free_subscription(StompLoopbackSubscription *subscription) {
+	free(subscription->id);
+	free(subscription->destination);
+	free(subscription);
+}
+
+static void free_transaction(StompLoopbackTransaction *transaction) {
+	free_frames(transaction->head);
+	free(transaction->id);
+	free(transaction);
+}
+
+// Everything of the connection, the options and the counters stay
+static void reset_connection(StompAdapterLoopbackData *custom_data) {
+	while (custom_data->subscriptions != NULL) {
+		StompLoopbackSubscription *next = custom_data->subscriptions->next;
+		free_subscription(custom_data->subscriptions);
+		custom_data->subscriptions = next;
+	}
+
+	while (custom_data->transactions != NULL) {
+		StompLoopbackTransaction *next = custom_data->transactions->next;
+		free_transaction(custom_data->transactions);
+		custom_data->transactions = next;
+	}
+
+	free_frames(custom_data->out_head);
+	custom_data->out_head = NULL;
+	custom_data->out_tail = NULL;
+
+	custom_data->paused = 0;
+	custom_data->closing = 0;
+	custom_data->frames = 0;
+}
+
+static int init_function(StompAdapter *adapter, StompAdapter *parent_adapter) {
+	if (adapter->status != created) return -1;
+
+	adapter->parent_adapter = parent_adapter;
+
+	adapter->status = initialized;
+
+	return 0;
+}
+
+static int connect_function (StompAdapter *adapter) {
+	if (adapter->status != initialized) return -1;
+
+	reset_connection(get_adapter_custom_data(adapter));
+
+	// onopen_callback from the first service call
+	adapter->status = preconnected;
+
+	return 0;
+}
+
+static StompLoopbackFrame* create_frame(size_t len) {
+	StompLoopbackFrame *frame = malloc(sizeof(StompLoopbackFrame) + len + 1);
+	if (frame == NULL) return NULL;
+
+	frame->next = NULL;
+	frame->len = len;
+	frame->data[len] = '\0';
+
+	return frame;
+}
+
+static void append_frame(StompLoopbackFrame **head, StompLoopbackFrame **tail, StompLoopbackFrame *frame) {
+	if (*tail != NULL) {
+		(*tail)->next = frame;
+	} else {
+		*head = frame;
+	}
+	*tail = frame;
+}
+
+// Queues a frame for the client, due after the configured latency
+static void queue_output(StompAdapterLoopbackData *custom_data, StompLoopbackFrame *frame) {
+	frame->due_ns = now_ns() + custom_data->options.latency_us * 1000LL;
+
+	append_frame(&custom_data->out_head, &custom_data->out_tail, frame);
+}
+
+static void queue_text(StompAdapterLoopbackData *custom_data, const char *text) {
+	StompLoopbackFrame *frame = create_frame(strlen(text));
+	if (frame == NULL) return;
+
+	memcpy(frame->data, text, frame->len);
+	queue_output(custom_data, frame);
+}
+
+// Value of a header of the frame head, with its length, or NULL
+static const char* find_header(const char *head, size_t head_len, const char *name, size_t *value_len) {
+	size_t name_len = strlen(name);
+
+	const char *line = memchr(head, '\n', head_len);
+	while (line != NULL && ++line < &head[head_len]) {
+		const char *end = memchr(line, '\n', &head[head_len] - line);
+		if (end == NULL) end = &head[head_len];
+
+		if (end - line > name_len && !strncmp(line, name, name_len) && line[name_len] == ':') {
+			const char *value = &line[name_len + 1];
+			*value_len = end - value;
+			if (*value_len > 0 && value[*value_len - 1] == '\r') (*value_len)--;
+			return value;
+		}
+
+		line = end < &head[head_len] ? end : NULL;
+	}
+
+	return NULL;
+}
+
+// Splits a frame in its command, head and body. Returns -1 if it has no blank line after the headers
+static int parse_frame(const char *frame, size_t len, char *command, size_t command_size, size_t *head_len, size_t *body_len) {
+	const char *blank = NULL;
+	for (const char *line = frame; line < &frame[len]; ) {
+		const char *end = memchr(line, '\n', &frame[len] - line);
+		if (end == NULL) break;
+
+		if (end == line || (end == line + 1 && *line == '\r')) {
+			blank = end + 1;
+			break;
+		}
+
+		line = end + 1;
+	}
+	if (blank == NULL) return -1;
+
+	size_t command_len = strcspn(frame, "\r\n");
+	if (command_len >= command_size) return -1;
+	memcpy(command, frame, command_len);
+	command[command_len] = '\0';
+
+	*head_len = blank - frame;
+	*body_len = len - *head_len;
+
+	size_t value_len;
+	const char *content_length = find_header(frame, *head_len, "content-length", &value_len);
+	if (content_length != NULL && strtoull(content_length, NULL, 10) < *body_len) *body_len = strtoull(content_length, NULL, 10);
+
+	return 0;
+}
+
+static int header_equals(const char *value, size_t value_len, const char *string) {
+	return value != NULL && strlen(string) == value_len && !strncmp(value, string, value_len);
+}
+
+// Copies of the SEND for every subscription to its destination
+static void route_send(StompAdapterLoopbackData *custom_data, const char *frame, size_t head_len, size_t body_len) {
+	const char *body = &frame[head_len];
+
+	size_t destination_len;
+	const char *destination = find_header(frame, head_len, "destination", &destination_len);
+	if (destination == NULL) return;
+
+	// the SEND headers follow the command line
+	const char *headers = memchr(frame, '\n', head_len) + 1;
+	size_t headers_len = &frame[head_len] - headers;
+
+	for (StompLoopbackSubscription *subscription = custom_data->subscriptions; subscription != NULL; subscription = subscription->next) {
+		if (!header_equals(destination, destination_len, subscription->destination)) continue;
+
+		if (custom_data->options.drop_rate > 0 && next_random(custom_data) < custom_data->options.drop_rate) {
+			custom_data->stats.messages_dropped++;
+			continue;
+		}
+
+		char prefix[160];
+		int prefix_len = snprintf(prefix, sizeof(prefix), "MESSAGE\nsubscription:%s\nmessage-id:%llu\n",
+				subscription->id, custom_data->next_message_id++);
+
+		StompLoopbackFrame *message = create_frame(prefix_len + headers_len + body_len);
+		if (message == NULL) return;
+
+		memcpy(message->data, prefix, prefix_len);
+		char *pos = &message->data[prefix_len];
+
+		// the client headers but the ones meant for this broker, blank line included
+		for (const char *line = headers; line < &frame[head_len]; ) {
+			const char *end = memchr(line, '\n', &frame[head_len] - line);
+			size_t line_len = (end != NULL ? end + 1 : &frame[head_len]) - line;
+
+			if (strncmp(line, "receipt:", 8) && strncmp(line, "transaction:", 12)) {
+				memcpy(pos, line, line_len);
+				pos += line_len;
+			}
+
+			line += line_len;
+		}
+
+		memcpy(pos, body, body_len);
+		message->len = pos + body_len - message->data;
+		message->data[message->len] = '\0';
+
+		queue_output(custom_data, message);
+		custom_data->stats.messages_routed++;
+	}
+}
+
+static StompLoopbackTransaction* find_transaction(StompAdapterLoopbackData *custom_data, const char *id, size_t id_len) {
+	for (StompLoopbackTransaction *transaction = custom_data->transactions; transaction != NULL; transaction = transaction->next) {
+		if (header_equals(id, id_len, transaction->id)) return transaction;
+	}
+
+	return NULL;
+}
+
+static void remove_transaction(StompAdapterLoopbackData *custom_data, StompLoopbackTransaction *transaction) {
+	StompLoopbackTransaction **pointer = &custom_data->transactions;
+	while (*pointer != transaction) pointer = &(*pointer)->next;
+
+	*pointer = transaction->next;
+	free_transaction(transaction);
+}
+
+static void subscribe(StompAdapterLoopbackData *custom_data, const char *frame, size_t head_len) {
+	size_t id_len, destination_len;
+	const char *id = find_header(frame, head_len, "id", &id_len);
+	const char *destination = find_header(frame, head_len, "destination", &destination_len);
+	if (id == NULL || destination == NULL) return;
+
+	StompLoopbackSubscription *subscription = malloc(sizeof(StompLoopbackSubscription));
+	if (subscription == NULL) return;
+
+	subscription->id = strndup(id, id_len);
+	subscription->destination = strndup(destination, destination_len);
+	subscription->next = custom_data->subscriptions;
+	custom_data->subscriptions = subscription;
+}
+
+static void unsubscribe(StompAdapterLoopbackData *custom_data, const char *frame, size_t head_len) {
+	size_t id_len;
+	const char *id = find_header(frame, head_len, "id", &id_len);
+
+	StompLoopbackSubscription **pointer = &custom_data->subscriptions;
+	while (*pointer != NULL) {
+		if (header_equals(id, id_len, (*pointer)->id)) {
+			StompLoopbackSubscription *subscription = *pointer;
+			*pointer = subscription->next;
+			free_subscription(subscription);
+		} else {
+			pointer = &(*pointer)->next;
+		}
+	}
+}
+
+static void transaction_frame(StompAdapterLoopbackData *custom_data, const char *command, char *frame, size_t len, size_t head_len) {
+	size_t id_len;
+	const char *id = find_header(frame, head_len, "transaction", &id_len);
+	if (id == NULL) return;
+
+	StompLoopbackTransaction *transaction = find_transaction(custom_data, id, id_len);
+
+	if (!strcmp(command, "BEGIN")) {
+		if (transaction != NULL) return;
+
+		transaction = calloc(1, sizeof(StompLoopbackTransaction));
+		if (transaction == NULL) return;
+
+		transaction->id = strndup(id, id_len);
+		transaction->next = custom_data->transactions;
+		custom_data->transactions = transaction;
+	} else if (transaction == NULL) {
+		return;
+	} else if (!strcmp(command, "SEND")) {
+		StompLoopbackFrame *copy = create_frame(len);
+		if (copy == NULL) return;
+
+		memcpy(copy->data, frame, len);
+		append_frame(&transaction->head, &transaction->tail, copy);
+	} else {
+		// COMMIT routes the SENDs, ABORT drops them
+		for (StompLoopbackFrame *send = transaction->head; send != NULL && !strcmp(command, "COMMIT"); send = send->next) {
+			char send_command[16];
+			size_t send_head_len, send_body_len;
+			if (parse_frame(send->data, send->len, send_command, sizeof(send_command), &send_head_len, &send_body_len) == 0) {
+				route_send(custom_data, send->data, send_head_len, send_body_len);
+			}
+		}
+
+		remove_transaction(custom_data, transaction);
+	}
+}
+
+// Parses a frame of the client and queues the answers
+static void process_frame(StompAdapterLoopbackData *custom_data, char *frame, size_t len) {
+	char command[16];
+	size_t head_len, body_len;
+	if (parse_frame(frame, len, command, sizeof(command), &head_len, &body_len)) return;
+
+	size_t transaction_len;
+	int in_transaction = find_header(frame, head_len, "transaction", &transaction_len) != NULL;
+
+	if (!strcmp(command, "CONNECT") || !strcmp(command, "STOMP")) {
+		queue_text(custom_data, "CONNECTED\nversion:1.2\nserver:libstomp-loopback\nheart-beat:0,0\n\n");
+	} else if (!strcmp(command, "SUBSCRIBE")) {
+		subscribe(custom_data, frame, head_len);
+	} else if (!strcmp(command, "UNSUBSCRIBE")) {
+		unsubscribe(custom_data, frame, head_len);
+	} else if (!strcmp(command, "SEND") && !in_transaction) {
+		route_send(custom_data, frame, head_len, body_len);
+	} else if (!strcmp(command, "SEND") || !strcmp(command, "BEGIN") || !strcmp(command, "COMMIT") || !strcmp(command, "ABORT")) {
+		transaction_frame(custom_data, command, frame, len, head_len);
+	} else if (!strcmp(command, "DISCONNECT")) {
+		custom_data->closing = 1;
+	}
+
+	size_t receipt_len;
+	const char *receipt = find_header(frame, head_len, "receipt", &receipt_len);
+	if (receipt != NULL) {
+		char answer[256];
+		snprintf(answer, sizeof(answer), "RECEIPT\nreceipt-id:%.*s\n\n", (int)receipt_len, receipt);
+		queue_text(custom_data, answer);
+		custom_data->stats.receipts++;
+	}
+}
+
+// A frame written by the client. Frames after the connection is closing are lost, as on a dying socket
+static int receive_frame(StompAdapter *adapter, const struct iovec *iov, int iovcnt) {
+	if (adapter->status != connected) return -1;
+
+	StompAdapterLoopbackData *custom_data = get_adapter_custom_data(adapter);
+	if (custom_data->closing) return 0;
+
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+
+	if (len + 1 > custom_data->scratch_size) {
+		char *scratch = realloc(custom_data->scratch, len + 1);
+		if (scratch == NULL) return -1;
+
+		custom_data->scratch = scratch;
+		custom_data->scratch_size = len + 1;
+	}
+
+	char *pos = custom_data->scratch;
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+
+	// without the NULL char that ends the frame
+	if (len > 0 && custom_data->scratch[len - 1] == '\0') len--;
+	custom_data->scratch[len] = '\0';
+
+	custom_data->stats.frames_received++;
+	process_frame(custom_data, custom_data->scratch, len);
+
+	if (custom_data->options.disconnect_after > 0 && ++custom_data->frames >= custom_data->options.disconnect_after) {
+		custom_data->closing = 1;
+	}
+
+	return 0;
+}
+
+static int send_function (StompAdapter *adapter, char *message) {
+	struct iovec iov;
+	iov.iov_base = message;
+	iov.iov_len = strlen(message) + 1;
+
+	return receive_frame(adapter, &iov, 1);
+}
+
+static int sendv_function (StompAdapter *adapter, const struct iovec *iov, int iovcnt) {
+	return receive_frame(adapter, iov, iovcnt);
+}
+
+static int send_frames_function (StompAdapter *adapter, const struct iovec *frames, int count) {
+	for (int i = 0; i < count; i++) {
+		if (receive_frame(adapter, &frames[i], 1)) return -1;
+	}
+
+	return 0;
+}
+
+static int pause_function (StompAdapter *adapter, int paused) {
+	if (adapter->status != connected) return -1;
+
+	get_adapter_custom_data(adapter)->paused = paused;
+
+	return 0;
+}
+
+static int service_function (StompAdapter *adapter, int timeout_ms) {
+	StompAdapterLoopbackData *custom_data = get_adapter_custom_data(adapter);
+	StompAdapter *parent_adapter = adapter->parent_adapter;
+
+	if (adapter->status == preconnected) {
+		adapter->status = connected;
+		parent_adapter->onopen_callback(parent_adapter);
+	}
+
+	if (adapter->status != connected) return -1;
+
+	StompLoopbackFrame *frame = custom_data->out_head;
+	long long now = now_ns();
+
+	// sleeps as on a socket, until timeout_ms or the next frame is due
+	if (timeout_ms > 0 && !custom_data->closing && (frame == NULL || custom_data->paused || frame->due_ns > now)) {
+		long long wait_ns = timeout_ms * 1000000LL;
+		if (frame != NULL && !custom_data->paused && frame->due_ns - now < wait_ns) wait_ns = frame->due_ns - now;
+
+		struct timespec ts;
+		ts.tv_sec = wait_ns / 1000000000LL;
+		ts.tv_nsec = wait_ns % 1000000000LL;
+		nanosleep(&ts, NULL);
+
+		now = now_ns();
+	}
+
+	// the frames queued by the callbacks wait for the next call
+	StompLoopbackFrame *last = custom_data->out_tail;
+	while (!custom_data->paused && adapter->status == connected && (frame = custom_data->out_head) != NULL && frame->due_ns <= now) {
+		custom_data->out_head = frame->next;
+		if (custom_data->out_head == NULL) custom_data->out_tail = NULL;
+
+		int done = frame == last;
+		parent_adapter->onmessage_callback(parent_adapter, frame->data, frame->len);
+		free(frame);
+
+		if (done) break;
+	}
+
+	// after the frames queued before, ie the RECEIPT of a DISCONNECT
+	if (custom_data->closing && custom_data->out_head == NULL && adapter->status == connected) {
+		adapter->status = disconnected;
+		parent_adapter->onclose_callback(parent_adapter, "connection closed");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int destroy_function_internal (StompAdapter *adapter, int reconnect) {
+	if (adapter->status == destroyed) return -1;
+
+	StompAdapterLoopbackData *custom_data = get_adapter_custom_data(adapter);
+
+	reset_connection(custom_data);
+
+	if (reconnect) {
+		adapter->status = initialized;
+	} else {
+		free(custom_data->scratch);
+		free(adapter->custom_data);
+		adapter->status = destroyed;
+	}
+
+	return 0;
+}
+
+static int destroy_function (StompAdapter *adapter) {
+	return destroy_function_internal(adapter, 0);
+}
+
+static int restart_function(StompAdapter *adapter) {
+	if (adapter->status == destroyed) return -1;
+
+	if (destroy_function_internal(adapter, 1) != 0) return -1;
+
+	adapter->status = initialized;
+
+	return 0;
+}
+
+StompAdapter stomp_loopback_adapter(int max_frame_length) {
+	StompAdapter adapter;
+
+	adapter.status = created;
+	adapter.init_function = init_function;
+	adapter.service_function = service_function;
+	adapter.connect_function = connect_function;
+	adapter.send_function = send_function;
+	adapter.sendv_function = sendv_function;
+	adapter.sendv_async_function = NULL;
+	adapter.send_frames_function = send_frames_function;
+	adapter.restart_function = restart_function;
+	adapter.pause_function = pause_function;
+	adapter.destroy_function = destroy_function;
+	adapter.max_frame_length = max_frame_length;
+	adapter.max_message_length = SIZE_MAX;
+
+	StompAdapterLoopbackData *custom_data = calloc(1, sizeof(StompAdapterLoopbackData));
+	custom_data->options = stomp_loopback_default_options();
+	custom_data->random = custom_data->options.seed;
+	adapter.custom_data = custom_data;
+
+	return adapter;
+}
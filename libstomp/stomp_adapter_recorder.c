@@ -0,0 +1,327 @@
+/*
+ * libstomp - a free implementation of the stomp protocol than can be plugged
+ * to different connection implementations using an adapter interface.
+ *
+ * Copyright (C) 2017 Sergio Otero <sergio.otero@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+
+
+
+
+/*
+ * Records the traffic between an adapter and its parent, for stomp_replay_adapter.
+ *
+ * Sits between the stomp adapter and its real child adapter, every call and callback is
+ * forwarded. Frames in both directions, heartbeats, opens and closes are appended to a binary
+ * log (StompRecordFileHeader followed by StompRecord entries, see stomp_internal.h) through a
+ * stdio buffer, flushed when the connection closes. A write error stops the recording, not
+ * the connection.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stomp_internal.h"
+
+#define STOMP_RECORDER_BUFFER_SIZE (1024 * 1024)
+
+typedef struct {
+	char *path;
+	FILE *file; // NULL once a write failed
+	long long start_ns;
+} StompAdapterRecorderData;
+
+static StompAdapterRecorderData* get_adapter_custom_data(StompAdapter *adapter) {
+	return (StompAdapterRecorderData*)adapter->custom_data;
+}
+
+static long long now_ns(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void stop_recording(StompAdapterRecorderData *custom_data) {
+	stomp_log_error("recording to %s failed: %s", custom_data->path, strerror(errno));
+
+	fclose(custom_data->file);
+	custom_data->file = NULL;
+}
+
+// The segments hold length bytes, plus the NULL char of the frame if null_included
+static void write_record(StompAdapterRecorderData *custom_data, enum StompRecordType type, enum StompRecordDirection direction,
+		const struct iovec *iov, int iovcnt, int null_included) {
+	if (custom_data->file == NULL) return;
+
+	size_t written = 0;
+	for (int i = 0; i < iovcnt; i++) written += iov[i].iov_len;
+
+	size_t length = null_included && written > 0 ? written - 1 : written;
+	if (length > UINT32_MAX) {
+		stomp_log_error("frame of %zu bytes not recorded", length);
+		return;
+	}
+
+	StompRecord record;
+	record.time_ns = now_ns(CLOCK_MONOTONIC) - custom_data->start_ns;
+	record.length = length;
+	record.type = type;
+	record.direction = direction;
+	record.reserved = 0;
+
+	// NULL char and padding
+	static const char zeros[STOMP_RECORD_ALIGNMENT];
+	size_t padding = STOMP_RECORD_SIZE(length) - sizeof(StompRecord) - written;
+
+	int ok = fwrite(&record, sizeof(StompRecord), 1, custom_data->file) == 1;
+	for (int i = 0; ok && i < iovcnt; i++) {
+		ok = fwrite(iov[i].iov_base, 1, iov[i].iov_len, custom_data->file) == iov[i].iov_len;
+	}
+	if (ok) ok = fwrite(zeros, 1, padding, custom_data->file) == padding;
+
+	if (!ok) stop_recording(custom_data);
+}
+
+static void write_message(StompAdapterRecorderData *custom_data, enum StompRecordType type, enum StompRecordDirection direction,
+		char *message, size_t len) {
+	struct iovec iov;
+	iov.iov_base = message;
+	iov.iov_len = len + 1;
+
+	write_record(custom_data, type, direction, &iov, 1, 1);
+}
+
+static void flush_recording(StompAdapterRecorderData *custom_data) {
+	if (custom_data->file != NULL && fflush(custom_data->file)) stop_recording(custom_data);
+}
+
+static int onopen_callback(StompAdapter *adapter) {
+	StompAdapter *parent_adapter = adapter->parent_adapter;
+
+	write_record(get_adapter_custom_data(adapter), STOMP_RECORD_OPEN, STOMP_RECORD_IN, NULL, 0, 0);
+
+	adapter->status = connected;
+
+	return parent_adapter->onopen_callback(parent_adapter);
+}
+
+static int onmessage_callback(StompAdapter *adapter, char *message, size_t len) {
+	StompAdapter *parent_adapter = adapter->parent_adapter;
+
+	// before the parent parses it in place
+	write_message(get_adapter_custom_data(adapter), STOMP_RECORD_FRAME, STOMP_RECORD_IN, message, len);
+
+	return parent_adapter->onmessage_callback(parent_adapter, message, len);
+}
+
+static int onmessage_mapped_callback(StompAdapter *adapter, char *message, size_t len) {
+	StompAdapter *parent_adapter = adapter->parent_adapter;
+
+	write_message(get_adapter_custom_data(adapter), STOMP_RECORD_FRAME, STOMP_RECORD_IN, message, len);
+
+	return parent_adapter->onmessage_mapped_callback(parent_adapter, message, len);
+}
+
+static char* acquire_buffer_callback(StompAdapter *adapter, size_t len) {
+	StompAdapter *parent_adapter = adapter->parent_adapter;
+
+	return parent_adapter->acquire_buffer_callback(parent_adapter, len);
+}
+
+static int onerror_callback(StompAdapter *adapter, char *message) {
+	StompAdapter *parent_adapter = adapter->parent_adapter;
+
+	return parent_adapter->onerror_callback(parent_adapter, message);
+}
+
+static int onheartbeat_callback(StompAdapter *adapter) {
+	StompAdapter *parent_adapter = adapter->parent_adapter;
+
+	write_record(get_adapter_custom_data(adapter), STOMP_RECORD_HEARTBEAT, STOMP_RECORD_IN, NULL, 0, 0);
+
+	return parent_adapter->onheartbeat_callback(parent_adapter);
+}
+
+static int onclose_callback(StompAdapter *adapter, char *message) {
+	StompAdapterRecorderData *custom_data = get_adapter_custom_data(adapter);
+	StompAdapter *parent_adapter = adapter->parent_adapter;
+
+	write_message(custom_data, STOMP_RECORD_CLOSE, STOMP_RECORD_IN, message, message != NULL ? strlen(message) : 0);
+	flush_recording(custom_data);
+
+	adapter->status = disconnected;
+
+	return parent_adapter->onclose_callback(parent_adapter, message);
+}
+
+static int init_function(StompAdapter *adapter, StompAdapter *parent_adapter) {
+	if (adapter->status != created) return -1;
+
+	StompAdapterRecorderData *custom_data = get_adapter_custom_data(adapter);
+
+	custom_data->file = fopen(custom_data->path, "w");
+	if (custom_data->file == NULL) {
+		stomp_log_error("recording to %s failed: %s", custom_data->path, strerror(errno));
+		return -1;
+	}
+	setvbuf(custom_data->file, NULL, _IOFBF, STOMP_RECORDER_BUFFER_SIZE);
+
+	StompRecordFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, STOMP_RECORD_MAGIC, sizeof(header.magic));
+	header.version = STOMP_RECORD_VERSION;
+	header.start_epoch_ns = now_ns(CLOCK_REALTIME);
+	custom_data->start_ns = now_ns(CLOCK_MONOTONIC);
+
+	if (fwrite(&header, sizeof(header), 1, custom_data->file) != 1) stop_recording(custom_data);
+
+	adapter->parent_adapter = parent_adapter;
+
+	// the child only spills big frames to a mapping if the parent takes them
+	adapter->onmessage_mapped_callback = parent_adapter->onmessage_mapped_callback != NULL ? onmessage_mapped_callback : NULL;
+	adapter->acquire_buffer_callback = parent_adapter->acquire_buffer_callback != NULL ? acquire_buffer_callback : NULL;
+
+	adapter->status = initialized;
+
+	StompAdapter *child_adapter = adapter->child_adapter;
+	return child_adapter->init_function(child_adapter, adapter);
+}
+
+static int connect_function (StompAdapter *adapter) {
+	StompAdapter *child_adapter = adapter->child_adapter;
+
+	return child_adapter->connect_function(child_adapter);
+}
+
+static int send_function (StompAdapter *adapter, char *message) {
+	StompAdapter *child_adapter = adapter->child_adapter;
+
+	write_message(get_adapter_custom_data(adapter), STOMP_RECORD_FRAME, STOMP_RECORD_OUT, message, strlen(message));
+
+	return child_adapter->send_function(child_adapter, message);
+}
+
+static int sendv_function (StompAdapter *adapter, const struct iovec *iov, int iovcnt) {
+	StompAdapter *child_adapter = adapter->child_adapter;
+
+	write_record(get_adapter_custom_data(adapter), STOMP_RECORD_FRAME, STOMP_RECORD_OUT, iov, iovcnt, 1);
+
+	return child_adapter->sendv_function(child_adapter, iov, iovcnt);
+}
+
+static int sendv_async_function (StompAdapter *adapter, const struct iovec *iov, int iovcnt,
+		stomp_release_function release, void *release_data) {
+	StompAdapter *child_adapter = adapter->child_adapter;
+
+	write_record(get_adapter_custom_data(adapter), STOMP_RECORD_FRAME, STOMP_RECORD_OUT, iov, iovcnt, 1);
+
+	return child_adapter->sendv_async_function(child_adapter, iov, iovcnt, release, release_data);
+}
+
+static int send_frames_function (StompAdapter *adapter, const struct iovec *frames, int count) {
+	StompAdapter *child_adapter = adapter->child_adapter;
+
+	for (int i = 0; i < count; i++) {
+		write_record(get_adapter_custom_data(adapter), STOMP_RECORD_FRAME, STOMP_RECORD_OUT, &frames[i], 1, 1);
+	}
+
+	return child_adapter->send_frames_function(child_adapter, frames, count);
+}
+
+static int pause_function (StompAdapter *adapter, int paused) {
+	StompAdapter *child_adapter = adapter->child_adapter;
+
+	return child_adapter->pause_function(child_adapter, paused);
+}
+
+static int service_function (StompAdapter *adapter, int timeout_ms) {
+	StompAdapter *child_adapter = adapter->child_adapter;
+
+	return child_adapter->service_function(child_adapter, timeout_ms);
+}
+
+static int destroy_function (StompAdapter *adapter) {
+	if (adapter->status == destroyed) return -1;
+
+	StompAdapterRecorderData *custom_data = get_adapter_custom_data(adapter);
+	StompAdapter *child_adapter = adapter->child_adapter;
+
+	int ret = child_adapter->destroy_function(child_adapter);
+
+	if (custom_data->file != NULL && fclose(custom_data->file)) {
+		stomp_log_error("recording to %s failed: %s", custom_data->path, strerror(errno));
+	}
+
+	free(custom_data->path);
+	free(adapter->custom_data);
+	adapter->status = destroyed;
+
+	return ret;
+}
+
+static int restart_function(StompAdapter *adapter) {
+	if (adapter->status == destroyed) return -1;
+
+	flush_recording(get_adapter_custom_data(adapter));
+
+	StompAdapter *child_adapter = adapter->child_adapter;
+	if (child_adapter->restart_function(child_adapter) != 0) return -1;
+
+	adapter->status = initialized;
+
+	return 0;
+}
+
+StompAdapter stomp_recorder_adapter(StompAdapter *child_adapter, const char *path) {
+	StompAdapter adapter;
+
+	adapter.status = created;
+	adapter.init_function = init_function;
+	adapter.service_function = service_function;
+	adapter.connect_function = connect_function;
+	adapter.send_function = send_function;
+	adapter.sendv_function = child_adapter->sendv_function != NULL ? sendv_function : NULL;
+	adapter.sendv_async_function = child_adapter->sendv_async_function != NULL ? sendv_async_function : NULL;
+	adapter.send_frames_function = child_adapter->send_frames_function != NULL ? send_frames_function : NULL;
+	adapter.restart_function = restart_function;
+	adapter.pause_function = child_adapter->pause_function != NULL ? pause_function : NULL;
+	adapter.destroy_function = destroy_function;
+
+	adapter.onopen_callback = onopen_callback;
+	adapter.onmessage_callback = onmessage_callback;
+	adapter.onmessage_mapped_callback = NULL;
+	adapter.acquire_buffer_callback = NULL;
+	adapter.onerror_callback = onerror_callback;
+	adapter.onheartbeat_callback = onheartbeat_callback;
+	adapter.onclose_callback = onclose_callback;
+
+	adapter.child_adapter = child_adapter;
+	adapter.max_frame_length = child_adapter->max_frame_length;
+	adapter.max_message_length = child_adapter->max_message_length;
+
+	StompAdapterRecorderData *custom_data = calloc(1, sizeof(StompAdapterRecorderData));
+	custom_data->path = strdup(path);
+	adapter.custom_data = custom_data;
+
+	return adapter;
+}
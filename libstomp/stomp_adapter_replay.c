@@ -0,0 +1,317 @@
+/*
+ * libstomp - a free implementation of the stomp protocol than can be plugged
+ * to different connection implementations using an adapter interface.
+ *
+ * Copyright (C) 2017 Sergio Otero <sergio.otero@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+
+
+
+
+/*
+ * Replays a log of stomp_recorder_adapter, without network.
+ *
+ * The log is mapped copy on write and the frames the child adapter delivered are passed to
+ * onmessage_callback in place, with the recorded gaps divided by the speed: 1 is the original
+ * pace, 0 as fast as possible. Heartbeats and closes are replayed too, frames sent by the
+ * client are accepted and dropped. After a recorded close stomp_reconnect continues with the
+ * next connection of the log, its end closes the connection.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stomp_internal.h"
+
+// records delivered by a service call when they are all due, ie at speed 0
+#define STOMP_REPLAY_BATCH 1024
+
+typedef struct {
+	char *path;
+	char *map;
+	size_t map_len;
+	size_t offset; // of the next record
+
+	double speed;
+	int paused;
+
+	// a record of time_ns is due at base_now_ns + (time_ns - base_record_ns) / speed
+	long long base_record_ns;
+	long long base_now_ns;
+	long long last_record_ns;
+} StompAdapterReplayData;
+
+static StompAdapterReplayData* get_adapter_custom_data(StompAdapter *adapter) {
+	return (StompAdapterReplayData*)adapter->custom_data;
+}
+
+static long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void rebase(StompAdapterReplayData *custom_data, long long record_ns) {
+	custom_data->base_record_ns = record_ns;
+	custom_data->base_now_ns = now_ns();
+	custom_data->last_record_ns = record_ns;
+}
+
+int stomp_replay_set_speed(StompAdapter *adapter, double speed) {
+	if (adapter->status == destroyed || speed < 0) return -1;
+
+	StompAdapterReplayData *custom_data = get_adapter_custom_data(adapter);
+	custom_data->speed = speed;
+
+	// the new speed applies from the last record delivered
+	rebase(custom_data, custom_data->last_record_ns);
+
+	return 0;
+}
+
+// Next record the client sees, NULL at the end of the log. The frames it sent are skipped
+static StompRecord* next_record(StompAdapterReplayData *custom_data) {
+	while (custom_data->offset + sizeof(StompRecord) <= custom_data->map_len) {
+		StompRecord *record = (StompRecord*)&custom_data->map[custom_data->offset];
+
+		if (custom_data->offset + STOMP_RECORD_SIZE(record->length) > custom_data->map_len) {
+			stomp_log_error("replay %s is truncated", custom_data->path);
+			break;
+		}
+
+		if (record->type == STOMP_RECORD_FRAME && record->direction == STOMP_RECORD_OUT) {
+			custom_data->offset += STOMP_RECORD_SIZE(record->length);
+			continue;
+		}
+
+		return record;
+	}
+
+	custom_data->offset = custom_data->map_len;
+
+	return NULL;
+}
+
+static long long due_ns(StompAdapterReplayData *custom_data, StompRecord *record) {
+	if (custom_data->speed == 0) return 0;
+
+	return custom_data->base_now_ns + (long long) ((long long) (record->time_ns - custom_data->base_record_ns) / custom_data->speed);
+}
+
+static int init_function(StompAdapter *adapter, StompAdapter *parent_adapter) {
+	if (adapter->status != created) return -1;
+
+	StompAdapterReplayData *custom_data = get_adapter_custom_data(adapter);
+
+	int fd = open(custom_data->path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st)) {
+		stomp_log_error("replay %s: %s", custom_data->path, strerror(errno));
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+
+	StompRecordFileHeader *header = NULL;
+	if (st.st_size >= sizeof(StompRecordFileHeader)) {
+		// copy on write, the parent may parse the frames in place
+		header = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (header == MAP_FAILED) header = NULL;
+	}
+	close(fd);
+
+	if (header == NULL || memcmp(header->magic, STOMP_RECORD_MAGIC, sizeof(header->magic)) || header->version != STOMP_RECORD_VERSION) {
+		stomp_log_error("replay %s is not a recording", custom_data->path);
+		if (header != NULL) munmap(header, st.st_size);
+		return -1;
+	}
+
+	custom_data->map = (char*)header;
+	custom_data->map_len = st.st_size;
+	custom_data->offset = sizeof(StompRecordFileHeader);
+
+	adapter->parent_adapter = parent_adapter;
+
+	adapter->status = initialized;
+
+	return 0;
+}
+
+static int connect_function (StompAdapter *adapter) {
+	if (adapter->status != initialized) return -1;
+
+	get_adapter_custom_data(adapter)->paused = 0;
+
+	// onopen_callback from the first service call
+	adapter->status = preconnected;
+
+	return 0;
+}
+
+// The client frames were recorded, not replayed
+static int send_function (StompAdapter *adapter, char *message) {
+	return adapter->status == connected ? 0 : -1;
+}
+
+static int sendv_function (StompAdapter *adapter, const struct iovec *iov, int iovcnt) {
+	return adapter->status == connected ? 0 : -1;
+}
+
+static int send_frames_function (StompAdapter *adapter, const struct iovec *frames, int count) {
+	return adapter->status == connected ? 0 : -1;
+}
+
+static int pause_function (StompAdapter *adapter, int paused) {
+	if (adapter->status != connected) return -1;
+
+	get_adapter_custom_data(adapter)->paused = paused;
+
+	return 0;
+}
+
+static int connection_lost(StompAdapter *adapter, char *message) {
+	StompAdapter *parent_adapter = adapter->parent_adapter;
+
+	adapter->status = disconnected;
+	parent_adapter->onclose_callback(parent_adapter, message);
+
+	return -1;
+}
+
+static int service_function (StompAdapter *adapter, int timeout_ms) {
+	StompAdapterReplayData *custom_data = get_adapter_custom_data(adapter);
+	StompAdapter *parent_adapter = adapter->parent_adapter;
+
+	if (adapter->status == preconnected) {
+		StompRecord *record = next_record(custom_data);
+
+		// the recorded connection starts at its open
+		if (record != NULL && record->type == STOMP_RECORD_OPEN) custom_data->offset += STOMP_RECORD_SIZE(record->length);
+		rebase(custom_data, record != NULL ? record->time_ns : 0);
+
+		adapter->status = connected;
+		parent_adapter->onopen_callback(parent_adapter);
+	}
+
+	if (adapter->status != connected) return -1;
+
+	StompRecord *record = next_record(custom_data);
+	if (record == NULL) return connection_lost(adapter, "end of the recording");
+
+	long long now = now_ns();
+
+	// sleeps as on a socket, until timeout_ms or the next record is due
+	if (timeout_ms > 0 && (custom_data->paused || due_ns(custom_data, record) > now)) {
+		long long wait_ns = timeout_ms * 1000000LL;
+		if (!custom_data->paused && due_ns(custom_data, record) - now < wait_ns) wait_ns = due_ns(custom_data, record) - now;
+
+		struct timespec ts;
+		ts.tv_sec = wait_ns / 1000000000LL;
+		ts.tv_nsec = wait_ns % 1000000000LL;
+		nanosleep(&ts, NULL);
+
+		now = now_ns();
+	}
+
+	for (int i = 0; i < STOMP_REPLAY_BATCH && !custom_data->paused && adapter->status == connected; i++) {
+		record = next_record(custom_data);
+		if (record == NULL || due_ns(custom_data, record) > now) break;
+
+		custom_data->offset += STOMP_RECORD_SIZE(record->length);
+		custom_data->last_record_ns = record->time_ns;
+
+		char *data = (char*)&record[1];
+
+		switch (record->type) {
+		case STOMP_RECORD_FRAME:
+			parent_adapter->onmessage_callback(parent_adapter, data, record->length);
+			break;
+		case STOMP_RECORD_HEARTBEAT:
+			parent_adapter->onheartbeat_callback(parent_adapter);
+			break;
+		case STOMP_RECORD_CLOSE:
+			return connection_lost(adapter, data);
+		}
+	}
+
+	return 0;
+}
+
+static int destroy_function_internal (StompAdapter *adapter, int reconnect) {
+	if (adapter->status == destroyed) return -1;
+
+	StompAdapterReplayData *custom_data = get_adapter_custom_data(adapter);
+
+	if (reconnect) {
+		adapter->status = initialized;
+	} else {
+		if (custom_data->map != NULL) munmap(custom_data->map, custom_data->map_len);
+		free(custom_data->path);
+		free(adapter->custom_data);
+		adapter->status = destroyed;
+	}
+
+	return 0;
+}
+
+static int destroy_function (StompAdapter *adapter) {
+	return destroy_function_internal(adapter, 0);
+}
+
+static int restart_function(StompAdapter *adapter) {
+	if (adapter->status == destroyed) return -1;
+
+	if (destroy_function_internal(adapter, 1) != 0) return -1;
+
+	adapter->status = initialized;
+
+	return 0;
+}
+
+StompAdapter stomp_replay_adapter(const char *path, int max_frame_length) {
+	StompAdapter adapter;
+
+	adapter.status = created;
+	adapter.init_function = init_function;
+	adapter.service_function = service_function;
+	adapter.connect_function = connect_function;
+	adapter.send_function = send_function;
+	adapter.sendv_function = sendv_function;
+	adapter.sendv_async_function = NULL;
+	adapter.send_frames_function = send_frames_function;
+	adapter.restart_function = restart_function;
+	adapter.pause_function = pause_function;
+	adapter.destroy_function = destroy_function;
+	adapter.max_frame_length = max_frame_length;
+	adapter.max_message_length = SIZE_MAX;
+
+	StompAdapterReplayData *custom_data = calloc(1, sizeof(StompAdapterReplayData));
+	custom_data->path = strdup(path);
+	custom_data->speed = 1;
+	adapter.custom_data = custom_data;
+
+	return adapter;
+}
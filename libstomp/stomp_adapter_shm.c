@@ -0,0 +1,333 @@
+/*
+ * libstomp - a free implementation of the stomp protocol than can be plugged
+ * to different connection implementations using an adapter interface.
+ *
+ * Copyright (C) 2017 Sergio Otero <sergio.otero@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+
+
+
+
+/*
+ * STOMP through shared memory with a peer on the same host, usually a broker sidecar.
+ *
+ * Every frame is one message of the stomp_shm.c rings, NULL char included, so there is
+ * no stream to parse and received frames are handed to the parent in place. Sends are
+ * copied to the ring and published at the end of each call, frames that find the ring
+ * full are queued and written from service_function.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stomp_internal.h"
+
+// Frame waiting for room in the ring
+typedef struct StompShmMessage {
+	struct StompShmMessage *next;
+	size_t len;
+	char data[];
+} StompShmMessage;
+
+typedef struct {
+	char *name;
+	StompShm *shm;
+	int paused;
+
+	StompShmMessage *tx_head;
+	StompShmMessage *tx_tail;
+} StompAdapterShmData;
+
+static StompAdapterShmData* get_adapter_custom_data(StompAdapter *adapter) {
+	return (StompAdapterShmData*)adapter->custom_data;
+}
+
+static int init_function(StompAdapter *adapter, StompAdapter *parent_adapter) {
+	if (adapter->status != created) return -1;
+
+	adapter->parent_adapter = parent_adapter;
+
+	adapter->status = initialized;
+
+	return 0;
+}
+
+static void close_connection(StompAdapterShmData *custom_data) {
+	if (custom_data->shm != NULL) {
+		stomp_shm_detach(custom_data->shm);
+		custom_data->shm = NULL;
+	}
+
+	StompShmMessage *message = custom_data->tx_head;
+	while (message != NULL) {
+		StompShmMessage *next = message->next;
+		free(message);
+		message = next;
+	}
+
+	custom_data->tx_head = NULL;
+	custom_data->tx_tail = NULL;
+}
+
+static void connection_lost(StompAdapter *adapter, char *message) {
+	if (adapter->status != preconnected && adapter->status != connected) return;
+
+	adapter->status = disconnected;
+
+	adapter->parent_adapter->onclose_callback(adapter->parent_adapter, message);
+}
+
+static int connect_function (StompAdapter *adapter) {
+	if (adapter->status != initialized) return -1;
+
+	StompAdapterShmData *custom_data = get_adapter_custom_data(adapter);
+
+	custom_data->shm = stomp_shm_attach(custom_data->name);
+	if (custom_data->shm == NULL) return -1;
+
+	if (stomp_shm_max_message_length(custom_data->shm) < adapter->max_frame_length) {
+		stomp_log_error("shm %s rings are smaller than max_frame_length %d", custom_data->name, adapter->max_frame_length);
+		close_connection(custom_data);
+		return -1;
+	}
+
+	custom_data->paused = 0;
+
+	// onopen_callback from the first service call
+	adapter->status = preconnected;
+
+	return 0;
+}
+
+// Writes the queued frames until the ring is full
+static int flush_queue(StompAdapterShmData *custom_data) {
+	while (custom_data->tx_head != NULL) {
+		StompShmMessage *message = custom_data->tx_head;
+
+		struct iovec iov;
+		iov.iov_base = message->data;
+		iov.iov_len = message->len;
+
+		int ret = stomp_shm_write(custom_data->shm, &iov, 1);
+		if (ret < 0) return -1;
+		if (ret > 0) break;
+
+		custom_data->tx_head = message->next;
+		free(message);
+	}
+	if (custom_data->tx_head == NULL) custom_data->tx_tail = NULL;
+
+	stomp_shm_flush(custom_data->shm);
+
+	return 0;
+}
+
+// Copies one frame to the ring, or to the queue behind the frames already waiting. Published by the caller
+static int write_frame(StompAdapter *adapter, const struct iovec *iov, int iovcnt) {
+	StompAdapterShmData *custom_data = get_adapter_custom_data(adapter);
+
+	int ret = custom_data->tx_head != NULL ? 1 : stomp_shm_write(custom_data->shm, iov, iovcnt);
+	if (ret < 0) {
+		connection_lost(adapter, "connection closed");
+		return -1;
+	}
+	if (ret == 0) return 0;
+
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+
+	StompShmMessage *message = malloc(sizeof(StompShmMessage) + len);
+	if (message == NULL) return -1;
+
+	message->next = NULL;
+	message->len = len;
+	char *pos = message->data;
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+
+	if (custom_data->tx_tail != NULL) {
+		custom_data->tx_tail->next = message;
+	} else {
+		custom_data->tx_head = message;
+	}
+	custom_data->tx_tail = message;
+
+	return 0;
+}
+
+static int send_frames_function (StompAdapter *adapter, const struct iovec *frames, int count) {
+	if (adapter->status != connected) return -1;
+
+	for (int i = 0; i < count; i++) {
+		if (write_frame(adapter, &frames[i], 1)) return -1;
+	}
+
+	// one wake up for all of them
+	stomp_shm_flush(get_adapter_custom_data(adapter)->shm);
+
+	return 0;
+}
+
+static int send_function (StompAdapter *adapter, char *message) {
+	struct iovec iov;
+	iov.iov_base = message;
+	iov.iov_len = strlen(message) + 1; // send the null char
+
+	return send_frames_function(adapter, &iov, 1);
+}
+
+static int sendv_function (StompAdapter *adapter, const struct iovec *iov, int iovcnt) {
+	if (adapter->status != connected) return -1;
+
+	if (write_frame(adapter, iov, iovcnt)) return -1;
+
+	stomp_shm_flush(get_adapter_custom_data(adapter)->shm);
+
+	return 0;
+}
+
+// Delivers the frames in the ring until it is empty or the parent pauses
+static void read_input(StompAdapter *adapter) {
+	StompAdapterShmData *custom_data = get_adapter_custom_data(adapter);
+	StompAdapter *parent_adapter = adapter->parent_adapter;
+
+	char *message;
+	size_t len;
+	while (!custom_data->paused && adapter->status == connected && (message = stomp_shm_read(custom_data->shm, &len)) != NULL) {
+		// the parent gets the frame without its NULL char, still there at message[len]
+		if (len == 0 || message[len - 1] != '\0') {
+			stomp_log_error("shm %s message of %zu bytes is not NULL terminated", custom_data->name, len);
+			connection_lost(adapter, "invalid frame");
+			break;
+		}
+		len--;
+
+		// a frame of an EOL is a heartbeat
+		if (len == 0 || (len == 1 && *message == '\n')) {
+			parent_adapter->onheartbeat_callback(parent_adapter);
+		} else {
+			parent_adapter->onmessage_callback(parent_adapter, message, len);
+		}
+	}
+
+	// the parent copies the frames, their room can be reused
+	if (custom_data->shm != NULL) stomp_shm_release(custom_data->shm);
+}
+
+static int pause_function (StompAdapter *adapter, int paused) {
+	if (adapter->status != connected) return -1;
+
+	get_adapter_custom_data(adapter)->paused = paused;
+
+	return 0;
+}
+
+static int service_function (StompAdapter *adapter, int timeout_ms) {
+	StompAdapterShmData *custom_data = get_adapter_custom_data(adapter);
+
+	if (adapter->status == preconnected) {
+		adapter->status = connected;
+		adapter->parent_adapter->onopen_callback(adapter->parent_adapter);
+		return 0;
+	}
+
+	if (adapter->status != connected) return -1;
+
+	int events = (custom_data->paused ? 0 : STOMP_SHM_READABLE) | (custom_data->tx_head != NULL ? STOMP_SHM_WRITABLE : 0);
+	stomp_shm_wait(custom_data->shm, timeout_ms, events);
+
+	if (custom_data->tx_head != NULL && flush_queue(custom_data)) {
+		connection_lost(adapter, "connection closed");
+		return -1;
+	}
+
+	read_input(adapter);
+	if (adapter->status != connected) return -1;
+
+	// frames left before a pause are delivered once it ends
+	if (adapter->status == connected && !custom_data->paused && stomp_shm_closed(custom_data->shm)) {
+		connection_lost(adapter, "connection closed");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int destroy_function_internal (StompAdapter *adapter, int reconnect) {
+	if (adapter->status == destroyed) return -1;
+
+	StompAdapterShmData *custom_data = get_adapter_custom_data(adapter);
+
+	close_connection(custom_data);
+
+	if (reconnect) {
+		adapter->status = initialized;
+	} else {
+		free(adapter->custom_data);
+		adapter->status = destroyed;
+	}
+
+	return 0;
+}
+
+static int destroy_function (StompAdapter *adapter) {
+	return destroy_function_internal(adapter, 0);
+}
+
+static int restart_function(StompAdapter *adapter) {
+	if (adapter->status == destroyed) return -1;
+
+	if (destroy_function_internal(adapter, 1) != 0) return -1;
+
+	adapter->status = initialized;
+
+	return 0;
+}
+
+StompAdapter stomp_shm_adapter(char *name, int max_frame_length) {
+	StompAdapter adapter;
+
+	adapter.status = created;
+	adapter.init_function = init_function;
+	adapter.service_function = service_function;
+	adapter.connect_function = connect_function;
+	adapter.send_function = send_function;
+	adapter.sendv_function = sendv_function;
+	adapter.sendv_async_function = NULL;
+	adapter.send_frames_function = send_frames_function;
+	adapter.restart_function = restart_function;
+	adapter.pause_function = pause_function;
+	adapter.destroy_function = destroy_function;
+	adapter.max_frame_length = max_frame_length;
+	adapter.max_message_length = 0;
+
+	StompAdapterShmData *custom_data = malloc(sizeof(StompAdapterShmData));
+	custom_data->name = name;
+	custom_data->shm = NULL;
+	custom_data->paused = 0;
+	custom_data->tx_head = NULL;
+	custom_data->tx_tail = NULL;
+	adapter.custom_data = custom_data;
+
+	return adapter;
+}
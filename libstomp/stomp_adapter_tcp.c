@@ -0,0 +1,1341 @@
+/*
+ * libstomp - a free implementation of the stomp protocol than can be plugged
+ * to different connection implementations using an adapter interface.
+ *
+ * Copyright (C) 2017 Sergio Otero <sergio.otero@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+
+
+
+/*
+ * Native STOMP over TCP or unix domain sockets, optionally with TLS.
+ *
+ * The socket is non blocking and watched with epoll in service_function. Frames end
+ * with a NULL char, or after content-length bytes of body, and the EOLs between them
+ * are heartbeats. Frames are parsed from a read buffer of max_frame_length, larger
+ * ones are reassembled in a StompRxBuffer.
+ *
+ * Sends are written straight to the socket. Whatever does not fit is queued, copied
+ * or held until released for sendv_async_function, and flushed on EPOLLOUT.
+ *
+ * With STOMP_TCP_ENGINE_URING the plain sockets use the process wide io_uring of
+ * stomp_uring.c instead: received data comes from a multishot recv, sends are staged in
+ * the connection send buffer and every request is submitted by the next service call.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#ifdef HAVE_OPENSSL
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#endif
+
+#include "stomp_internal.h"
+
+#define STOMP_TCP_MAX_IOV 64
+#define STOMP_TLS_RECORD_SIZE 16384
+
+// Bytes waiting for the socket to accept them
+typedef struct StompTcpMessage {
+	struct StompTcpMessage *next;
+	const struct iovec *iov;
+	int iovcnt;
+	int iov_index;
+	size_t iov_offset;
+	stomp_release_function release; // held segments of sendv_async_function
+	void *release_data;
+	struct iovec copy; // the only segment of a copied message, pointing to data
+	char data[];
+} StompTcpMessage;
+
+enum StompTcpConnecting {
+	STOMP_TCP_CONNECTED,
+	STOMP_TCP_CONNECTING, // waiting for the socket connect
+	STOMP_TCP_HANDSHAKE // waiting for the TLS handshake
+};
+
+typedef struct {
+	char *url;
+	StompTlsOptions tls;
+	size_t spill_threshold;
+	enum StompTcpEngine engine;
+
+	int fd;
+	int epoll_fd;
+	unsigned int events; // registered in epoll
+	enum StompTcpConnecting connecting;
+	unsigned int handshake_events;
+	int paused;
+
+	int use_tls;
+	char host[256]; // for SNI and the certificate check
+	struct addrinfo *addresses; // resolved host, until the socket is connected
+	struct addrinfo *next_address; // tried if the connect to the current one fails
+#ifdef HAVE_OPENSSL
+	SSL_CTX *ssl_ctx;
+	SSL *ssl;
+	char *tls_buffer; // TLS records are gathered here
+	size_t tls_retry_len; // an SSL_write that wants to be repeated with the same length
+#endif
+
+	char *rx; // max_frame_length bytes, complete frames are parsed in place
+	size_t rx_len;
+	StompRxBuffer large; // frame that does not fit in rx
+	size_t large_remaining; // bytes of the large frame still to read with its NULL char, SIZE_MAX if unknown
+
+	StompTcpMessage *tx_head;
+	StompTcpMessage *tx_tail;
+
+	StompUringOwner *uring; // NULL with epoll
+	size_t send_len; // bytes staged in uring->send_buffer
+	size_t send_offset; // of them already written
+	int send_in_flight;
+	int send_result; // of a SEND_ZC waiting for its notification
+	int recv_armed;
+} StompAdapterTcpData;
+
+static StompAdapterTcpData* get_adapter_custom_data(StompAdapter *adapter) {
+	return (StompAdapterTcpData*)adapter->custom_data;
+}
+
+StompTlsOptions stomp_tcp_default_tls_options(void) {
+	StompTlsOptions options;
+
+	options.verify_peer = 1;
+	options.ca_file = NULL;
+	options.cert_file = NULL;
+	options.key_file = NULL;
+
+	return options;
+}
+
+int stomp_tcp_set_tls_options(StompAdapter *adapter, const StompTlsOptions *options) {
+	if (adapter->status != created && adapter->status != initialized) return -1;
+
+#ifdef HAVE_OPENSSL
+	get_adapter_custom_data(adapter)->tls = *options;
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+int stomp_tcp_set_engine(StompAdapter *adapter, enum StompTcpEngine engine) {
+	if (adapter->status != created && adapter->status != initialized) return -1;
+
+#ifdef HAVE_IO_URING
+	if (engine == STOMP_TCP_ENGINE_URING && !stomp_uring_supported()) return -1;
+#else
+	if (engine == STOMP_TCP_ENGINE_URING) return -1;
+#endif
+
+	get_adapter_custom_data(adapter)->engine = engine;
+
+	return 0;
+}
+
+static int init_function(StompAdapter *adapter, StompAdapter *parent_adapter) {
+	if (adapter->status != created) return -1;
+
+	adapter->parent_adapter = parent_adapter;
+
+	adapter->status = initialized;
+
+	return 0;
+}
+
+static void update_events(StompAdapterTcpData *custom_data) {
+	if (custom_data->epoll_fd < 0) return;
+
+	unsigned int events;
+	if (custom_data->connecting == STOMP_TCP_CONNECTING) {
+		events = EPOLLOUT;
+	} else if (custom_data->connecting == STOMP_TCP_HANDSHAKE) {
+		events = custom_data->handshake_events;
+	} else {
+		events = (custom_data->paused ? 0 : EPOLLIN) | (custom_data->tx_head != NULL ? EPOLLOUT : 0);
+	}
+
+	if (events == custom_data->events) return;
+
+	struct epoll_event event;
+	event.events = events;
+	event.data.ptr = custom_data;
+	if (epoll_ctl(custom_data->epoll_fd, EPOLL_CTL_MOD, custom_data->fd, &event) == 0) {
+		custom_data->events = events;
+	}
+}
+
+static void free_message(StompTcpMessage *message) {
+	if (message->release != NULL) message->release(message->release_data);
+	free(message);
+}
+
+static void free_tx_queue(StompAdapterTcpData *custom_data) {
+	StompTcpMessage *message = custom_data->tx_head;
+	while (message != NULL) {
+		StompTcpMessage *next = message->next;
+		free_message(message);
+		message = next;
+	}
+
+	custom_data->tx_head = NULL;
+	custom_data->tx_tail = NULL;
+}
+
+static void free_addresses(StompAdapterTcpData *custom_data) {
+	if (custom_data->addresses != NULL) freeaddrinfo(custom_data->addresses);
+	custom_data->addresses = NULL;
+	custom_data->next_address = NULL;
+}
+
+static void close_connection(StompAdapterTcpData *custom_data) {
+#ifdef HAVE_OPENSSL
+	if (custom_data->ssl != NULL) {
+		SSL_free(custom_data->ssl);
+		custom_data->ssl = NULL;
+	}
+	if (custom_data->ssl_ctx != NULL) {
+		SSL_CTX_free(custom_data->ssl_ctx);
+		custom_data->ssl_ctx = NULL;
+	}
+	free(custom_data->tls_buffer);
+	custom_data->tls_buffer = NULL;
+	custom_data->tls_retry_len = 0;
+#endif
+	if (custom_data->epoll_fd >= 0) {
+		close(custom_data->epoll_fd);
+		custom_data->epoll_fd = -1;
+	}
+#ifdef HAVE_IO_URING
+	if (custom_data->uring != NULL) {
+		stomp_uring_close(custom_data->uring, custom_data->fd);
+		custom_data->uring = NULL;
+	}
+	custom_data->send_len = 0;
+	custom_data->send_offset = 0;
+	custom_data->send_in_flight = 0;
+	custom_data->recv_armed = 0;
+#endif
+	if (custom_data->fd >= 0) {
+		close(custom_data->fd);
+		custom_data->fd = -1;
+	}
+	free_addresses(custom_data);
+
+	free_tx_queue(custom_data);
+	stomp_rx_buffer_free(&custom_data->large);
+	custom_data->large_remaining = 0;
+	free(custom_data->rx);
+	custom_data->rx = NULL;
+	custom_data->rx_len = 0;
+}
+
+// The socket is kept until the adapter is restarted or destroyed
+static void connection_lost(StompAdapter *adapter, char *message) {
+	if (adapter->status != preconnected && adapter->status != connected) return;
+
+	adapter->status = disconnected;
+
+	adapter->parent_adapter->onclose_callback(adapter->parent_adapter, message);
+}
+
+// Splits tcp://host:port, ssl://host:port, tls://host:port and unix:///path
+static int parse_url(StompAdapterTcpData *custom_data, char *scheme, size_t scheme_size, char *port, size_t port_size,
+		char *path, size_t path_size) {
+	const char *url = custom_data->url;
+	const char *sep = strstr(url, "://");
+	if (sep == NULL || sep - url >= scheme_size) return -1;
+
+	snprintf(scheme, scheme_size, "%.*s", (int)(sep - url), url);
+	const char *rest = sep + 3;
+
+	custom_data->use_tls = !strcmp(scheme, "ssl") || !strcmp(scheme, "tls");
+
+	if (!strcmp(scheme, "unix")) {
+		if (strlen(rest) >= path_size) return -1;
+		strcpy(path, rest);
+		return 0;
+	}
+
+	const char *host = rest, *host_end;
+	if (*rest == '[') {
+		// [ipv6]:port
+		host = rest + 1;
+		host_end = strchr(host, ']');
+		if (host_end == NULL) return -1;
+		rest = host_end + 1;
+	} else {
+		host_end = rest + strcspn(rest, ":/");
+		rest = host_end;
+	}
+
+	if (host_end - host >= sizeof(custom_data->host) || host_end == host) return -1;
+	snprintf(custom_data->host, sizeof(custom_data->host), "%.*s", (int)(host_end - host), host);
+
+	if (*rest == ':') {
+		rest++;
+		snprintf(port, port_size, "%.*s", (int)strcspn(rest, "/"), rest);
+	} else {
+		snprintf(port, port_size, "%s", custom_data->use_tls ? "61614" : "61613");
+	}
+
+	return 0;
+}
+
+// Starts connecting to the next resolved address that takes a socket, it is custom_data->fd
+static int connect_next_address(StompAdapterTcpData *custom_data) {
+	while (custom_data->next_address != NULL) {
+		struct addrinfo *address = custom_data->next_address;
+		custom_data->next_address = address->ai_next;
+
+		int fd = socket(address->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0) continue;
+
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		if (connect(fd, address->ai_addr, address->ai_addrlen) == 0 || errno == EINPROGRESS) {
+			custom_data->fd = fd;
+			return 0;
+		}
+
+		close(fd);
+	}
+
+	return -1;
+}
+
+static int open_socket(StompAdapterTcpData *custom_data) {
+	char scheme[16], port[16], path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+	if (parse_url(custom_data, scheme, sizeof(scheme), port, sizeof(port), path, sizeof(path))) {
+		stomp_log_error("Error parsing URL %s", custom_data->url);
+		return -1;
+	}
+
+	if (!strcmp(scheme, "unix")) {
+		struct sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		strcpy(address.sun_path, path);
+
+		custom_data->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (custom_data->fd < 0) return -1;
+
+		if (connect(custom_data->fd, (struct sockaddr *)&address, sizeof(address)) && errno != EINPROGRESS && errno != EAGAIN) {
+			stomp_log_error("Error connecting to %s: %s", custom_data->url, strerror(errno));
+			return -1;
+		}
+
+		return 0;
+	}
+
+	if (strcmp(scheme, "tcp") && !custom_data->use_tls) {
+		stomp_log_error("Unknown scheme %s", scheme);
+		return -1;
+	}
+
+#ifndef HAVE_OPENSSL
+	if (custom_data->use_tls) {
+		stomp_log_error("libstomp is built without TLS support");
+		return -1;
+	}
+#endif
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int ret = getaddrinfo(custom_data->host, port, &hints, &custom_data->addresses);
+	if (ret) {
+		custom_data->addresses = NULL;
+		stomp_log_error("Error resolving %s: %s", custom_data->host, gai_strerror(ret));
+		return -1;
+	}
+	custom_data->next_address = custom_data->addresses;
+
+	if (connect_next_address(custom_data)) {
+		stomp_log_error("Error connecting to %s", custom_data->url);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int connect_function (StompAdapter *adapter) {
+	if (adapter->status != initialized) return -1;
+
+	StompAdapterTcpData *custom_data = get_adapter_custom_data(adapter);
+
+	if (open_socket(custom_data)) {
+		close_connection(custom_data);
+		return -1;
+	}
+
+	custom_data->rx = malloc(adapter->max_frame_length);
+
+	// without the mapped callback a big frame stays in the heap
+	stomp_rx_buffer_init(&custom_data->large, adapter->parent_adapter->onmessage_mapped_callback != NULL ? custom_data->spill_threshold : 0);
+
+	custom_data->connecting = STOMP_TCP_CONNECTING;
+	custom_data->paused = 0;
+
+#ifdef HAVE_IO_URING
+	// OpenSSL reads and writes the TLS records on the socket itself
+	if (custom_data->engine == STOMP_TCP_ENGINE_URING && !custom_data->use_tls) {
+		custom_data->uring = stomp_uring_open(adapter);
+		if (custom_data->uring == NULL) stomp_log_info("io_uring not available, %s uses epoll", custom_data->url);
+	}
+
+	if (custom_data->uring != NULL) {
+		if (custom_data->rx == NULL || stomp_uring_poll(custom_data->uring, custom_data->fd, POLLOUT)) {
+			close_connection(custom_data);
+			return -1;
+		}
+
+		adapter->status = preconnected;
+
+		return 0;
+	}
+#endif
+
+	custom_data->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	struct epoll_event event;
+	event.events = custom_data->events = EPOLLOUT;
+	event.data.ptr = custom_data;
+	if (custom_data->rx == NULL || custom_data->epoll_fd < 0 || epoll_ctl(custom_data->epoll_fd, EPOLL_CTL_ADD, custom_data->fd, &event)) {
+		close_connection(custom_data);
+		return -1;
+	}
+
+	adapter->status = preconnected;
+
+	return 0;
+}
+
+#ifdef HAVE_OPENSSL
+static void log_tls_error(const char *message) {
+	char error[256];
+	ERR_error_string_n(ERR_get_error(), error, sizeof(error));
+	stomp_log_error("%s: %s", message, error);
+}
+
+static int start_tls(StompAdapterTcpData *custom_data) {
+	StompTlsOptions *options = &custom_data->tls;
+
+	custom_data->ssl_ctx = SSL_CTX_new(TLS_client_method());
+	if (custom_data->ssl_ctx == NULL) {
+		log_tls_error("Error creating the TLS context");
+		return -1;
+	}
+
+	SSL_CTX_set_min_proto_version(custom_data->ssl_ctx, TLS1_2_VERSION);
+	SSL_CTX_set_mode(custom_data->ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	if (options->verify_peer) {
+		SSL_CTX_set_verify(custom_data->ssl_ctx, SSL_VERIFY_PEER, NULL);
+		int loaded = options->ca_file != NULL
+				? SSL_CTX_load_verify_locations(custom_data->ssl_ctx, options->ca_file, NULL)
+				: SSL_CTX_set_default_verify_paths(custom_data->ssl_ctx);
+		if (!loaded) {
+			log_tls_error("Error loading the CA certificates");
+			return -1;
+		}
+	}
+
+	if (options->cert_file != NULL && (SSL_CTX_use_certificate_chain_file(custom_data->ssl_ctx, options->cert_file) != 1 ||
+			SSL_CTX_use_PrivateKey_file(custom_data->ssl_ctx, options->key_file ? options->key_file : options->cert_file, SSL_FILETYPE_PEM) != 1)) {
+		log_tls_error("Error loading the client certificate");
+		return -1;
+	}
+
+	custom_data->ssl = SSL_new(custom_data->ssl_ctx);
+	custom_data->tls_buffer = malloc(STOMP_TLS_RECORD_SIZE);
+	if (custom_data->ssl == NULL || custom_data->tls_buffer == NULL) return -1;
+
+	SSL_set_fd(custom_data->ssl, custom_data->fd);
+
+	// IP addresses are checked against the certificate IP SANs and are not sent as SNI
+	X509_VERIFY_PARAM *param = SSL_get0_param(custom_data->ssl);
+	if (X509_VERIFY_PARAM_set1_ip_asc(param, custom_data->host) != 1) {
+		SSL_set_tlsext_host_name(custom_data->ssl, custom_data->host);
+		if (options->verify_peer) SSL_set1_host(custom_data->ssl, custom_data->host);
+	}
+
+	return 0;
+}
+
+// 1 when done, 0 waiting for the socket, -1 on error
+static int continue_handshake(StompAdapterTcpData *custom_data) {
+	int ret = SSL_connect(custom_data->ssl);
+	if (ret == 1) return 1;
+
+	switch (SSL_get_error(custom_data->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+			custom_data->handshake_events = EPOLLIN;
+			return 0;
+		case SSL_ERROR_WANT_WRITE:
+			custom_data->handshake_events = EPOLLOUT;
+			return 0;
+		default:
+			log_tls_error("TLS handshake failed");
+			return -1;
+	}
+}
+#endif
+
+// The connect to an address failed, ie IPv6 without a route on a dual stack host. Moves to the next
+// one with a new socket, waiting for it like connect_function
+static int retry_connect(StompAdapterTcpData *custom_data) {
+	int fd = custom_data->fd;
+	if (connect_next_address(custom_data)) return -1;
+
+	if (custom_data->epoll_fd >= 0) epoll_ctl(custom_data->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+
+#ifdef HAVE_IO_URING
+	if (custom_data->uring != NULL) return stomp_uring_poll(custom_data->uring, custom_data->fd, POLLOUT);
+#endif
+
+	struct epoll_event event;
+	event.events = custom_data->events = EPOLLOUT;
+	event.data.ptr = custom_data;
+
+	return epoll_ctl(custom_data->epoll_fd, EPOLL_CTL_ADD, custom_data->fd, &event);
+}
+
+// Progresses the socket connect and the TLS handshake, onopen_callback once both are done
+static int continue_connect(StompAdapter *adapter) {
+	StompAdapterTcpData *custom_data = get_adapter_custom_data(adapter);
+
+	if (custom_data->connecting == STOMP_TCP_CONNECTING) {
+		int error = 0;
+		socklen_t len = sizeof(error);
+		if (getsockopt(custom_data->fd, SOL_SOCKET, SO_ERROR, &error, &len) || error) {
+			if (custom_data->next_address != NULL) {
+				stomp_log_info("Error connecting to %s: %s, trying the next address", custom_data->url, strerror(error));
+				if (retry_connect(custom_data) == 0) return 0;
+			}
+
+			stomp_log_error("Error connecting to %s: %s", custom_data->url, strerror(error));
+			connection_lost(adapter, "connection error");
+			return -1;
+		}
+
+		free_addresses(custom_data);
+		custom_data->connecting = STOMP_TCP_CONNECTED;
+#ifdef HAVE_OPENSSL
+		if (custom_data->use_tls) {
+			if (start_tls(custom_data)) {
+				connection_lost(adapter, "tls error");
+				return -1;
+			}
+			custom_data->connecting = STOMP_TCP_HANDSHAKE;
+		}
+#endif
+	}
+
+#ifdef HAVE_OPENSSL
+	if (custom_data->connecting == STOMP_TCP_HANDSHAKE) {
+		int ret = continue_handshake(custom_data);
+		if (ret < 0) {
+			connection_lost(adapter, "tls handshake failed");
+			return -1;
+		}
+		if (ret == 0) {
+			update_events(custom_data);
+			return 0;
+		}
+
+		custom_data->connecting = STOMP_TCP_CONNECTED;
+	}
+#endif
+
+	update_events(custom_data);
+
+	adapter->status = connected;
+
+	adapter->parent_adapter->onopen_callback(adapter->parent_adapter);
+
+	return 0;
+}
+
+#ifdef HAVE_OPENSSL
+// Copies up to max_len bytes of the segments, after the first skip bytes
+static size_t gather_segments(const struct iovec *iov, int iovcnt, size_t skip, char *buffer, size_t max_len) {
+	size_t len = 0;
+	for (int i = 0; i < iovcnt && len < max_len; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+
+		size_t n = iov[i].iov_len - skip;
+		if (n > max_len - len) n = max_len - len;
+
+		memcpy(&buffer[len], (char *)iov[i].iov_base + skip, n);
+		len += n;
+		skip = 0;
+	}
+
+	return len;
+}
+#endif
+
+// Writes as much of the segments as the socket takes. Returns the bytes written or -1 on error
+static ssize_t write_segments(StompAdapterTcpData *custom_data, const struct iovec *iov, int iovcnt) {
+#ifdef HAVE_OPENSSL
+	if (custom_data->ssl != NULL) {
+		size_t written = 0;
+
+		// one record at a time. After WANT_WRITE, OpenSSL needs the same length again
+		while (1) {
+			size_t len = gather_segments(iov, iovcnt, written, custom_data->tls_buffer,
+					custom_data->tls_retry_len ? custom_data->tls_retry_len : STOMP_TLS_RECORD_SIZE);
+			if (len == 0) return written;
+
+			int n = SSL_write(custom_data->ssl, custom_data->tls_buffer, len);
+			if (n <= 0) {
+				int error = SSL_get_error(custom_data->ssl, n);
+				if (error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ) {
+					custom_data->tls_retry_len = len;
+					return written;
+				}
+
+				log_tls_error("TLS write failed");
+				return -1;
+			}
+
+			custom_data->tls_retry_len = 0;
+			written += n;
+		}
+	}
+#endif
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *)iov;
+	msg.msg_iovlen = iovcnt;
+
+	while (1) {
+		ssize_t n = sendmsg(custom_data->fd, &msg, MSG_NOSIGNAL);
+		if (n >= 0) return n;
+		if (errno == EINTR) continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+
+		stomp_log_error("Error writing to %s: %s", custom_data->url, strerror(errno));
+		return -1;
+	}
+}
+
+// Moves the message position n bytes forward, returns 1 when all of it has been written
+static int advance_message(StompTcpMessage *message, size_t *n) {
+	while (message->iov_index < message->iovcnt) {
+		size_t available = message->iov[message->iov_index].iov_len - message->iov_offset;
+		if (*n < available) {
+			message->iov_offset += *n;
+			*n = 0;
+			return 0;
+		}
+
+		*n -= available;
+		message->iov_index++;
+		message->iov_offset = 0;
+	}
+
+	return 1;
+}
+
+// Writes the queued messages, several in one call, until the socket is full
+static int flush_output(StompAdapterTcpData *custom_data) {
+	while (custom_data->tx_head != NULL) {
+		struct iovec iov[STOMP_TCP_MAX_IOV];
+		int iovcnt = 0;
+		size_t total = 0;
+
+		for (StompTcpMessage *message = custom_data->tx_head; message != NULL && iovcnt < STOMP_TCP_MAX_IOV; message = message->next) {
+			for (int i = message->iov_index; i < message->iovcnt && iovcnt < STOMP_TCP_MAX_IOV; i++) {
+				size_t offset = i == message->iov_index ? message->iov_offset : 0;
+				iov[iovcnt].iov_base = (char *)message->iov[i].iov_base + offset;
+				iov[iovcnt].iov_len = message->iov[i].iov_len - offset;
+				total += iov[iovcnt++].iov_len;
+			}
+		}
+
+		ssize_t written = write_segments(custom_data, iov, iovcnt);
+		if (written < 0) return -1;
+
+		size_t n = written;
+		while (custom_data->tx_head != NULL && advance_message(custom_data->tx_head, &n)) {
+			StompTcpMessage *message = custom_data->tx_head;
+			custom_data->tx_head = message->next;
+			free_message(message);
+		}
+		if (custom_data->tx_head == NULL) custom_data->tx_tail = NULL;
+
+		if (written < total) break;
+	}
+
+	update_events(custom_data);
+
+	return 0;
+}
+
+static void enqueue_message(StompAdapterTcpData *custom_data, StompTcpMessage *message) {
+	message->next = NULL;
+
+	if (custom_data->tx_tail != NULL) {
+		custom_data->tx_tail->next = message;
+	} else {
+		custom_data->tx_head = message;
+	}
+	custom_data->tx_tail = message;
+
+	update_events(custom_data);
+}
+
+// Queues the len bytes left of a message. With release its segments are held, otherwise they are copied
+static int queue_message(StompAdapterTcpData *custom_data, StompTcpMessage *direct, size_t len,
+		stomp_release_function release, void *release_data) {
+	StompTcpMessage *message;
+	if (release != NULL) {
+		message = malloc(sizeof(StompTcpMessage));
+		if (message == NULL) {
+			release(release_data);
+			return -1;
+		}
+
+		*message = *direct;
+		message->release = release;
+		message->release_data = release_data;
+	} else {
+		message = malloc(sizeof(StompTcpMessage) + len);
+		if (message == NULL) return -1;
+
+		// the part that was not written
+		char *pos = message->data;
+		for (int i = direct->iov_index; i < direct->iovcnt; i++) {
+			size_t offset = i == direct->iov_index ? direct->iov_offset : 0;
+			memcpy(pos, (char *)direct->iov[i].iov_base + offset, direct->iov[i].iov_len - offset);
+			pos += direct->iov[i].iov_len - offset;
+		}
+
+		message->copy.iov_base = message->data;
+		message->copy.iov_len = len;
+		message->iov = &message->copy;
+		message->iovcnt = 1;
+		message->iov_index = 0;
+		message->iov_offset = 0;
+		message->release = NULL;
+	}
+
+	enqueue_message(custom_data, message);
+
+	return 0;
+}
+
+#ifdef HAVE_IO_URING
+// Copies up to max_len bytes from the message position and moves it forward
+static size_t gather_message(StompTcpMessage *message, char *buffer, size_t max_len) {
+	size_t len = 0;
+	while (message->iov_index < message->iovcnt && len < max_len) {
+		const struct iovec *segment = &message->iov[message->iov_index];
+		size_t n = segment->iov_len - message->iov_offset;
+		if (n > max_len - len) n = max_len - len;
+
+		memcpy(&buffer[len], (char *)segment->iov_base + message->iov_offset, n);
+		len += n;
+		advance_message(message, &n);
+	}
+
+	return len;
+}
+
+// Refills the send buffer from the queue and writes it, with one send in flight at a time
+static int uring_flush(StompAdapterTcpData *custom_data) {
+	if (custom_data->send_in_flight) return 0;
+
+	char *buffer = custom_data->uring->send_buffer;
+	if (custom_data->send_offset > 0) {
+		custom_data->send_len -= custom_data->send_offset;
+		memmove(buffer, &buffer[custom_data->send_offset], custom_data->send_len);
+		custom_data->send_offset = 0;
+	}
+
+	while (custom_data->tx_head != NULL && custom_data->send_len < STOMP_URING_SEND_BUFFER_SIZE) {
+		StompTcpMessage *message = custom_data->tx_head;
+		custom_data->send_len += gather_message(message, &buffer[custom_data->send_len], STOMP_URING_SEND_BUFFER_SIZE - custom_data->send_len);
+		if (message->iov_index < message->iovcnt) break;
+
+		custom_data->tx_head = message->next;
+		free_message(message);
+	}
+	if (custom_data->tx_head == NULL) custom_data->tx_tail = NULL;
+
+	if (custom_data->send_len == 0) return 0;
+
+	if (stomp_uring_send(custom_data->uring, custom_data->fd, 0, custom_data->send_len)) return -1;
+	custom_data->send_in_flight = 1;
+
+	return 0;
+}
+
+// Stages what fits in the send buffer, after a send in flight if there is one, and queues the rest
+static int uring_send_segments(StompAdapter *adapter, const struct iovec *iov, int iovcnt,
+		stomp_release_function release, void *release_data) {
+	StompAdapterTcpData *custom_data = get_adapter_custom_data(adapter);
+
+	StompTcpMessage direct;
+	direct.iov = iov;
+	direct.iovcnt = iovcnt;
+	direct.iov_index = 0;
+	direct.iov_offset = 0;
+
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+	}
+
+	size_t staged = 0;
+	if (custom_data->tx_head == NULL) {
+		staged = gather_message(&direct, &custom_data->uring->send_buffer[custom_data->send_len],
+				STOMP_URING_SEND_BUFFER_SIZE - custom_data->send_len);
+		custom_data->send_len += staged;
+	}
+
+	if (staged == total) {
+		if (release != NULL) release(release_data);
+	} else if (queue_message(custom_data, &direct, total - staged, release, release_data)) {
+		return -1;
+	}
+
+	if (uring_flush(custom_data)) {
+		connection_lost(adapter, "write error");
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+// Writes the segments if nothing is queued and queues the rest. With release the segments are held
+// instead of copied and released once written
+static int send_segments(StompAdapter *adapter, const struct iovec *iov, int iovcnt,
+		stomp_release_function release, void *release_data) {
+	StompAdapterTcpData *custom_data = get_adapter_custom_data(adapter);
+
+	if (adapter->status != connected) {
+		if (release != NULL) release(release_data);
+		return -1;
+	}
+
+#ifdef HAVE_IO_URING
+	if (custom_data->uring != NULL) return uring_send_segments(adapter, iov, iovcnt, release, release_data);
+#endif
+
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+	}
+
+	// written from the caller segments
+	StompTcpMessage direct;
+	direct.iov = iov;
+	direct.iovcnt = iovcnt;
+	direct.iov_index = 0;
+	direct.iov_offset = 0;
+
+	size_t written = 0;
+	if (custom_data->tx_head == NULL) {
+		ssize_t n = iovcnt <= STOMP_TCP_MAX_IOV ? write_segments(custom_data, iov, iovcnt) : 0;
+		if (n < 0) {
+			if (release != NULL) release(release_data);
+			connection_lost(adapter, "write error");
+			return -1;
+		}
+		written = n;
+	}
+
+	if (written == total) {
+		if (release != NULL) release(release_data);
+		return 0;
+	}
+
+	size_t n = written;
+	advance_message(&direct, &n);
+
+	return queue_message(custom_data, &direct, total - written, release, release_data);
+}
+
+static int send_function (StompAdapter *adapter, char *message) {
+	struct iovec iov;
+	iov.iov_base = message;
+	iov.iov_len = strlen(message) + 1; // send the null char
+
+	return send_segments(adapter, &iov, 1, NULL, NULL);
+}
+
+static int sendv_function (StompAdapter *adapter, const struct iovec *iov, int iovcnt) {
+	return send_segments(adapter, iov, iovcnt, NULL, NULL);
+}
+
+static int sendv_async_function (StompAdapter *adapter, const struct iovec *iov, int iovcnt,
+		stomp_release_function release, void *release_data) {
+	return send_segments(adapter, iov, iovcnt, release, release_data);
+}
+
+// The frames are already NULL terminated, a TCP stream takes them all in one write
+static int send_frames_function (StompAdapter *adapter, const struct iovec *frames, int count) {
+	return send_segments(adapter, frames, count, NULL, NULL);
+}
+
+// Offset of the body, after the empty line that ends the headers, or 0 if it has not been read yet
+static size_t head_length(const char *frame, size_t len) {
+	const char *line = frame;
+	while (line < &frame[len]) {
+		const char *end = memchr(line, '\n', &frame[len] - line);
+		if (end == NULL) return 0;
+
+		if (end == line || (end == line + 1 && *line == '\r')) return end + 1 - frame;
+
+		line = end + 1;
+	}
+
+	return 0;
+}
+
+// Value of the content-length header or -1
+static long long content_length(const char *frame, size_t head_len) {
+	const char *line = memchr(frame, '\n', head_len);
+	while (line != NULL && ++line < &frame[head_len]) {
+		if (!strncmp(line, "content-length:", 15)) return strtoll(&line[15], NULL, 10);
+
+		line = memchr(line, '\n', &frame[head_len] - line);
+	}
+
+	return -1;
+}
+
+// Bytes of a frame larger than the read buffer go to custom_data->large until its end
+static int read_large_frame(StompAdapter *adapter, char *data, size_t len, size_t *consumed) {
+	StompAdapterTcpData *custom_data = get_adapter_custom_data(adapter);
+
+	size_t n = len;
+	int end = 0;
+	if (custom_data->large_remaining != SIZE_MAX) {
+		if (n >= custom_data->large_remaining) {
+			n = custom_data->large_remaining;
+			end = 1;
+		}
+		custom_data->large_remaining -= n;
+	} else {
+		char *null_char = memchr(data, '\0', len);
+		if (null_char != NULL) {
+			n = null_char - data + 1;
+			end = 1;
+		}
+	}
+	*consumed = n;
+
+	// the NULL char is not part of the message
+	if (stomp_rx_buffer_append(&custom_data->large, data, end ? n - 1 : n)) return -1;
+
+	if (end) {
+		custom_data->large_remaining = 0;
+		stomp_rx_buffer_deliver(&custom_data->large, adapter->parent_adapter);
+	}
+
+	return 0;
+}
+
+// Delivers the complete frames in the read buffer and moves the partial one to its start
+static int process_input(StompAdapter *adapter) {
+	StompAdapterTcpData *custom_data = get_adapter_custom_data(adapter);
+	StompAdapter *parent_adapter = adapter->parent_adapter;
+	size_t capacity = adapter->max_frame_length;
+
+	size_t pos = 0;
+	while (pos < custom_data->rx_len && adapter->status == connected) {
+		char *frame = &custom_data->rx[pos];
+		size_t available = custom_data->rx_len - pos;
+
+		if (custom_data->large_remaining > 0) {
+			size_t consumed;
+			if (read_large_frame(adapter, frame, available, &consumed)) return -1;
+
+			pos += consumed;
+			continue;
+		}
+
+		// EOLs between frames are heartbeats
+		if (*frame == '\n' || *frame == '\r') {
+			if (*frame == '\n') parent_adapter->onheartbeat_callback(parent_adapter);
+			pos++;
+			continue;
+		}
+
+		size_t head_len = head_length(frame, available);
+		if (head_len == 0) {
+			if (available < capacity) break;
+
+			stomp_log_error("frame headers exceed max_frame_length %zu", capacity);
+			return -1;
+		}
+
+		long long body_length = content_length(frame, head_len);
+		if (body_length >= 0) {
+			size_t frame_len = head_len + body_length + 1;
+
+			if (frame_len <= available) {
+				if (frame[frame_len - 1] != '\0') {
+					stomp_log_error("frame body longer than its content-length");
+					return -1;
+				}
+
+				parent_adapter->onmessage_callback(parent_adapter, frame, frame_len - 1);
+				pos += frame_len;
+			} else if (frame_len > capacity) {
+				custom_data->large_remaining = frame_len;
+				// without the NULL char
+				stomp_rx_buffer_expect(&custom_data->large, parent_adapter, frame_len - 1);
+			} else {
+				break;
+			}
+		} else {
+			char *null_char = memchr(&frame[head_len], '\0', available - head_len);
+
+			if (null_char != NULL) {
+				parent_adapter->onmessage_callback(parent_adapter, frame, null_char - frame);
+				pos += null_char - frame + 1;
+			} else if (available == capacity) {
+				custom_data->large_remaining = SIZE_MAX;
+			} else {
+				break;
+			}
+		}
+	}
+
+	custom_data->rx_len -= pos;
+	memmove(custom_data->rx, &custom_data->rx[pos], custom_data->rx_len);
+
+	return 0;
+}
+
+// Returns the bytes read, 0 if there is nothing to read or -1 if the connection is closed
+static ssize_t read_socket(StompAdapterTcpData *custom_data, char *buffer, size_t len) {
+#ifdef HAVE_OPENSSL
+	if (custom_data->ssl != NULL) {
+		int n = SSL_read(custom_data->ssl, buffer, len);
+		if (n > 0) return n;
+
+		int error = SSL_get_error(custom_data->ssl, n);
+		if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) return 0;
+		if (error != SSL_ERROR_ZERO_RETURN) log_tls_error("TLS read failed");
+
+		return -1;
+	}
+#endif
+
+	while (1) {
+		ssize_t n = recv(custom_data->fd, buffer, len, 0);
+		if (n > 0) return n;
+		if (n == 0) return -1;
+		if (errno == EINTR) continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+
+		stomp_log_error("Error reading from %s: %s", custom_data->url, strerror(errno));
+		return -1;
+	}
+}
+
+// Reads until the socket is empty or the parent pauses
+static int read_input(StompAdapter *adapter) {
+	StompAdapterTcpData *custom_data = get_adapter_custom_data(adapter);
+
+	while (!custom_data->paused && adapter->status == connected) {
+		ssize_t n = read_socket(custom_data, &custom_data->rx[custom_data->rx_len], adapter->max_frame_length - custom_data->rx_len);
+		if (n < 0) {
+			connection_lost(adapter, "connection closed");
+			return -1;
+		}
+		if (n == 0) return 0;
+
+		custom_data->rx_len += n;
+
+		if (process_input(adapter)) {
+			connection_lost(adapter, "invalid frame");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+#ifdef HAVE_IO_URING
+// Arms the multishot recv unless it is armed or reads are paused
+static void uring_receive(StompAdapter *adapter) {
+	StompAdapterTcpData *custom_data = get_adapter_custom_data(adapter);
+
+	if (custom_data->recv_armed || custom_data->paused || adapter->status != connected) return;
+
+	if (stomp_uring_recv(custom_data->uring, custom_data->fd)) {
+		connection_lost(adapter, "io_uring full");
+		return;
+	}
+
+	custom_data->recv_armed = 1;
+}
+
+// Parses the bytes of a provided buffer through the read buffer
+static int uring_input(StompAdapter *adapter, char *data, size_t len) {
+	StompAdapterTcpData *custom_data = get_adapter_custom_data(adapter);
+
+	while (len > 0 && adapter->status == connected) {
+		size_t n = adapter->max_frame_length - custom_data->rx_len;
+		if (n > len) n = len;
+
+		memcpy(&custom_data->rx[custom_data->rx_len], data, n);
+		custom_data->rx_len += n;
+		data += n;
+		len -= n;
+
+		if (process_input(adapter)) return -1;
+	}
+
+	return 0;
+}
+
+static void uring_completion(StompUringOwner *owner, enum StompUringOp op, int res, unsigned int flags, char *data) {
+	StompAdapter *adapter = owner->data;
+	StompAdapterTcpData *custom_data = get_adapter_custom_data(adapter);
+
+	switch (op) {
+		case STOMP_URING_OP_POLL:
+			// the socket connect finished
+			if (continue_connect(adapter) == 0) uring_receive(adapter);
+			break;
+		case STOMP_URING_OP_RECV:
+			if (!(flags & IORING_CQE_F_MORE)) custom_data->recv_armed = 0;
+
+			if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED)) {
+				if (res < 0) stomp_log_error("Error reading from %s: %s", custom_data->url, strerror(-res));
+				connection_lost(adapter, "connection closed");
+				return;
+			}
+
+			if (res > 0 && uring_input(adapter, data, res)) {
+				connection_lost(adapter, "invalid frame");
+				return;
+			}
+
+			// ended by a cancel from pause_function or by running out of provided buffers
+			uring_receive(adapter);
+			break;
+		case STOMP_URING_OP_SEND:
+			// SEND_ZC completes with F_MORE, then with F_NOTIF once the buffer can be reused
+			if (!(flags & IORING_CQE_F_NOTIF)) custom_data->send_result = res;
+			if (flags & IORING_CQE_F_MORE) break;
+
+			custom_data->send_in_flight = 0;
+			if (custom_data->send_result < 0) {
+				stomp_log_error("Error writing to %s: %s", custom_data->url, strerror(-custom_data->send_result));
+				connection_lost(adapter, "write error");
+				return;
+			}
+
+			custom_data->send_offset += custom_data->send_result;
+			if (uring_flush(custom_data)) connection_lost(adapter, "write error");
+			break;
+		default:
+			break;
+	}
+}
+#endif
+
+static int pause_function (StompAdapter *adapter, int paused) {
+	if (adapter->status != connected) return -1;
+
+	StompAdapterTcpData *custom_data = get_adapter_custom_data(adapter);
+
+#ifdef HAVE_IO_URING
+	if (custom_data->uring != NULL) {
+		custom_data->paused = paused;
+
+		// a cancelled recv is armed again by its completion if reads were resumed meanwhile
+		if (paused && custom_data->recv_armed) {
+			stomp_uring_cancel(custom_data->uring, STOMP_URING_OP_RECV);
+		} else {
+			uring_receive(adapter);
+		}
+
+		return 0;
+	}
+#endif
+
+	// the broker is throttled by the TCP window once the socket buffer fills
+	custom_data->paused = paused;
+	update_events(custom_data);
+
+	return 0;
+}
+
+static int service_function (StompAdapter *adapter, int timeout_ms) {
+	if (adapter->status != preconnected && adapter->status != connected) return -1;
+
+	StompAdapterTcpData *custom_data = get_adapter_custom_data(adapter);
+
+#ifdef HAVE_IO_URING
+	// completions of every connection on the ring are dispatched
+	if (custom_data->uring != NULL) return stomp_uring_service(timeout_ms, uring_completion);
+#endif
+
+#ifdef HAVE_OPENSSL
+	// records decrypted before a pause are not signaled by epoll
+	if (custom_data->ssl != NULL && !custom_data->paused && adapter->status == connected && SSL_pending(custom_data->ssl) > 0) {
+		read_input(adapter);
+		timeout_ms = 0;
+	}
+#endif
+
+	struct epoll_event event;
+	int n = epoll_wait(custom_data->epoll_fd, &event, 1, timeout_ms);
+	if (n < 0) return errno == EINTR ? 0 : -1;
+	if (n == 0) return 0;
+
+	if (custom_data->connecting != STOMP_TCP_CONNECTED) {
+		return continue_connect(adapter) < 0 ? -1 : 0;
+	}
+
+	if (event.events & EPOLLOUT) {
+		if (flush_output(custom_data)) {
+			connection_lost(adapter, "write error");
+			return -1;
+		}
+	}
+
+	if (event.events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+		return read_input(adapter);
+	}
+
+	return 0;
+}
+
+static int destroy_function_internal (StompAdapter *adapter, int reconnect) {
+	if (adapter->status == destroyed) return -1;
+
+	StompAdapterTcpData *custom_data = get_adapter_custom_data(adapter);
+
+	close_connection(custom_data);
+
+	if (reconnect) {
+		adapter->status = initialized;
+	} else {
+		free(adapter->custom_data);
+		adapter->status = destroyed;
+	}
+
+	return 0;
+}
+
+static int destroy_function (StompAdapter *adapter) {
+	return destroy_function_internal(adapter, 0);
+}
+
+static int restart_function(StompAdapter *adapter) {
+	if (adapter->status == destroyed) return -1;
+
+	if (destroy_function_internal(adapter, 1) != 0) return -1;
+
+	adapter->status = initialized;
+
+	return 0;
+}
+
+StompAdapter stomp_tcp_adapter(char *url, int max_frame_length) {
+	StompAdapter adapter;
+
+	adapter.status = created;
+	adapter.init_function = init_function;
+	adapter.service_function = service_function;
+	adapter.connect_function = connect_function;
+	adapter.send_function = send_function;
+	adapter.sendv_function = sendv_function;
+	adapter.sendv_async_function = sendv_async_function;
+	adapter.send_frames_function = send_frames_function;
+	adapter.restart_function = restart_function;
+	adapter.pause_function = pause_function;
+	adapter.destroy_function = destroy_function;
+	adapter.max_frame_length = max_frame_length;
+	adapter.max_message_length = SIZE_MAX;
+
+	StompAdapterTcpData *custom_data = malloc(sizeof(StompAdapterTcpData));
+	custom_data->url = url;
+	custom_data->tls = stomp_tcp_default_tls_options();
+	custom_data->spill_threshold = STOMP_TCP_SPILL_THRESHOLD;
+	custom_data->engine = STOMP_TCP_ENGINE_EPOLL;
+	custom_data->fd = -1;
+	custom_data->epoll_fd = -1;
+	custom_data->connecting = STOMP_TCP_CONNECTED;
+	custom_data->paused = 0;
+	custom_data->use_tls = 0;
+	custom_data->addresses = NULL;
+	custom_data->next_address = NULL;
+#ifdef HAVE_OPENSSL
+	custom_data->ssl_ctx = NULL;
+	custom_data->ssl = NULL;
+	custom_data->tls_buffer = NULL;
+	custom_data->tls_retry_len = 0;
+#endif
+	custom_data->rx = NULL;
+	custom_data->rx_len = 0;
+	stomp_rx_buffer_init(&custom_data->large, 0);
+	custom_data->large_remaining = 0;
+	custom_data->tx_head = NULL;
+	custom_data->tx_tail = NULL;
+	custom_data->uring = NULL;
+	custom_data->send_len = 0;
+	custom_data->send_offset = 0;
+	custom_data->send_in_flight = 0;
+	custom_data->recv_armed = 0;
+	adapter.custom_data = custom_data;
+
+	return adapter;
+}
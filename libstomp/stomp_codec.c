@@ -0,0 +1,246 @@
+/*
+ * libstomp - a free implementation of the stomp protocol than can be plugged
+ * to different connection implementations using an adapter interface.
+ *
+ * Copyright (C) 2017 Sergio Otero <sergio.otero@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#define LZ4_STATIC_LINKING_ONLY // LZ4_attach_dictionary
+#include <lz4.h>
+#endif
+
+#include "libstomp.h"
+
+#ifdef HAVE_ZSTD
+
+typedef struct {
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+	ZSTD_CDict *cdict;
+	ZSTD_DDict *ddict;
+} StompZstdData;
+
+static ssize_t zstd_compress(StompCodec *codec, const char *src, size_t src_len, char *dst, size_t dst_capacity) {
+	StompZstdData *data = (StompZstdData *)codec->custom_data;
+
+	size_t n = ZSTD_compress_usingCDict(data->cctx, dst, dst_capacity, src, src_len, data->cdict);
+	if (ZSTD_isError(n)) return -1;
+
+	return n;
+}
+
+static ssize_t zstd_decompress(StompCodec *codec, const char *src, size_t src_len, char *dst, size_t dst_capacity) {
+	StompZstdData *data = (StompZstdData *)codec->custom_data;
+
+	size_t n = ZSTD_decompress_usingDDict(data->dctx, dst, dst_capacity, src, src_len, data->ddict);
+	if (ZSTD_isError(n)) return -1;
+
+	return n;
+}
+
+static size_t zstd_bound(StompCodec *codec, size_t src_len) {
+	return ZSTD_compressBound(src_len);
+}
+
+static ssize_t zstd_decompressed_size(StompCodec *codec, const char *src, size_t src_len) {
+	// the frame header stores the content size
+	unsigned long long size = ZSTD_getFrameContentSize(src, src_len);
+	if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR || size > SSIZE_MAX) return -1;
+
+	return size;
+}
+
+static void zstd_destroy(StompCodec *codec) {
+	StompZstdData *data = (StompZstdData *)codec->custom_data;
+
+	ZSTD_freeCCtx(data->cctx);
+	ZSTD_freeDCtx(data->dctx);
+	ZSTD_freeCDict(data->cdict);
+	ZSTD_freeDDict(data->ddict);
+	free(data);
+}
+
+int stomp_zstd_codec(StompCodec *codec, const void *dictionary, size_t dictionary_len, int level) {
+	StompZstdData *data = malloc(sizeof(StompZstdData));
+
+	// the dictionaries are digested once and reused for every message
+	data->cctx = ZSTD_createCCtx();
+	data->dctx = ZSTD_createDCtx();
+	data->cdict = ZSTD_createCDict(dictionary, dictionary_len, level);
+	data->ddict = ZSTD_createDDict(dictionary, dictionary_len);
+
+	codec->name = "zstd";
+	codec->min_size = 64;
+	codec->compress_function = zstd_compress;
+	codec->decompress_function = zstd_decompress;
+	codec->bound_function = zstd_bound;
+	codec->decompressed_size_function = zstd_decompressed_size;
+	codec->destroy_function = zstd_destroy;
+	codec->custom_data = data;
+
+	if (!data->cctx || !data->dctx || !data->cdict || !data->ddict) {
+		zstd_destroy(codec);
+		return -1;
+	}
+
+	return 0;
+}
+
+#else
+
+int stomp_zstd_codec(StompCodec *codec, const void *dictionary, size_t dictionary_len, int level) {
+	(void)codec;
+	(void)dictionary;
+	(void)dictionary_len;
+	(void)level;
+
+	stomp_log_error("libstomp built without zstd");
+	return -1;
+}
+
+#endif
+
+#ifdef HAVE_LZ4
+
+// lz4 blocks do not store the original size, it is prefixed as 4 bytes little endian
+#define STOMP_LZ4_PREFIX 4
+
+typedef struct {
+	LZ4_stream_t *stream;
+	LZ4_stream_t *dictionary_stream;
+	char *dictionary;
+	size_t dictionary_len;
+} StompLz4Data;
+
+static ssize_t lz4_compress(StompCodec *codec, const char *src, size_t src_len, char *dst, size_t dst_capacity) {
+	StompLz4Data *data = (StompLz4Data *)codec->custom_data;
+
+	// lz4 takes int sizes
+	if (dst_capacity < STOMP_LZ4_PREFIX || src_len > LZ4_MAX_INPUT_SIZE) return -1;
+	if (dst_capacity - STOMP_LZ4_PREFIX > INT_MAX) dst_capacity = (size_t)INT_MAX + STOMP_LZ4_PREFIX;
+
+	// attaching reuses the hashed dictionary instead of loading it for every message
+	LZ4_resetStream_fast(data->stream);
+	LZ4_attach_dictionary(data->stream, data->dictionary_stream);
+
+	int n = LZ4_compress_fast_continue(data->stream, src, &dst[STOMP_LZ4_PREFIX], src_len, dst_capacity - STOMP_LZ4_PREFIX, 1);
+	if (n <= 0) return -1;
+
+	uint32_t size = src_len;
+	for (int i = 0; i < STOMP_LZ4_PREFIX; i++) {
+		dst[i] = (size >> (8 * i)) & 0xff;
+	}
+
+	return n + STOMP_LZ4_PREFIX;
+}
+
+static ssize_t lz4_decompress(StompCodec *codec, const char *src, size_t src_len, char *dst, size_t dst_capacity) {
+	StompLz4Data *data = (StompLz4Data *)codec->custom_data;
+
+	if (src_len < STOMP_LZ4_PREFIX || src_len - STOMP_LZ4_PREFIX > INT_MAX) return -1;
+	if (dst_capacity > INT_MAX) dst_capacity = INT_MAX;
+
+	int n = LZ4_decompress_safe_usingDict(&src[STOMP_LZ4_PREFIX], dst, src_len - STOMP_LZ4_PREFIX, dst_capacity,
+			data->dictionary, data->dictionary_len);
+
+	return n < 0 ? -1 : n;
+}
+
+static size_t lz4_bound(StompCodec *codec, size_t src_len) {
+	return LZ4_compressBound(src_len) + STOMP_LZ4_PREFIX;
+}
+
+static ssize_t lz4_decompressed_size(StompCodec *codec, const char *src, size_t src_len) {
+	if (src_len < STOMP_LZ4_PREFIX) return -1;
+
+	uint32_t size = 0;
+	for (int i = 0; i < STOMP_LZ4_PREFIX; i++) {
+		size |= (uint32_t)(unsigned char)src[i] << (8 * i);
+	}
+
+	return size;
+}
+
+static void lz4_destroy(StompCodec *codec) {
+	StompLz4Data *data = (StompLz4Data *)codec->custom_data;
+
+	LZ4_freeStream(data->stream);
+	LZ4_freeStream(data->dictionary_stream);
+	free(data->dictionary);
+	free(data);
+}
+
+int stomp_lz4_codec(StompCodec *codec, const void *dictionary, size_t dictionary_len) {
+	StompLz4Data *data = malloc(sizeof(StompLz4Data));
+
+	// lz4 only uses the last 64KB of the dictionary
+	if (dictionary_len > 64 * 1024) {
+		dictionary = (const char *)dictionary + dictionary_len - 64 * 1024;
+		dictionary_len = 64 * 1024;
+	}
+
+	data->dictionary = malloc(dictionary_len);
+	memcpy(data->dictionary, dictionary, dictionary_len);
+	data->dictionary_len = dictionary_len;
+
+	data->stream = LZ4_createStream();
+	data->dictionary_stream = LZ4_createStream();
+
+	codec->name = "lz4";
+	codec->min_size = 64;
+	codec->compress_function = lz4_compress;
+	codec->decompress_function = lz4_decompress;
+	codec->bound_function = lz4_bound;
+	codec->decompressed_size_function = lz4_decompressed_size;
+	codec->destroy_function = lz4_destroy;
+	codec->custom_data = data;
+
+	if (!data->stream || !data->dictionary_stream) {
+		lz4_destroy(codec);
+		return -1;
+	}
+
+	LZ4_loadDict(data->dictionary_stream, data->dictionary, dictionary_len);
+
+	return 0;
+}
+
+#else
+
+int stomp_lz4_codec(StompCodec *codec, const void *dictionary, size_t dictionary_len) {
+	(void)codec;
+	(void)dictionary;
+	(void)dictionary_len;
+
+	stomp_log_error("libstomp built without lz4");
+	return -1;
+}
+
+#endif
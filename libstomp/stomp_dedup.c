@@ -0,0 +1,307 @@
+/*
+ * libstomp - a free implementation of the stomp protocol than can be plugged
+ * to different connection implementations using an adapter interface.
+ *
+ * Copyright (C) 2017 Sergio Otero <sergio.otero@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+
+
+/*
+ * Duplicate detection for redelivered messages, in fixed memory.
+ *
+ * The most recent keys are kept exactly in an LRU. Older ones are only remembered
+ * by a cuckoo filter of 16 bit fingerprints, so a new key may rarely be taken
+ * for a duplicate. When the filter is full it is cleared and refilled with the LRU.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libstomp.h"
+#include "stomp_internal.h"
+
+#define STOMP_CUCKOO_BUCKET_SIZE 4
+#define STOMP_CUCKOO_MAX_KICKS 500
+
+typedef struct {
+	char *key;
+	uint64_t hash;
+	int previous; // LRU order, -1 at the ends
+	int next;
+	int hash_next; // chain of the hash bucket
+} StompDedupEntry;
+
+struct StompDedup {
+	uint16_t *fingerprints; // num_buckets * STOMP_CUCKOO_BUCKET_SIZE, 0 is empty
+	uint32_t buckets_mask;
+	uint32_t random;
+
+	StompDedupEntry *entries;
+	int entries_size;
+	int entries_len;
+	int head; // most recent
+	int tail;
+	int *hash_buckets;
+	uint32_t hash_mask;
+
+	StompDedupStats stats;
+};
+
+// FNV-1a, with the murmur3 finalizer so the high bits used by the fingerprint depend on every byte
+static uint64_t stomp_dedup_hash(const char *key) {
+	uint64_t hash = 14695981039346656037ull;
+	for (; *key; key++) {
+		hash = (hash ^ (unsigned char)*key) * 1099511628211ull;
+	}
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdull;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ull;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+static uint32_t stomp_power_of_two(uint32_t min) {
+	uint32_t size = 1;
+	while (size < min) size *= 2;
+
+	return size;
+}
+
+StompDedup* stomp_dedup_create(int capacity, int exact_size) {
+	if (capacity <= 0 || exact_size <= 0) return NULL;
+
+	StompDedup *dedup = calloc(1, sizeof(StompDedup));
+
+	uint32_t num_buckets = stomp_power_of_two((capacity + STOMP_CUCKOO_BUCKET_SIZE - 1) / STOMP_CUCKOO_BUCKET_SIZE);
+	dedup->fingerprints = calloc(num_buckets * STOMP_CUCKOO_BUCKET_SIZE, sizeof(uint16_t));
+	dedup->buckets_mask = num_buckets - 1;
+	dedup->random = 2463534242u;
+
+	dedup->entries = calloc(exact_size, sizeof(StompDedupEntry));
+	dedup->entries_size = exact_size;
+	dedup->head = dedup->tail = -1;
+
+	uint32_t hash_size = stomp_power_of_two(exact_size * 2);
+	dedup->hash_buckets = malloc(hash_size * sizeof(int));
+	memset(dedup->hash_buckets, -1, hash_size * sizeof(int));
+	dedup->hash_mask = hash_size - 1;
+
+	return dedup;
+}
+
+void stomp_dedup_destroy(StompDedup *dedup) {
+	for (int i = 0; i < dedup->entries_len; i++) {
+		free(dedup->entries[i].key);
+	}
+
+	free(dedup->entries);
+	free(dedup->hash_buckets);
+	free(dedup->fingerprints);
+	free(dedup);
+}
+
+void stomp_dedup_get_stats(StompDedup *dedup, StompDedupStats *stats) {
+	*stats = dedup->stats;
+}
+
+/*
+ * Cuckoo filter
+ */
+
+static uint16_t stomp_cuckoo_fingerprint(uint64_t hash) {
+	uint16_t fingerprint = (uint16_t)(hash >> 48);
+
+	return fingerprint ? fingerprint : 1;
+}
+
+static uint32_t stomp_cuckoo_alternate(StompDedup *dedup, uint32_t bucket, uint16_t fingerprint) {
+	return (bucket ^ (fingerprint * 0x5bd1e995u)) & dedup->buckets_mask;
+}
+
+static int stomp_cuckoo_bucket_contains(StompDedup *dedup, uint32_t bucket, uint16_t fingerprint) {
+	uint16_t *slots = &dedup->fingerprints[bucket * STOMP_CUCKOO_BUCKET_SIZE];
+	for (int i = 0; i < STOMP_CUCKOO_BUCKET_SIZE; i++) {
+		if (slots[i] == fingerprint) return 1;
+	}
+
+	return 0;
+}
+
+static int stomp_cuckoo_bucket_insert(StompDedup *dedup, uint32_t bucket, uint16_t fingerprint) {
+	uint16_t *slots = &dedup->fingerprints[bucket * STOMP_CUCKOO_BUCKET_SIZE];
+	for (int i = 0; i < STOMP_CUCKOO_BUCKET_SIZE; i++) {
+		if (slots[i] == 0) {
+			slots[i] = fingerprint;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int stomp_cuckoo_contains(StompDedup *dedup, uint64_t hash) {
+	uint16_t fingerprint = stomp_cuckoo_fingerprint(hash);
+	uint32_t bucket = (uint32_t)hash & dedup->buckets_mask;
+
+	return stomp_cuckoo_bucket_contains(dedup, bucket, fingerprint)
+			|| stomp_cuckoo_bucket_contains(dedup, stomp_cuckoo_alternate(dedup, bucket, fingerprint), fingerprint);
+}
+
+// xorshift32, to choose the fingerprint to kick out
+static uint32_t stomp_cuckoo_random(StompDedup *dedup) {
+	uint32_t x = dedup->random;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	dedup->random = x;
+
+	return x;
+}
+
+// Returns 0 if the filter is full
+static int stomp_cuckoo_insert(StompDedup *dedup, uint64_t hash) {
+	uint16_t fingerprint = stomp_cuckoo_fingerprint(hash);
+	uint32_t bucket = (uint32_t)hash & dedup->buckets_mask;
+
+	if (stomp_cuckoo_bucket_insert(dedup, bucket, fingerprint)) return 1;
+
+	bucket = stomp_cuckoo_alternate(dedup, bucket, fingerprint);
+	if (stomp_cuckoo_bucket_insert(dedup, bucket, fingerprint)) return 1;
+
+	for (int kick = 0; kick < STOMP_CUCKOO_MAX_KICKS; kick++) {
+		uint16_t *slot = &dedup->fingerprints[bucket * STOMP_CUCKOO_BUCKET_SIZE + stomp_cuckoo_random(dedup) % STOMP_CUCKOO_BUCKET_SIZE];
+		uint16_t kicked = *slot;
+		*slot = fingerprint;
+
+		fingerprint = kicked;
+		bucket = stomp_cuckoo_alternate(dedup, bucket, fingerprint);
+		if (stomp_cuckoo_bucket_insert(dedup, bucket, fingerprint)) return 1;
+	}
+
+	// the last kicked fingerprint is lost, the caller clears the filter anyway
+	return 0;
+}
+
+/*
+ * Exact LRU
+ */
+
+static int stomp_lru_find(StompDedup *dedup, const char *key, uint64_t hash) {
+	for (int i = dedup->hash_buckets[hash & dedup->hash_mask]; i >= 0; i = dedup->entries[i].hash_next) {
+		if (dedup->entries[i].hash == hash && !strcmp(dedup->entries[i].key, key)) return i;
+	}
+
+	return -1;
+}
+
+static void stomp_lru_unlink(StompDedup *dedup, int i) {
+	StompDedupEntry *entry = &dedup->entries[i];
+
+	if (entry->previous >= 0) dedup->entries[entry->previous].next = entry->next;
+	else dedup->head = entry->next;
+	if (entry->next >= 0) dedup->entries[entry->next].previous = entry->previous;
+	else dedup->tail = entry->previous;
+}
+
+static void stomp_lru_push_head(StompDedup *dedup, int i) {
+	StompDedupEntry *entry = &dedup->entries[i];
+
+	entry->previous = -1;
+	entry->next = dedup->head;
+	if (dedup->head >= 0) dedup->entries[dedup->head].previous = i;
+	dedup->head = i;
+	if (dedup->tail < 0) dedup->tail = i;
+}
+
+static void stomp_lru_remove_hash(StompDedup *dedup, int i) {
+	int *current = &dedup->hash_buckets[dedup->entries[i].hash & dedup->hash_mask];
+	while (*current != i) current = &dedup->entries[*current].hash_next;
+	*current = dedup->entries[i].hash_next;
+}
+
+static void stomp_lru_insert(StompDedup *dedup, const char *key, uint64_t hash) {
+	int i;
+	if (dedup->entries_len < dedup->entries_size) {
+		i = dedup->entries_len++;
+	} else {
+		// the oldest is only kept by the filter from now on
+		i = dedup->tail;
+		stomp_lru_unlink(dedup, i);
+		stomp_lru_remove_hash(dedup, i);
+		free(dedup->entries[i].key);
+	}
+
+	StompDedupEntry *entry = &dedup->entries[i];
+	entry->key = strdup(key);
+	entry->hash = hash;
+	entry->hash_next = dedup->hash_buckets[hash & dedup->hash_mask];
+	dedup->hash_buckets[hash & dedup->hash_mask] = i;
+
+	stomp_lru_push_head(dedup, i);
+}
+
+static void stomp_dedup_reset_filter(StompDedup *dedup) {
+	memset(dedup->fingerprints, 0, (dedup->buckets_mask + 1) * STOMP_CUCKOO_BUCKET_SIZE * sizeof(uint16_t));
+
+	for (int i = dedup->head; i >= 0; i = dedup->entries[i].next) {
+		stomp_cuckoo_insert(dedup, dedup->entries[i].hash);
+	}
+
+	dedup->stats.filter_resets++;
+}
+
+int stomp_dedup_contains(StompDedup *dedup, const char *key) {
+	uint64_t hash = stomp_dedup_hash(key);
+
+	int i = stomp_lru_find(dedup, key, hash);
+	if (i >= 0) {
+		stomp_lru_unlink(dedup, i);
+		stomp_lru_push_head(dedup, i);
+
+		dedup->stats.exact_hits++;
+		return 1;
+	}
+
+	if (stomp_cuckoo_contains(dedup, hash)) {
+		dedup->stats.filter_hits++;
+		return 1;
+	}
+
+	dedup->stats.misses++;
+
+	return 0;
+}
+
+void stomp_dedup_insert(StompDedup *dedup, const char *key) {
+	uint64_t hash = stomp_dedup_hash(key);
+
+	// delivered twice, ie a redelivery that arrived while the first one was queued
+	if (stomp_lru_find(dedup, key, hash) >= 0) return;
+
+	stomp_lru_insert(dedup, key, hash);
+
+	if (!stomp_cuckoo_contains(dedup, hash) && !stomp_cuckoo_insert(dedup, hash)) {
+		stomp_dedup_reset_filter(dedup);
+	}
+}
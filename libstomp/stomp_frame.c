@@ -0,0 +1,254 @@
+/*
+ * libstomp - a free implementation of the stomp protocol than can be plugged
+ * to different connection implementations using an adapter interface.
+ *
+ * Copyright (C) 2017 Sergio Otero <sergio.otero@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "libstomp.h"
+#include "stomp_internal.h"
+
+struct StompFramePool {
+	StompFrameBuffer *_Atomic released; // pushed by any thread on release
+	StompFrameBuffer *free_list; // only used by the I/O thread
+	atomic_int references; // 1 for the connection plus 1 per buffer in use
+};
+
+StompFramePool* stomp_frame_pool_create(void) {
+	StompFramePool *pool = malloc(sizeof(StompFramePool));
+
+	atomic_init(&pool->released, NULL);
+	pool->free_list = NULL;
+	atomic_init(&pool->references, 1);
+
+	return pool;
+}
+
+static void stomp_frame_buffer_unmap(StompFrameBuffer *buffer) {
+	if (buffer->mapping == NULL) return;
+
+	munmap(buffer->mapping, buffer->mapping_len);
+	buffer->mapping = NULL;
+}
+
+static void stomp_frame_buffer_free(StompFrameBuffer *buffer) {
+	stomp_frame_buffer_unmap(buffer);
+	free(buffer->headers.header_array);
+	free(buffer->data);
+	free(buffer->body_data);
+	free(buffer);
+}
+
+static void stomp_frame_buffer_list_free(StompFrameBuffer *buffer) {
+	while (buffer != NULL) {
+		StompFrameBuffer *next = buffer->next;
+		stomp_frame_buffer_free(buffer);
+		buffer = next;
+	}
+}
+
+static void stomp_frame_pool_unref(StompFramePool *pool) {
+	if (atomic_fetch_sub(&pool->references, 1) != 1) return;
+
+	stomp_frame_buffer_list_free(pool->free_list);
+	stomp_frame_buffer_list_free(atomic_load(&pool->released));
+	free(pool);
+}
+
+void stomp_frame_pool_destroy(StompFramePool *pool) {
+	stomp_frame_pool_unref(pool);
+}
+
+static StompFrameBuffer* stomp_frame_buffer_create(StompFramePool *pool) {
+	StompFrameBuffer *buffer = malloc(sizeof(StompFrameBuffer));
+
+	buffer->pool = pool;
+	buffer->headers.len = 0;
+	buffer->headers.header_array = NULL;
+	buffer->headers_capacity = 0;
+	buffer->data = NULL;
+	buffer->capacity = 0;
+	buffer->body_data = NULL;
+	buffer->body_capacity = 0;
+	buffer->mapping = NULL;
+	buffer->next = NULL;
+
+	return buffer;
+}
+
+static int stomp_frame_buffer_reserve(char **data, size_t *capacity, size_t len) {
+	if (*capacity >= len) return 0;
+
+	char *new_data = realloc(*data, len);
+	if (new_data == NULL) return -1;
+
+	*data = new_data;
+	*capacity = len;
+
+	return 0;
+}
+
+StompFrameBuffer* stomp_frame_pool_acquire(StompFramePool *pool, size_t len) {
+	if (pool->free_list == NULL) {
+		// take everything released by other threads at once, so there is no ABA problem
+		pool->free_list = atomic_exchange(&pool->released, NULL);
+	}
+
+	StompFrameBuffer *buffer = pool->free_list;
+	if (buffer != NULL) {
+		pool->free_list = buffer->next;
+	} else {
+		buffer = stomp_frame_buffer_create(pool);
+	}
+
+	if (stomp_frame_buffer_reserve(&buffer->data, &buffer->capacity, len + 1)) {
+		buffer->next = pool->free_list;
+		pool->free_list = buffer;
+		return NULL;
+	}
+
+	atomic_fetch_add(&pool->references, 1);
+	atomic_init(&buffer->refcount, 1);
+	buffer->headers.len = 0;
+	buffer->next = NULL;
+
+	StompFrame *frame = &buffer->frame;
+	frame->command = NULL;
+	frame->system_headers = &buffer->headers;
+	frame->user_headers = NULL;
+	frame->body = NULL;
+	frame->body_length = 0;
+	frame->pool_buffer = buffer;
+
+	return buffer;
+}
+
+StompHeader* stomp_frame_buffer_add_header(StompFrameBuffer *buffer) {
+	StompHeaders *headers = &buffer->headers;
+
+	if (headers->len == buffer->headers_capacity) {
+		size_t capacity = buffer->headers_capacity ? buffer->headers_capacity * 2 : 16;
+		StompHeader *header_array = realloc(headers->header_array, capacity * sizeof(StompHeader));
+		if (header_array == NULL) return NULL;
+
+		headers->header_array = header_array;
+		buffer->headers_capacity = capacity;
+	}
+
+	return &headers->header_array[headers->len++];
+}
+
+char* stomp_frame_buffer_body(StompFrameBuffer *buffer, size_t len) {
+	if (stomp_frame_buffer_reserve(&buffer->body_data, &buffer->body_capacity, len)) return NULL;
+
+	return buffer->body_data;
+}
+
+// Deep copy of a frame that is not owned by libstomp, ie the ERROR built for a closed connection
+static StompFrameBuffer* stomp_frame_copy(const StompFrame *frame) {
+	StompFrameBuffer *buffer = stomp_frame_buffer_create(NULL);
+	size_t body_length = stomp_frame_body_length(frame);
+
+	StompHeaders *all_headers[2] = {frame->system_headers, frame->user_headers};
+
+	size_t len = strlen(frame->command) + 1 + body_length + 1;
+	for (int h = 0; h < 2; h++) {
+		for (int i = 0; all_headers[h] != NULL && i < all_headers[h]->len; i++) {
+			len += strlen(all_headers[h]->header_array[i].name) + strlen(all_headers[h]->header_array[i].value) + 2;
+		}
+	}
+
+	if (stomp_frame_buffer_reserve(&buffer->data, &buffer->capacity, len)) {
+		stomp_frame_buffer_free(buffer);
+		return NULL;
+	}
+
+	char *pos = buffer->data;
+
+	buffer->frame.command = strcpy(pos, frame->command);
+	pos += strlen(pos) + 1;
+
+	for (int h = 0; h < 2; h++) {
+		for (int i = 0; all_headers[h] != NULL && i < all_headers[h]->len; i++) {
+			StompHeader *header = stomp_frame_buffer_add_header(buffer);
+			if (header == NULL) {
+				stomp_frame_buffer_free(buffer);
+				return NULL;
+			}
+
+			header->name = strcpy(pos, all_headers[h]->header_array[i].name);
+			pos += strlen(pos) + 1;
+			header->value = strcpy(pos, all_headers[h]->header_array[i].value);
+			pos += strlen(pos) + 1;
+		}
+	}
+
+	buffer->frame.body = NULL;
+	if (frame->body != NULL) {
+		buffer->frame.body = memcpy(pos, frame->body, body_length);
+		pos[body_length] = '\0';
+	}
+
+	atomic_init(&buffer->refcount, 1);
+	buffer->frame.system_headers = &buffer->headers;
+	buffer->frame.user_headers = NULL;
+	buffer->frame.body_length = body_length;
+	buffer->frame.pool_buffer = buffer;
+
+	return buffer;
+}
+
+StompFrame* stomp_frame_retain(const StompFrame *frame) {
+	StompFrameBuffer *buffer = (StompFrameBuffer *)frame->pool_buffer;
+
+	if (buffer == NULL) {
+		buffer = stomp_frame_copy(frame);
+		return buffer ? &buffer->frame : NULL;
+	}
+
+	atomic_fetch_add(&buffer->refcount, 1);
+
+	return &buffer->frame;
+}
+
+void stomp_frame_release(StompFrame *frame) {
+	StompFrameBuffer *buffer = (StompFrameBuffer *)frame->pool_buffer;
+
+	if (buffer == NULL || atomic_fetch_sub(&buffer->refcount, 1) != 1) return;
+
+	// a big mapping should not wait in the free list
+	stomp_frame_buffer_unmap(buffer);
+
+	StompFramePool *pool = buffer->pool;
+	if (pool == NULL) {
+		stomp_frame_buffer_free(buffer);
+		return;
+	}
+
+	// lock free push, the I/O thread takes the whole list in stomp_frame_pool_acquire
+	buffer->next = atomic_load(&pool->released);
+	while (!atomic_compare_exchange_weak(&pool->released, &buffer->next, buffer));
+
+	stomp_frame_pool_unref(pool);
+}
@@ -0,0 +1,270 @@
+/*
+ * libstomp - a free implementation of the stomp protocol than can be plugged
+ * to different connection implementations using an adapter interface.
+ *
+ * Copyright (C) 2017 Sergio Otero <sergio.otero@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+
+/*
+ * Internal declarations shared by the libstomp sources, not installed.
+ */
+
+#ifndef stomp_internal_H
+#define stomp_internal_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "libstomp.h"
+
+typedef struct StompFrameBuffer StompFrameBuffer;
+
+// Received frame and the bytes it points to. Refcounted, returns to its pool when released
+struct StompFrameBuffer {
+	StompFrame frame; // frame.pool_buffer points back here
+	atomic_int refcount;
+	StompFramePool *pool; // NULL for copies made by stomp_frame_retain
+
+	StompHeaders headers;
+	size_t headers_capacity;
+
+	char *data; // the raw frame, parsed in place
+	size_t capacity;
+
+	char *body_data; // rewritten body, ie decompressed
+	size_t body_capacity;
+	char body_length_value[24];
+
+	char *mapping; // read only message the body points into, unmapped when released
+	size_t mapping_len;
+
+	StompFrameBuffer *next; // free list
+};
+
+// Frames handed to the adapter in one write, ie coalesced ACKs
+#define STOMP_FRAMES_CHUNK 64
+
+// Marshalled frames of a transaction not committed yet
+struct StompTransaction {
+	StompInfo *stomp_info;
+	char transaction_id[30];
+
+	char *buffer;
+	size_t buffer_len;
+	size_t buffer_size;
+
+	size_t *frame_offsets; // start of each frame in buffer
+	int frames_len;
+	int frames_size;
+};
+
+// SEND with the command and constant headers already marshalled
+struct StompPreparedSend {
+	StompInfo *stomp_info;
+	char *prefix;
+	size_t prefix_len;
+};
+
+struct StompReceipt {
+	char receipt_id[30];
+	stomp_callback callback;
+	StompReceipt *next;
+};
+
+extern StompRouter* stomp_router_create(void);
+
+extern void stomp_router_destroy(StompRouter *router);
+
+extern int stomp_router_add(StompRouter *router, const char *pattern, stomp_callback callback);
+
+// Routes removed from a callback are freed once the dispatch returns
+extern int stomp_router_remove(StompRouter *router, const char *pattern, stomp_callback callback);
+
+// Calls the routes matching destination, returns how many
+extern int stomp_router_dispatch(StompRouter *router, StompInfo *stomp_info, const char *destination, const StompFrame *frame);
+
+extern StompDedup* stomp_dedup_create(int capacity, int exact_size);
+
+extern void stomp_dedup_destroy(StompDedup *dedup);
+
+// Returns 1 if key was inserted before
+extern int stomp_dedup_contains(StompDedup *dedup, const char *key);
+
+// Remembers the key of a message delivered to the application
+extern void stomp_dedup_insert(StompDedup *dedup, const char *key);
+
+extern void stomp_dedup_get_stats(StompDedup *dedup, StompDedupStats *stats);
+
+#define STOMP_SPOOL_REPLAY_BATCH 64
+
+typedef int (*stomp_spool_send_function)(void *user_data, struct iovec *frames, int count);
+
+// Recovers the segments in options->directory
+extern StompSpool* stomp_spool_open(const StompSpoolOptions *options, int max_frame_length);
+
+extern void stomp_spool_close(StompSpool *spool);
+
+// Sequence of the next frame, for its receipt header
+extern unsigned long long stomp_spool_next_sequence(StompSpool *spool);
+
+// Room for a frame of up to max_len bytes and the sequence it will have
+extern char* stomp_spool_reserve(StompSpool *spool, size_t max_len, unsigned long long *sequence);
+
+// Makes the reserved frame of len bytes, NULL char included, durable and points frame to it
+extern int stomp_spool_commit(StompSpool *spool, size_t len, struct iovec *frame);
+
+// Frames up to sequence have been received by the broker
+extern void stomp_spool_confirm(StompSpool *spool, unsigned long long sequence);
+
+// A new connection, every unconfirmed frame has to be sent again
+extern void stomp_spool_reset_sent(StompSpool *spool);
+
+// Sends the frames not sent on this connection yet, STOMP_SPOOL_REPLAY_BATCH at a time
+extern int stomp_spool_replay(StompSpool *spool, stomp_spool_send_function send, void *user_data);
+
+// Sends the frame just committed without going through the segments, unless older ones are unsent
+extern int stomp_spool_send_last(StompSpool *spool, struct iovec *frame, stomp_spool_send_function send, void *user_data);
+
+extern void stomp_spool_get_stats(StompSpool *spool, StompSpoolStats *stats);
+
+// Parses the len bytes of buffer->data in place
+extern int stomp_frame_unmarshall(StompFrameBuffer *buffer, size_t len);
+
+extern StompFramePool* stomp_frame_pool_create(void);
+
+// Frames still retained by the application are freed when released
+extern void stomp_frame_pool_destroy(StompFramePool *pool);
+
+// Buffer holding len bytes plus the NULL char, with a refcount of 1. Only from the I/O thread
+extern StompFrameBuffer* stomp_frame_pool_acquire(StompFramePool *pool, size_t len);
+
+extern StompHeader* stomp_frame_buffer_add_header(StompFrameBuffer *buffer);
+
+extern char* stomp_frame_buffer_body(StompFrameBuffer *buffer, size_t len);
+
+#define STOMP_URING_SEND_BUFFER_SIZE 16384
+
+enum StompUringOp {
+	STOMP_URING_OP_POLL = 1,
+	STOMP_URING_OP_RECV,
+	STOMP_URING_OP_SEND,
+	STOMP_URING_OP_CANCEL
+};
+
+// A connection of the process wide io_uring
+typedef struct {
+	void *data; // NULL once closed, freed when its last request completes
+	int pending; // requests in flight
+	char *send_buffer; // STOMP_URING_SEND_BUFFER_SIZE bytes, registered when slot >= 0
+	int slot;
+} StompUringOwner;
+
+// data is a provided buffer with res bytes for STOMP_URING_OP_RECV, returned to the ring after the call
+typedef void (*stomp_uring_handler)(StompUringOwner *owner, enum StompUringOp op, int res, unsigned int flags, char *data);
+
+// Whether the ring can be set up on this kernel, checked once
+extern int stomp_uring_supported(void);
+
+// Creates the ring with the first connection. NULL if io_uring can not be used
+extern StompUringOwner* stomp_uring_open(void *data);
+
+// Cancels the requests on fd, which can be closed afterwards. The ring is destroyed with the last owner
+extern void stomp_uring_close(StompUringOwner *owner, int fd);
+
+// The requests are queued until the next stomp_uring_service
+extern int stomp_uring_poll(StompUringOwner *owner, int fd, unsigned int events);
+
+extern int stomp_uring_recv(StompUringOwner *owner, int fd);
+
+// Writes len bytes of the send buffer from offset
+extern int stomp_uring_send(StompUringOwner *owner, int fd, size_t offset, size_t len);
+
+extern int stomp_uring_cancel(StompUringOwner *owner, enum StompUringOp op);
+
+// Submits the queued requests of every connection, waits for completions and dispatches them
+extern int stomp_uring_service(int timeout_ms, stomp_uring_handler handler);
+
+enum StompShmSide {
+	STOMP_SHM_CLIENT,
+	STOMP_SHM_PEER
+};
+
+#define STOMP_SHM_READABLE 1
+#define STOMP_SHM_WRITABLE 2
+
+// Maps the segment of a peer and takes it as its client
+extern StompShm* stomp_shm_attach(const char *name);
+
+// Marks the segment closed and wakes the other side
+extern void stomp_shm_detach(StompShm *shm);
+
+extern size_t stomp_shm_max_message_length(StompShm *shm);
+
+extern int stomp_shm_closed(StompShm *shm);
+
+// Copies a message of the segments to the ring, published by stomp_shm_flush. Returns 1 if it is full
+extern int stomp_shm_write(StompShm *shm, const struct iovec *iov, int iovcnt);
+
+extern void stomp_shm_flush(StompShm *shm);
+
+// Next message, in place until stomp_shm_release. NULL if there is none, or after closing the
+// segment on a length that does not fit the ring
+extern char* stomp_shm_read(StompShm *shm, size_t *len);
+
+extern void stomp_shm_release(StompShm *shm);
+
+// Waits up to timeout_ms for STOMP_SHM_READABLE / STOMP_SHM_WRITABLE events or the close. 1 if one happened
+extern int stomp_shm_wait(StompShm *shm, int timeout_ms, int events);
+
+// Log of stomp_recorder_adapter, read by stomp_replay_adapter. Host byte order
+#define STOMP_RECORD_MAGIC "STOMPREC"
+#define STOMP_RECORD_VERSION 1
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	int64_t start_epoch_ns; // wall clock of the first record
+} StompRecordFileHeader;
+
+enum StompRecordType {
+	STOMP_RECORD_OPEN = 1,
+	STOMP_RECORD_CLOSE, // the data is the message of onclose_callback
+	STOMP_RECORD_FRAME,
+	STOMP_RECORD_HEARTBEAT
+};
+
+enum StompRecordDirection {
+	STOMP_RECORD_IN, // from the child adapter
+	STOMP_RECORD_OUT
+};
+
+// Followed by length bytes and a NULL char, padded to STOMP_RECORD_ALIGNMENT
+typedef struct {
+	uint64_t time_ns; // monotonic, since the first record
+	uint32_t length;
+	uint8_t type;
+	uint8_t direction;
+	uint16_t reserved;
+} StompRecord;
+
+#define STOMP_RECORD_ALIGNMENT 8
+#define STOMP_RECORD_SIZE(length) ((sizeof(StompRecord) + (length) + 1 + STOMP_RECORD_ALIGNMENT - 1) & ~(size_t)(STOMP_RECORD_ALIGNMENT - 1))
+
+#endif
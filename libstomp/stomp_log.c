@@ -0,0 +1,287 @@
+/*
+ * libstomp - a free implementation of the stomp protocol than can be plugged
+ * to different connection implementations using an adapter interface.
+ *
+ * Copyright (C) 2017 Sergio Otero <sergio.otero@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "libstomp.h"
+
+#define STOMP_LOG_LINE_MAX 512
+
+_Atomic enum StompLogLevel stomp_log_level = STOMP_LOG_WARN;
+
+typedef struct {
+	atomic_size_t sequence;
+	enum StompLogLevel level;
+	char line[STOMP_LOG_LINE_MAX];
+} StompLogSlot;
+
+// Bounded MPSC ring: producers claim a slot with a CAS on enqueue_pos and publish it
+// through the slot sequence, the drain thread is the only consumer
+typedef struct {
+	StompLogSlot *slots;
+	size_t mask;
+	atomic_size_t enqueue_pos;
+	size_t dequeue_pos;
+	atomic_int running;
+	pthread_t thread;
+} StompLogRing;
+
+static const char *level_names[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR"};
+
+static stomp_log_sink log_sink = NULL;
+static void *log_sink_user_data = NULL;
+
+static StompLogRing *_Atomic log_ring = NULL;
+static atomic_int log_writers = 0; // in log_vwrite, stomp_log_stop_async waits for them
+static atomic_ulong log_dropped = 0;
+
+static atomic_int payload_max_bytes = 256;
+static atomic_int payload_max_per_second = 100;
+static atomic_long payload_window = 0;
+static atomic_int payload_count = 0;
+
+static void default_sink(enum StompLogLevel level, const char *line, void *user_data) {
+	(void)user_data;
+	fprintf(stderr, "stomp %s: %s\n", level_names[level], line);
+}
+
+static void deliver(enum StompLogLevel level, const char *line) {
+	stomp_log_sink sink = log_sink;
+	if (sink) {
+		sink(level, line, log_sink_user_data);
+	} else {
+		default_sink(level, line, NULL);
+	}
+}
+
+void stomp_log_set_level(enum StompLogLevel level) {
+	atomic_store_explicit(&stomp_log_level, level, memory_order_relaxed);
+}
+
+void stomp_log_set_sink(stomp_log_sink sink, void *user_data) {
+	log_sink_user_data = user_data;
+	log_sink = sink;
+}
+
+void stomp_log_set_payload_limit(int max_bytes, int max_per_second) {
+	atomic_store(&payload_max_bytes, max_bytes);
+	atomic_store(&payload_max_per_second, max_per_second);
+}
+
+unsigned long stomp_log_dropped(void) {
+	return atomic_load(&log_dropped);
+}
+
+static StompLogSlot* ring_claim(StompLogRing *ring, size_t *pos_out) {
+	size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+
+	for (;;) {
+		StompLogSlot *slot = &ring->slots[pos & ring->mask];
+		size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+		intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+				*pos_out = pos;
+				return slot;
+			}
+		} else if (diff < 0) {
+			// full, the drain thread is behind
+			return NULL;
+		} else {
+			pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+		}
+	}
+}
+
+static void ring_publish(StompLogSlot *slot, size_t pos) {
+	atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+}
+
+static int ring_drain(StompLogRing *ring) {
+	int drained = 0;
+
+	for (;;) {
+		StompLogSlot *slot = &ring->slots[ring->dequeue_pos & ring->mask];
+		size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+
+		if (sequence != ring->dequeue_pos + 1) break;
+
+		deliver(slot->level, slot->line);
+
+		atomic_store_explicit(&slot->sequence, ring->dequeue_pos + ring->mask + 1, memory_order_release);
+		ring->dequeue_pos++;
+		drained++;
+	}
+
+	return drained;
+}
+
+static void* drain_thread(void *arg) {
+	StompLogRing *ring = (StompLogRing *)arg;
+	unsigned long reported_dropped = 0;
+	struct timespec idle = {.tv_sec = 0, .tv_nsec = 1000000};
+
+	while (atomic_load(&ring->running)) {
+		if (ring_drain(ring) == 0) {
+			nanosleep(&idle, NULL);
+		}
+
+		unsigned long dropped = atomic_load(&log_dropped);
+		if (dropped != reported_dropped) {
+			char line[64];
+			snprintf(line, sizeof(line), "%lu log lines dropped", dropped - reported_dropped);
+			deliver(STOMP_LOG_WARN, line);
+			reported_dropped = dropped;
+		}
+	}
+
+	ring_drain(ring);
+
+	return NULL;
+}
+
+int stomp_log_start_async(int ring_size) {
+	if (atomic_load(&log_ring) != NULL || ring_size <= 0) return -1;
+
+	// round up to a power of 2 to index with a mask
+	size_t size = 1;
+	while (size < (size_t)ring_size) size <<= 1;
+
+	StompLogRing *ring = malloc(sizeof(StompLogRing));
+	if (ring == NULL) return -1;
+
+	ring->slots = malloc(size * sizeof(StompLogSlot));
+	if (ring->slots == NULL) {
+		free(ring);
+		return -1;
+	}
+
+	ring->mask = size - 1;
+	ring->dequeue_pos = 0;
+	atomic_init(&ring->enqueue_pos, 0);
+	atomic_init(&ring->running, 1);
+
+	for (size_t i = 0; i < size; i++) {
+		atomic_init(&ring->slots[i].sequence, i);
+	}
+
+	if (pthread_create(&ring->thread, NULL, drain_thread, ring)) {
+		free(ring->slots);
+		free(ring);
+		return -1;
+	}
+
+	atomic_store(&log_ring, ring);
+
+	return 0;
+}
+
+int stomp_log_stop_async(void) {
+	StompLogRing *ring = atomic_exchange(&log_ring, NULL);
+	if (ring == NULL) return -1;
+
+	// a writer that loaded the ring before the exchange may still be formatting into a claimed slot,
+	// once they are gone every claimed slot is published and the thread drains it before exiting
+	struct timespec idle = {.tv_sec = 0, .tv_nsec = 100000};
+	while (atomic_load(&log_writers) > 0) {
+		nanosleep(&idle, NULL);
+	}
+
+	atomic_store(&ring->running, 0);
+	pthread_join(ring->thread, NULL);
+
+	free(ring->slots);
+	free(ring);
+
+	return 0;
+}
+
+static void log_vwrite(enum StompLogLevel level, const char *fmt, va_list args) {
+	// counted before loading the ring, see stomp_log_stop_async
+	atomic_fetch_add(&log_writers, 1);
+	StompLogRing *ring = atomic_load(&log_ring);
+
+	if (ring == NULL) {
+		atomic_fetch_sub(&log_writers, 1);
+
+		char line[STOMP_LOG_LINE_MAX];
+		vsnprintf(line, sizeof(line), fmt, args);
+		deliver(level, line);
+		return;
+	}
+
+	size_t pos;
+	StompLogSlot *slot = ring_claim(ring, &pos);
+	if (slot == NULL) {
+		atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+		atomic_fetch_sub(&log_writers, 1);
+		return;
+	}
+
+	// format straight into the claimed slot
+	slot->level = level;
+	vsnprintf(slot->line, sizeof(slot->line), fmt, args);
+
+	ring_publish(slot, pos);
+	atomic_fetch_sub(&log_writers, 1);
+}
+
+void stomp_log_write(enum StompLogLevel level, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	log_vwrite(level, fmt, args);
+	va_end(args);
+}
+
+static int payload_allowed(void) {
+	int max_per_second = atomic_load_explicit(&payload_max_per_second, memory_order_relaxed);
+	if (max_per_second <= 0) return 1;
+
+	long now = (long)time(NULL);
+	long window = atomic_load_explicit(&payload_window, memory_order_relaxed);
+	if (window != now && atomic_compare_exchange_strong(&payload_window, &window, now)) {
+		atomic_store_explicit(&payload_count, 0, memory_order_relaxed);
+	}
+
+	return atomic_fetch_add_explicit(&payload_count, 1, memory_order_relaxed) < max_per_second;
+}
+
+void stomp_log_write_payload(enum StompLogLevel level, const char *prefix, const char *payload, size_t len) {
+	int max_bytes = atomic_load_explicit(&payload_max_bytes, memory_order_relaxed);
+	if (max_bytes <= 0 || !payload_allowed()) return;
+
+	if (len > (size_t)max_bytes) {
+		stomp_log_write(level, "%s (%zu bytes): '%.*s'...", prefix, len, max_bytes, payload);
+	} else {
+		stomp_log_write(level, "%s (%zu bytes): '%.*s'", prefix, len, (int)len, payload);
+	}
+}
@@ -0,0 +1,308 @@
+/*
+ * libstomp - a free implementation of the stomp protocol than can be plugged
+ * to different connection implementations using an adapter interface.
+ *
+ * Copyright (C) 2017 Sergio Otero <sergio.otero@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+
+
+/*
+ * Destination routing trie. Destinations are split in segments by '/' and '.',
+ * '*' matches one segment and '>' or '#' the remaining ones, none included.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libstomp.h"
+#include "stomp_internal.h"
+
+typedef struct StompRouteNode StompRouteNode;
+typedef struct StompRoute StompRoute;
+
+struct StompRoute {
+	stomp_callback callback; // NULL once removed during a dispatch
+	StompRoute *next;
+};
+
+struct StompRouteNode {
+	char *segment;
+	size_t segment_len;
+
+	// exact children, open addressing by segment
+	StompRouteNode **children;
+	unsigned int children_mask;
+	int children_len;
+
+	StompRouteNode *any_one; // '*'
+	StompRoute *any_rest; // '>' or '#', always the last segment
+
+	StompRoute *routes; // patterns ending here
+};
+
+struct StompRouter {
+	StompRouteNode root;
+	int dispatching;
+	int removed; // routes to sweep after the dispatch
+};
+
+static int stomp_route_separator(char c) {
+	return c == '/' || c == '.';
+}
+
+// Next non empty segment from *pos, NULL at the end
+static const char* stomp_route_segment(const char **pos, size_t *len) {
+	const char *start = *pos;
+	while (*start && stomp_route_separator(*start)) start++;
+	if (*start == '\0') return NULL;
+
+	const char *end = start;
+	while (*end && !stomp_route_separator(*end)) end++;
+
+	*pos = end;
+	*len = end - start;
+
+	return start;
+}
+
+// FNV-1a
+static unsigned int stomp_route_hash(const char *segment, size_t len) {
+	unsigned int hash = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char)segment[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+static StompRouteNode** stomp_route_child_slot(StompRouteNode *node, const char *segment, size_t len) {
+	unsigned int i = stomp_route_hash(segment, len) & node->children_mask;
+
+	while (node->children[i] != NULL
+			&& (node->children[i]->segment_len != len || memcmp(node->children[i]->segment, segment, len))) {
+		i = (i + 1) & node->children_mask;
+	}
+
+	return &node->children[i];
+}
+
+static StompRouteNode* stomp_route_find_child(StompRouteNode *node, const char *segment, size_t len) {
+	if (node->children == NULL) return NULL;
+
+	return *stomp_route_child_slot(node, segment, len);
+}
+
+static StompRouteNode* stomp_route_node_create(const char *segment, size_t len) {
+	StompRouteNode *node = calloc(1, sizeof(StompRouteNode));
+	node->segment = malloc(len + 1);
+	memcpy(node->segment, segment, len);
+	node->segment[len] = '\0';
+	node->segment_len = len;
+
+	return node;
+}
+
+// Grows the table past half full
+static StompRouteNode* stomp_route_add_child(StompRouteNode *node, const char *segment, size_t len) {
+	if (node->children == NULL || (node->children_len + 1) * 2 > node->children_mask + 1) {
+		StompRouteNode **old_children = node->children;
+		unsigned int old_size = old_children != NULL ? node->children_mask + 1 : 0;
+		unsigned int size = old_size ? old_size * 2 : 4;
+
+		node->children = calloc(size, sizeof(StompRouteNode *));
+		node->children_mask = size - 1;
+
+		for (unsigned int i = 0; i < old_size; i++) {
+			if (old_children[i] == NULL) continue;
+			*stomp_route_child_slot(node, old_children[i]->segment, old_children[i]->segment_len) = old_children[i];
+		}
+		free(old_children);
+	}
+
+	StompRouteNode *child = stomp_route_node_create(segment, len);
+	*stomp_route_child_slot(node, segment, len) = child;
+	node->children_len++;
+
+	return child;
+}
+
+static void stomp_route_free_list(StompRoute *route) {
+	while (route != NULL) {
+		StompRoute *next = route->next;
+		free(route);
+		route = next;
+	}
+}
+
+static void stomp_route_node_free(StompRouteNode *node) {
+	for (unsigned int i = 0; node->children != NULL && i <= node->children_mask; i++) {
+		if (node->children[i] != NULL) {
+			stomp_route_node_free(node->children[i]);
+			free(node->children[i]);
+		}
+	}
+	free(node->children);
+
+	if (node->any_one != NULL) {
+		stomp_route_node_free(node->any_one);
+		free(node->any_one);
+	}
+
+	stomp_route_free_list(node->any_rest);
+	stomp_route_free_list(node->routes);
+	free(node->segment);
+}
+
+StompRouter* stomp_router_create(void) {
+	return calloc(1, sizeof(StompRouter));
+}
+
+void stomp_router_destroy(StompRouter *router) {
+	stomp_route_node_free(&router->root);
+	free(router);
+}
+
+// The route list of pattern, creating the nodes on the way if create is set
+static StompRoute** stomp_router_routes(StompRouter *router, const char *pattern, int create) {
+	StompRouteNode *node = &router->root;
+	const char *pos = pattern;
+	const char *segment;
+	size_t len;
+
+	while ((segment = stomp_route_segment(&pos, &len)) != NULL) {
+		if (len == 1 && (*segment == '>' || *segment == '#')) {
+			// nothing can follow
+			if (stomp_route_segment(&pos, &len) != NULL) return NULL;
+			return &node->any_rest;
+		}
+
+		StompRouteNode *next;
+		if (len == 1 && *segment == '*') {
+			if (node->any_one == NULL && create) node->any_one = stomp_route_node_create(segment, len);
+			next = node->any_one;
+		} else {
+			next = stomp_route_find_child(node, segment, len);
+			if (next == NULL && create) next = stomp_route_add_child(node, segment, len);
+		}
+
+		if (next == NULL) return NULL;
+		node = next;
+	}
+
+	return &node->routes;
+}
+
+int stomp_router_add(StompRouter *router, const char *pattern, stomp_callback callback) {
+	StompRoute **routes = stomp_router_routes(router, pattern, 1);
+	if (routes == NULL) return -1;
+
+	StompRoute *route = malloc(sizeof(StompRoute));
+	route->callback = callback;
+
+	// called in the order they were added
+	while (*routes != NULL) routes = &(*routes)->next;
+	route->next = NULL;
+	*routes = route;
+
+	return 0;
+}
+
+static void stomp_route_sweep_list(StompRoute **routes) {
+	while (*routes != NULL) {
+		StompRoute *route = *routes;
+		if (route->callback == NULL) {
+			*routes = route->next;
+			free(route);
+		} else {
+			routes = &route->next;
+		}
+	}
+}
+
+static void stomp_route_sweep(StompRouteNode *node) {
+	for (unsigned int i = 0; node->children != NULL && i <= node->children_mask; i++) {
+		if (node->children[i] != NULL) stomp_route_sweep(node->children[i]);
+	}
+	if (node->any_one != NULL) stomp_route_sweep(node->any_one);
+
+	stomp_route_sweep_list(&node->any_rest);
+	stomp_route_sweep_list(&node->routes);
+}
+
+int stomp_router_remove(StompRouter *router, const char *pattern, stomp_callback callback) {
+	StompRoute **routes = stomp_router_routes(router, pattern, 0);
+	if (routes == NULL) return -1;
+
+	for (StompRoute *route = *routes; route != NULL; route = route->next) {
+		if (route->callback != callback) continue;
+
+		route->callback = NULL;
+		if (router->dispatching) {
+			router->removed = 1;
+		} else {
+			stomp_route_sweep_list(routes);
+		}
+
+		return 0;
+	}
+
+	return -1;
+}
+
+static int stomp_route_call(StompRoute *route, StompInfo *stomp_info, const StompFrame *frame) {
+	int matched = 0;
+
+	for (; route != NULL; route = route->next) {
+		if (route->callback == NULL) continue;
+
+		route->callback(stomp_info, frame);
+		matched++;
+	}
+
+	return matched;
+}
+
+static int stomp_route_match(StompRouteNode *node, const char *pos, StompInfo *stomp_info, const StompFrame *frame) {
+	int matched = stomp_route_call(node->any_rest, stomp_info, frame);
+
+	size_t len;
+	const char *segment = stomp_route_segment(&pos, &len);
+	if (segment == NULL) return matched + stomp_route_call(node->routes, stomp_info, frame);
+
+	StompRouteNode *child = stomp_route_find_child(node, segment, len);
+	if (child != NULL) matched += stomp_route_match(child, pos, stomp_info, frame);
+
+	if (node->any_one != NULL) matched += stomp_route_match(node->any_one, pos, stomp_info, frame);
+
+	return matched;
+}
+
+int stomp_router_dispatch(StompRouter *router, StompInfo *stomp_info, const char *destination, const StompFrame *frame) {
+	router->dispatching++;
+	int matched = stomp_route_match(&router->root, destination, stomp_info, frame);
+	router->dispatching--;
+
+	if (router->dispatching == 0 && router->removed) {
+		router->removed = 0;
+		stomp_route_sweep(&router->root);
+	}
+
+	return matched;
+}
@@ -0,0 +1,229 @@
+/*
+ * libstomp - a free implementation of the stomp protocol than can be plugged
+ * to different connection implementations using an adapter interface.
+ *
+ * Copyright (C) 2017 Sergio Otero <sergio.otero@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+
+
+
+/*
+ * Reassembly of messages that the transport delivers in several reads. They are
+ * gathered in a heap buffer that is reused between messages. A message that grows
+ * over spill_threshold is moved to an unlinked temp file, a memfd where available,
+ * and handed to the parent adapter as a read only mapping, so the heap never holds
+ * more than spill_threshold bytes for one connection.
+ *
+ * When the length is known in advance the message is gathered in a buffer lent by the
+ * parent adapter instead, which takes it as is rather than copying it once more.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libstomp.h"
+
+void stomp_rx_buffer_init(StompRxBuffer *rx_buffer, size_t spill_threshold) {
+	rx_buffer->spill_threshold = spill_threshold;
+	rx_buffer->data = NULL;
+	rx_buffer->len = 0;
+	rx_buffer->capacity = 0;
+	rx_buffer->fd = -1;
+	rx_buffer->acquired = NULL;
+	rx_buffer->acquired_len = 0;
+}
+
+void stomp_rx_buffer_expect(StompRxBuffer *rx_buffer, StompAdapter *parent_adapter, size_t len) {
+	if (rx_buffer->len > 0 || parent_adapter->acquire_buffer_callback == NULL) return;
+	if (rx_buffer->spill_threshold > 0 && len > rx_buffer->spill_threshold) return;
+
+	rx_buffer->acquired = parent_adapter->acquire_buffer_callback(parent_adapter, len);
+	rx_buffer->acquired_len = len;
+}
+
+static int stomp_rx_buffer_open_file(void) {
+	int fd = -1;
+
+#ifdef MFD_CLOEXEC
+	fd = memfd_create("libstomp-rx", MFD_CLOEXEC);
+	if (fd >= 0) return fd;
+#endif
+
+	const char *dir = getenv("TMPDIR");
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/libstomp-rx-XXXXXX", dir != NULL ? dir : "/tmp");
+
+	fd = mkstemp(path);
+	if (fd >= 0) unlink(path);
+
+	return fd;
+}
+
+static int stomp_rx_buffer_write(int fd, const char *data, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// Moves the bytes received so far to a temp file and frees the heap buffer
+static int stomp_rx_buffer_spill(StompRxBuffer *rx_buffer) {
+	int fd = stomp_rx_buffer_open_file();
+	if (fd < 0) {
+		stomp_log_error("can not create a temp file to spill a message: %s", strerror(errno));
+		return -1;
+	}
+
+	if (stomp_rx_buffer_write(fd, rx_buffer->data, rx_buffer->len)) {
+		stomp_log_error("error spilling a message: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	free(rx_buffer->data);
+	rx_buffer->data = NULL;
+	rx_buffer->capacity = 0;
+	rx_buffer->fd = fd;
+
+	return 0;
+}
+
+// On error the partial message is dropped
+int stomp_rx_buffer_append(StompRxBuffer *rx_buffer, const char *data, size_t len) {
+	if (rx_buffer->acquired != NULL) {
+		if (rx_buffer->len + len <= rx_buffer->acquired_len) {
+			memcpy(&rx_buffer->acquired[rx_buffer->len], data, len);
+			rx_buffer->len += len;
+			return 0;
+		}
+
+		// longer than expected, the parent drops its buffer with the next one it lends
+		char *acquired = rx_buffer->acquired;
+		size_t acquired_len = rx_buffer->len;
+		rx_buffer->acquired = NULL;
+		rx_buffer->len = 0;
+		if (stomp_rx_buffer_append(rx_buffer, acquired, acquired_len)) return -1;
+	}
+
+	if (rx_buffer->fd < 0 && rx_buffer->spill_threshold > 0 && rx_buffer->len + len > rx_buffer->spill_threshold) {
+		if (stomp_rx_buffer_spill(rx_buffer)) {
+			stomp_rx_buffer_reset(rx_buffer);
+			return -1;
+		}
+	}
+
+	if (rx_buffer->fd >= 0) {
+		if (stomp_rx_buffer_write(rx_buffer->fd, data, len)) {
+			stomp_log_error("error spilling a message: %s", strerror(errno));
+			stomp_rx_buffer_reset(rx_buffer);
+			return -1;
+		}
+
+		rx_buffer->len += len;
+		return 0;
+	}
+
+	// room for the NULL char
+	size_t needed = rx_buffer->len + len + 1;
+	if (needed > rx_buffer->capacity) {
+		size_t capacity = rx_buffer->capacity ? rx_buffer->capacity : 4096;
+		while (capacity < needed) capacity *= 2;
+
+		char *data = realloc(rx_buffer->data, capacity);
+		if (data == NULL) {
+			stomp_rx_buffer_reset(rx_buffer);
+			return -1;
+		}
+
+		rx_buffer->data = data;
+		rx_buffer->capacity = capacity;
+	}
+
+	memcpy(&rx_buffer->data[rx_buffer->len], data, len);
+	rx_buffer->len += len;
+
+	return 0;
+}
+
+int stomp_rx_buffer_deliver(StompRxBuffer *rx_buffer, StompAdapter *parent_adapter) {
+	size_t len = rx_buffer->len;
+	rx_buffer->len = 0;
+
+	char *acquired = rx_buffer->acquired;
+	rx_buffer->acquired = NULL;
+
+	if (rx_buffer->fd < 0) {
+		if (len == 0) return 0;
+
+		char *message = acquired != NULL ? acquired : rx_buffer->data;
+		message[len] = '\0';
+
+		return parent_adapter->onmessage_callback(parent_adapter, message, len);
+	}
+
+	int fd = rx_buffer->fd;
+	rx_buffer->fd = -1;
+
+	// the NULL char is part of the mapping, the file lives on through it
+	char *message = MAP_FAILED;
+	if (stomp_rx_buffer_write(fd, "", 1) == 0) {
+		message = mmap(NULL, len + 1, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+
+	if (message == MAP_FAILED) {
+		stomp_log_error("error mapping a spilled message of %zu bytes: %s", len, strerror(errno));
+		return -1;
+	}
+
+	return parent_adapter->onmessage_mapped_callback(parent_adapter, message, len);
+}
+
+void stomp_rx_buffer_reset(StompRxBuffer *rx_buffer) {
+	if (rx_buffer->fd >= 0) {
+		close(rx_buffer->fd);
+		rx_buffer->fd = -1;
+	}
+
+	rx_buffer->acquired = NULL;
+	rx_buffer->len = 0;
+}
+
+void stomp_rx_buffer_free(StompRxBuffer *rx_buffer) {
+	stomp_rx_buffer_reset(rx_buffer);
+
+	free(rx_buffer->data);
+	rx_buffer->data = NULL;
+	rx_buffer->capacity = 0;
+}
@@ -0,0 +1,433 @@
+/*
+ * libstomp - a free implementation of the stomp protocol than can be plugged
+ * to different connection implementations using an adapter interface.
+ *
+ * Copyright (C) 2017 Sergio Otero <sergio.otero@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+
+
+
+
+/*
+ * Shared memory segment of the shm adapter: two single producer, single consumer rings,
+ * client to peer and peer to client, in a POSIX shared memory object.
+ *
+ * A message is a 32 bit length and its bytes, padded to 8. The data of each ring is
+ * mapped twice back to back so a message is contiguous even when it wraps, and it is
+ * read in place. Positions only grow, the writer publishes head after a batch and the
+ * reader publishes tail once the messages have been consumed.
+ *
+ * A side that runs out of work spins for a while and then sleeps on the futex of its
+ * doorbell. The other side rings it after publishing, only if the waiting flag is set.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "stomp_internal.h"
+
+#define STOMP_SHM_MAGIC 0x53544f4du // STOM
+#define STOMP_SHM_VERSION 1
+#define STOMP_SHM_SPIN 4000
+#define STOMP_SHM_RECORD_HEADER 4
+
+enum StompShmState {
+	STOMP_SHM_WAITING, // created by the peer
+	STOMP_SHM_ATTACHED, // a client took it
+	STOMP_SHM_CLOSED // by either side, the peer creates it again for the next client
+};
+
+// Positions of a ring, each on its own cache line
+typedef struct {
+	_Alignas(64) atomic_ullong head;
+	_Alignas(64) atomic_ullong tail;
+} StompShmRing;
+
+// Wake up of a side, rung by the other one
+typedef struct {
+	_Alignas(64) atomic_uint doorbell; // futex word
+	atomic_uint waiting;
+} StompShmSide;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t capacity; // of each ring
+	atomic_uint state;
+	StompShmRing rings[2]; // indexed by the side that reads it
+	StompShmSide sides[2];
+} StompShmHeader;
+
+struct StompShm {
+	char *name; // unlinked when the peer destroys the segment
+	int side;
+	StompShmHeader *header;
+	size_t header_size;
+	size_t capacity;
+	size_t mask;
+
+	char *rx; // double mapped data of the ring read by this side
+	char *tx;
+	unsigned long long rx_pos; // read, not published yet
+	unsigned long long tx_pos; // written, not published yet
+	size_t tx_needed; // room a write did not find, for STOMP_SHM_WRITABLE
+	int spin; // checks before sleeping, none with a single CPU
+};
+
+static size_t record_size(size_t len) {
+	return (STOMP_SHM_RECORD_HEADER + len + 7) & ~(size_t)7;
+}
+
+static size_t shm_header_size(void) {
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	return (sizeof(StompShmHeader) + page - 1) & ~(page - 1);
+}
+
+// The rings are masked and mapped on pages
+static int shm_valid_capacity(uint64_t capacity) {
+	return capacity >= (uint64_t)sysconf(_SC_PAGESIZE) && !(capacity & (capacity - 1));
+}
+
+static void futex_wake(atomic_uint *word) {
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void futex_wait(atomic_uint *word, unsigned int value, int timeout_ms) {
+	struct timespec ts;
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+	syscall(SYS_futex, word, FUTEX_WAIT, value, timeout_ms >= 0 ? &ts : NULL, NULL, 0);
+}
+
+// Maps the data of a ring twice, the second copy right after the first
+static char* map_ring(int fd, off_t offset, size_t capacity) {
+	char *area = mmap(NULL, 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (area == MAP_FAILED) return NULL;
+
+	if (mmap(area, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED ||
+			mmap(area + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED) {
+		munmap(area, 2 * capacity);
+		return NULL;
+	}
+
+	return area;
+}
+
+static StompShm* shm_map(int fd, int side, size_t capacity) {
+	StompShm *shm = calloc(1, sizeof(StompShm));
+	if (shm == NULL) return NULL;
+
+	shm->side = side;
+	shm->capacity = capacity;
+	shm->mask = capacity - 1;
+	shm->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? STOMP_SHM_SPIN : 0;
+	shm->header_size = shm_header_size();
+
+	shm->header = mmap(NULL, shm->header_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm->header == MAP_FAILED) {
+		free(shm);
+		return NULL;
+	}
+
+	// ring 0 is read by the client, ring 1 by the peer
+	char *rings[2];
+	rings[0] = map_ring(fd, shm->header_size, capacity);
+	rings[1] = map_ring(fd, shm->header_size + capacity, capacity);
+	shm->rx = rings[side];
+	shm->tx = rings[!side];
+
+	if (shm->rx == NULL || shm->tx == NULL) {
+		stomp_shm_detach(shm);
+		return NULL;
+	}
+
+	return shm;
+}
+
+StompShm* stomp_shm_peer_create(const char *name, size_t capacity) {
+	if (!shm_valid_capacity(capacity)) {
+		stomp_log_error("shm capacity %zu is not a power of 2 of at least a page", capacity);
+		return NULL;
+	}
+
+	// a segment left by a previous peer
+	shm_unlink(name);
+
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		stomp_log_error("Error creating shm %s: %s", name, strerror(errno));
+		return NULL;
+	}
+
+	StompShm *shm = NULL;
+	if (ftruncate(fd, shm_header_size() + 2 * capacity) == 0) shm = shm_map(fd, STOMP_SHM_PEER, capacity);
+	close(fd);
+
+	if (shm == NULL || (shm->name = strdup(name)) == NULL) {
+		stomp_log_error("Error mapping shm %s", name);
+		if (shm != NULL) stomp_shm_detach(shm);
+		shm_unlink(name);
+		return NULL;
+	}
+
+	StompShmHeader *header = shm->header;
+	header->version = STOMP_SHM_VERSION;
+	header->capacity = capacity;
+	atomic_store(&header->state, STOMP_SHM_WAITING);
+	// the client checks the magic last
+	atomic_store((atomic_uint *)&header->magic, STOMP_SHM_MAGIC);
+
+	return shm;
+}
+
+StompShm* stomp_shm_attach(const char *name) {
+	int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0) {
+		stomp_log_error("Error opening shm %s: %s", name, strerror(errno));
+		return NULL;
+	}
+
+	StompShm *shm = NULL;
+	StompShmHeader header;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size >= sizeof(header) && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+			header.magic == STOMP_SHM_MAGIC && header.version == STOMP_SHM_VERSION && shm_valid_capacity(header.capacity) &&
+			st.st_size >= shm_header_size() && header.capacity <= (st.st_size - shm_header_size()) / 2) {
+		shm = shm_map(fd, STOMP_SHM_CLIENT, header.capacity);
+	}
+	close(fd);
+
+	if (shm == NULL) {
+		stomp_log_error("shm %s is not a libstomp segment", name);
+		return NULL;
+	}
+
+	unsigned int state = STOMP_SHM_WAITING;
+	if (!atomic_compare_exchange_strong(&shm->header->state, &state, STOMP_SHM_ATTACHED)) {
+		stomp_log_error("shm %s is already in use", name);
+		munmap(shm->header, shm->header_size);
+		shm->header = NULL;
+		stomp_shm_detach(shm);
+		return NULL;
+	}
+
+	return shm;
+}
+
+// Wakes the other side if it sleeps
+static void shm_ring(StompShm *shm) {
+	StompShmSide *other = &shm->header->sides[!shm->side];
+
+	// orders the published position before reading the flag, see stomp_shm_wait
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&other->waiting, memory_order_relaxed)) {
+		atomic_fetch_add(&other->doorbell, 1);
+		futex_wake(&other->doorbell);
+	}
+}
+
+void stomp_shm_detach(StompShm *shm) {
+	if (shm->header != NULL) {
+		atomic_store(&shm->header->state, STOMP_SHM_CLOSED);
+		shm_ring(shm);
+		munmap(shm->header, shm->header_size);
+	}
+	if (shm->rx != NULL) munmap(shm->rx, 2 * shm->capacity);
+	if (shm->tx != NULL) munmap(shm->tx, 2 * shm->capacity);
+
+	if (shm->name != NULL) {
+		shm_unlink(shm->name);
+		free(shm->name);
+	}
+
+	free(shm);
+}
+
+void stomp_shm_peer_destroy(StompShm *shm) {
+	stomp_shm_detach(shm);
+}
+
+size_t stomp_shm_max_message_length(StompShm *shm) {
+	return shm->capacity - STOMP_SHM_RECORD_HEADER;
+}
+
+int stomp_shm_closed(StompShm *shm) {
+	return atomic_load_explicit(&shm->header->state, memory_order_acquire) == STOMP_SHM_CLOSED;
+}
+
+int stomp_shm_write(StompShm *shm, const struct iovec *iov, int iovcnt) {
+	if (stomp_shm_closed(shm)) return -1;
+
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+
+	size_t size = record_size(len);
+	if (size > shm->capacity) {
+		stomp_log_error("message of %zu bytes does not fit the shm ring", len);
+		return -1;
+	}
+
+	StompShmRing *ring = &shm->header->rings[!shm->side];
+	unsigned long long tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (shm->capacity - (shm->tx_pos - tail) < size) {
+		shm->tx_needed = size;
+		return 1;
+	}
+
+	char *record = &shm->tx[shm->tx_pos & shm->mask];
+	uint32_t record_len = len;
+	memcpy(record, &record_len, STOMP_SHM_RECORD_HEADER);
+
+	char *pos = record + STOMP_SHM_RECORD_HEADER;
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+
+	shm->tx_pos += size;
+
+	return 0;
+}
+
+void stomp_shm_flush(StompShm *shm) {
+	StompShmRing *ring = &shm->header->rings[!shm->side];
+	if (atomic_load_explicit(&ring->head, memory_order_relaxed) == shm->tx_pos) return;
+
+	atomic_store_explicit(&ring->head, shm->tx_pos, memory_order_release);
+	shm_ring(shm);
+}
+
+char* stomp_shm_read(StompShm *shm, size_t *len) {
+	StompShmRing *ring = &shm->header->rings[shm->side];
+	if (atomic_load_explicit(&ring->head, memory_order_acquire) == shm->rx_pos) return NULL;
+
+	char *record = &shm->rx[shm->rx_pos & shm->mask];
+	uint32_t record_len;
+	memcpy(&record_len, record, STOMP_SHM_RECORD_HEADER);
+
+	// the other side wrote past its messages, nothing after it can be trusted
+	if (record_len > shm->capacity - STOMP_SHM_RECORD_HEADER) {
+		stomp_log_error("shm record of %u bytes does not fit the ring", record_len);
+		atomic_store(&shm->header->state, STOMP_SHM_CLOSED);
+		shm_ring(shm);
+		return NULL;
+	}
+
+	*len = record_len;
+	shm->rx_pos += record_size(record_len);
+
+	return record + STOMP_SHM_RECORD_HEADER;
+}
+
+void stomp_shm_release(StompShm *shm) {
+	StompShmRing *ring = &shm->header->rings[shm->side];
+	if (atomic_load_explicit(&ring->tail, memory_order_relaxed) == shm->rx_pos) return;
+
+	atomic_store_explicit(&ring->tail, shm->rx_pos, memory_order_release);
+	shm_ring(shm);
+}
+
+// Something to read, the room a write was missing or the other side gone
+static int shm_ready(StompShm *shm, int events) {
+	StompShmHeader *header = shm->header;
+	if (atomic_load_explicit(&header->state, memory_order_acquire) == STOMP_SHM_CLOSED) return 1;
+
+	if ((events & STOMP_SHM_READABLE) && atomic_load_explicit(&header->rings[shm->side].head, memory_order_acquire) != shm->rx_pos) {
+		return 1;
+	}
+
+	if (events & STOMP_SHM_WRITABLE) {
+		unsigned long long tail = atomic_load_explicit(&header->rings[!shm->side].tail, memory_order_acquire);
+		if (shm->capacity - (shm->tx_pos - tail) >= shm->tx_needed) return 1;
+	}
+
+	return 0;
+}
+
+int stomp_shm_wait(StompShm *shm, int timeout_ms, int events) {
+	if (shm_ready(shm, events)) return 1;
+	if (timeout_ms == 0) return 0;
+
+	for (int i = 0; i < shm->spin; i++) {
+		if (shm_ready(shm, events)) return 1;
+	}
+
+	StompShmSide *self = &shm->header->sides[shm->side];
+	unsigned int doorbell = atomic_load(&self->doorbell);
+	atomic_store(&self->waiting, 1);
+
+	// the other side publishes then reads waiting, this side sets waiting then reads the positions
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!shm_ready(shm, events)) futex_wait(&self->doorbell, doorbell, timeout_ms);
+
+	atomic_store(&self->waiting, 0);
+
+	return shm_ready(shm, events);
+}
+
+int stomp_shm_peer_send(StompShm *shm, const char *frame, size_t len) {
+	struct iovec iov;
+	iov.iov_base = (char *)frame;
+	iov.iov_len = len;
+
+	int ret = stomp_shm_write(shm, &iov, 1);
+	if (ret == 0) stomp_shm_flush(shm);
+
+	return ret;
+}
+
+ssize_t stomp_shm_peer_receive(StompShm *shm, char *buffer, size_t size, int timeout_ms) {
+	size_t len;
+	char *message = stomp_shm_read(shm, &len);
+	if (message == NULL) {
+		if (stomp_shm_closed(shm)) return -1;
+		if (!stomp_shm_wait(shm, timeout_ms, STOMP_SHM_READABLE)) return 0;
+
+		message = stomp_shm_read(shm, &len);
+		if (message == NULL) return stomp_shm_closed(shm) ? -1 : 0;
+	}
+
+	if (len > size) {
+		stomp_log_error("shm message of %zu bytes does not fit the buffer", len);
+		stomp_shm_release(shm);
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	memcpy(buffer, message, len);
+	stomp_shm_release(shm);
+
+	return len;
+}
@@ -0,0 +1,489 @@
+/*
+ * libstomp - a free implementation of the stomp protocol than can be plugged
+ * to different connection implementations using an adapter interface.
+ *
+ * Copyright (C) 2017 Sergio Otero <sergio.otero@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+
+
+/*
+ * Outbound spool: SEND frames are written to memory mapped segment files before they
+ * are sent, so they survive a disconnection (and a crash) until the broker confirms
+ * them with a RECEIPT.
+ *
+ * A segment starts with a StompSpoolSegmentHeader followed by records. Each record
+ * is a StompSpoolRecord and the marshalled frame with its NULL char, padded to 8
+ * bytes. The magic of a record is written last, the recovery scan stops at the
+ * first record without it, with a wrong checksum or with an older sequence.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libstomp.h"
+#include "stomp_internal.h"
+
+#define STOMP_SPOOL_SEGMENT_MAGIC 0x53545053u // STPS
+#define STOMP_SPOOL_RECORD_MAGIC 0x53545052u // STPR
+#define STOMP_SPOOL_VERSION 1
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t confirmed_sequence; // every record up to this one has a RECEIPT
+} StompSpoolSegmentHeader;
+
+typedef struct {
+	uint64_t sequence;
+	uint32_t length; // frame bytes, with the NULL char
+	uint32_t checksum;
+	uint32_t reserved;
+	volatile uint32_t magic;
+} StompSpoolRecord;
+
+typedef struct {
+	int index; // in the file name
+	char *map;
+	size_t size;
+	size_t write_pos;
+	uint64_t first_sequence; // 0 if empty
+	uint64_t last_sequence;
+} StompSpoolSegment;
+
+struct StompSpool {
+	StompSpoolOptions options;
+	char *directory;
+
+	StompSpoolSegment *segments; // oldest first, the last one is written
+	int segments_len;
+	int next_index;
+
+	uint64_t next_sequence;
+	uint64_t confirmed_sequence;
+	uint64_t sent_sequence; // written to the adapter on this connection
+
+	// first record after sent_sequence, or the end of the last segment
+	int replay_segment;
+	size_t replay_pos;
+
+	size_t reserved_pos; // record being written by stomp_spool_reserve
+};
+
+static size_t stomp_spool_align(size_t len) {
+	return (len + 7) & ~(size_t)7;
+}
+
+// FNV-1a
+static uint32_t stomp_spool_checksum(const char *data, size_t len) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+static void stomp_spool_path(StompSpool *spool, int index, char *path, size_t size) {
+	snprintf(path, size, "%s/spool-%08d.seg", spool->directory, index);
+}
+
+static int stomp_spool_map(StompSpoolSegment *segment, int fd, size_t size) {
+	segment->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (segment->map == MAP_FAILED) return -1;
+
+	segment->size = size;
+
+	return 0;
+}
+
+static void stomp_spool_unmap(StompSpoolSegment *segment) {
+	munmap(segment->map, segment->size);
+}
+
+static StompSpoolRecord* stomp_spool_record(StompSpoolSegment *segment, size_t pos) {
+	return (StompSpoolRecord *)&segment->map[pos];
+}
+
+// Finds the valid records of a segment, returns the first free position
+static size_t stomp_spool_scan(StompSpoolSegment *segment) {
+	size_t pos = sizeof(StompSpoolSegmentHeader);
+
+	segment->first_sequence = segment->last_sequence = 0;
+
+	while (pos + sizeof(StompSpoolRecord) <= segment->size) {
+		StompSpoolRecord *record = stomp_spool_record(segment, pos);
+		char *data = (char *)&record[1];
+
+		if (record->magic != STOMP_SPOOL_RECORD_MAGIC) break;
+		if (pos + sizeof(StompSpoolRecord) + record->length > segment->size) break;
+		if (record->checksum != stomp_spool_checksum(data, record->length)) break;
+		// older records left after the segment was started again
+		if (record->sequence <= segment->last_sequence) break;
+
+		if (segment->first_sequence == 0) segment->first_sequence = record->sequence;
+		segment->last_sequence = record->sequence;
+
+		pos += sizeof(StompSpoolRecord) + stomp_spool_align(record->length);
+	}
+
+	return pos;
+}
+
+static int stomp_spool_open_segment(StompSpool *spool, int index, StompSpoolSegment *segment) {
+	char path[512];
+	stomp_spool_path(spool, index, path, sizeof(path));
+
+	int fd = open(path, O_RDWR);
+	if (fd < 0) return -1;
+
+	struct stat st;
+	int ret = fstat(fd, &st) || st.st_size < sizeof(StompSpoolSegmentHeader) || stomp_spool_map(segment, fd, st.st_size) ? -1 : 0;
+	close(fd);
+	if (ret) return -1;
+
+	StompSpoolSegmentHeader *header = (StompSpoolSegmentHeader *)segment->map;
+	if (header->magic != STOMP_SPOOL_SEGMENT_MAGIC || header->version != STOMP_SPOOL_VERSION) {
+		stomp_spool_unmap(segment);
+		return -1;
+	}
+
+	segment->index = index;
+	segment->write_pos = stomp_spool_scan(segment);
+
+	if (header->confirmed_sequence > spool->confirmed_sequence) spool->confirmed_sequence = header->confirmed_sequence;
+
+	return 0;
+}
+
+static StompSpoolSegment* stomp_spool_create_segment(StompSpool *spool) {
+	if (spool->segments_len == spool->options.max_segments) return NULL;
+
+	char path[512];
+	stomp_spool_path(spool, spool->next_index, path, sizeof(path));
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		stomp_log_error("stomp spool can not create %s", path);
+		return NULL;
+	}
+
+	StompSpoolSegment *segment = &spool->segments[spool->segments_len];
+	int ret = ftruncate(fd, spool->options.segment_size) || stomp_spool_map(segment, fd, spool->options.segment_size) ? -1 : 0;
+	close(fd);
+	if (ret) {
+		unlink(path);
+		return NULL;
+	}
+
+	StompSpoolSegmentHeader *header = (StompSpoolSegmentHeader *)segment->map;
+	header->version = STOMP_SPOOL_VERSION;
+	header->confirmed_sequence = spool->confirmed_sequence;
+	header->magic = STOMP_SPOOL_SEGMENT_MAGIC;
+
+	segment->index = spool->next_index++;
+	segment->write_pos = sizeof(StompSpoolSegmentHeader);
+	segment->first_sequence = segment->last_sequence = 0;
+	spool->segments_len++;
+
+	return segment;
+}
+
+static void stomp_spool_delete_segment(StompSpool *spool, int i) {
+	char path[512];
+	stomp_spool_path(spool, spool->segments[i].index, path, sizeof(path));
+
+	stomp_spool_unmap(&spool->segments[i]);
+	unlink(path);
+
+	memmove(&spool->segments[i], &spool->segments[i + 1], (spool->segments_len - i - 1) * sizeof(StompSpoolSegment));
+	spool->segments_len--;
+}
+
+static int stomp_spool_compare_index(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+// Opens the segments left by a previous run, the oldest first
+static int stomp_spool_recover(StompSpool *spool) {
+	DIR *dir = opendir(spool->directory);
+	if (dir == NULL) return -1;
+
+	int indexes_size = 16, indexes_len = 0;
+	int *indexes = malloc(indexes_size * sizeof(int));
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		int index;
+		char end;
+		if (sscanf(entry->d_name, "spool-%d.se%c", &index, &end) != 2 || end != 'g') continue;
+
+		if (indexes_len == indexes_size) {
+			indexes_size *= 2;
+			indexes = realloc(indexes, indexes_size * sizeof(int));
+		}
+		indexes[indexes_len++] = index;
+	}
+	closedir(dir);
+
+	qsort(indexes, indexes_len, sizeof(int), stomp_spool_compare_index);
+
+	for (int i = 0; i < indexes_len; i++) {
+		if (indexes[i] >= spool->next_index) spool->next_index = indexes[i] + 1;
+
+		if (spool->segments_len == spool->options.max_segments) {
+			stomp_log_error("stomp spool has more than %d segments, spool-%08d ignored", spool->options.max_segments, indexes[i]);
+			continue;
+		}
+
+		StompSpoolSegment *segment = &spool->segments[spool->segments_len];
+		if (stomp_spool_open_segment(spool, indexes[i], segment)) {
+			stomp_log_warn("stomp spool segment spool-%08d is not valid, ignored", indexes[i]);
+			continue;
+		}
+		spool->segments_len++;
+
+		if (segment->last_sequence >= spool->next_sequence) spool->next_sequence = segment->last_sequence + 1;
+	}
+	free(indexes);
+
+	// the confirmed ones are not needed anymore
+	while (spool->segments_len > 0 && spool->segments[0].last_sequence <= spool->confirmed_sequence) {
+		stomp_spool_delete_segment(spool, 0);
+	}
+
+	if (spool->next_sequence <= spool->confirmed_sequence) spool->next_sequence = spool->confirmed_sequence + 1;
+
+	stomp_log_info("stomp spool recovered %llu frames", (unsigned long long)(spool->next_sequence - 1 - spool->confirmed_sequence));
+
+	return 0;
+}
+
+// Moves the replay cursor to the first record after sent_sequence
+static void stomp_spool_seek(StompSpool *spool) {
+	spool->replay_segment = 0;
+	spool->replay_pos = sizeof(StompSpoolSegmentHeader);
+
+	for (int i = 0; i < spool->segments_len; i++) {
+		StompSpoolSegment *segment = &spool->segments[i];
+
+		spool->replay_segment = i;
+		spool->replay_pos = sizeof(StompSpoolSegmentHeader);
+		if (segment->last_sequence <= spool->sent_sequence) {
+			spool->replay_pos = segment->write_pos;
+			continue;
+		}
+
+		while (spool->replay_pos < segment->write_pos) {
+			StompSpoolRecord *record = stomp_spool_record(segment, spool->replay_pos);
+			if (record->sequence > spool->sent_sequence) return;
+
+			spool->replay_pos += sizeof(StompSpoolRecord) + stomp_spool_align(record->length);
+		}
+	}
+}
+
+StompSpool* stomp_spool_open(const StompSpoolOptions *options, int max_frame_length) {
+	if (options->directory == NULL || options->max_segments <= 0
+			|| options->segment_size < sizeof(StompSpoolSegmentHeader) + sizeof(StompSpoolRecord) + max_frame_length) return NULL;
+
+	StompSpool *spool = calloc(1, sizeof(StompSpool));
+	spool->options = *options;
+	spool->directory = strdup(options->directory);
+	spool->segments = malloc(options->max_segments * sizeof(StompSpoolSegment));
+	spool->next_sequence = 1;
+
+	if (stomp_spool_recover(spool)) {
+		stomp_spool_close(spool);
+		return NULL;
+	}
+
+	spool->sent_sequence = spool->confirmed_sequence;
+	stomp_spool_seek(spool);
+
+	return spool;
+}
+
+void stomp_spool_close(StompSpool *spool) {
+	for (int i = 0; i < spool->segments_len; i++) {
+		msync(spool->segments[i].map, spool->segments[i].size, MS_ASYNC);
+		stomp_spool_unmap(&spool->segments[i]);
+	}
+
+	free(spool->segments);
+	free(spool->directory);
+	free(spool);
+}
+
+char* stomp_spool_reserve(StompSpool *spool, size_t max_len, unsigned long long *sequence) {
+	StompSpoolSegment *segment = spool->segments_len > 0 ? &spool->segments[spool->segments_len - 1] : NULL;
+
+	if (segment == NULL || segment->write_pos + sizeof(StompSpoolRecord) + max_len > segment->size) {
+		segment = stomp_spool_create_segment(spool);
+		if (segment == NULL) {
+			stomp_log_error("stomp spool full, %d segments", spool->options.max_segments);
+			return NULL;
+		}
+	}
+
+	*sequence = spool->next_sequence;
+	spool->reserved_pos = segment->write_pos;
+
+	return (char *)&stomp_spool_record(segment, segment->write_pos)[1];
+}
+
+int stomp_spool_commit(StompSpool *spool, size_t len, struct iovec *frame) {
+	StompSpoolSegment *segment = &spool->segments[spool->segments_len - 1];
+	StompSpoolRecord *record = stomp_spool_record(segment, spool->reserved_pos);
+	char *data = (char *)&record[1];
+
+	record->sequence = spool->next_sequence++;
+	record->length = len;
+	record->checksum = stomp_spool_checksum(data, len);
+	record->reserved = 0;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	record->magic = STOMP_SPOOL_RECORD_MAGIC;
+
+	if (segment->first_sequence == 0) segment->first_sequence = record->sequence;
+	segment->last_sequence = record->sequence;
+	segment->write_pos += sizeof(StompSpoolRecord) + stomp_spool_align(len);
+
+	frame->iov_base = data;
+	frame->iov_len = len;
+
+	return 0;
+}
+
+void stomp_spool_confirm(StompSpool *spool, unsigned long long sequence) {
+	// receipts come in order, one confirms the previous frames too
+	if (sequence <= spool->confirmed_sequence) return;
+	spool->confirmed_sequence = sequence;
+
+	// the last segment is kept to write on
+	int deleted = 0;
+	while (spool->segments_len > 1 && spool->segments[0].last_sequence <= sequence) {
+		stomp_spool_delete_segment(spool, 0);
+		deleted++;
+	}
+
+	for (int i = 0; i < spool->segments_len; i++) {
+		((StompSpoolSegmentHeader *)spool->segments[i].map)->confirmed_sequence = sequence;
+	}
+
+	// everything confirmed, start the last segment again
+	if (spool->segments_len == 1 && spool->segments[0].last_sequence <= sequence) {
+		StompSpoolSegment *segment = &spool->segments[0];
+		stomp_spool_record(segment, sizeof(StompSpoolSegmentHeader))->magic = 0;
+		segment->write_pos = sizeof(StompSpoolSegmentHeader);
+		segment->first_sequence = segment->last_sequence = 0;
+	}
+
+	if (spool->sent_sequence < sequence) {
+		// a receipt for a frame not sent on this connection
+		spool->sent_sequence = sequence;
+		stomp_spool_seek(spool);
+	} else if (spool->replay_segment < deleted || (spool->segments_len == 1 && spool->segments[0].last_sequence == 0)) {
+		// the cursor was at the end of a deleted or emptied segment
+		spool->replay_segment = 0;
+		spool->replay_pos = sizeof(StompSpoolSegmentHeader);
+	} else {
+		spool->replay_segment -= deleted;
+	}
+}
+
+void stomp_spool_reset_sent(StompSpool *spool) {
+	spool->sent_sequence = spool->confirmed_sequence;
+	stomp_spool_seek(spool);
+}
+
+int stomp_spool_replay(StompSpool *spool, stomp_spool_send_function send, void *user_data) {
+	struct iovec frames[STOMP_SPOOL_REPLAY_BATCH];
+	int count = 0, ret = 0;
+	unsigned long long last_sequence = spool->sent_sequence;
+
+	// where the batch starts, to go back if it is not sent
+	int batch_segment = spool->replay_segment;
+	size_t batch_pos = spool->replay_pos;
+
+	while (spool->replay_segment < spool->segments_len) {
+		StompSpoolSegment *segment = &spool->segments[spool->replay_segment];
+
+		if (spool->replay_pos >= segment->write_pos) {
+			if (spool->replay_segment == spool->segments_len - 1) break;
+
+			spool->replay_segment++;
+			spool->replay_pos = sizeof(StompSpoolSegmentHeader);
+			continue;
+		}
+
+		StompSpoolRecord *record = stomp_spool_record(segment, spool->replay_pos);
+		spool->replay_pos += sizeof(StompSpoolRecord) + stomp_spool_align(record->length);
+
+		frames[count].iov_base = &record[1];
+		frames[count].iov_len = record->length;
+		last_sequence = record->sequence;
+
+		if (++count == STOMP_SPOOL_REPLAY_BATCH) {
+			if ((ret = send(user_data, frames, count))) break;
+			spool->sent_sequence = last_sequence;
+			batch_segment = spool->replay_segment;
+			batch_pos = spool->replay_pos;
+			count = 0;
+		}
+	}
+
+	if (!ret && count > 0 && !(ret = send(user_data, frames, count))) spool->sent_sequence = last_sequence;
+
+	if (ret) {
+		spool->replay_segment = batch_segment;
+		spool->replay_pos = batch_pos;
+		return -1;
+	}
+
+	return 0;
+}
+
+int stomp_spool_send_last(StompSpool *spool, struct iovec *frame, stomp_spool_send_function send, void *user_data) {
+	// older frames go first
+	if (spool->sent_sequence + 1 != spool->next_sequence - 1) return stomp_spool_replay(spool, send, user_data);
+
+	if (send(user_data, frame, 1)) return -1;
+
+	spool->sent_sequence++;
+	spool->replay_segment = spool->segments_len - 1;
+	spool->replay_pos = spool->segments[spool->replay_segment].write_pos;
+
+	return 0;
+}
+
+unsigned long long stomp_spool_next_sequence(StompSpool *spool) {
+	return spool->next_sequence;
+}
+
+void stomp_spool_get_stats(StompSpool *spool, StompSpoolStats *stats) {
+	stats->pending = spool->next_sequence - 1 - spool->confirmed_sequence;
+	stats->unsent = spool->next_sequence - 1 - spool->sent_sequence;
+	stats->segments = spool->segments_len;
+}
@@ -0,0 +1,504 @@
+/*
+ * libstomp - a free implementation of the stomp protocol than can be plugged
+ * to different connection implementations using an adapter interface.
+ *
+ * Copyright (C) 2017 Sergio Otero <sergio.otero@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+
+
+
+
+/*
+ * Process wide io_uring shared by the tcp adapters that select STOMP_TCP_ENGINE_URING.
+ *
+ * Every socket has one multishot recv picking its buffers from a ring of provided
+ * buffers, so idle connections hold no receive memory. Sends are staged in a slice of
+ * one registered buffer and written with SEND_ZC, or from the heap with SEND once the
+ * slices are taken. The adapters only queue requests: stomp_uring_service submits all
+ * of them and reaps the completions of every connection in one io_uring_enter.
+ *
+ * The raw syscalls are used, liburing is not needed. Not thread safe, the connections
+ * have to be serviced from one thread.
+ */
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "stomp_internal.h"
+
+#define STOMP_URING_ENTRIES 4096
+#define STOMP_URING_RECV_BUFFERS 512 // a power of 2
+#define STOMP_URING_RECV_BUFFER_SIZE 16384
+#define STOMP_URING_SEND_SLOTS 256
+#define STOMP_URING_BUFFER_GROUP 0
+#define STOMP_URING_OP_MASK 7 // user_data is the owner pointer with the operation in its low bits
+#define STOMP_URING_DRAIN_MS 10000
+
+typedef struct {
+	int fd;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int to_submit; // queued since the last io_uring_enter
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *ring;
+	size_t ring_size;
+	size_t sqes_size;
+
+	struct io_uring_buf_ring *recv_ring;
+	size_t recv_ring_size;
+	unsigned short recv_tail;
+	char *recv_buffers;
+
+	char *send_buffers; // fixed buffer 0, split in slots. NULL if it could not be registered
+	int free_slots[STOMP_URING_SEND_SLOTS];
+	int free_slots_len;
+
+	int owners; // allocated, closed ones are freed when their last request completes
+	int open_owners;
+	int reaping;
+} StompUring;
+
+static StompUring *uring_instance;
+static int uring_unavailable;
+
+static int uring_register(StompUring *uring, unsigned int opcode, void *arg, unsigned int nr_args) {
+	return syscall(__NR_io_uring_register, uring->fd, opcode, arg, nr_args);
+}
+
+// Submits the queued requests and waits up to timeout_ms (-1 forever) for min_complete completions
+static int uring_enter(StompUring *uring, unsigned int min_complete, int timeout_ms) {
+	if (uring->to_submit == 0 && min_complete == 0) return 0;
+
+	unsigned int flags = 0;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	void *argp = NULL;
+	size_t argsz = 0;
+
+	if (min_complete > 0) {
+		flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		memset(&arg, 0, sizeof(arg));
+		arg.sigmask_sz = _NSIG / 8;
+		if (timeout_ms >= 0) {
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+			arg.ts = (uintptr_t)&ts;
+		}
+		argp = &arg;
+		argsz = sizeof(arg);
+	}
+
+	int ret = syscall(__NR_io_uring_enter, uring->fd, uring->to_submit, min_complete, flags, argp, argsz);
+	if (ret < 0) {
+		// EBUSY: the completion queue is full and has to be reaped first
+		if (errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN) return 0;
+
+		stomp_log_error("io_uring_enter failed: %s", strerror(errno));
+		return -1;
+	}
+
+	uring->to_submit -= ret;
+
+	return 0;
+}
+
+static void uring_destroy(StompUring *uring) {
+	if (uring->recv_ring != NULL) munmap(uring->recv_ring, uring->recv_ring_size);
+	free(uring->recv_buffers);
+	if (uring->send_buffers != NULL) munmap(uring->send_buffers, STOMP_URING_SEND_SLOTS * STOMP_URING_SEND_BUFFER_SIZE);
+	if (uring->sqes != NULL) munmap(uring->sqes, uring->sqes_size);
+	if (uring->ring != NULL) munmap(uring->ring, uring->ring_size);
+	// unregisters the buffers
+	if (uring->fd >= 0) close(uring->fd);
+	free(uring);
+}
+
+// Returns a provided buffer to the kernel
+static void uring_recycle(StompUring *uring, unsigned short bid) {
+	// bufs[0] overlaps the ring tail, only the buffer fields are written
+	struct io_uring_buf *buf = &uring->recv_ring->bufs[uring->recv_tail & (STOMP_URING_RECV_BUFFERS - 1)];
+	buf->addr = (uintptr_t)&uring->recv_buffers[(size_t)bid * STOMP_URING_RECV_BUFFER_SIZE];
+	buf->len = STOMP_URING_RECV_BUFFER_SIZE;
+	buf->bid = bid;
+
+	__atomic_store_n(&uring->recv_ring->tail, ++uring->recv_tail, __ATOMIC_RELEASE);
+}
+
+// Multishot recv and SEND_ZC with fixed buffers came with linux 6.0
+static int uring_supported(StompUring *uring) {
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	if (probe == NULL) return 0;
+
+	int supported = uring_register(uring, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+			probe->last_op >= IORING_OP_SEND_ZC && (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+
+	free(probe);
+
+	return supported;
+}
+
+static int uring_map(StompUring *uring, struct io_uring_params *params) {
+	size_t sq_size = params->sq_off.array + params->sq_entries * sizeof(unsigned int);
+	size_t cq_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+	uring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+
+	// one mapping for both rings
+	if (!(params->features & IORING_FEAT_SINGLE_MMAP) || !(params->features & IORING_FEAT_EXT_ARG)) return -1;
+
+	uring->ring = mmap(NULL, uring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+	if (uring->ring == MAP_FAILED) {
+		uring->ring = NULL;
+		return -1;
+	}
+
+	uring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		uring->sqes = NULL;
+		return -1;
+	}
+
+	char *ring = uring->ring;
+	uring->sq_head = (unsigned int *)(ring + params->sq_off.head);
+	uring->sq_tail = (unsigned int *)(ring + params->sq_off.tail);
+	uring->sq_mask = *(unsigned int *)(ring + params->sq_off.ring_mask);
+	uring->sq_entries = *(unsigned int *)(ring + params->sq_off.ring_entries);
+	uring->sq_array = (unsigned int *)(ring + params->sq_off.array);
+	uring->cq_head = (unsigned int *)(ring + params->cq_off.head);
+	uring->cq_tail = (unsigned int *)(ring + params->cq_off.tail);
+	uring->cq_mask = *(unsigned int *)(ring + params->cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)(ring + params->cq_off.cqes);
+
+	return 0;
+}
+
+static int uring_register_buffers(StompUring *uring) {
+	uring->recv_ring_size = STOMP_URING_RECV_BUFFERS * sizeof(struct io_uring_buf);
+	uring->recv_ring = mmap(NULL, uring->recv_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	uring->recv_buffers = malloc((size_t)STOMP_URING_RECV_BUFFERS * STOMP_URING_RECV_BUFFER_SIZE);
+	if (uring->recv_ring == MAP_FAILED) uring->recv_ring = NULL;
+	if (uring->recv_ring == NULL || uring->recv_buffers == NULL) return -1;
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)uring->recv_ring;
+	reg.ring_entries = STOMP_URING_RECV_BUFFERS;
+	reg.bgid = STOMP_URING_BUFFER_GROUP;
+	if (uring_register(uring, IORING_REGISTER_PBUF_RING, &reg, 1)) return -1;
+
+	uring->recv_tail = 0;
+	for (int bid = 0; bid < STOMP_URING_RECV_BUFFERS; bid++) {
+		uring_recycle(uring, bid);
+	}
+
+	// pinned memory counts against RLIMIT_MEMLOCK, without it the sends are not zero copy
+	size_t send_size = (size_t)STOMP_URING_SEND_SLOTS * STOMP_URING_SEND_BUFFER_SIZE;
+	uring->send_buffers = mmap(NULL, send_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (uring->send_buffers == MAP_FAILED) uring->send_buffers = NULL;
+
+	struct iovec iov;
+	iov.iov_base = uring->send_buffers;
+	iov.iov_len = send_size;
+	if (uring->send_buffers != NULL && uring_register(uring, IORING_REGISTER_BUFFERS, &iov, 1)) {
+		stomp_log_info("io_uring send buffers not registered: %s", strerror(errno));
+		munmap(uring->send_buffers, send_size);
+		uring->send_buffers = NULL;
+	}
+
+	uring->free_slots_len = 0;
+	if (uring->send_buffers != NULL) {
+		for (int slot = STOMP_URING_SEND_SLOTS - 1; slot >= 0; slot--) {
+			uring->free_slots[uring->free_slots_len++] = slot;
+		}
+	}
+
+	return 0;
+}
+
+static StompUring* uring_create(void) {
+	StompUring *uring = calloc(1, sizeof(StompUring));
+	if (uring == NULL) return NULL;
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+
+	uring->fd = syscall(__NR_io_uring_setup, STOMP_URING_ENTRIES, &params);
+	if (uring->fd < 0 && errno == EINVAL) {
+		memset(&params, 0, sizeof(params));
+		uring->fd = syscall(__NR_io_uring_setup, STOMP_URING_ENTRIES, &params);
+	}
+
+	if (uring->fd < 0 || !uring_supported(uring) || uring_map(uring, &params) || uring_register_buffers(uring)) {
+		stomp_log_info("io_uring not available: %s", strerror(errno));
+		uring_destroy(uring);
+		return NULL;
+	}
+
+	return uring;
+}
+
+// Next submission entry, NULL if the ring is still full after submitting it
+static struct io_uring_sqe* uring_sqe(StompUring *uring, StompUringOwner *owner, enum StompUringOp op) {
+	unsigned int tail = *uring->sq_tail;
+	if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) == uring->sq_entries) {
+		if (uring_enter(uring, 0, 0) || tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) == uring->sq_entries) {
+			return NULL;
+		}
+	}
+
+	unsigned int index = tail & uring->sq_mask;
+	struct io_uring_sqe *sqe = &uring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uintptr_t)owner | op;
+	uring->sq_array[index] = index;
+
+	// without SQPOLL the kernel reads the entry in io_uring_enter, after the caller fills it
+	__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	uring->to_submit++;
+	owner->pending++;
+
+	return sqe;
+}
+
+static void uring_free_owner(StompUring *uring, StompUringOwner *owner) {
+	if (owner->slot >= 0) {
+		uring->free_slots[uring->free_slots_len++] = owner->slot;
+	} else {
+		free(owner->send_buffer);
+	}
+
+	free(owner);
+	uring->owners--;
+}
+
+// Dispatches the completions to the owners not closed yet
+static void uring_reap(StompUring *uring, stomp_uring_handler handler) {
+	uring->reaping = 1;
+
+	unsigned int head = *uring->cq_head;
+	while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+		StompUringOwner *owner = (StompUringOwner *)(uintptr_t)(cqe->user_data & ~(uint64_t)STOMP_URING_OP_MASK);
+		enum StompUringOp op = cqe->user_data & STOMP_URING_OP_MASK;
+		int res = cqe->res;
+		unsigned int flags = cqe->flags;
+
+		// the kernel can reuse the entry once the head moves
+		__atomic_store_n(uring->cq_head, ++head, __ATOMIC_RELEASE);
+
+		char *data = NULL;
+		unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		if (flags & IORING_CQE_F_BUFFER) data = &uring->recv_buffers[(size_t)bid * STOMP_URING_RECV_BUFFER_SIZE];
+
+		if (owner->data != NULL && handler != NULL) handler(owner, op, res, flags, data);
+
+		// multishot requests and SEND_ZC go on while F_MORE is set. Counted after the handler so that
+		// closing the owner from it does not free it
+		if (!(flags & IORING_CQE_F_MORE)) owner->pending--;
+
+		if (data != NULL) uring_recycle(uring, bid);
+
+		if (owner->data == NULL && owner->pending == 0) uring_free_owner(uring, owner);
+	}
+
+	uring->reaping = 0;
+}
+
+// After the last connection is closed, waits for its cancelled requests and destroys the ring
+static void uring_drain(StompUring *uring) {
+	for (int waited = 0; uring->owners > 0 && waited < STOMP_URING_DRAIN_MS; waited += 10) {
+		if (uring_enter(uring, 1, 10)) break;
+		uring_reap(uring, NULL);
+	}
+
+	uring_instance = NULL;
+
+	if (uring->owners > 0) {
+		// the kernel may still write to the buffers, they are leaked rather than reused
+		stomp_log_warn("io_uring requests still in flight, ring not freed");
+		return;
+	}
+
+	uring_destroy(uring);
+}
+
+int stomp_uring_supported(void) {
+	if (uring_instance == NULL && !uring_unavailable) {
+		// the first connection creates it again
+		StompUring *uring = uring_create();
+		uring_unavailable = uring == NULL;
+		if (uring != NULL) uring_destroy(uring);
+	}
+
+	return !uring_unavailable;
+}
+
+StompUringOwner* stomp_uring_open(void *data) {
+	if (uring_instance == NULL && !uring_unavailable) {
+		uring_instance = uring_create();
+		uring_unavailable = uring_instance == NULL;
+	}
+
+	StompUring *uring = uring_instance;
+	if (uring == NULL) return NULL;
+
+	StompUringOwner *owner = malloc(sizeof(StompUringOwner));
+	if (owner == NULL) return NULL;
+
+	owner->data = data;
+	owner->pending = 0;
+	if (uring->free_slots_len > 0) {
+		owner->slot = uring->free_slots[--uring->free_slots_len];
+		owner->send_buffer = &uring->send_buffers[(size_t)owner->slot * STOMP_URING_SEND_BUFFER_SIZE];
+	} else {
+		owner->slot = -1;
+		owner->send_buffer = malloc(STOMP_URING_SEND_BUFFER_SIZE);
+		if (owner->send_buffer == NULL) {
+			free(owner);
+			return NULL;
+		}
+	}
+
+	uring->owners++;
+	uring->open_owners++;
+
+	return owner;
+}
+
+void stomp_uring_close(StompUringOwner *owner, int fd) {
+	StompUring *uring = uring_instance;
+
+	owner->data = NULL;
+	uring->open_owners--;
+
+	struct io_uring_sqe *sqe = uring_sqe(uring, owner, STOMP_URING_OP_CANCEL);
+	if (sqe != NULL) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = fd;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	} else if (owner->pending > 0) {
+		// the requests end when the socket does
+		shutdown(fd, SHUT_RDWR);
+	} else {
+		uring_free_owner(uring, owner);
+	}
+
+	// before the caller closes fd
+	uring_enter(uring, 0, 0);
+
+	if (uring->open_owners == 0 && !uring->reaping) uring_drain(uring);
+}
+
+int stomp_uring_poll(StompUringOwner *owner, int fd, unsigned int events) {
+	struct io_uring_sqe *sqe = uring_sqe(uring_instance, owner, STOMP_URING_OP_POLL);
+	if (sqe == NULL) return -1;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+
+	return 0;
+}
+
+int stomp_uring_recv(StompUringOwner *owner, int fd) {
+	struct io_uring_sqe *sqe = uring_sqe(uring_instance, owner, STOMP_URING_OP_RECV);
+	if (sqe == NULL) return -1;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = STOMP_URING_BUFFER_GROUP;
+
+	return 0;
+}
+
+int stomp_uring_send(StompUringOwner *owner, int fd, size_t offset, size_t len) {
+	struct io_uring_sqe *sqe = uring_sqe(uring_instance, owner, STOMP_URING_OP_SEND);
+	if (sqe == NULL) return -1;
+
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)&owner->send_buffer[offset];
+	sqe->len = len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+
+	if (owner->slot >= 0) {
+		// the slot must not change until the IORING_CQE_F_NOTIF completion
+		sqe->opcode = IORING_OP_SEND_ZC;
+		sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+		sqe->buf_index = 0;
+	} else {
+		sqe->opcode = IORING_OP_SEND;
+	}
+
+	return 0;
+}
+
+int stomp_uring_cancel(StompUringOwner *owner, enum StompUringOp op) {
+	struct io_uring_sqe *sqe = uring_sqe(uring_instance, owner, STOMP_URING_OP_CANCEL);
+	if (sqe == NULL) return -1;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uintptr_t)owner | op;
+
+	return 0;
+}
+
+int stomp_uring_service(int timeout_ms, stomp_uring_handler handler) {
+	StompUring *uring = uring_instance;
+	if (uring == NULL) return -1;
+
+	// no need to wait if there are completions already
+	int ready = *uring->cq_head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+	if (uring_enter(uring, timeout_ms != 0 && !ready ? 1 : 0, timeout_ms)) return -1;
+
+	uring_reap(uring, handler);
+
+	// the last connection was closed from a callback
+	if (uring->open_owners == 0) uring_drain(uring);
+
+	return 0;
+}
+
+#endif